@@ -40,7 +40,7 @@ void onClose(struct websocket_server_desc *wsDesc, void *socketUserData,
 
 int main(int argc, char *argv[])
 {
-  struct websocket_server_init websocketInit;
+  struct websocket_server_init websocketInit = { 0 };
   struct websocket_server_desc *wsDesc;
 
   signal(SIGINT, sigIntHandler);
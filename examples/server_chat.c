@@ -13,7 +13,10 @@
 #include <signal.h>
 #include <assert.h>
 
+#define HANDOVER_PATH "/tmp/ezwebsocket_chat.sock"
+
 static bool stop = false;
+static bool handover = false;
 
 struct app_ctx
 {
@@ -25,6 +28,11 @@ void sigIntHandler(int dummy)
   stop = true;
 }
 
+void sigUsr2Handler(int dummy)
+{
+  handover = true;
+}
+
 void* onOpen(void *socketUserData, struct websocket_server_desc *wsDesc,
              struct websocket_connection_desc *connectionDesc)
 {
@@ -42,6 +50,25 @@ void onMessage(void *socketUserData, struct websocket_connection_desc *connectio
   websocket_sendData(connectionDesc, dataType, msg, len);
 }
 
+size_t onHandover(void *socketUserData, struct websocket_connection_desc *connectionDesc,
+                  void *userData, void *buf, size_t len)
+{
+  struct app_ctx *ctx = (struct app_ctx *) userData;
+
+  // hand over the state of the connection to the new process
+  return snprintf(buf, len, "%s", ctx->test_msg);
+}
+
+void* onTakeover(void *socketUserData, struct websocket_server_desc *wsDesc,
+                 struct websocket_connection_desc *connectionDesc, const void *state, size_t len)
+{
+  struct app_ctx *ctx = calloc(1, sizeof(*ctx));
+  printf("connection to %s taken over\n", websocketServer_getPeerIp(connectionDesc));
+
+  ctx->test_msg = strndup(state, len);
+  return ctx;
+}
+
 void onClose(struct websocket_server_desc *wsDesc, void *socketUserData,
              struct websocket_connection_desc *connectionDesc, void *userData)
 {
@@ -55,24 +82,44 @@ void onClose(struct websocket_server_desc *wsDesc, void *socketUserData,
 
 int main(int argc, char *argv[])
 {
-  struct websocket_server_init websocketInit;
+  struct websocket_server_init websocketInit = { 0 };
   struct websocket_server_desc *wsDesc;
 
   signal(SIGINT, sigIntHandler);
+  signal(SIGUSR2, sigUsr2Handler);
 
   websocketInit.port = "9001";
   websocketInit.address = "0.0.0.0";
   websocketInit.ws_onOpen = onOpen;
   websocketInit.ws_onClose = onClose;
   websocketInit.ws_onMessage = onMessage;
+  websocketInit.ws_onHandover = onHandover;
+  websocketInit.ws_onTakeover = onTakeover;
 
-  wsDesc = websocketServer_open(&websocketInit, NULL);
+  // hot restart: start the new instance with --takeover and send SIGUSR2 to the old one
+  if((argc > 1) && !strcmp(argv[1], "--takeover"))
+  {
+    while(access(HANDOVER_PATH, F_OK) && !stop)
+      usleep(100000);
+    wsDesc = websocketServer_takeover(&websocketInit, NULL, HANDOVER_PATH);
+  }
+  else
+  {
+    wsDesc = websocketServer_open(&websocketInit, NULL);
+  }
   if(wsDesc == NULL)
     return -1;
 
   while(!stop)
   {
     usleep(300000);
+    if(handover)
+    {
+      printf("handed over %d connections\n",
+             websocketServer_handover(wsDesc, HANDOVER_PATH, true, 10000));
+      websocketServer_drain(wsDesc, 1000);
+      break;
+    }
   }
 
   websocketServer_close(wsDesc);
@@ -31,6 +31,7 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 //! the 2 different websocket data types
 enum ws_data_type {
@@ -78,10 +79,132 @@ enum ws_close_code {
   WS_CLOSE_CODE_RESERVED_3 = 1015,
 };
 
+//! presets for the socket options
+enum ws_socket_profile {
+  //! TCP_NODELAY (the default)
+  WS_SOCKET_PROFILE_DEFAULT = 0,
+  //! TCP_NODELAY, TCP_QUICKACK, small TCP_NOTSENT_LOWAT and busy polling
+  WS_SOCKET_PROFILE_LOW_LATENCY,
+  //! Nagle's algorithm and large socket buffers
+  WS_SOCKET_PROFILE_THROUGHPUT,
+  //! TCP_NODELAY, small socket buffers and a small TCP_NOTSENT_LOWAT
+  WS_SOCKET_PROFILE_MEMORY_LEAN,
+};
+
+//! options of the tcp sockets, they are applied to the listening socket (the accepted
+//! connections inherit them) or to the client socket
+//! every value that is 0 is taken from the profile
+struct ws_socket_options {
+  //! the profile that provides the values that aren't set
+  enum ws_socket_profile profile;
+  //! disable Nagle's algorithm TCP_NODELAY (1 => on, -1 => off)
+  int noDelay;
+  //! send acks immediately, TCP_QUICKACK is rearmed after every read (1 => on, -1 => off)
+  int quickAck;
+  //! enable keepalive SO_KEEPALIVE (1 => on, -1 => off)
+  //! (the default is on for servers and off for clients)
+  int keepalive;
+  //! idle time before the first keepalive probe in seconds TCP_KEEPIDLE (-1 => system default)
+  int keepIdleSec;
+  //! unanswered probes before the connection is closed TCP_KEEPCNT (-1 => system default)
+  int keepCnt;
+  //! interval between keepalive probes in seconds TCP_KEEPINTVL (-1 => system default)
+  int keepIntvlSec;
+  //! size of the send buffer in bytes SO_SNDBUF (-1 => system default)
+  int sndBuf;
+  //! size of the receive buffer in bytes SO_RCVBUF (-1 => system default)
+  int rcvBuf;
+  //! limit of unsent bytes in the send buffer TCP_NOTSENT_LOWAT (-1 => system default)
+  int notSentLowat;
+  //! time to busy poll on receive in microseconds SO_BUSY_POLL (-1 => off)
+  int busyPollUs;
+};
+
+//! action that is taken when a peer exceeds an inbound rate limit
+enum ws_rate_limit_action {
+  //! stop reading until the rate allows it again (the peer is slowed down by TCP flow control)
+  WS_RATE_LIMIT_PAUSE = 0,
+  //! drop the messages that exceed the limit (fragmented messages are dropped completely)
+  WS_RATE_LIMIT_DROP,
+  //! close the connection with WS_CLOSE_CODE_POLICY_VIOLATION
+  WS_RATE_LIMIT_CLOSE,
+};
+
+//! verdict of ws_onUpgradeRequest
+enum ws_upgrade_verdict {
+  //! continue with the websocket handshake
+  WS_UPGRADE_ACCEPT = 0,
+  //! reply with the given http status and close the connection
+  WS_UPGRADE_REJECT,
+  //! the verdict is passed to websocketUpgrade_complete later
+  WS_UPGRADE_PENDING,
+};
+
+//! inbound rate limit (token buckets for frames and bytes), close frames are not limited
+struct ws_rate_limit {
+  //! the allowed number of frames per second (0 => unlimited)
+  unsigned long msgsPerSec;
+  //! the number of frames that may be received at once (0 => msgsPerSec)
+  unsigned long msgsBurst;
+  //! the allowed number of bytes per second (0 => unlimited)
+  unsigned long bytesPerSec;
+  //! the number of bytes that may be received at once (0 => bytesPerSec)
+  unsigned long bytesBurst;
+  //! the action that is taken if the limit is exceeded
+  enum ws_rate_limit_action action;
+};
+
 //! descriptor for the websocket server
 struct websocket_server_desc;
 //! descriptor for the websocket connection
 struct websocket_connection_desc;
+//! a frame that is encoded once and can be sent to several connections
+struct websocket_frame;
+//! descriptor for the replay ring of a topic
+struct websocket_replay;
+//! descriptor for a logical channel of a multiplexed connection
+struct websocket_channel;
+//! descriptor for a shared memory bus that passes prepared frames to other processes
+struct websocket_bus;
+//! an upgrade request that waits for the verdict of ws_onUpgradeRequest
+struct websocket_upgrade;
+
+//! a message that was taken from the receive queue of a server with websocketServer_recvBatch
+//! (pass it to websocket_releaseMessages when it's done)
+struct ws_message {
+  //! the connection that received the message (holds a reference)
+  struct websocket_connection_desc *connection;
+  //! the user data of the connection at the time the message was received
+  void *connectionUserData;
+  //! the type of the data
+  enum ws_data_type dataType;
+  //! the payload (holds a reference, can be passed to websocket_ref to keep it longer)
+  //! NULL if len is 0
+  void *data;
+  //! the length of the payload
+  size_t len;
+};
+
+//! the highest channel id of multiplexed connections (the id is sent as one byte per message)
+#define WS_CHANNEL_MAX 127
+
+//! structure to configure a logical channel
+struct ws_channel_init {
+  //! callback that is called when a message is received on the channel
+  void (*ws_onMessage)(void *channelUserData, struct websocket_channel *channel,
+                       enum ws_data_type dataType, void *msg, size_t len);
+  //! callback that is called when the channel was closed by the peer or the connection was
+  //! closed (the channel must not be used afterwards unless it was passed to websocket_ref)
+  void (*ws_onClose)(void *channelUserData, struct websocket_channel *channel);
+  //! callback that is called when the peer accepted the channel or granted new credits
+  //! (use NULL if not used)
+  void (*ws_onCredit)(void *channelUserData, struct websocket_channel *channel);
+  //! the number of bytes the peer may send before it has to wait for new credits, the credits
+  //! are granted again once half of it was passed to ws_onMessage (0 => unlimited)
+  unsigned long window;
+  //! the user data that is passed to the callbacks
+  void *userData;
+};
 
 //! structure to configure a websocket server socket
 struct websocket_server_init {
@@ -94,12 +217,125 @@ struct websocket_server_init {
   //! callback that is called when a connection is closed
   void (*ws_onClose)(struct websocket_server_desc *wsDesc, void *websocketUserData,
                      struct websocket_connection_desc *connectionDesc, void *connectionUserData);
-  //! the listening address
+  //! the listening address, "unix:/path/to/socket" listens on a unix domain socket and
+  //! "unix:@name" on a unix domain socket in the abstract namespace
   const char *address;
-  //! the listening port
+  //! the listening port (ignored for unix sockets)
   const char *port;
+  //! callback that is called when a connection is handed over to another process
+  //! (websocketServer_handover) it can store up to len bytes of application state in buf
+  //! and returns the number of bytes used (use NULL if not used)
+  size_t (*ws_onHandover)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                          void *connectionUserData, void *buf, size_t len);
+  //! callback that is called instead of ws_onOpen when a connection was taken over from another
+  //! process (websocketServer_takeover) with the application state stored by ws_onHandover
+  //! (use NULL if not used => ws_onOpen is called)
+  void *(*ws_onTakeover)(void *websocketUserData, struct websocket_server_desc *wsDesc,
+                         struct websocket_connection_desc *connectionDesc, const void *state,
+                         size_t len);
+  //! the maximum number of connections, when it's reached the server stops accepting until a
+  //! connection is closed (0 => unlimited)
+  unsigned long maxConnections;
+  //! the maximum memory for the receive buffers of all connections, when it's reached the
+  //! server stops accepting until it's below again (0 => unlimited)
+  size_t maxBufferMemory;
+  //! the maximum number of pending connections in the listen queue (0 => system maximum)
+  int backlog;
+  //! if > 0 connections are only accepted once the upgrade request has arrived, connections
+  //! that don't send anything within this time in seconds are dropped (TCP_DEFER_ACCEPT)
+  int deferAcceptSec;
+  //! the options of the tcp sockets
+  struct ws_socket_options socketOptions;
+  //! the file permissions of the unix socket file, e.g. 0660 (0 => keep the default of the umask)
+  unsigned int unixMode;
+  //! the inbound rate limit of every connection (can be changed with websocket_setRateLimit)
+  struct ws_rate_limit rateLimit;
+  //! the inbound rate limit of all connections of the server together
+  struct ws_rate_limit endpointRateLimit;
+  //! the maximum number of bytes that are read from a connection before the other connections
+  //! get their turn (0 => 64 KiB, SIZE_MAX => unlimited)
+  size_t readBudgetBytes;
+  //! the maximum number of frames that are processed for a connection before the other
+  //! connections get their turn (0 => 64, ULONG_MAX => unlimited)
+  unsigned long readBudgetMsgs;
+  //! offer multiplexed logical channels (subprotocol "ezws.mux") to the clients, all messages
+  //! of connections that accepted it are passed to the callbacks of the channels instead of
+  //! ws_onMessage (connections taken over from another process are never multiplexed)
+  bool channels;
+  //! callback that is called when the peer opens a channel, it fills in init and returns true
+  //! to accept the channel (NULL => all channels are rejected)
+  bool (*ws_onChannelOpen)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                           void *connectionUserData, unsigned int channelId,
+                           struct ws_channel_init *init);
+  //! accept websockets over cleartext HTTP/2 with prior knowledge (RFC 8441), every stream of
+  //! such a connection is passed to the callbacks as a separate websocket connection, a stream
+  //! that stops reading (rate limit, recvQueueDepth) holds back its flow control window
+  bool http2;
+  //! offer resumable sessions (subprotocol "ezws.resume") to the clients, the text and binary
+  //! messages sent to such connections get a sequence number and the last ones are kept so that
+  //! a client that reconnects with its session token gets only the messages it missed
+  //! (not combined with channels, fragmented messages can't be sent on such connections)
+  bool resumable;
+  //! the number of messages that are kept per session for the replay (0 => 256)
+  unsigned long sessionFrames;
+  //! the time in milliseconds a session is kept after its connection was closed (0 => 60000)
+  unsigned long sessionTimeoutMs;
+  //! callback that is called with every upgrade request before any state is allocated for the
+  //! connection, it returns WS_UPGRADE_REJECT with the http status in status to reject the
+  //! request or WS_UPGRADE_PENDING to pass the verdict to websocketUpgrade_complete later from
+  //! any thread, every HTTP/2 stream is passed as "CONNECT <:path> HTTP/2" request with the
+  //! :authority as host header and only that stream waits for the verdict (use NULL if not used)
+  enum ws_upgrade_verdict (*ws_onUpgradeRequest)(void *websocketUserData,
+                                                 struct websocket_upgrade *upgrade, int *status);
+  //! the time in milliseconds a pending upgrade request waits for its verdict before it's
+  //! rejected with 503 (0 => 10000)
+  unsigned long upgradeTimeoutMs;
+  //! put the complete text and binary messages into a receive queue of this depth instead of
+  //! passing them to ws_onMessage, consumer threads take them with websocketServer_recvBatch
+  //! and reading stops while the queue is full (0 => ws_onMessage is used)
+  unsigned long recvQueueDepth;
+  //! the egress rate of every connection in bytes per second, tcp connections are paced by the
+  //! kernel (SO_MAX_PACING_RATE, best with the fq qdisc) for other connections the data that
+  //! exceeds the rate is queued and sent by the I/O thread (0 => unlimited, can be changed with
+  //! websocket_setPacingRate)
+  unsigned long pacingRate;
+  //! the egress rate of all connections together in bytes per second, the data that exceeds it
+  //! is queued like with pacingRate, the send functions never wait for the rate but fail with
+  //! errno EAGAIN while 4 MiB are queued for a connection, control frames (close, ping, pong)
+  //! don't count (0 => unlimited)
+  unsigned long serverPacingRate;
+  //! callback that is called when an fd should be watched by the event loop of the application
+  //! with the given poll events (events == 0 => stop watching the fd)
+  //! if set no threads are started and the application has to call websocket_process
+  //! use NULL for the threaded mode
+  void (*ws_onWatch)(void *websocketUserData, int fd, int events);
+};
+
+//! statistics of a websocket server
+struct websocket_server_stats {
+  //! the number of open connections
+  unsigned long connections;
+  //! the memory that is used for receive buffers
+  size_t bufferMemory;
+  //! the number of connections that were rejected (HTTP 503) because no fd was left
+  unsigned long rejectedNoFd;
+  //! the number of connections that were rejected (HTTP 503) because maxConnections or
+  //! maxBufferMemory was reached
+  unsigned long rejectedBudget;
+  //! the number of times the server stopped accepting because a limit was reached
+  unsigned long listenerPauses;
+  //! indicates if the server currently doesn't accept connections because a limit is reached
+  bool paused;
+  //! the number of times a connection exceeded the rate limit
+  unsigned long rateLimited;
 };
 
+//! the maximum size of the application state that can be handed over per connection
+#define WS_HANDOVER_STATE_MAX 16384
+
+//! the length of a session token of a resumable connection
+#define WS_SESSION_TOKEN_LEN 32
+
 //! structure to configure a websocket client socket
 struct websocket_client_init {
   //! callback that is called when a message is received
@@ -110,9 +346,9 @@ struct websocket_client_init {
   //! callback that is called when a connection is closed
   void (*ws_onClose)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
                      void *connectionUserData);
-  //! the address of the remote target
+  //! the address of the remote target ("unix:/path" or "unix:@name" => unix domain socket)
   const char *address;
-  //! the port of the remote target
+  //! the port of the remote target (ignored for unix sockets)
   const char *port;
   //! the endpoint of the remote (e.g. /chat)
   const char *endpoint;
@@ -125,6 +361,36 @@ struct websocket_client_init {
   //! The frequency of keepalive packets after the first one is sent
   int keep_intvl;
   int secure;
+  //! the options of the tcp socket (if keepalive is true the keepalive values above are used)
+  struct ws_socket_options socketOptions;
+  //! request multiplexed logical channels (subprotocol "ezws.mux") from the server, if the
+  //! server accepts it all messages are passed to the callbacks of the channels instead of
+  //! ws_onMessage
+  bool channels;
+  //! callback that is called when the peer opens a channel, it fills in init and returns true
+  //! to accept the channel (NULL => all channels are rejected)
+  bool (*ws_onChannelOpen)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                           void *connectionUserData, unsigned int channelId,
+                           struct ws_channel_init *init);
+  //! request a resumable session (subprotocol "ezws.resume") from the server, the sequence
+  //! numbers are removed from the received messages and replayed duplicates are dropped
+  //! (ignored if channels are requested)
+  bool resumable;
+  //! the token of the session that should be resumed (websocketConnection_getSessionToken of the
+  //! previous connection, NULL => new session)
+  const char *resumeToken;
+  //! the sequence number of the last message that was received in the session that should be
+  //! resumed (websocketConnection_getSessionSeq of the previous connection)
+  unsigned long long resumeSeq;
+  //! the maximum payload of a TLS record (512 - 16384), 0 => dynamic record sizing: records
+  //! fit in one TCP segment while the connection starts or after it was idle and grow to the
+  //! maximum while a lot of data is sent
+  unsigned long tlsRecordSize;
+  //! callback that is called when an fd should be watched by the event loop of the application
+  //! with the given poll events (events == 0 => stop watching the fd)
+  //! if set no thread is started and the application has to call websocket_process
+  //! use NULL for the threaded mode
+  void (*ws_onWatch)(void *websocketUserData, int fd, int events);
 };
 
 //! structure to configure a websocket server socket
@@ -147,7 +413,7 @@ struct websocket_init {
 };
 
 /**
- * \brief Returns the ipv4 address of the client
+ * \brief Returns the ip address of the client
  *
  * \param *wsConnectionDesc Pointer to the websocket client descriptor
  *
@@ -156,7 +422,7 @@ const char *
 websocketServer_getPeerIp(struct websocket_connection_desc *wsConnectionDesc);
 
 /**
- * \brief Returns the ipv4 address of the server interface
+ * \brief Returns the ip address of the server interface
  *
  * \param *wsConnectionDesc Pointer to the websocket client descriptor
  *
@@ -206,6 +472,100 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
 void
 websocketServer_close(struct websocket_server_desc *wsDesc);
 
+/**
+ * \brief Drains the given websocket server
+ *        stops accepting new connections, sends a close frame (going away) to every connection
+ *        and waits for the close handshakes. Connections that are still open when the timeout
+ *        expires are closed forcefully
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param timeoutMs The maximum time to wait for the close handshakes in milliseconds
+ *
+ * \return The number of connections that had to be closed forcefully
+ *
+ * \note In threadless mode the function returns 0 immediately and the remaining connections
+ *       are closed by websocket_process when the timeout expires.
+ *       websocketServer_close must be called afterwards in any case
+ */
+int
+websocketServer_drain(struct websocket_server_desc *wsDesc, int timeoutMs);
+
+/**
+ * \brief Returns the statistics of the given websocket server
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param *stats Pointer to where the statistics should be stored
+ */
+void
+websocketServer_getStats(struct websocket_server_desc *wsDesc,
+                         struct websocket_server_stats *stats);
+
+/**
+ * \brief Takes up to max messages from the receive queue of the server (recvQueueDepth),
+ *        can be called from any thread, the messages of a connection are queued in order
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param *msgs Pointer to where the messages should be stored (the caller owns them and passes
+ *              them to websocket_releaseMessages)
+ * \param max The maximum number of messages
+ * \param timeoutMs The maximum time to wait for the first message in milliseconds
+ *                  (-1 => infinite, 0 => don't wait)
+ *
+ * \return The number of messages (0 => timeout or the server was closed)
+ *
+ * \note the server must not be freed while a thread waits, pass it to websocket_ref to keep it
+ */
+size_t
+websocketServer_recvBatch(struct websocket_server_desc *wsDesc, struct ws_message *msgs,
+                          size_t max, int timeoutMs);
+
+/**
+ * \brief Releases the payloads and connections of messages from websocketServer_recvBatch
+ *
+ * \param *msgs Pointer to the messages
+ * \param count The number of messages
+ */
+void
+websocket_releaseMessages(struct ws_message *msgs, size_t count);
+
+/**
+ * \brief Hands over the listening socket (and optionally the established connections) of the
+ *        given server to another process that calls websocketServer_takeover (hot restart)
+ *        waits for the other process to connect to the unix socket at path and stops accepting
+ *        new connections afterwards
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param *path The path of the unix socket that is used for the handover
+ * \param connections true => hand over the established connections too
+ * \param timeoutMs The maximum time to wait for the other process in milliseconds
+ *
+ * \return The number of connections that were handed over or -1 in case of error
+ *
+ * \note Only connections that are between two messages can be handed over, multiplexed,
+ *       relayed (websocket_relay), resumable and HTTP/2 connections are never handed over.
+ *       Before a connection is handed over ws_onHandover is called, afterwards the connection
+ *       is closed in this process (without notifying the peer) and ws_onClose is called.
+ *       Connections that couldn't be handed over stay open and can be closed with
+ *       websocketServer_drain. websocketServer_close must be called afterwards in any case
+ */
+int
+websocketServer_handover(struct websocket_server_desc *wsDesc, const char *path, bool connections,
+                         int timeoutMs);
+
+/**
+ * \brief Opens a websocket server with the listening socket (and the connections) of another
+ *        process that calls websocketServer_handover (hot restart)
+ *
+ * \param *wsInit Pointer to the init struct (address and port are ignored)
+ * \param *websocketUserData userData for the socket
+ * \param *path The path of the unix socket that is used for the handover
+ *
+ * \return the websocket descriptor or NULL in case of error
+ */
+struct websocket_server_desc *
+websocketServer_takeover(struct websocket_server_init *wsInit, void *websocketUserData,
+                         const char *path);
+
 /**
  * \brief Closes a websocket client
  *
@@ -256,6 +616,22 @@ int
 websocket_sendData(struct websocket_connection_desc *wsConnectionDesc, enum ws_data_type dataType,
                    const void *msg, size_t len);
 
+/**
+ * \brief Sends one binary or text message whose payload is spread over several buffers
+ *        (e.g. header, body and trailer) without joining them first, servers pass the buffers
+ *        to the socket directly and clients mask them in one pass
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param dataType the datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *iov Pointer to the buffers of the payload
+ * \param iovcnt the number of buffers
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocket_sendDataV(struct websocket_connection_desc *wsConnectionDesc,
+                    enum ws_data_type dataType, const struct iovec *iov, int iovcnt);
+
 /**
  * \brief Closes the given websocket connection
  *
@@ -266,6 +642,34 @@ void
 websocket_closeConnection(struct websocket_connection_desc *wsConnectionDesc,
                           enum ws_close_code code);
 
+/**
+ * \brief Changes the inbound rate limit of the given server connection
+ *        (e.g. to give authenticated clients a higher limit)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *rateLimit Pointer to the new limit (the buckets start full)
+ *
+ * \return 0 if successful else -1 (not a server connection)
+ *
+ * \note must be called from ws_onOpen or ws_onMessage of the connection
+ */
+int
+websocket_setRateLimit(struct websocket_connection_desc *wsConnectionDesc,
+                       const struct ws_rate_limit *rateLimit);
+
+/**
+ * \brief Changes the egress rate of the given server connection
+ *        (e.g. to give a slow consumer a lower rate)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param bytesPerSec The rate in bytes per second (0 => unlimited)
+ *
+ * \return 0 if successful else -1 (not a server connection or an HTTP/2 stream)
+ */
+int
+websocket_setPacingRate(struct websocket_connection_desc *wsConnectionDesc,
+                        unsigned long bytesPerSec);
+
 /**
  * \brief Sends fragmented binary or text data through websockets
  *         use websocket_sendDataFragmetedCont for further fragments
@@ -297,6 +701,336 @@ int
 websocket_sendDataFragmentedCont(struct websocket_connection_desc *wsConnectionDesc, bool fin,
                                  const void *msg, size_t len);
 
+/**
+ * \brief Encodes a text or binary message once so that it can be sent to several server
+ *        connections without copying it again
+ *
+ * \param dataType the datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *msg the payload data
+ * \param len the payload length
+ *
+ * \return the prepared frame (release it with websocket_unref) or NULL in case of error
+ */
+struct websocket_frame *
+websocket_prepareFrame(enum ws_data_type dataType, const void *msg, size_t len);
+
+/**
+ * \brief Sends a prepared frame through the given server connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *frame Pointer to the prepared frame
+ *
+ * \return 0 if successful else -1
+ *
+ * \note the frame keeps its order behind the frames replay rings queued for the connection
+ */
+int
+websocket_sendFrame(struct websocket_connection_desc *wsConnectionDesc,
+                    const struct websocket_frame *frame);
+
+/**
+ * \brief Pairs two connections (e.g. a server connection and the client connection to the
+ *        upstream server) so that every frame received on one is forwarded to the other
+ *        without reassembly (proxy mode)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *peer Pointer to the websocket connection descriptor of the other side
+ *
+ * \return 0 if successful else -1
+ *
+ * \note ws_onMessage isn't called for paired connections anymore, frames that were received
+ *       before are passed to it as usual. Control frames (including the close handshake) are
+ *       forwarded too, if one connection is closed the other one is closed as well.
+ *       Unmasked frames are forwarded as they are, masked frames are remasked in one pass.
+ */
+int
+websocket_relay(struct websocket_connection_desc *wsConnectionDesc,
+                struct websocket_connection_desc *peer);
+
+/**
+ * \brief Creates a replay ring that keeps the last frames of a topic for late joining
+ *        subscribers
+ *
+ * \param maxFrames the maximum number of frames that are kept (must not be 0)
+ * \param maxAgeMs the maximum age of the frames that are kept in milliseconds (0 => unlimited)
+ *
+ * \return the replay descriptor or NULL in case of error
+ */
+struct websocket_replay *
+websocketReplay_create(unsigned long maxFrames, unsigned long maxAgeMs);
+
+/**
+ * \brief Releases the given replay ring with all its frames and subscriptions
+ *
+ * \param *replay Pointer to the replay descriptor
+ */
+void
+websocketReplay_destroy(struct websocket_replay *replay);
+
+/**
+ * \brief Appends a prepared frame to the replay ring and sends it to all subscribers
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *frame Pointer to the prepared frame (the ring takes its own reference)
+ *
+ * \return the number of subscribers the frame was sent to (or queued for if another thread is
+ *         sending to the subscriber)
+ *
+ * \note subscribers that fail to receive the frame are removed, the frame is queued for every
+ *       subscriber and sent without holding the lock of the ring, a publisher never waits for a
+ *       subscriber another thread is sending to (a subscriber that falls 16 MiB behind is
+ *       closed)
+ */
+int
+websocketReplay_publish(struct websocket_replay *replay, struct websocket_frame *frame);
+
+/**
+ * \brief Sends the frames of the replay ring to the given server connection with vectored
+ *        sends and subscribes it to the frames that are published afterwards (no gap and no
+ *        duplicates)
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocketReplay_subscribe(struct websocket_replay *replay,
+                          struct websocket_connection_desc *wsConnectionDesc);
+
+/**
+ * \brief Unsubscribes the given connection from the replay ring (closed connections are
+ *        unsubscribed automatically)
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+void
+websocketReplay_unsubscribe(struct websocket_replay *replay,
+                            struct websocket_connection_desc *wsConnectionDesc);
+
+/**
+ * \brief Creates a shared memory bus (memfd) that passes prepared frames from this process
+ *        to other processes without a network hop (single producer, multiple consumers)
+ *
+ * \param size the size of the ring in bytes (rounded up to a power of 2, at least 64 KiB),
+ *             frames must not be bigger than a quarter of it
+ *
+ * \return the bus descriptor or NULL in case of error
+ */
+struct websocket_bus *
+websocketBus_create(size_t size);
+
+/**
+ * \brief Returns the memfd of the bus that is passed to the other processes
+ *        (e.g. inherited by fork or sent with SCM_RIGHTS)
+ *
+ * \param *bus Pointer to the bus descriptor
+ *
+ * \return the memfd or -1 if the bus was attached
+ */
+int
+websocketBus_getFd(struct websocket_bus *bus);
+
+/**
+ * \brief Writes a prepared frame to the bus, the writer never waits for the readers
+ *        (frames that a slow reader didn't read yet are overwritten)
+ *
+ * \param *bus Pointer to the bus descriptor (must be created by this process)
+ * \param *frame Pointer to the prepared frame
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocketBus_publish(struct websocket_bus *bus, struct websocket_frame *frame);
+
+/**
+ * \brief Attaches to the bus of another process, every frame that is published afterwards is
+ *        passed to ws_onFrame from a thread of the bus (e.g. to pass it to websocket_sendFrame
+ *        or websocketReplay_publish)
+ *
+ * \param fd the memfd of the bus (it isn't taken over)
+ * \param *ws_onFrame callback for the frames (the frame is only valid until the callback
+ *                    returns unless it was passed to websocket_ref), lost is true if frames
+ *                    were overwritten before they could be read
+ * \param *userData the user data that is passed to the callback
+ *
+ * \return the bus descriptor or NULL in case of error
+ */
+struct websocket_bus *
+websocketBus_attach(int fd,
+                    void (*ws_onFrame)(void *userData, struct websocket_frame *frame, bool lost),
+                    void *userData);
+
+/**
+ * \brief Closes the given bus
+ *
+ * \param *bus Pointer to the bus descriptor
+ */
+void
+websocketBus_close(struct websocket_bus *bus);
+
+/**
+ * \brief Returns if the connection uses multiplexed channels
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return true if the subprotocol for multiplexed channels was negotiated else false
+ */
+bool
+websocketConnection_isMultiplexed(struct websocket_connection_desc *wsConnectionDesc);
+
+/**
+ * \brief Returns the token of the resumable session of the connection, a client passes it with
+ *        websocketConnection_getSessionSeq in websocket_client_init to resume the session
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return The token (valid as long as the connection) or NULL if the connection has no
+ *         resumable session
+ */
+const char *
+websocketConnection_getSessionToken(struct websocket_connection_desc *wsConnectionDesc);
+
+/**
+ * \brief Returns the sequence number of the last message of the resumable session, that is the
+ *        last sent message for servers and the last received message for clients
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return The sequence number (0 => no message yet or no resumable session)
+ */
+unsigned long long
+websocketConnection_getSessionSeq(struct websocket_connection_desc *wsConnectionDesc);
+
+/**
+ * \brief Returns if the connection continues a previous session, if not the application has to
+ *        send the full state again
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return true if the session was resumed else false (new session or not resumable)
+ */
+bool
+websocketConnection_isResumed(struct websocket_connection_desc *wsConnectionDesc);
+
+/**
+ * \brief Returns the request target of the upgrade request
+ *
+ * \param *upgrade Pointer to the upgrade request
+ *
+ * \return The request target (e.g. "/chat?token=abc", the :path of HTTP/2 streams)
+ */
+const char *
+websocketUpgrade_getPath(struct websocket_upgrade *upgrade);
+
+/**
+ * \brief Returns the value of a header of the upgrade request
+ *
+ * \param *upgrade Pointer to the upgrade request
+ * \param *name The name of the header (case insensitive)
+ *
+ * \return The value (valid until the verdict was passed) or NULL if the header is missing
+ */
+const char *
+websocketUpgrade_getHeader(struct websocket_upgrade *upgrade, const char *name);
+
+/**
+ * \brief Returns the ip address of the client that sent the upgrade request
+ *
+ * \param *upgrade Pointer to the upgrade request
+ *
+ * \return The ip address as string
+ */
+const char *
+websocketUpgrade_getPeerIp(struct websocket_upgrade *upgrade);
+
+/**
+ * \brief Passes the verdict of an upgrade request for which ws_onUpgradeRequest returned
+ *        WS_UPGRADE_PENDING, can be called from any thread
+ *
+ * \param *upgrade Pointer to the upgrade request (must not be used afterwards)
+ * \param accept true to continue with the websocket handshake, false to reject the request
+ * \param status The http status of a rejected request (400 - 599, else 403 is used)
+ *
+ * \note servers without own threads (ws_onWatch) apply the verdict with the next
+ *       websocket_process call
+ */
+void
+websocketUpgrade_complete(struct websocket_upgrade *upgrade, bool accept, int status);
+
+/**
+ * \brief Opens a logical channel on a multiplexed connection, messages can be sent once the
+ *        peer accepted it (ws_onCredit is called)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param channelId the channel id (1 - WS_CHANNEL_MAX)
+ * \param *init Pointer to the callbacks, the receive window and the user data
+ *
+ * \return the channel or NULL in case of error, if the peer rejects it ws_onClose is called
+ */
+struct websocket_channel *
+websocketChannel_open(struct websocket_connection_desc *wsConnectionDesc, unsigned int channelId,
+                      const struct ws_channel_init *init);
+
+/**
+ * \brief Sends binary or text data through the given channel
+ *
+ * \param *channel Pointer to the channel
+ * \param dataType the datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *msg the payload data
+ * \param len the payload length
+ *
+ * \return 0 if successful else -1 (e.g. not accepted yet or no credits left)
+ */
+int
+websocketChannel_send(struct websocket_channel *channel, enum ws_data_type dataType,
+                      const void *msg, size_t len);
+
+/**
+ * \brief Returns the number of bytes that can be sent through the channel until the peer
+ *        grants new credits (a message is sent as long as there are credits left)
+ *
+ * \param *channel Pointer to the channel
+ *
+ * \return the number of bytes (0 if not accepted yet, LONG_MAX => unlimited)
+ */
+long
+websocketChannel_getCredit(struct websocket_channel *channel);
+
+/**
+ * \brief Closes the given channel (ws_onClose of the channel isn't called)
+ *
+ * \param *channel Pointer to the channel (must not be used afterwards)
+ */
+void
+websocketChannel_close(struct websocket_channel *channel);
+
+/**
+ * \brief Processes the events of an fd that was passed to ws_onWatch (threadless mode),
+ *        the connections that used up their read budget (round robin) and all expired timeouts
+ *
+ * \param fd The file descriptor (use -1 if only the timeouts should be processed)
+ * \param events The poll events that occured on the fd (POLLIN, POLLHUP, ...)
+ *
+ * \return 0 if successful else -1 (fd unknown)
+ *
+ * \note All callbacks are called from within this function. In threadless mode all
+ *       functions of the library must be called from the thread of the event loop
+ */
+int
+websocket_process(int fd, int events);
+
+/**
+ * \brief Returns the time until websocket_process has to be called for the next timeout
+ *        (threadless mode)
+ *
+ * \return The timeout in milliseconds (0 if a connection has data left that exceeded its read
+ *         budget) or -1 if there is no timeout pending
+ */
+int
+websocket_nextTimeout(void);
+
 /* ------------------------------ LEGACY FUNCTIONS ------------------------------ */
 
 /**
@@ -0,0 +1,533 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Optional header only C++ (>= C++17) wrapper of ezwebsocket.h
+ *
+ * The handles own exactly one reference of the underlying object and are move only, so
+ * ownership is passed on without touching the reference count. Messages are passed to the
+ * callbacks as views of the receive buffer, they are only referenced when they are retained.
+ * The wrapper never throws, exceptions that escape from a callback are logged and dropped.
+ */
+
+#ifndef WEBSOCKET_HPP_
+#define WEBSOCKET_HPP_
+
+#include "ezwebsocket.h"
+extern "C" {
+#include "ezwebsocket_log.h"
+}
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define EZWEBSOCKET_HAVE_SPAN 1
+#endif
+
+namespace ezwebsocket {
+
+//! a received message that owns one reference of the payload
+class Message
+{
+public:
+  Message() noexcept = default;
+  Message(Message &&other) noexcept
+    : mType(other.mType), mData(std::exchange(other.mData, nullptr)),
+      mLen(std::exchange(other.mLen, 0))
+  {
+  }
+  Message &
+  operator=(Message &&other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      mType = other.mType;
+      mData = std::exchange(other.mData, nullptr);
+      mLen = std::exchange(other.mLen, 0);
+    }
+    return *this;
+  }
+  Message(const Message &) = delete;
+  Message &
+  operator=(const Message &) = delete;
+  ~Message() { reset(); }
+
+  /**
+   * \brief Takes over a reference of a payload that was passed to ws_onMessage
+   *        (the caller must have called websocket_ref for it)
+   */
+  static Message
+  adopt(enum ws_data_type type, void *data, size_t len) noexcept
+  {
+    Message msg;
+
+    msg.mType = type;
+    msg.mData = data;
+    msg.mLen = data ? len : 0;
+    return msg;
+  }
+
+  //! gives up the ownership, the caller has to call websocket_unref for the returned pointer
+  void *
+  release() noexcept
+  {
+    mLen = 0;
+    return std::exchange(mData, nullptr);
+  }
+
+  void
+  reset() noexcept
+  {
+    if (mData)
+      websocket_unref(mData);
+    mData = nullptr;
+    mLen = 0;
+  }
+
+  enum ws_data_type
+  type() const noexcept
+  {
+    return mType;
+  }
+  const void *
+  data() const noexcept
+  {
+    return mData;
+  }
+  size_t
+  size() const noexcept
+  {
+    return mLen;
+  }
+  std::string_view
+  text() const noexcept
+  {
+    return std::string_view(static_cast<const char *>(mData), mLen);
+  }
+#ifdef EZWEBSOCKET_HAVE_SPAN
+  std::span<const std::byte>
+  bytes() const noexcept
+  {
+    return std::span<const std::byte>(static_cast<const std::byte *>(mData), mLen);
+  }
+#endif
+
+private:
+  enum ws_data_type mType = WS_DATA_TYPE_BINARY;
+  void *mData = nullptr;
+  size_t mLen = 0;
+};
+
+//! a message that was passed to a callback, it's only valid until the callback returns
+class MessageView
+{
+public:
+  MessageView(enum ws_data_type type, void *data, size_t len) noexcept
+    : mType(type), mData(data), mLen(data ? len : 0)
+  {
+  }
+
+  enum ws_data_type
+  type() const noexcept
+  {
+    return mType;
+  }
+  const void *
+  data() const noexcept
+  {
+    return mData;
+  }
+  size_t
+  size() const noexcept
+  {
+    return mLen;
+  }
+  std::string_view
+  text() const noexcept
+  {
+    return std::string_view(static_cast<const char *>(mData), mLen);
+  }
+#ifdef EZWEBSOCKET_HAVE_SPAN
+  std::span<const std::byte>
+  bytes() const noexcept
+  {
+    return std::span<const std::byte>(static_cast<const std::byte *>(mData), mLen);
+  }
+#endif
+
+  //! keeps the payload beyond the callback without copying it
+  Message
+  retain() const noexcept
+  {
+    if (mData)
+      websocket_ref(mData);
+    return Message::adopt(mType, mData, mLen);
+  }
+
+private:
+  enum ws_data_type mType;
+  void *mData;
+  size_t mLen;
+};
+
+class Connection;
+
+//! a connection that is not owned (e.g. passed to a callback)
+class ConnectionRef
+{
+public:
+  ConnectionRef(struct websocket_connection_desc *desc = nullptr) noexcept : mDesc(desc) {}
+
+  struct websocket_connection_desc *
+  get() const noexcept
+  {
+    return mDesc;
+  }
+  explicit operator bool() const noexcept { return mDesc != nullptr; }
+
+  bool
+  send(std::string_view text) const noexcept
+  {
+    return websocket_sendData(mDesc, WS_DATA_TYPE_TEXT, text.data(), text.size()) == 0;
+  }
+  bool
+  send(enum ws_data_type type, const void *data, size_t len) const noexcept
+  {
+    return websocket_sendData(mDesc, type, data, len) == 0;
+  }
+#ifdef EZWEBSOCKET_HAVE_SPAN
+  bool
+  send(std::span<const std::byte> data) const noexcept
+  {
+    return websocket_sendData(mDesc, WS_DATA_TYPE_BINARY, data.data(), data.size()) == 0;
+  }
+#endif
+  //! sends the payload of a received message again (e.g. an echo) without copying it
+  bool
+  send(const MessageView &msg) const noexcept
+  {
+    return websocket_sendData(mDesc, msg.type(), msg.data(), msg.size()) == 0;
+  }
+  bool
+  send(const Message &msg) const noexcept
+  {
+    return websocket_sendData(mDesc, msg.type(), msg.data(), msg.size()) == 0;
+  }
+  bool
+  sendFrame(struct websocket_frame *frame) const noexcept
+  {
+    return websocket_sendFrame(mDesc, frame) == 0;
+  }
+  bool
+  relay(ConnectionRef peer) const noexcept
+  {
+    return websocket_relay(mDesc, peer.get()) == 0;
+  }
+  void
+  close(enum ws_close_code code = WS_CLOSE_CODE_NORMAL) const noexcept
+  {
+    websocket_closeConnection(mDesc, code);
+  }
+  bool
+  isConnected() const noexcept
+  {
+    return websocketConnection_isConnected(mDesc);
+  }
+  const char *
+  peerIp() const noexcept
+  {
+    return websocketServer_getPeerIp(mDesc);
+  }
+
+  //! keeps the connection beyond the callback
+  inline Connection
+  retain() const noexcept;
+
+protected:
+  struct websocket_connection_desc *mDesc;
+};
+
+//! a connection that owns one reference of the descriptor
+class Connection : public ConnectionRef
+{
+public:
+  Connection() noexcept = default;
+  Connection(Connection &&other) noexcept : ConnectionRef(std::exchange(other.mDesc, nullptr)) {}
+  Connection &
+  operator=(Connection &&other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      mDesc = std::exchange(other.mDesc, nullptr);
+    }
+    return *this;
+  }
+  Connection(const Connection &) = delete;
+  Connection &
+  operator=(const Connection &) = delete;
+  ~Connection() { reset(); }
+
+  //! takes over a reference of the descriptor (the caller must have called websocket_ref)
+  static Connection
+  adopt(struct websocket_connection_desc *desc) noexcept
+  {
+    Connection conn;
+
+    conn.mDesc = desc;
+    return conn;
+  }
+
+  //! gives up the ownership, the caller has to call websocket_unref for the returned pointer
+  struct websocket_connection_desc *
+  release() noexcept
+  {
+    return std::exchange(mDesc, nullptr);
+  }
+
+  void
+  reset() noexcept
+  {
+    if (mDesc)
+      websocket_unref(mDesc);
+    mDesc = nullptr;
+  }
+};
+
+inline Connection
+ConnectionRef::retain() const noexcept
+{
+  if (mDesc)
+    websocket_ref(mDesc);
+  return Connection::adopt(mDesc);
+}
+
+//! the callbacks of a server or client, every member may be empty
+struct Handlers {
+  //! called when a new connection is established
+  std::function<void(ConnectionRef)> onOpen;
+  //! called when a message is received
+  std::function<void(ConnectionRef, MessageView)> onMessage;
+  //! called when a connection is closed
+  std::function<void(ConnectionRef)> onClose;
+};
+
+namespace detail {
+
+template <typename Func, typename... Args>
+inline void
+invoke(const char *name, const Func &func, Args &&...args) noexcept
+{
+  if (!func)
+    return;
+  try {
+    func(std::forward<Args>(args)...);
+  } catch (const std::exception &e) {
+    ezwebsocket_log(EZLOG_ERROR, "%s threw: %s\n", name, e.what());
+  } catch (...) {
+    ezwebsocket_log(EZLOG_ERROR, "%s threw\n", name);
+  }
+}
+
+inline void
+onMessage(void *userData, struct websocket_connection_desc *desc, void *connectionUserData,
+          enum ws_data_type type, void *msg, size_t len)
+{
+  (void) connectionUserData;
+  invoke("onMessage", static_cast<Handlers *>(userData)->onMessage, ConnectionRef(desc),
+         MessageView(type, msg, len));
+}
+
+inline void *
+onServerOpen(void *userData, struct websocket_server_desc *wsDesc,
+             struct websocket_connection_desc *desc)
+{
+  (void) wsDesc;
+  invoke("onOpen", static_cast<Handlers *>(userData)->onOpen, ConnectionRef(desc));
+  return nullptr;
+}
+
+inline void
+onServerClose(struct websocket_server_desc *wsDesc, void *userData,
+              struct websocket_connection_desc *desc, void *connectionUserData)
+{
+  (void) wsDesc;
+  (void) connectionUserData;
+  invoke("onClose", static_cast<Handlers *>(userData)->onClose, ConnectionRef(desc));
+}
+
+inline void *
+onClientOpen(void *userData, struct websocket_connection_desc *desc)
+{
+  invoke("onOpen", static_cast<Handlers *>(userData)->onOpen, ConnectionRef(desc));
+  return nullptr;
+}
+
+inline void
+onClientClose(void *userData, struct websocket_connection_desc *desc, void *connectionUserData)
+{
+  (void) connectionUserData;
+  invoke("onClose", static_cast<Handlers *>(userData)->onClose, ConnectionRef(desc));
+}
+
+} // namespace detail
+
+//! a websocket server that is closed when it's destroyed
+class Server
+{
+public:
+  Server() noexcept = default;
+  /**
+   * \brief Opens a server, the callbacks of init are replaced by the handlers
+   *        (check the result with operator bool)
+   */
+  Server(struct websocket_server_init init, Handlers handlers) noexcept
+  {
+    try {
+      mHandlers = std::make_unique<Handlers>(std::move(handlers));
+    } catch (...) {
+      return;
+    }
+    init.ws_onOpen = detail::onServerOpen;
+    init.ws_onMessage = detail::onMessage;
+    init.ws_onClose = detail::onServerClose;
+    mDesc = websocketServer_open(&init, mHandlers.get());
+  }
+  Server(Server &&other) noexcept
+    : mHandlers(std::move(other.mHandlers)), mDesc(std::exchange(other.mDesc, nullptr))
+  {
+  }
+  Server &
+  operator=(Server &&other) noexcept
+  {
+    if (this != &other) {
+      close();
+      mHandlers = std::move(other.mHandlers);
+      mDesc = std::exchange(other.mDesc, nullptr);
+    }
+    return *this;
+  }
+  Server(const Server &) = delete;
+  Server &
+  operator=(const Server &) = delete;
+  ~Server() { close(); }
+
+  explicit operator bool() const noexcept { return mDesc != nullptr; }
+  struct websocket_server_desc *
+  get() const noexcept
+  {
+    return mDesc;
+  }
+
+  int
+  drain(int timeoutMs) noexcept
+  {
+    return websocketServer_drain(mDesc, timeoutMs);
+  }
+
+  //! closes the server (the handlers are not called afterwards)
+  void
+  close() noexcept
+  {
+    if (mDesc)
+      websocketServer_close(mDesc);
+    mDesc = nullptr;
+    mHandlers.reset();
+  }
+
+private:
+  std::unique_ptr<Handlers> mHandlers;
+  struct websocket_server_desc *mDesc = nullptr;
+};
+
+//! a websocket client connection that is closed when it's destroyed
+class Client
+{
+public:
+  Client() noexcept = default;
+  /**
+   * \brief Connects to a server, the callbacks of init are replaced by the handlers
+   *        (check the result with operator bool)
+   */
+  Client(struct websocket_client_init init, Handlers handlers) noexcept
+  {
+    try {
+      mHandlers = std::make_unique<Handlers>(std::move(handlers));
+    } catch (...) {
+      return;
+    }
+    init.ws_onOpen = detail::onClientOpen;
+    init.ws_onMessage = detail::onMessage;
+    init.ws_onClose = detail::onClientClose;
+    mDesc = websocketClient_open(&init, mHandlers.get());
+  }
+  Client(Client &&other) noexcept
+    : mHandlers(std::move(other.mHandlers)), mDesc(std::exchange(other.mDesc, nullptr))
+  {
+  }
+  Client &
+  operator=(Client &&other) noexcept
+  {
+    if (this != &other) {
+      close();
+      mHandlers = std::move(other.mHandlers);
+      mDesc = std::exchange(other.mDesc, nullptr);
+    }
+    return *this;
+  }
+  Client(const Client &) = delete;
+  Client &
+  operator=(const Client &) = delete;
+  ~Client() { close(); }
+
+  explicit operator bool() const noexcept { return mDesc != nullptr; }
+  ConnectionRef
+  connection() const noexcept
+  {
+    return ConnectionRef(mDesc);
+  }
+
+  //! closes the connection (the handlers are not called afterwards)
+  void
+  close(enum ws_close_code code = WS_CLOSE_CODE_NORMAL) noexcept
+  {
+    if (mDesc)
+      websocketClient_close(mDesc, code);
+    mDesc = nullptr;
+    mHandlers.reset();
+  }
+
+private:
+  std::unique_ptr<Handlers> mHandlers;
+  struct websocket_connection_desc *mDesc = nullptr;
+};
+
+} // namespace ezwebsocket
+
+#endif /* WEBSOCKET_HPP_ */
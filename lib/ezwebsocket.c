@@ -24,22 +24,37 @@
  */
 
 #define _GNU_SOURCE
+#include "http2/http2.h"
 #include "ref_count.h"
 #include "socket_client/socket_client.h"
 #include "socket_server/socket_server.h"
 #include "stringck.h"
 #include "utils/base64.h"
+#include "utils/event_loop.h"
+#include "utils/msg_queue.h"
+#include "utils/random.h"
+#include "utils/shm_ring.h"
+#include "utils/token_bucket.h"
+#include "utils/unix_socket.h"
 #include "utils/utf8.h"
 #include <config.h>
 #include <ctype.h>
+#include <errno.h>
 #include <ezwebsocket.h>
 #include <ezwebsocket_log.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #ifdef HAVE_OPENSSL
@@ -61,8 +76,13 @@
 //! value of the websocket payload length if the extended 64-bit length is used
 #define EXTENDED_64BIT_PAYLOAD_LENGTH 127
 
+//! the default number of bytes that are read from a connection at once
+#define READ_BUDGET_BYTES_DEFAULT 65536
+//! the default number of frames that are processed for a connection at once
+#define READ_BUDGET_MSGS_DEFAULT  64
+
 //! the different websocket states
-enum ws_state { WS_STATE_HANDSHAKE, WS_STATE_CONNECTED, WS_STATE_CLOSED };
+enum ws_state { WS_STATE_HANDSHAKE, WS_STATE_CONNECTED, WS_STATE_CLOSING, WS_STATE_CLOSED };
 
 //! the websocket op-codes
 enum ws_opcode {
@@ -95,10 +115,59 @@ struct websocket_server_desc {
   //! callback that is called when the websocket is closed
   void (*ws_onClose)(struct websocket_server_desc *wsDesc, void *websocketUserData,
                      struct websocket_connection_desc *connectionDesc, void *userData);
+  //! callback that is called when an fd should be (un)watched (threadless mode)
+  void (*ws_onWatch)(void *websocketUserData, int fd, int events);
+  //! callback that is called when a connection is handed over to another process
+  size_t (*ws_onHandover)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                          void *connectionUserData, void *buf, size_t len);
+  //! callback that is called when a connection was taken over from another process
+  void *(*ws_onTakeover)(void *websocketUserData, struct websocket_server_desc *wsDesc,
+                         struct websocket_connection_desc *connectionDesc, const void *state,
+                         size_t len);
   //! pointer to the socket descriptor
   void *socketDesc;
   //! pointer to the user data
   void *wsSocketUserData;
+  //! the inbound rate limit for new connections
+  struct ws_rate_limit rateLimit;
+  //! the inbound rate limit of all connections together
+  struct ws_rate_limit endpointRateLimit;
+  //! token bucket for the frames of all connections
+  struct token_bucket endpointMsgBucket;
+  //! token bucket for the bytes of all connections
+  struct token_bucket endpointByteBucket;
+  //! the number of times a connection exceeded the rate limit
+  unsigned long rateLimited;
+  //! mutex that protects the endpoint buckets and rateLimited
+  pthread_mutex_t rateMutex;
+  //! indicates if multiplexed channels are offered to the clients
+  bool channels;
+  //! callback that is called when the peer opens a channel
+  bool (*ws_onChannelOpen)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                           void *connectionUserData, unsigned int channelId,
+                           struct ws_channel_init *init);
+  //! the callbacks of the http/2 sessions (NULL => http/2 is disabled)
+  const struct http2_callbacks *h2Callbacks;
+  //! indicates if resumable sessions are offered to the clients
+  bool resumable;
+  //! the number of frames that are kept per session
+  unsigned long sessionFrames;
+  //! the time a session is kept after its connection was closed in milliseconds
+  unsigned long sessionTimeoutMs;
+  //! the resumable sessions (hold a reference)
+  struct ws_session *sessions;
+  //! mutex that protects the sessions
+  pthread_mutex_t sessionMutex;
+  //! callback that decides about upgrade requests before the connection is set up
+  enum ws_upgrade_verdict (*ws_onUpgradeRequest)(void *websocketUserData,
+                                                 struct websocket_upgrade *upgrade, int *status);
+  //! the time in milliseconds a pending upgrade request waits for its verdict
+  unsigned long upgradeTimeoutMs;
+  //! the upgrade requests whose verdict is pending or not applied yet (hold a reference)
+  struct websocket_upgrade *upgrades;
+  //! the queue the complete messages are put into instead of passing them to ws_onMessage
+  //! (NULL => not used)
+  struct msg_queue *recvQueue;
 };
 
 //! structure that holds message data
@@ -131,6 +200,54 @@ struct websocket_connection_desc {
   void *connectionUserData;
   //! stores the time for message timeouts
   struct timespec timeout;
+  //! the inbound rate limit of the connection (server only)
+  struct ws_rate_limit rateLimit;
+  //! token bucket for the received frames
+  struct token_bucket msgBucket;
+  //! token bucket for the received bytes
+  struct token_bucket byteBucket;
+  //! indicates that the rest of a fragmented message is dropped because of the rate limit
+  bool dropping;
+  //! indicates that the subprotocol for multiplexed channels was negotiated
+  bool multiplexed;
+  //! the logical channels indexed by the channel id (multiplexed connections only)
+  struct websocket_channel **channels;
+  //! mutex that protects the channels
+  pthread_mutex_t channelMutex;
+  //! the http/2 session if the connection carries websockets over http/2 (server only)
+  struct http2_session *h2Session;
+  //! the http/2 stream if the websocket is carried by a http/2 stream (server only)
+  struct http2_stream *h2Stream;
+  //! the connection the received frames are forwarded to (proxy mode, referenced)
+  struct websocket_connection_desc *relayPeer;
+  //! the number of replay rings the connection is subscribed to
+  unsigned long replaySubscriptions;
+  //! the frames of replay rings and sessions that wait to be sent in the order they were queued
+  struct outbox_entry *outbox;
+  //! the last entry of the outbox
+  struct outbox_entry *outboxLast;
+  //! the number of bytes in the outbox
+  size_t outboxBytes;
+  //! indicates that a thread is sending the outbox
+  bool outboxBusy;
+  //! indicates that frames were lost, the outbox drops all frames from then on
+  bool outboxFailed;
+  //! indicates that the connection has to be closed because frames were lost
+  bool outboxClose;
+  //! mutex that protects the outbox
+  pthread_mutex_t outboxMutex;
+  //! indicates that a close frame was received in proxy mode
+  bool relayClosing;
+  //! the resumable session (server only, holds a reference)
+  struct ws_session *session;
+  //! indicates that the subprotocol for resumable sessions was negotiated (client only)
+  bool resumable;
+  //! indicates that the connection continues a previous session
+  bool resumed;
+  //! the token of the session (client only)
+  char sessionToken[WS_SESSION_TOKEN_LEN + 1];
+  //! the sequence number of the last received message (client only)
+  unsigned long long sessionSeq;
   //! union for either client or server descriptor
   union {
     //! pointer to the websocket client descriptor (in case of client mode)
@@ -150,6 +267,8 @@ struct websocket_client_desc {
   //! callback that is called when the websocket is closed
   void (*ws_onClose)(void *socketUserData, struct websocket_connection_desc *connectionDesc,
                      void *connectionUserData);
+  //! callback that is called when an fd should be (un)watched (threadless mode)
+  void (*ws_onWatch)(void *socketUserData, int fd, int events);
   //! pointer to the socket descriptor
   void *socketDesc;
   //! pointer to the user data
@@ -164,6 +283,179 @@ struct websocket_client_desc {
   char *endpoint;
   //! pointer to the websocket key that is used to validate it's a websocket connection
   char *wsKey;
+  //! indicates if multiplexed channels are requested from the server
+  bool channels;
+  //! callback that is called when the peer opens a channel
+  bool (*ws_onChannelOpen)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                           void *connectionUserData, unsigned int channelId,
+                           struct ws_channel_init *init);
+  //! indicates if a resumable session is requested from the server
+  bool resumable;
+  //! the token of the session that should be resumed (empty => new session)
+  char resumeToken[WS_SESSION_TOKEN_LEN + 1];
+  //! the sequence number of the last message received in the session that should be resumed
+  unsigned long long resumeSeq;
+};
+
+//! the types of the channel control messages
+enum ws_channel_ctrl {
+  //! opens a channel or acknowledges the opening (value => receive window)
+  WS_CHANNEL_CTRL_OPEN = 1,
+  //! closes a channel or rejects the opening
+  WS_CHANNEL_CTRL_CLOSE = 2,
+  //! grants new credits (value => number of bytes)
+  WS_CHANNEL_CTRL_CREDIT = 3,
+};
+
+//! the channel id of the control messages
+#define WS_CHANNEL_CONTROL  0
+//! the length of a control message (channel id, type, channel, 32-bit value)
+#define WS_CHANNEL_CTRL_LEN 7
+
+//! structure that contains information about a logical channel
+struct websocket_channel {
+  //! the connection the channel belongs to (holds a reference)
+  struct websocket_connection_desc *connection;
+  //! the channel id
+  unsigned int id;
+  //! the callbacks, the receive window and the user data
+  struct ws_channel_init init;
+  //! indicates that the peer has opened or acknowledged the channel
+  bool open;
+  //! indicates that the channel is closed
+  bool closed;
+  //! the receive window of the peer (0 => unlimited)
+  unsigned long peerWindow;
+  //! the number of bytes that may still be sent (can get negative by the last message)
+  long long credit;
+  //! the number of received bytes that were not granted again yet
+  unsigned long consumed;
+};
+
+//! a frame that is encoded once and can be sent to several server connections
+struct websocket_frame {
+  //! the length of the encoded frame
+  size_t len;
+  //! the encoded frame (header and payload)
+  unsigned char data[];
+};
+
+//! the maximum number of bytes that wait in the outbox of a connection, a connection that
+//! falls further behind is closed
+#define WS_OUTBOX_MAX   (16 * 1024 * 1024)
+//! the maximum number of frames that are sent from the outbox with one vectored send
+#define WS_OUTBOX_BATCH 64
+
+//! a frame that waits in the outbox of a connection
+struct outbox_entry {
+  //! the frame (holds a reference)
+  struct websocket_frame *frame;
+  //! the next entry of the outbox
+  struct outbox_entry *next;
+};
+
+//! an entry of the replay ring
+struct replay_entry {
+  //! the prepared frame (holds a reference)
+  struct websocket_frame *frame;
+  //! the time when the frame was published
+  struct timespec time;
+};
+
+//! ring of the last published frames of a topic and its subscribers
+struct websocket_replay {
+  //! the ring with the frames
+  struct replay_entry *entries;
+  //! the maximum number of frames in the ring
+  unsigned long maxFrames;
+  //! the maximum age of the frames in milliseconds (0 => unlimited)
+  unsigned long maxAgeMs;
+  //! the index of the oldest frame
+  unsigned long head;
+  //! the number of frames in the ring
+  unsigned long count;
+  //! the subscribed connections (hold a reference)
+  struct websocket_connection_desc **subscribers;
+  //! the number of subscribed connections
+  size_t numSubscribers;
+  //! the number of allocated subscriber entries
+  size_t maxSubscribers;
+  //! mutex that protects the ring and the subscribers
+  pthread_mutex_t lock;
+  //! the next replay ring in the list of all replay rings
+  struct websocket_replay *next;
+};
+
+//! a shared memory ring that passes prepared frames from one process to others
+struct websocket_bus {
+  //! the ring in the memfd
+  struct shm_ring *ring;
+  //! callback that is called for every frame (only for attached buses)
+  void (*ws_onFrame)(void *userData, struct websocket_frame *frame, bool lost);
+  //! the user data that is passed to ws_onFrame
+  void *userData;
+  //! the thread that reads the ring (only for attached buses)
+  pthread_t tid;
+  //! tells the reader thread to stop
+  bool stop;
+};
+
+//! the default time a pending upgrade request waits for its verdict in milliseconds
+#define WS_UPGRADE_TIMEOUT_MS_DEFAULT 10000
+
+//! an upgrade request that is passed to ws_onUpgradeRequest
+struct websocket_upgrade {
+  //! the connection that sent the request (holds a reference)
+  struct socket_connection_desc *socketConnectionDesc;
+  //! the http/2 stream that carries the request (holds a reference, NULL for HTTP/1.1)
+  struct http2_stream *h2Stream;
+  //! the verdict (WS_UPGRADE_PENDING until it's known)
+  enum ws_upgrade_verdict verdict;
+  //! the http status of a rejected request
+  int status;
+  //! indicates that the connection was closed before the verdict was applied
+  bool closed;
+  //! the time when a pending request is rejected (CLOCK_MONOTONIC)
+  struct timespec deadline;
+  //! the next upgrade request of the server
+  struct websocket_upgrade *next;
+  //! the request target
+  const char *path;
+  //! the length of the request
+  size_t len;
+  //! a copy of the request with every line terminated by '\0'
+  char request[];
+};
+
+//! the length of the sequence number in front of the messages of resumable connections
+#define WS_SESSION_SEQ_LEN            8
+//! the default number of frames that are kept per session for the replay
+#define WS_SESSION_FRAMES_DEFAULT     256
+//! the default time a session is kept after its connection was closed in milliseconds
+#define WS_SESSION_TIMEOUT_MS_DEFAULT 60000
+
+//! a resumable session of a server with the last sent frames
+struct ws_session {
+  //! the token that identifies the session
+  char token[WS_SESSION_TOKEN_LEN + 1];
+  //! the sequence number of the last sent message
+  unsigned long long seq;
+  //! the ring with the last sent frames (hold a reference)
+  struct websocket_frame **frames;
+  //! the maximum number of frames in the ring
+  unsigned long maxFrames;
+  //! the index of the oldest frame
+  unsigned long head;
+  //! the number of frames in the ring
+  unsigned long count;
+  //! the connection the session is attached to (NULL => detached)
+  struct websocket_connection_desc *connection;
+  //! the time when the session was detached
+  struct timespec detached;
+  //! the next session of the server
+  struct ws_session *next;
+  //! mutex that protects the ring and the connection
+  pthread_mutex_t lock;
 };
 
 //! the magic key to calculate the websocket handshake accept key
@@ -246,30 +538,150 @@ parseHttpHeader(const char *wsHeader, size_t len, char *key)
   return 0;
 }
 
+//! websocket handshake subprotocol identifier
+#define WS_HS_PROTOCOL_ID   "Sec-WebSocket-Protocol:"
+//! the subprotocol that is used for multiplexed channels
+#define WS_CHANNEL_PROTOCOL "ezws.mux"
+//! the subprotocol that is used for resumable sessions
+#define WS_RESUME_PROTOCOL  "ezws.resume"
+
+/**
+ * \brief Checks if the given list of subprotocols contains the given protocol
+ *
+ * \param *cpnt Pointer to the comma separated list of tokens
+ * \param *end Pointer to the end of the list
+ * \param *protocol The protocol that should be searched
+ *
+ * \return True if the protocol was found else false
+ */
+static bool
+hasProtocolToken(const char *cpnt, const char *end, const char *protocol)
+{
+  size_t protocolLen = strlen(protocol);
+
+  while (cpnt < end) {
+    while ((cpnt < end) && ((*cpnt == ' ') || (*cpnt == '\t') || (*cpnt == ',')))
+      cpnt++;
+    if (((size_t) (end - cpnt) >= protocolLen) && !strncmp(cpnt, protocol, protocolLen) &&
+        ((cpnt + protocolLen == end) || (cpnt[protocolLen] == ',') ||
+         (cpnt[protocolLen] == ' ') || (cpnt[protocolLen] == '\t')))
+      return true;
+    while ((cpnt < end) && (*cpnt != ','))
+      cpnt++;
+  }
+
+  return false;
+}
+
+/**
+ * \brief Checks if the subprotocol header contains the given protocol
+ *
+ * \param *header Pointer to the http header
+ * \param len The length of the header
+ * \param *protocol The protocol that should be searched
+ *
+ * \return True if the protocol was found else false
+ */
+static bool
+hasWsProtocol(const char *header, size_t len, const char *protocol)
+{
+  const char *cpnt;
+  const char *end;
+
+  cpnt = strnstr((char *) header, WS_HS_PROTOCOL_ID, len);
+  if (!cpnt)
+    return false;
+  cpnt += strlen(WS_HS_PROTOCOL_ID);
+
+  end = strnstr((char *) cpnt, "\r\n", len - (cpnt - header));
+  if (!end)
+    return false;
+
+  return hasProtocolToken(cpnt, end, protocol);
+}
+
 //! blueprint for the websocket handshake reply
 #define WS_HANDSHAKE_REPLY_BLUEPRINT                                                               \
   "HTTP/1.1 101 Switching Protocols\r\n"                                                           \
   "Upgrade: websocket\r\n"                                                                         \
   "Connection: Upgrade\r\n"                                                                        \
   "Sec-WebSocket-Accept: %s\r\n"                                                                   \
+  "%s"                                                                                             \
   "\r\n"
 
+//! the subprotocol header of the handshake for multiplexed channels
+#define WS_CHANNEL_PROTOCOL_HEADER WS_HS_PROTOCOL_ID " " WS_CHANNEL_PROTOCOL "\r\n"
+//! the subprotocol header of the handshake for resumable sessions
+#define WS_RESUME_PROTOCOL_HEADER  WS_HS_PROTOCOL_ID " " WS_RESUME_PROTOCOL "\r\n"
+//! the header with the session token (and the last received sequence number in the request)
+#define WS_HS_SESSION_ID           "Ezws-Session:"
+
+/**
+ * \brief Parses the session header of the handshake ("Ezws-Session: <token> [<seq>]")
+ *
+ * \param *header Pointer to the http header
+ * \param len The length of the header
+ * \param[out] *token Pointer to where the token should be stored (WS_SESSION_TOKEN_LEN + 1 bytes)
+ * \param[out] *seq Pointer to where the sequence number should be stored (0 if not given)
+ *
+ * \return 0 if successful else -1
+ */
+static int
+parseSessionHeader(const char *header, size_t len, char *token, unsigned long long *seq)
+{
+  const char *cpnt;
+  const char *end;
+  size_t i;
+
+  cpnt = strnstr((char *) header, WS_HS_SESSION_ID, len);
+  if (!cpnt)
+    return -1;
+  cpnt += strlen(WS_HS_SESSION_ID);
+
+  end = strnstr((char *) cpnt, "\r\n", len - (cpnt - header));
+  if (!end)
+    return -1;
+
+  while ((cpnt < end) && (*cpnt == ' '))
+    cpnt++;
+
+  for (i = 0; (i < WS_SESSION_TOKEN_LEN) && (cpnt < end) && isxdigit((unsigned char) *cpnt); i++)
+    token[i] = *cpnt++;
+  if (i < WS_SESSION_TOKEN_LEN)
+    return -1;
+  token[i] = '\0';
+
+  while ((cpnt < end) && (*cpnt == ' '))
+    cpnt++;
+
+  *seq = 0;
+  for (; (cpnt < end) && isdigit((unsigned char) *cpnt); cpnt++) {
+    if (*seq > (ULLONG_MAX - 9) / 10)
+      return -1;
+    *seq = *seq * 10 + (*cpnt - '0');
+  }
+
+  return (cpnt == end) ? 0 : -1;
+}
+
 /**
  * \brief Sends the websocket handshake reply
  *
  * \param *socketConnectionDesc The connection descriptor of the socket
  * \param *replyKey The calculated Sec-WebSocket-Accept key
+ * \param *extraHeader The headers of the accepted subprotocol ("" if none was accepted)
  *
  * \return -1 on error 0 if successful
  *
  */
 static int
-sendWsHandshakeReply(struct socket_connection_desc *socketConnectionDesc, const char *replyKey)
+sendWsHandshakeReply(struct socket_connection_desc *socketConnectionDesc, const char *replyKey,
+                     const char *extraHeader)
 {
-  char replyHeader[strlen(WS_HANDSHAKE_REPLY_BLUEPRINT) + 28];
+  char replyHeader[strlen(WS_HANDSHAKE_REPLY_BLUEPRINT) + strlen(extraHeader) + 28];
 
-  if (snprintf(replyHeader, sizeof(replyHeader), WS_HANDSHAKE_REPLY_BLUEPRINT, replyKey) >=
-      (int) sizeof(replyHeader)) {
+  if (snprintf(replyHeader, sizeof(replyHeader), WS_HANDSHAKE_REPLY_BLUEPRINT, replyKey,
+               extraHeader) >= (int) sizeof(replyHeader)) {
     ezwebsocket_log(EZLOG_ERROR, "problem with the handshake reply key (buffer to small)\n");
     return -1;
   }
@@ -300,6 +712,8 @@ checkWsHandshakeReply(struct websocket_connection_desc *wsConnectionDesc, char *
   char *cpnt;
   unsigned long i;
   char key[30];
+  char token[WS_SESSION_TOKEN_LEN + 1];
+  unsigned long long seq;
   char *acceptString = NULL;
   bool retVal = false;
 
@@ -333,6 +747,21 @@ checkWsHandshakeReply(struct websocket_connection_desc *wsConnectionDesc, char *
 
   *len = (uintptr_t) cpnt - (uintptr_t) header;
 
+  if (wsDesc->channels && hasWsProtocol(header, *len, WS_CHANNEL_PROTOCOL)) {
+    wsConnectionDesc->channels = calloc(WS_CHANNEL_MAX + 1, sizeof(struct websocket_channel *));
+    wsConnectionDesc->multiplexed = (wsConnectionDesc->channels != NULL);
+  }
+
+  // a different token means that the server started a new session
+  if (wsDesc->resumable && !wsConnectionDesc->multiplexed &&
+      hasWsProtocol(header, *len, WS_RESUME_PROTOCOL) &&
+      (parseSessionHeader(header, *len, token, &seq) == 0)) {
+    wsConnectionDesc->resumable = true;
+    wsConnectionDesc->resumed = (strcmp(token, wsDesc->resumeToken) == 0);
+    wsConnectionDesc->sessionSeq = wsConnectionDesc->resumed ? wsDesc->resumeSeq : 0;
+    strcpy(wsConnectionDesc->sessionToken, token);
+  }
+
   acceptString = calculateSecWebSocketAccept(wsDesc->wsKey);
   if (acceptString == NULL) {
     ezwebsocket_log(EZLOG_ERROR, "calculateSecWebSocketAccept failed\n");
@@ -356,24 +785,38 @@ static bool
 sendWsHandshakeRequest(struct websocket_connection_desc *wsConnectionDesc)
 {
   unsigned char wsKeyBytes[16];
-  unsigned long i;
   char *requestHeader = NULL;
+  char protocolHeader[sizeof(WS_RESUME_PROTOCOL_HEADER WS_HS_SESSION_ID) + WS_SESSION_TOKEN_LEN +
+                      24];
   bool success = false;
   struct websocket_client_desc *wsDesc = wsConnectionDesc->wsDesc.wsClientDesc;
+  // a unix socket has no host name so localhost is used
+  const char *host = unixSocket_isAddress(wsDesc->address) ? "localhost" : wsDesc->address;
+
+  if (wsDesc->channels)
+    snprintf(protocolHeader, sizeof(protocolHeader), WS_CHANNEL_PROTOCOL_HEADER);
+  else if (wsDesc->resumable && wsDesc->resumeToken[0])
+    snprintf(protocolHeader, sizeof(protocolHeader),
+             WS_RESUME_PROTOCOL_HEADER WS_HS_SESSION_ID " %s %llu\r\n", wsDesc->resumeToken,
+             wsDesc->resumeSeq);
+  else if (wsDesc->resumable)
+    snprintf(protocolHeader, sizeof(protocolHeader), WS_RESUME_PROTOCOL_HEADER);
+  else
+    protocolHeader[0] = '\0';
 
-  for (i = 0; i < sizeof(wsKeyBytes); i++) {
-    wsKeyBytes[i] = rand();
-  }
-
+  random_fill(wsKeyBytes, sizeof(wsKeyBytes));
   wsDesc->wsKey = base64_encode(wsKeyBytes, sizeof(wsKeyBytes));
   if (asprintf(&requestHeader,
                "GET %s HTTP/1.1\r\n"
-               "Host: %s:%s\r\n"
+               "Host: %s%s%s\r\n"
                "Upgrade: websocket\r\n"
                "Connection: Upgrade\r\n"
                "Sec-WebSocket-Key: %s\r\n"
-               "Sec-WebSocket-Version: 13\r\n\r\n",
-               wsDesc->endpoint, wsDesc->address, wsDesc->port, wsDesc->wsKey) < 0) {
+               "Sec-WebSocket-Version: 13\r\n"
+               "%s\r\n",
+               wsDesc->endpoint, host, unixSocket_isAddress(wsDesc->address) ? "" : ":",
+               unixSocket_isAddress(wsDesc->address) ? "" : wsDesc->port, wsDesc->wsKey,
+               protocolHeader) < 0) {
     ezwebsocket_log(EZLOG_ERROR, "asprintf failed\n");
     goto EXIT;
   }
@@ -599,39 +1042,202 @@ createWebsocketHeader(unsigned char *buffer, enum ws_opcode opcode, bool fin, bo
 static void
 copyMasked(unsigned char *to, const unsigned char *from, unsigned long mask, size_t len)
 {
-  unsigned char byteMask[4];
+  unsigned char byteMask[8];
+  uint64_t wideMask;
+  uint64_t word;
   size_t i;
-  unsigned char maskIdx = 0;
 
   // big endian
   byteMask[0] = mask >> 24 & 0xFF;
   byteMask[1] = mask >> 16 & 0xFF;
   byteMask[2] = mask >> 8 & 0xFF;
   byteMask[3] = mask >> 0 & 0xFF;
+  memcpy(&byteMask[4], byteMask, 4);
+  memcpy(&wideMask, byteMask, sizeof(wideMask));
+
+  // 8 bytes at once (the compiler vectorizes this loop), to and from may be the same buffer
+  for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, &from[i], sizeof(word));
+    word ^= wideMask;
+    memcpy(&to[i], &word, sizeof(word));
+  }
+  for (; i < len; i++)
+    to[i] = from[i] ^ byteMask[i % 4];
+}
+
+/**
+ * \brief Rotates a mask so that it continues the masking after the given number of bytes
+ *
+ * \param mask The mask (32-bit)
+ * \param offset The number of bytes that were masked before
+ *
+ * \return The rotated mask
+ */
+static unsigned long
+rotateMask(unsigned long mask, size_t offset)
+{
+  unsigned int shift = (offset % 4) * 8;
+
+  if (!shift)
+    return mask;
+
+  return ((mask << shift) | (mask >> (32 - shift))) & 0xFFFFFFFF;
+}
+
+//! the size of the chunks that are validated right after they were copied (while they are
+//! still in the cache), it's a multiple of 4 so that every chunk starts with the same mask
+#define PAYLOAD_CHUNK_SIZE 4096
+
+/**
+ * \brief Copies the payload of a received frame, unmasks it and validates text in the same pass
+ *
+ * \param *to Pointer to where the payload should be copied
+ * \param *data Pointer to the received frame
+ * \param *header Pointer to the parsed websocket header structure
+ * \param *utf8Handle Pointer to the UTF-8 state of the message or NULL for binary data
+ *
+ * \return UTF8_STATE_OK, UTF8_STATE_FAIL or UTF8_STATE_BUSY if the text ends within a character
+ */
+static enum utf8_state
+copyPayload(char *to, const unsigned char *data, const struct ws_header *header,
+            unsigned long *utf8Handle)
+{
+  const unsigned char *from = &data[header->payloadStartOffset];
+  enum utf8_state state;
+  unsigned long mask = 0;
+  size_t offset, len;
+
+  if (header->masked)
+    mask = ((unsigned long) header->mask[0] << 24) | (header->mask[1] << 16) |
+           (header->mask[2] << 8) | header->mask[3];
+
+  if (!utf8Handle) {
+    if (header->masked)
+      copyMasked((unsigned char *) to, from, mask, header->payloadLength);
+    else
+      memcpy(to, from, header->payloadLength);
+    return UTF8_STATE_OK;
+  }
 
-  for (i = 0; i < len; i++) {
-    *to = *from ^ byteMask[maskIdx];
-    maskIdx = (maskIdx + 1) % 4;
-    to++;
-    from++;
+  state = *utf8Handle ? UTF8_STATE_BUSY : UTF8_STATE_OK;
+  for (offset = 0; offset < header->payloadLength; offset += len) {
+    len = header->payloadLength - offset;
+    if (len > PAYLOAD_CHUNK_SIZE)
+      len = PAYLOAD_CHUNK_SIZE;
+    copyMasked((unsigned char *) &to[offset], &from[offset], mask, len);
+    state = utf8_validate(&to[offset], len, utf8Handle);
+    if (state == UTF8_STATE_FAIL)
+      break;
   }
+  return state;
 }
 
 /**
- * \brief Sends data through websockets with custom opcodes
+ * \brief Sends raw data over the transport of the given connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *data Pointer to the data
+ * \param len The length of the data
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendRaw(struct websocket_connection_desc *wsConnectionDesc, void *data, size_t len)
+{
+  if (wsConnectionDesc->h2Stream)
+    return http2_send(wsConnectionDesc->h2Stream, data, len);
+
+  switch (wsConnectionDesc->wsType) {
+  case WS_TYPE_SERVER:
+    return socketServer_send(wsConnectionDesc->socketClientDesc, data, len);
+
+  case WS_TYPE_CLIENT:
+    return socketClient_send(wsConnectionDesc->socketClientDesc, data, len);
+  }
+
+  return -1;
+}
+
+/**
+ * \brief Sends a raw control frame over the transport of the given connection, it doesn't use
+ *        up the pacing tokens of a server connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *data Pointer to the frame
+ * \param len The length of the frame
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendRawControl(struct websocket_connection_desc *wsConnectionDesc, void *data, size_t len)
+{
+  if (!wsConnectionDesc->h2Stream && (wsConnectionDesc->wsType == WS_TYPE_SERVER))
+    return socketServer_sendControl(wsConnectionDesc->socketClientDesc, data, len);
+
+  return sendRaw(wsConnectionDesc, data, len);
+}
+
+/**
+ * \brief Sends raw data from multiple buffers over the transport of the given server connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *iov Pointer to the buffers
+ * \param iovcnt The number of buffers
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendRawv(struct websocket_connection_desc *wsConnectionDesc, const struct iovec *iov,
+         size_t iovcnt)
+{
+  if (wsConnectionDesc->h2Stream)
+    return http2_sendv(wsConnectionDesc->h2Stream, iov, iovcnt);
+
+  return socketServer_sendv(wsConnectionDesc->socketClientDesc, iov, iovcnt);
+}
+
+/**
+ * \brief Closes the transport of the given connection (the socket or the http/2 stream)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+closeTransport(struct websocket_connection_desc *wsConnectionDesc)
+{
+  if (wsConnectionDesc->h2Stream) {
+    http2_closeStream(wsConnectionDesc->h2Stream);
+    return;
+  }
+
+  switch (wsConnectionDesc->wsType) {
+  case WS_TYPE_SERVER:
+    socketServer_closeConnection(wsConnectionDesc->socketClientDesc);
+    break;
+
+  case WS_TYPE_CLIENT:
+    socketClient_closeConnection(wsConnectionDesc->socketClientDesc);
+    break;
+  }
+}
+
+/**
+ * \brief Sends data with a prefix (e.g. the channel id) through websockets with custom opcodes
  *
  * \param *wsConnectionDesc Pointer to the websocket connection descriptor
  * \param opcode The opcode to use
  * \param fin True if this is the last frame of a sequence else false
  * \param masked True => send masked (client to server) else false (server to client)
+ * \param *prefix The data that is put in front of the payload (NULL if not used)
+ * \param prefixLen The length of the prefix (0 - 3)
  * \param *msg The payload data
  * \param len The payload length
  *
  * \return 0 if successful else -1
  */
 static int
-sendDataLowLevel(struct websocket_connection_desc *wsConnectionDesc, enum ws_opcode opcode,
-                 bool fin, bool masked, const void *msg, size_t len)
+sendDataLowLevelPrefixed(struct websocket_connection_desc *wsConnectionDesc,
+                         enum ws_opcode opcode, bool fin, bool masked, const void *prefix,
+                         size_t prefixLen, const void *msg, size_t len)
 {
   unsigned char header[14]; // the maximum size of a websocket header is 14
   int headerLength;
@@ -643,31 +1249,34 @@ sendDataLowLevel(struct websocket_connection_desc *wsConnectionDesc, enum ws_opc
     return -1;
 
   if (masked) {
-    mask = (rand() << 16) | (rand() & 0x0000FFFF);
+    mask = random_u32();
   }
 
-  headerLength = createWebsocketHeader(header, opcode, fin, masked, mask, len);
+  headerLength = createWebsocketHeader(header, opcode, fin, masked, mask, prefixLen + len);
 
-  sendBuffer = malloc(headerLength + len);
+  sendBuffer = malloc(headerLength + prefixLen + len);
   if (!sendBuffer)
     return -1;
   memcpy(sendBuffer, header, headerLength);
+  if (prefixLen) {
+    if (masked)
+      copyMasked(&sendBuffer[headerLength], prefix, mask, prefixLen);
+    else
+      memcpy(&sendBuffer[headerLength], prefix, prefixLen);
+  }
   if (len) {
     if (masked) {
-      copyMasked(&sendBuffer[headerLength], msg, mask, len);
+      // the mask continues after the prefix
+      copyMasked(&sendBuffer[headerLength + prefixLen], msg, rotateMask(mask, prefixLen), len);
     } else
-      memcpy(&sendBuffer[headerLength], msg, len);
+      memcpy(&sendBuffer[headerLength + prefixLen], msg, len);
   }
+  len += prefixLen;
 
-  switch (wsConnectionDesc->wsType) {
-  case WS_TYPE_SERVER:
-    rc = socketServer_send(wsConnectionDesc->socketClientDesc, sendBuffer, len + headerLength);
-    break;
-
-  case WS_TYPE_CLIENT:
-    rc = socketClient_send(wsConnectionDesc->socketClientDesc, sendBuffer, len + headerLength);
-    break;
-  }
+  if (opcode >= WS_OPCODE_DISCONNECT)
+    rc = sendRawControl(wsConnectionDesc, sendBuffer, len + headerLength);
+  else
+    rc = sendRaw(wsConnectionDesc, sendBuffer, len + headerLength);
   free(sendBuffer);
 
   ezwebsocket_log(EZLOG_DEBUG, "%s retv:%d\n", __func__, rc);
@@ -676,73 +1285,580 @@ sendDataLowLevel(struct websocket_connection_desc *wsConnectionDesc, enum ws_opc
 }
 
 /**
- * \brief Checks if the given close code is valid
+ * \brief Sends data through websockets with custom opcodes
  *
- * \param code The code that should be checked
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param opcode The opcode to use
+ * \param fin True if this is the last frame of a sequence else false
+ * \param masked True => send masked (client to server) else false (server to client)
+ * \param *msg The payload data
+ * \param len The payload length
  *
- * \return True if code is valid else false
+ * \return 0 if successful else -1
  */
-static bool
-checkCloseCode(enum ws_close_code code)
+static int
+sendDataLowLevel(struct websocket_connection_desc *wsConnectionDesc, enum ws_opcode opcode,
+                 bool fin, bool masked, const void *msg, size_t len)
 {
-  if (code < 1000)
-    return false;
-
-  if (code > 4999)
-    return false;
+  return sendDataLowLevelPrefixed(wsConnectionDesc, opcode, fin, masked, NULL, 0, msg, len);
+}
 
-  if ((code >= 1012) & (code <= 1014))
-    return false;
+/**
+ * \brief Encodes an unmasked frame that can be sent to several server connections
+ *
+ * \param opcode The opcode to use
+ * \param *prefix The data that is put in front of the payload (NULL if not used)
+ * \param prefixLen The length of the prefix
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return The frame (release it with refcnt_unref) or NULL in case of error
+ */
+static struct websocket_frame *
+allocFrame(enum ws_opcode opcode, const void *prefix, size_t prefixLen, const void *msg, size_t len)
+{
+  unsigned char header[14]; // the maximum size of a websocket header is 14
+  struct websocket_frame *frame;
+  int headerLength;
 
-  if ((code >= 1016) && (code < 3000))
-    return false;
+  headerLength = createWebsocketHeader(header, opcode, true, false, 0, prefixLen + len);
+  frame = refcnt_allocate(sizeof(struct websocket_frame) + headerLength + prefixLen + len, NULL);
+  if (!frame)
+    return NULL;
 
-  switch (code) {
-  case WS_CLOSE_CODE_RESERVED_0:
-  case WS_CLOSE_CODE_RESERVED_1:
-  case WS_CLOSE_CODE_RESERVED_2:
-  case WS_CLOSE_CODE_RESERVED_3:
-    return false;
+  frame->len = headerLength + prefixLen + len;
+  memcpy(frame->data, header, headerLength);
+  if (prefixLen)
+    memcpy(&frame->data[headerLength], prefix, prefixLen);
+  if (len)
+    memcpy(&frame->data[headerLength + prefixLen], msg, len);
 
-  default:
-    return true;
-  }
+  return frame;
 }
 
-//! the states of a websocket message
-enum ws_msg_state {
-  WS_MSG_STATE_ERROR,
-  WS_MSG_STATE_INCOMPLETE,
-  WS_MSG_STATE_NO_USER_DATA,
-  WS_MSG_STATE_USER_DATA,
-};
-
 /**
- * \brief Handles the first message (which is sometimes followed by a cont message)
+ * \brief Appends a frame to the outbox of the given server connection, it's sent by the next
+ *        call of flushOutbox
+ *
+ * The frames are sent in the order in which they were queued, so the caller holds the lock that
+ * defines the order (e.g. the lock of the replay ring) while queueing.
  *
  * \param *wsConnectionDesc Pointer to the websocket connection descriptor
- * \param *data Pointer to the payload data
- * \param *header Pointer to the parsed websocket header structure
+ * \param *frame Pointer to the frame (the outbox takes its own reference)
+ * \param limited true if the connection is closed instead of exceeding WS_OUTBOX_MAX bytes
  *
- * \return The message state
+ * \return 0 if successful else -1
  */
-static enum ws_msg_state
-handleFirstMessage(struct websocket_connection_desc *wsConnectionDesc, const unsigned char *data,
-                   struct ws_header *header)
+static int
+queueFrame(struct websocket_connection_desc *wsConnectionDesc, struct websocket_frame *frame,
+           bool limited)
 {
-  size_t i;
+  struct outbox_entry *entry = NULL;
+  int rc = -1;
 
-  if (!header->masked && (wsConnectionDesc->wsType == WS_TYPE_SERVER)) {
-    websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_PROTOCOL_ERROR);
-    return WS_MSG_STATE_ERROR;
+  pthread_mutex_lock(&wsConnectionDesc->outboxMutex);
+  if (wsConnectionDesc->outboxFailed)
+    goto EXIT;
+
+  if (limited && (wsConnectionDesc->outboxBytes + frame->len > WS_OUTBOX_MAX))
+    ezwebsocket_log(EZLOG_ERROR, "outbox full, closing connection\n");
+  else if (!(entry = malloc(sizeof(struct outbox_entry))))
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+
+  // the connection is closed rather than leaving a gap in the frames
+  if (!entry) {
+    wsConnectionDesc->outboxFailed = true;
+    wsConnectionDesc->outboxClose = true;
+    goto EXIT;
   }
 
-  if (wsConnectionDesc->lastMessage.data != NULL) {
-    ezwebsocket_log(EZLOG_ERROR, "last message not finished\n");
+  refcnt_ref(frame);
+  entry->frame = frame;
+  entry->next = NULL;
+  if (wsConnectionDesc->outbox)
+    wsConnectionDesc->outboxLast->next = entry;
+  else
+    wsConnectionDesc->outbox = entry;
+  wsConnectionDesc->outboxLast = entry;
+  wsConnectionDesc->outboxBytes += frame->len;
+  rc = 0;
+
+EXIT:
+  pthread_mutex_unlock(&wsConnectionDesc->outboxMutex);
+  return rc;
+}
+
+/**
+ * \brief Sends the outbox of the given server connection unless another thread is sending it
+ *        already, that thread sends the frames that were queued in the meantime as well
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return 0 if successful else -1 (frames were lost, the connection is closed)
+ */
+static int
+flushOutbox(struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct outbox_entry *batch[WS_OUTBOX_BATCH];
+  struct iovec iov[WS_OUTBOX_BATCH];
+  bool failed;
+  bool lost;
+  size_t cnt;
+  size_t i;
+  int rc;
+
+  pthread_mutex_lock(&wsConnectionDesc->outboxMutex);
+  while (!wsConnectionDesc->outboxBusy && wsConnectionDesc->outbox) {
+    wsConnectionDesc->outboxBusy = true;
+    for (cnt = 0; (cnt < WS_OUTBOX_BATCH) && wsConnectionDesc->outbox; cnt++) {
+      batch[cnt] = wsConnectionDesc->outbox;
+      wsConnectionDesc->outbox = batch[cnt]->next;
+      iov[cnt].iov_base = batch[cnt]->frame->data;
+      iov[cnt].iov_len = batch[cnt]->frame->len;
+      wsConnectionDesc->outboxBytes -= iov[cnt].iov_len;
+    }
+    failed = wsConnectionDesc->outboxFailed;
+    pthread_mutex_unlock(&wsConnectionDesc->outboxMutex);
+
+    // the frames are dropped once a send failed
+    if (!failed && (sendRawv(wsConnectionDesc, iov, cnt) < 0))
+      failed = true;
+    for (i = 0; i < cnt; i++) {
+      refcnt_unref(batch[i]->frame);
+      free(batch[i]);
+    }
+
+    pthread_mutex_lock(&wsConnectionDesc->outboxMutex);
+    if (failed && !wsConnectionDesc->outboxFailed) {
+      wsConnectionDesc->outboxFailed = true;
+      wsConnectionDesc->outboxClose = true;
+    }
+    wsConnectionDesc->outboxBusy = false;
+  }
+  rc = wsConnectionDesc->outboxFailed ? -1 : 0;
+  lost = wsConnectionDesc->outboxClose;
+  wsConnectionDesc->outboxClose = false;
+  pthread_mutex_unlock(&wsConnectionDesc->outboxMutex);
+
+  // this also wakes up a thread that is stuck sending to the connection
+  if (lost)
+    closeTransport(wsConnectionDesc);
+
+  return rc;
+}
+
+/**
+ * \brief frees the frames of the given session when the last reference is gone
+ *
+ * \param *ptr Pointer to the session
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+destroySession(void *ptr)
+{
+  struct ws_session *session = ptr;
+  unsigned long i;
+
+  for (i = 0; i < session->count; i++)
+    refcnt_unref(session->frames[(session->head + i) % session->maxFrames]);
+  free(session->frames);
+  pthread_mutex_destroy(&session->lock);
+}
+
+/**
+ * \brief Queues a message with the next sequence number of the session and keeps the frame
+ *        for the replay
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor (resumable server
+ *                          connection)
+ * \param opcode The opcode to use (WS_OPCODE_TEXT or WS_OPCODE_BINARY)
+ * \param *msg The payload data
+ * \param len The payload length
+ * \param limited true if the connection is closed instead of exceeding WS_OUTBOX_MAX bytes
+ *
+ * \return 0 if successful else -1
+ */
+static int
+queueSessionMessage(struct websocket_connection_desc *wsConnectionDesc, enum ws_opcode opcode,
+                    const void *msg, size_t len, bool limited)
+{
+  struct ws_session *session = wsConnectionDesc->session;
+  unsigned char seq[WS_SESSION_SEQ_LEN];
+  unsigned long long value;
+  struct websocket_frame *frame;
+  int rc;
+  int i;
+
+  pthread_mutex_lock(&session->lock);
+  // the session was taken over by a resumed connection
+  if (session->connection != wsConnectionDesc) {
+    pthread_mutex_unlock(&session->lock);
+    return -1;
+  }
+
+  // 7 bits per byte so that the messages stay valid UTF-8
+  value = session->seq + 1;
+  for (i = WS_SESSION_SEQ_LEN - 1; i >= 0; i--) {
+    seq[i] = value & 0x7F;
+    value >>= 7;
+  }
+
+  frame = allocFrame(opcode, seq, sizeof(seq), msg, len);
+  if (!frame) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    pthread_mutex_unlock(&session->lock);
+    return -1;
+  }
+
+  session->seq++;
+  if (session->count == session->maxFrames) {
+    refcnt_unref(session->frames[session->head]);
+    session->head = (session->head + 1) % session->maxFrames;
+    session->count--;
+  }
+  session->frames[(session->head + session->count) % session->maxFrames] = frame;
+  session->count++;
+  // the frame stays in the ring even if it's lost so it's replayed on resumption
+  rc = queueFrame(wsConnectionDesc, frame, limited);
+  pthread_mutex_unlock(&session->lock);
+
+  return rc;
+}
+
+/**
+ * \brief Sends a message with the next sequence number of the session and keeps the frame
+ *        for the replay
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor (resumable server
+ *                          connection)
+ * \param opcode The opcode to use (WS_OPCODE_TEXT or WS_OPCODE_BINARY)
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendSessionMessage(struct websocket_connection_desc *wsConnectionDesc, enum ws_opcode opcode,
+                   const void *msg, size_t len)
+{
+  int rc;
+
+  rc = queueSessionMessage(wsConnectionDesc, opcode, msg, len, true);
+  // the outbox is flushed anyway so that a connection that lost frames is closed
+  if (flushOutbox(wsConnectionDesc) < 0)
+    rc = -1;
+
+  return rc;
+}
+
+/**
+ * \brief Removes the sequence number from the received message of a resumable client
+ *        connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return True if the message should be passed on else false (duplicate or malformed)
+ */
+static bool
+takeSessionSeq(struct websocket_connection_desc *wsConnectionDesc)
+{
+  unsigned char *data = (unsigned char *) wsConnectionDesc->lastMessage.data;
+  unsigned long long seq = 0;
+  size_t i;
+
+  if (wsConnectionDesc->lastMessage.len < WS_SESSION_SEQ_LEN) {
+    ezwebsocket_log(EZLOG_ERROR, "message without sequence number dropped\n");
+    return false;
+  }
+
+  for (i = 0; i < WS_SESSION_SEQ_LEN; i++)
+    seq = (seq << 7) | (data[i] & 0x7F);
+
+  // messages that already arrived before the connection was resumed are replayed again
+  if (seq <= wsConnectionDesc->sessionSeq)
+    return false;
+
+  wsConnectionDesc->sessionSeq = seq;
+  wsConnectionDesc->lastMessage.len -= WS_SESSION_SEQ_LEN;
+  // the payload is moved so that the buffer can still be referenced by the application
+  memmove(data, &data[WS_SESSION_SEQ_LEN], wsConnectionDesc->lastMessage.len);
+  return true;
+}
+
+/**
+ * \brief Releases the sessions of the server that were detached longer than the timeout
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor (sessionMutex must be locked)
+ * \param *now The current time
+ */
+static void
+expireSessions(struct websocket_server_desc *wsDesc, const struct timespec *now)
+{
+  struct ws_session **pnt = &wsDesc->sessions;
+  struct ws_session *session;
+  unsigned long long age;
+  bool expired;
+
+  while (*pnt) {
+    session = *pnt;
+    pthread_mutex_lock(&session->lock);
+    age = (now->tv_sec - session->detached.tv_sec) * 1000ULL +
+          (now->tv_nsec - session->detached.tv_nsec) / 1000000;
+    expired = !session->connection && (age >= wsDesc->sessionTimeoutMs);
+    pthread_mutex_unlock(&session->lock);
+
+    if (expired) {
+      *pnt = session->next;
+      refcnt_unref(session);
+    } else {
+      pnt = &session->next;
+    }
+  }
+}
+
+/**
+ * \brief Creates a new session with a random token and adds it to the server
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor (sessionMutex must be locked)
+ *
+ * \return The session or NULL in case of error
+ */
+static struct ws_session *
+createSession(struct websocket_server_desc *wsDesc)
+{
+  unsigned char tokenBytes[WS_SESSION_TOKEN_LEN / 2];
+  struct ws_session *session;
+  size_t i;
+
+  session = refcnt_allocate(sizeof(struct ws_session), destroySession);
+  if (!session) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return NULL;
+  }
+  memset(session, 0, sizeof(struct ws_session));
+  pthread_mutex_init(&session->lock, NULL);
+
+  session->maxFrames = wsDesc->sessionFrames;
+  session->frames = calloc(session->maxFrames, sizeof(struct websocket_frame *));
+  if (!session->frames) {
+    ezwebsocket_log(EZLOG_ERROR, "calloc failed\n");
+    refcnt_unref(session);
+    return NULL;
+  }
+
+  random_fill(tokenBytes, sizeof(tokenBytes));
+  for (i = 0; i < sizeof(tokenBytes); i++)
+    snprintf(&session->token[i * 2], 3, "%02x", tokenBytes[i]);
+
+  session->next = wsDesc->sessions;
+  wsDesc->sessions = session;
+  return session;
+}
+
+/**
+ * \brief Detaches the session from the given server connection so that it can be resumed
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+detachSession(struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct websocket_server_desc *wsDesc = wsConnectionDesc->wsDesc.wsServerDesc;
+  struct ws_session *session = wsConnectionDesc->session;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&session->lock);
+  if (session->connection == wsConnectionDesc) {
+    session->connection = NULL;
+    session->detached = now;
+  }
+  pthread_mutex_unlock(&session->lock);
+
+  pthread_mutex_lock(&wsDesc->sessionMutex);
+  expireSessions(wsDesc, &now);
+  pthread_mutex_unlock(&wsDesc->sessionMutex);
+}
+
+/**
+ * \brief Resumes the session the client asks for or starts a new one, sends the handshake reply
+ *        and replays the messages the client missed
+ *
+ * The session is attached under its lock, the replies are sent after the locks were released.
+ * If the handshake reply can't be sent the session stays attached until the connection closes.
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *socketConnectionDesc The connection descriptor of the socket
+ * \param *replyKey The calculated Sec-WebSocket-Accept key
+ * \param *header Pointer to the http header of the request
+ * \param len The length of the header
+ *
+ * \return 0 if successful else -1
+ */
+static int
+openSession(struct websocket_connection_desc *wsConnectionDesc,
+            struct socket_connection_desc *socketConnectionDesc, const char *replyKey,
+            const char *header, size_t len)
+{
+  struct websocket_server_desc *wsDesc = wsConnectionDesc->wsDesc.wsServerDesc;
+  char token[WS_SESSION_TOKEN_LEN + 1];
+  char sessionHeader[sizeof(WS_RESUME_PROTOCOL_HEADER WS_HS_SESSION_ID) + WS_SESSION_TOKEN_LEN + 3];
+  const unsigned char goingAway[2] = { WS_CLOSE_CODE_GOING_AWAY >> 8,
+                                       WS_CLOSE_CODE_GOING_AWAY & 0xFF };
+  struct socket_connection_desc *previous = NULL;
+  struct ws_session *session = NULL;
+  struct websocket_frame *closeFrame;
+  unsigned long long lastSeq = 0;
+  unsigned long missed;
+  unsigned long i;
+  struct timespec now;
+  int rc = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&wsDesc->sessionMutex);
+  expireSessions(wsDesc, &now);
+
+  if (parseSessionHeader(header, len, token, &lastSeq) == 0) {
+    for (session = wsDesc->sessions; session; session = session->next) {
+      if (strcmp(session->token, token) == 0)
+        break;
+    }
+  }
+
+  if (session) {
+    pthread_mutex_lock(&session->lock);
+    // a new session is started if the ring doesn't reach back to the last received message
+    if ((lastSeq > session->seq) || (session->seq - lastSeq > session->count)) {
+      pthread_mutex_unlock(&session->lock);
+      session = NULL;
+    }
+  }
+
+  if (session) {
+    wsConnectionDesc->resumed = true;
+  } else {
+    session = createSession(wsDesc);
+    if (!session) {
+      pthread_mutex_unlock(&wsDesc->sessionMutex);
+      return -1;
+    }
+    pthread_mutex_lock(&session->lock);
+    lastSeq = 0;
+  }
+  pthread_mutex_unlock(&wsDesc->sessionMutex);
+
+  // the previous connection may not have noticed yet that the client is gone, its socket is
+  // valid until it has detached the session, so it's referenced before the session is replaced
+  if (session->connection) {
+    previous = session->connection->socketClientDesc;
+    refcnt_ref(previous);
+  }
+  session->connection = wsConnectionDesc;
+  refcnt_ref(session);
+  wsConnectionDesc->session = session;
+
+  // the replay is queued before the session can send anything else to the connection, it's
+  // sent after the handshake reply (the connection isn't open for the application yet)
+  missed = session->seq - lastSeq;
+  for (i = 0; i < missed; i++) {
+    queueFrame(wsConnectionDesc,
+               session->frames[(session->head + session->count - missed + i) % session->maxFrames],
+               false);
+  }
+  snprintf(sessionHeader, sizeof(sessionHeader),
+           WS_RESUME_PROTOCOL_HEADER WS_HS_SESSION_ID " %s\r\n", session->token);
+  pthread_mutex_unlock(&session->lock);
+
+  if (previous) {
+    closeFrame = allocFrame(WS_OPCODE_DISCONNECT, NULL, 0, goingAway, sizeof(goingAway));
+    if (closeFrame) {
+      socketServer_send(previous, closeFrame->data, closeFrame->len);
+      refcnt_unref(closeFrame);
+    }
+    socketServer_closeConnection(previous);
+    refcnt_unref(previous);
+  }
+
+  if (sendWsHandshakeReply(socketConnectionDesc, replyKey, sessionHeader) >= 0)
+    rc = flushOutbox(wsConnectionDesc);
+
+  return rc;
+}
+
+/**
+ * \brief Checks if the given close code is valid
+ *
+ * \param code The code that should be checked
+ *
+ * \return True if code is valid else false
+ */
+static bool
+checkCloseCode(enum ws_close_code code)
+{
+  if (code < 1000)
+    return false;
+
+  if (code > 4999)
+    return false;
+
+  if ((code >= 1012) & (code <= 1014))
+    return false;
+
+  if ((code >= 1016) && (code < 3000))
+    return false;
+
+  switch (code) {
+  case WS_CLOSE_CODE_RESERVED_0:
+  case WS_CLOSE_CODE_RESERVED_1:
+  case WS_CLOSE_CODE_RESERVED_2:
+  case WS_CLOSE_CODE_RESERVED_3:
+    return false;
+
+  default:
+    return true;
+  }
+}
+
+//! the states of a websocket message
+enum ws_msg_state {
+  WS_MSG_STATE_ERROR,
+  WS_MSG_STATE_INCOMPLETE,
+  WS_MSG_STATE_NO_USER_DATA,
+  WS_MSG_STATE_USER_DATA,
+};
+
+/**
+ * \brief Handles the first message (which is sometimes followed by a cont message)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *data Pointer to the payload data
+ * \param *header Pointer to the parsed websocket header structure
+ *
+ * \return The message state
+ */
+static enum ws_msg_state
+handleFirstMessage(struct websocket_connection_desc *wsConnectionDesc, const unsigned char *data,
+                   struct ws_header *header)
+{
+  enum utf8_state state;
+
+  if (!header->masked && (wsConnectionDesc->wsType == WS_TYPE_SERVER)) {
+    websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_PROTOCOL_ERROR);
+    return WS_MSG_STATE_ERROR;
+  }
+
+  if (wsConnectionDesc->lastMessage.data != NULL) {
+    ezwebsocket_log(EZLOG_ERROR, "last message not finished\n");
     websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_PROTOCOL_ERROR);
     return WS_MSG_STATE_ERROR;
   }
 
+  wsConnectionDesc->lastMessage.dataType = header->opcode == WS_OPCODE_TEXT ? WS_DATA_TYPE_TEXT
+                                                                            : WS_DATA_TYPE_BINARY;
+  wsConnectionDesc->lastMessage.utf8Handle = 0;
+  state = UTF8_STATE_OK;
+
   if (header->payloadLength) // it's allowed to send frames with payload length = 0
   {
     if (header->fin)
@@ -754,34 +1870,20 @@ handleFirstMessage(struct websocket_connection_desc *wsConnectionDesc, const uns
       return WS_MSG_STATE_ERROR;
     }
 
-    if (header->masked) {
-      for (i = 0; i < header->payloadLength; i++) {
-        wsConnectionDesc->lastMessage.data[i] = data[header->payloadStartOffset + i] ^
-                                                header->mask[i % 4];
-      }
-    } else {
-      memcpy(wsConnectionDesc->lastMessage.data, &data[header->payloadStartOffset],
-             header->payloadLength);
-    }
+    state = copyPayload(wsConnectionDesc->lastMessage.data, data, header,
+                        wsConnectionDesc->lastMessage.dataType == WS_DATA_TYPE_TEXT
+                          ? &wsConnectionDesc->lastMessage.utf8Handle
+                          : NULL);
   }
 
   wsConnectionDesc->lastMessage.firstReceived = true;
   wsConnectionDesc->lastMessage.complete = header->fin;
-  wsConnectionDesc->lastMessage.dataType = header->opcode == WS_OPCODE_TEXT ? WS_DATA_TYPE_TEXT
-                                                                            : WS_DATA_TYPE_BINARY;
-
   wsConnectionDesc->lastMessage.len = header->payloadLength;
-  if (wsConnectionDesc->lastMessage.dataType == WS_DATA_TYPE_TEXT) {
-    enum utf8_state state;
-
-    wsConnectionDesc->lastMessage.utf8Handle = 0;
-    state = utf8_validate(wsConnectionDesc->lastMessage.data, wsConnectionDesc->lastMessage.len,
-                          &wsConnectionDesc->lastMessage.utf8Handle);
-    if ((header->fin && (state != UTF8_STATE_OK)) || (!header->fin && (state == UTF8_STATE_FAIL))) {
-      ezwebsocket_log(EZLOG_ERROR, "no valid utf8 string closing connection\n");
-      websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_INVALID_DATA);
-      return WS_MSG_STATE_ERROR;
-    }
+
+  if ((header->fin && (state != UTF8_STATE_OK)) || (!header->fin && (state == UTF8_STATE_FAIL))) {
+    ezwebsocket_log(EZLOG_ERROR, "no valid utf8 string closing connection\n");
+    websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_INVALID_DATA);
+    return WS_MSG_STATE_ERROR;
   }
   if (header->fin)
     return WS_MSG_STATE_USER_DATA;
@@ -802,7 +1904,7 @@ static enum ws_msg_state
 handleContMessage(struct websocket_connection_desc *wsConnectionDesc, const unsigned char *data,
                   struct ws_header *header)
 {
-  size_t i;
+  enum utf8_state state;
   char *temp;
 
   if (!wsConnectionDesc->lastMessage.firstReceived) {
@@ -817,6 +1919,8 @@ handleContMessage(struct websocket_connection_desc *wsConnectionDesc, const unsi
     return WS_MSG_STATE_ERROR;
   }
 
+  // an empty final frame must not end the text within a character
+  state = wsConnectionDesc->lastMessage.utf8Handle ? UTF8_STATE_BUSY : UTF8_STATE_OK;
   if (wsConnectionDesc->lastMessage.len +
       header->payloadLength) // it's allowed to send frames with payload length = 0
   {
@@ -843,28 +1947,18 @@ handleContMessage(struct websocket_connection_desc *wsConnectionDesc, const unsi
       wsConnectionDesc->lastMessage.data = temp;
     }
 
-    if (header->masked) {
-      for (i = 0; i < header->payloadLength; i++) {
-        wsConnectionDesc->lastMessage
-          .data[wsConnectionDesc->lastMessage.len + i] = data[header->payloadStartOffset + i] ^
-                                                         header->mask[i % 4];
-      }
-    } else {
-      memcpy(&wsConnectionDesc->lastMessage.data[wsConnectionDesc->lastMessage.len],
-             &data[header->payloadStartOffset], header->payloadLength);
-    }
+    state = copyPayload(&wsConnectionDesc->lastMessage.data[wsConnectionDesc->lastMessage.len],
+                        data, header,
+                        wsConnectionDesc->lastMessage.dataType == WS_DATA_TYPE_TEXT
+                          ? &wsConnectionDesc->lastMessage.utf8Handle
+                          : NULL);
   }
   wsConnectionDesc->lastMessage.complete = header->fin;
 
-  if (wsConnectionDesc->lastMessage.dataType == WS_DATA_TYPE_TEXT) {
-    enum utf8_state state;
-    state = utf8_validate(&wsConnectionDesc->lastMessage.data[wsConnectionDesc->lastMessage.len],
-                          header->payloadLength, &wsConnectionDesc->lastMessage.utf8Handle);
-    if ((header->fin && state != UTF8_STATE_OK) || (!header->fin && state == UTF8_STATE_FAIL)) {
-      ezwebsocket_log(EZLOG_ERROR, "no valid utf8 string closing connection\n");
-      websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_INVALID_DATA);
-      return WS_MSG_STATE_ERROR;
-    }
+  if ((header->fin && state != UTF8_STATE_OK) || (!header->fin && state == UTF8_STATE_FAIL)) {
+    ezwebsocket_log(EZLOG_ERROR, "no valid utf8 string closing connection\n");
+    websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_INVALID_DATA);
+    return WS_MSG_STATE_ERROR;
   }
   wsConnectionDesc->lastMessage.len += header->payloadLength;
 
@@ -1017,7 +2111,7 @@ handleDisconnectMessage(struct websocket_connection_desc *wsConnectionDesc,
           rc = WS_MSG_STATE_ERROR;
         switch (wsConnectionDesc->wsType) {
         case WS_TYPE_SERVER:
-          socketServer_closeConnection(wsConnectionDesc->socketClientDesc);
+          closeTransport(wsConnectionDesc);
           break;
 
         case WS_TYPE_CLIENT:
@@ -1129,579 +2223,3990 @@ websocketServer_getServerIp(struct websocket_connection_desc *wsConnectionDesc)
 }
 
 /**
- * \brief Function that gets called when a connection to a client is established
- *         allocates and initialises the wsClientDesc
+ * \brief frees the given connection
  *
- * \param *socketUserData: In this case this is the websocket descriptor
- * \param *socketConnectionDesc The connection descriptor from the socket server
+ * \param *connection pointer to the websocket connection descriptor
  *
- * \return Pointer to the websocket connection descriptor
+ * \note this function is called by destroyConnection and websocketClient_close to free the
+ *       connection in case of websocket client
  */
-static void *
-websocketServer_onOpen(void *socketUserData, struct socket_connection_desc *socketConnectionDesc)
+static void
+freeConnection(void *connection)
 {
-  struct websocket_server_desc *wsDesc = socketUserData;
-  struct websocket_connection_desc *wsConnectionDesc;
+  struct websocket_connection_desc *wsConnectionDesc = connection;
 
-  if (wsDesc == NULL) {
-    ezwebsocket_log(EZLOG_ERROR, "%s(): wsDesc must not be NULL!\n", __func__);
-    return NULL;
+  if (wsConnectionDesc == NULL)
+    return;
+
+  if (wsConnectionDesc->wsDesc.wsClientDesc != NULL) {
+    if (wsConnectionDesc->socketClientDesc != NULL) {
+      socketClient_close(wsConnectionDesc->socketClientDesc);
+      wsConnectionDesc->socketClientDesc = NULL;
+    }
+
+    free(wsConnectionDesc->wsDesc.wsClientDesc->address);
+    wsConnectionDesc->wsDesc.wsClientDesc->address = NULL;
+    free(wsConnectionDesc->wsDesc.wsClientDesc->port);
+    wsConnectionDesc->wsDesc.wsClientDesc->port = NULL;
+    free(wsConnectionDesc->wsDesc.wsClientDesc->endpoint);
+    wsConnectionDesc->wsDesc.wsClientDesc->endpoint = NULL;
+    free(wsConnectionDesc->wsDesc.wsClientDesc->wsKey);
+    wsConnectionDesc->wsDesc.wsClientDesc->wsKey = NULL;
+    free(wsConnectionDesc->wsDesc.wsClientDesc);
+    wsConnectionDesc->wsDesc.wsClientDesc = NULL;
   }
+}
 
-  if (socketConnectionDesc == NULL) {
-    ezwebsocket_log(EZLOG_ERROR, "%s(): socketClientDesc must not be NULL!\n", __func__);
-    return NULL;
+/**
+ * \brief frees the given connection when the last reference is gone
+ *
+ * \param *connection pointer to the websocket connection descriptor
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+destroyConnection(void *connection)
+{
+  struct websocket_connection_desc *wsConnectionDesc = connection;
+  struct outbox_entry *entry;
+
+  if (wsConnectionDesc->wsType == WS_TYPE_CLIENT)
+    freeConnection(wsConnectionDesc);
+  else if (wsConnectionDesc->socketClientDesc)
+    refcnt_unref(wsConnectionDesc->socketClientDesc);
+  while ((entry = wsConnectionDesc->outbox)) {
+    wsConnectionDesc->outbox = entry->next;
+    refcnt_unref(entry->frame);
+    free(entry);
   }
+  if (wsConnectionDesc->h2Stream)
+    refcnt_unref(wsConnectionDesc->h2Stream);
+  if (wsConnectionDesc->session)
+    refcnt_unref(wsConnectionDesc->session);
+  free(wsConnectionDesc->channels);
+  pthread_mutex_destroy(&wsConnectionDesc->channelMutex);
+  pthread_mutex_destroy(&wsConnectionDesc->outboxMutex);
+}
 
-  refcnt_ref(socketConnectionDesc);
-  wsConnectionDesc = refcnt_allocate(sizeof(struct websocket_connection_desc), NULL);
-  memset(wsConnectionDesc, 0, sizeof(struct websocket_connection_desc));
-  wsConnectionDesc->wsType = WS_TYPE_SERVER;
-  wsConnectionDesc->socketClientDesc = socketConnectionDesc;
-  wsConnectionDesc->state = WS_STATE_HANDSHAKE;
-  wsConnectionDesc->timeout.tv_nsec = 0;
-  wsConnectionDesc->timeout.tv_sec = 0;
-  wsConnectionDesc->lastMessage.firstReceived = false;
-  wsConnectionDesc->lastMessage.data = NULL;
-  wsConnectionDesc->lastMessage.len = 0;
-  wsConnectionDesc->lastMessage.complete = false;
-  wsConnectionDesc->wsDesc.wsServerDesc = wsDesc;
+/**
+ * \brief Sends a channel control message
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param type The type of the control message
+ * \param channelId The channel id the message refers to
+ * \param value The value (receive window or credits)
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendChannelControl(struct websocket_connection_desc *wsConnectionDesc, enum ws_channel_ctrl type,
+                   unsigned int channelId, unsigned long value)
+{
+  unsigned char msg[WS_CHANNEL_CTRL_LEN];
+
+  msg[0] = WS_CHANNEL_CONTROL;
+  msg[1] = type;
+  msg[2] = channelId;
+  msg[3] = value >> 24 & 0xFF;
+  msg[4] = value >> 16 & 0xFF;
+  msg[5] = value >> 8 & 0xFF;
+  msg[6] = value & 0xFF;
+
+  return sendDataLowLevel(wsConnectionDesc, WS_OPCODE_BINARY, true,
+                          wsConnectionDesc->wsType == WS_TYPE_CLIENT, msg, sizeof(msg));
+}
 
-  return wsConnectionDesc;
+/**
+ * \brief frees the given channel
+ *
+ * \param *channel Pointer to the channel
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+freeChannel(void *channel)
+{
+  struct websocket_channel *wsChannel = channel;
+
+  refcnt_unref(wsChannel->connection);
 }
 
 /**
- * \brief Function that get's called when a websocket client connection is
- *        established
+ * \brief Allocates a channel and adds it to the channels of the connection
  *
- * \param *socketUserData In this case this is the websocket descriptor
- * \param *socketDesc The socket descriptor of the socket client
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param channelId The channel id
+ * \param *init Pointer to the callbacks, the receive window and the user data
  *
- * \return Pointer to the websocket connection descriptor
+ * \return The channel or NULL in case of error
+ *
+ * \note must be called with the channelMutex held
  */
-static void *
-websocketClient_onOpen(void *socketUserData, void *socketDesc)
+static struct websocket_channel *
+addChannel(struct websocket_connection_desc *wsConnectionDesc, unsigned int channelId,
+           const struct ws_channel_init *init)
 {
-  struct websocket_connection_desc *wsConnectionDesc = socketUserData;
-  struct websocket_client_desc *wsDesc = wsConnectionDesc->wsDesc.wsClientDesc;
-  (void) socketDesc;
+  struct websocket_channel *channel;
 
-  if (sendWsHandshakeRequest(wsConnectionDesc)) {
-    return wsDesc->connection;
-  } else {
-    wsConnectionDesc->state = WS_STATE_CLOSED;
+  channel = refcnt_allocate(sizeof(struct websocket_channel), freeChannel);
+  if (!channel)
     return NULL;
-  }
+
+  memset(channel, 0, sizeof(struct websocket_channel));
+  refcnt_ref(wsConnectionDesc);
+  channel->connection = wsConnectionDesc;
+  channel->id = channelId;
+  channel->init = *init;
+  wsConnectionDesc->channels[channelId] = channel;
+
+  return channel;
 }
 
 /**
- * \brief gets called when the websocket is closed
+ * \brief Handles a received channel control message
  *
  * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *msg Pointer to the message (without the channel id)
+ * \param len The length of the message
  */
 static void
-callOnClose(struct websocket_connection_desc *wsConnectionDesc)
+handleChannelControl(struct websocket_connection_desc *wsConnectionDesc, const unsigned char *msg,
+                     size_t len)
 {
-  switch (wsConnectionDesc->wsType) {
-  case WS_TYPE_SERVER:
-    if (wsConnectionDesc->wsDesc.wsServerDesc->ws_onClose != NULL) {
-      wsConnectionDesc->wsDesc.wsServerDesc
-        ->ws_onClose(wsConnectionDesc->wsDesc.wsServerDesc,
-                     wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData, wsConnectionDesc,
-                     wsConnectionDesc->connectionUserData);
-    } else if (wsConnectionDesc->wsDesc.wsServerDesc->ws_onCloseLegacy != NULL) {
-      wsConnectionDesc->wsDesc.wsServerDesc
-        ->ws_onCloseLegacy(wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData,
-                           wsConnectionDesc, wsConnectionDesc->connectionUserData);
+  struct websocket_channel *channel;
+  struct ws_channel_init init;
+  unsigned long value;
+  unsigned int channelId;
+  bool (*onChannelOpen)(void *websocketUserData, struct websocket_connection_desc *connectionDesc,
+                        void *connectionUserData, unsigned int channelId,
+                        struct ws_channel_init *init);
+  void *userData;
+
+  if ((len != WS_CHANNEL_CTRL_LEN - 1) || (msg[1] == WS_CHANNEL_CONTROL) ||
+      (msg[1] > WS_CHANNEL_MAX)) {
+    ezwebsocket_log(EZLOG_ERROR, "invalid channel control message\n");
+    return;
+  }
+
+  channelId = msg[1];
+  value = (unsigned long) msg[2] << 24 | (unsigned long) msg[3] << 16 |
+          (unsigned long) msg[4] << 8 | msg[5];
+
+  pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+  channel = wsConnectionDesc->channels[channelId];
+  switch (msg[0]) {
+  case WS_CHANNEL_CTRL_OPEN:
+    if (channel) {
+      // acknowledge of a channel we opened (or both sides opened it at the same time)
+      if (channel->open) {
+        pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+        return;
+      }
+      channel->open = true;
+      channel->peerWindow = value;
+      channel->credit = value;
+      refcnt_ref(channel);
+      pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+      if (channel->init.ws_onCredit)
+        channel->init.ws_onCredit(channel->init.userData, channel);
+      refcnt_unref(channel);
+      return;
     }
-    break;
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
 
-  case WS_TYPE_CLIENT:
-    if (wsConnectionDesc->wsDesc.wsClientDesc->ws_onClose != NULL)
-      wsConnectionDesc->wsDesc.wsClientDesc
-        ->ws_onClose(wsConnectionDesc->wsDesc.wsClientDesc->wsUserData, wsConnectionDesc,
-                     wsConnectionDesc->connectionUserData);
-    break;
+    if (wsConnectionDesc->wsType == WS_TYPE_SERVER) {
+      onChannelOpen = wsConnectionDesc->wsDesc.wsServerDesc->ws_onChannelOpen;
+      userData = wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData;
+    } else {
+      onChannelOpen = wsConnectionDesc->wsDesc.wsClientDesc->ws_onChannelOpen;
+      userData = wsConnectionDesc->wsDesc.wsClientDesc->wsUserData;
+    }
+
+    memset(&init, 0, sizeof(init));
+    if (!onChannelOpen ||
+        !onChannelOpen(userData, wsConnectionDesc, wsConnectionDesc->connectionUserData, channelId,
+                       &init)) {
+      sendChannelControl(wsConnectionDesc, WS_CHANNEL_CTRL_CLOSE, channelId, 0);
+      return;
+    }
+
+    pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+    if (wsConnectionDesc->channels[channelId] || !addChannel(wsConnectionDesc, channelId, &init)) {
+      pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+      ezwebsocket_log(EZLOG_ERROR, "couldn't open channel %u\n", channelId);
+      sendChannelControl(wsConnectionDesc, WS_CHANNEL_CTRL_CLOSE, channelId, 0);
+      return;
+    }
+    channel = wsConnectionDesc->channels[channelId];
+    channel->open = true;
+    channel->peerWindow = value;
+    channel->credit = value;
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    sendChannelControl(wsConnectionDesc, WS_CHANNEL_CTRL_OPEN, channelId, init.window);
+    return;
+
+  case WS_CHANNEL_CTRL_CLOSE:
+    if (channel) {
+      channel->closed = true;
+      wsConnectionDesc->channels[channelId] = NULL;
+    }
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    if (channel) {
+      if (channel->init.ws_onClose)
+        channel->init.ws_onClose(channel->init.userData, channel);
+      refcnt_unref(channel);
+    }
+    return;
+
+  case WS_CHANNEL_CTRL_CREDIT:
+    if (!channel || !channel->open) {
+      pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+      return;
+    }
+    channel->credit += value;
+    refcnt_ref(channel);
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    if (channel->init.ws_onCredit)
+      channel->init.ws_onCredit(channel->init.userData, channel);
+    refcnt_unref(channel);
+    return;
+
+  default:
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    ezwebsocket_log(EZLOG_ERROR, "unknown channel control message %u\n", msg[0]);
+    return;
   }
 }
 
 /**
- * \brief function that gets called when a connection to a client is closed
- *         frees the websocket client descriptor
- *
- * \param *socketUserData The websocket descriptor
- * \param *socketConnectionDesc The connection descriptor from the socket server/client
- * \param *wsConnectionDescriptor The websocket connection descriptor
+ * \brief Passes a received message of a multiplexed connection to its channel
  *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
  */
 static void
-websocket_onClose(void *socketUserData, void *socketConnectionDesc, void *wsConnectionDescriptor)
+dispatchChannelMessage(struct websocket_connection_desc *wsConnectionDesc)
 {
-  (void) socketUserData;
-  struct websocket_connection_desc *wsConnectionDesc = wsConnectionDescriptor;
-  (void) socketConnectionDesc;
+  unsigned char *data = (unsigned char *) wsConnectionDesc->lastMessage.data;
+  size_t len = wsConnectionDesc->lastMessage.len;
+  struct websocket_channel *channel = NULL;
+  unsigned long grant = 0;
 
-  if (wsConnectionDesc == NULL) {
-    ezwebsocket_log(EZLOG_ERROR, "%s(): wsConnectionDesc must not be NULL!\n", __func__);
+  if (len < 1) {
+    ezwebsocket_log(EZLOG_ERROR, "message without channel id dropped\n");
     return;
   }
 
-  if (wsConnectionDesc->lastMessage.data && wsConnectionDesc->lastMessage.complete)
-    refcnt_unref(wsConnectionDesc->lastMessage.data);
-  else
-    free(wsConnectionDesc->lastMessage.data);
-  wsConnectionDesc->lastMessage.data = NULL;
+  if (data[0] == WS_CHANNEL_CONTROL) {
+    handleChannelControl(wsConnectionDesc, &data[1], len - 1);
+    return;
+  }
 
-  if (wsConnectionDesc->state == WS_STATE_CONNECTED) {
-    wsConnectionDesc->state = WS_STATE_CLOSED;
+  pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+  if (data[0] <= WS_CHANNEL_MAX)
+    channel = wsConnectionDesc->channels[data[0]];
+  if (channel && channel->open)
+    refcnt_ref(channel);
+  else
+    channel = NULL;
+  pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
 
-    callOnClose(wsConnectionDesc);
+  if (!channel) {
+    ezwebsocket_log(EZLOG_ERROR, "message for unknown channel %u dropped\n", data[0]);
+    return;
   }
 
-  if (wsConnectionDesc->wsType ==
-      WS_TYPE_SERVER) // in client mode the connection descriptor is not allocated
-  {
-    if (wsConnectionDesc->socketClientDesc)
-      refcnt_unref(wsConnectionDesc->socketClientDesc);
-    wsConnectionDesc->socketClientDesc = NULL;
-    refcnt_unref(wsConnectionDesc);
+  if (channel->init.ws_onMessage)
+    channel->init.ws_onMessage(channel->init.userData, channel,
+                               wsConnectionDesc->lastMessage.dataType, &data[1], len - 1);
+
+  // the credits are granted again once half of the window is consumed
+  if (channel->init.window) {
+    pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+    channel->consumed += len - 1;
+    if (!channel->closed && (channel->consumed >= channel->init.window / 2)) {
+      grant = channel->consumed;
+      channel->consumed = 0;
+    }
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    if (grant)
+      sendChannelControl(wsConnectionDesc, WS_CHANNEL_CTRL_CREDIT, channel->id, grant);
   }
+  refcnt_unref(channel);
 }
 
 /**
- * \brief Gets called when a message was received on the websocket
+ * \brief Closes all channels of the given connection and calls their ws_onClose
  *
  * \param *wsConnectionDesc Pointer to the websocket connection descriptor
  */
 static void
-callOnMessage(struct websocket_connection_desc *wsConnectionDesc)
+closeChannels(struct websocket_connection_desc *wsConnectionDesc)
 {
-  switch (wsConnectionDesc->wsType) {
-  case WS_TYPE_SERVER: {
-    if (wsConnectionDesc->wsDesc.wsServerDesc->ws_onMessage) {
-      wsConnectionDesc->wsDesc.wsServerDesc
-        ->ws_onMessage(wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData, wsConnectionDesc,
-                       wsConnectionDesc->connectionUserData, wsConnectionDesc->lastMessage.dataType,
-                       wsConnectionDesc->lastMessage.data, wsConnectionDesc->lastMessage.len);
-    }
-  } break;
-
-  case WS_TYPE_CLIENT: {
-    if (wsConnectionDesc->wsDesc.wsClientDesc->ws_onMessage) {
-      wsConnectionDesc->wsDesc.wsClientDesc
-        ->ws_onMessage(wsConnectionDesc->wsDesc.wsClientDesc->wsUserData, wsConnectionDesc,
-                       wsConnectionDesc->connectionUserData, wsConnectionDesc->lastMessage.dataType,
-                       wsConnectionDesc->lastMessage.data, wsConnectionDesc->lastMessage.len);
+  struct websocket_channel *channel;
+  unsigned int i;
+
+  for (i = 1; i <= WS_CHANNEL_MAX; i++) {
+    pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+    channel = wsConnectionDesc->channels[i];
+    wsConnectionDesc->channels[i] = NULL;
+    if (channel)
+      channel->closed = true;
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+
+    if (channel) {
+      if (channel->init.ws_onClose)
+        channel->init.ws_onClose(channel->init.userData, channel);
+      refcnt_unref(channel);
     }
-  } break;
   }
 }
 
 /**
- * \brief Function that gets called when a message arrives at the socket server
- *
- * \param *socketUserData In this case this is the websocket descriptor
- * \param *socketConnectionDesc The descriptor of the underlying socket
- * \param *connectionDescriptor The websocket connection descriptor
- * \param *msg Pointer to the buffer containing the data
- * \param len The length of msg
+ * \brief allocates and initialises the websocket connection descriptor of a server connection
  *
- * \return the amount of bytes read
+ * \param *wsDesc Pointer to the websocket server descriptor
+ * \param *socketConnectionDesc The connection descriptor from the socket server
  *
+ * \return Pointer to the websocket connection descriptor or NULL in case of error
  */
-static size_t
-websocket_onMessage(void *socketUserData, void *socketConnectionDesc, void *connectionDescriptor,
-                    void *msg, size_t len)
+static struct websocket_connection_desc *
+createServerConnection(struct websocket_server_desc *wsDesc,
+                       struct socket_connection_desc *socketConnectionDesc)
 {
-  struct websocket_connection_desc *wsConnectionDesc = connectionDescriptor;
-  struct ws_header wsHeader = { 0 };
-  struct timespec now;
-
-  char key[WS_HS_KEY_LEN];
-  char *replyKey;
+  struct websocket_connection_desc *wsConnectionDesc;
 
-  if (wsConnectionDesc == NULL) {
-    ezwebsocket_log(EZLOG_ERROR, "%s(): wsConnectionDesc must not be NULL!\n", __func__);
-    return 0;
+  wsConnectionDesc = refcnt_allocate(sizeof(struct websocket_connection_desc), destroyConnection);
+  if (!wsConnectionDesc) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return NULL;
   }
+  memset(wsConnectionDesc, 0, sizeof(struct websocket_connection_desc));
+  pthread_mutex_init(&wsConnectionDesc->channelMutex, NULL);
+  pthread_mutex_init(&wsConnectionDesc->outboxMutex, NULL);
+  refcnt_ref(socketConnectionDesc);
+  wsConnectionDesc->wsType = WS_TYPE_SERVER;
+  wsConnectionDesc->socketClientDesc = socketConnectionDesc;
+  wsConnectionDesc->state = WS_STATE_HANDSHAKE;
+  wsConnectionDesc->timeout.tv_nsec = 0;
+  wsConnectionDesc->timeout.tv_sec = 0;
+  wsConnectionDesc->lastMessage.firstReceived = false;
+  wsConnectionDesc->lastMessage.data = NULL;
+  wsConnectionDesc->lastMessage.len = 0;
+  wsConnectionDesc->lastMessage.complete = false;
+  wsConnectionDesc->wsDesc.wsServerDesc = wsDesc;
+  websocket_setRateLimit(wsConnectionDesc, &wsDesc->rateLimit);
 
-  if (socketConnectionDesc == NULL) {
-    ezwebsocket_log(EZLOG_ERROR, "%s(): socketConnectionDesc must not be NULL!\n", __func__);
-    return 0;
-  }
+  return wsConnectionDesc;
+}
 
-  switch (wsConnectionDesc->state) {
-  case WS_STATE_HANDSHAKE:
-    switch (wsConnectionDesc->wsType) {
-    case WS_TYPE_SERVER:
-      if (parseHttpHeader(msg, len, key) == 0) {
-        struct websocket_server_desc *wsDesc = socketUserData;
+//! mutex that protects the upgrade requests of all servers
+static pthread_mutex_t upgradeMutex = PTHREAD_MUTEX_INITIALIZER;
 
-        replyKey = calculateSecWebSocketAccept(key);
-        if (replyKey == NULL) {
-          ezwebsocket_log(EZLOG_ERROR, "%s(): calculateSecWebSocketAccept failed!\n", __func__);
-          return 0;
-        }
+/**
+ * \brief releases the connection of the given upgrade request when the last reference is gone
+ *
+ * \param *ptr Pointer to the upgrade request
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+freeUpgrade(void *ptr)
+{
+  struct websocket_upgrade *upgrade = ptr;
 
-        ezwebsocket_log(EZLOG_DEBUG, "%s() replyKey:%s\n", __func__, replyKey);
+  refcnt_unref(upgrade->socketConnectionDesc);
+  if (upgrade->h2Stream)
+    refcnt_unref(upgrade->h2Stream);
+}
 
-        sendWsHandshakeReply(socketConnectionDesc, replyKey);
+/**
+ * \brief Passes a new upgrade request to ws_onUpgradeRequest, the request is added to the
+ *        server before so that its verdict can be completed from other threads meanwhile
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor
+ * \param *socketConnectionDesc The connection descriptor of the socket
+ * \param *h2Stream The http/2 stream of the request (NULL for HTTP/1.1)
+ * \param *msg Pointer to the request
+ * \param len The length of the request (including the empty line)
+ *
+ * \return 0 if successful else -1
+ */
+static int
+startUpgrade(struct websocket_server_desc *wsDesc,
+             struct socket_connection_desc *socketConnectionDesc, struct http2_stream *h2Stream,
+             const char *msg, size_t len)
+{
+  struct websocket_upgrade *upgrade;
+  enum ws_upgrade_verdict verdict;
+  char *cpnt;
+  int status = 0;
 
-        free(replyKey);
-        wsConnectionDesc->state = WS_STATE_CONNECTED;
-        if (wsDesc->ws_onOpen != NULL)
-          wsConnectionDesc->connectionUserData = wsDesc->ws_onOpen(wsDesc->wsSocketUserData, wsDesc,
-                                                                   wsConnectionDesc);
+  upgrade = refcnt_allocate(sizeof(struct websocket_upgrade) + len + 1, freeUpgrade);
+  if (!upgrade) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return -1;
+  }
+  memset(upgrade, 0, sizeof(struct websocket_upgrade));
+  refcnt_ref(socketConnectionDesc);
+  upgrade->socketConnectionDesc = socketConnectionDesc;
+  if (h2Stream)
+    refcnt_ref(h2Stream);
+  upgrade->h2Stream = h2Stream;
+  upgrade->verdict = WS_UPGRADE_PENDING;
+  clock_gettime(CLOCK_MONOTONIC, &upgrade->deadline);
+  upgrade->deadline.tv_sec += wsDesc->upgradeTimeoutMs / 1000;
+  upgrade->deadline.tv_nsec += (wsDesc->upgradeTimeoutMs % 1000) * 1000000L;
+  if (upgrade->deadline.tv_nsec >= 1000000000L) {
+    upgrade->deadline.tv_sec++;
+    upgrade->deadline.tv_nsec -= 1000000000L;
+  }
 
-        if (wsDesc->ws_onOpenLegacy != NULL)
-          wsConnectionDesc->connectionUserData = wsDesc->ws_onOpenLegacy(wsDesc, wsConnectionDesc);
-      } else {
-        ezwebsocket_log(EZLOG_ERROR, "parseHttpHeader failed\n");
-      }
-      break;
+  // every line ends with "\0\n" and the request line is split after the target
+  upgrade->len = len;
+  memcpy(upgrade->request, msg, len);
+  upgrade->request[len] = '\0';
+  for (cpnt = upgrade->request; (cpnt = strchr(cpnt, '\r')) != NULL; cpnt++)
+    *cpnt = '\0';
+  cpnt = strchr(upgrade->request, ' ');
+  upgrade->path = cpnt ? cpnt + 1 : "";
+  if (cpnt && ((cpnt = strchr(cpnt + 1, ' ')) != NULL))
+    *cpnt = '\0';
+
+  // one reference for the server and one for the application
+  refcnt_ref(upgrade);
+  pthread_mutex_lock(&upgradeMutex);
+  upgrade->next = wsDesc->upgrades;
+  wsDesc->upgrades = upgrade;
+  pthread_mutex_unlock(&upgradeMutex);
+
+  verdict = wsDesc->ws_onUpgradeRequest(wsDesc->wsSocketUserData, upgrade, &status);
+  if (verdict != WS_UPGRADE_PENDING)
+    websocketUpgrade_complete(upgrade, verdict == WS_UPGRADE_ACCEPT, status);
 
-    case WS_TYPE_CLIENT:
-      if (checkWsHandshakeReply(wsConnectionDesc, msg, &len)) {
-        struct websocket_client_desc *wsDesc = wsConnectionDesc->wsDesc.wsClientDesc;
+  return 0;
+}
 
-        wsConnectionDesc->state = WS_STATE_CONNECTED;
+/**
+ * \brief Takes the upgrade request of the given connection from the server once its verdict
+ *        is known, reading (of the http/2 stream) is paused while it's pending
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor
+ * \param *socketConnectionDesc The connection descriptor of the socket
+ * \param *h2Stream The http/2 stream of the request (NULL for HTTP/1.1)
+ * \param[out] *verdict Pointer to where the verdict should be stored
+ * \param[out] *status Pointer to where the http status should be stored
+ *
+ * \return 1 if the verdict is known, 0 if it's pending or -1 if there's no request
+ */
+static int
+takeUpgrade(struct websocket_server_desc *wsDesc,
+            struct socket_connection_desc *socketConnectionDesc, struct http2_stream *h2Stream,
+            enum ws_upgrade_verdict *verdict, int *status)
+{
+  struct websocket_upgrade **pnt;
+  struct websocket_upgrade *upgrade;
+  struct timespec now;
+  long long remainingMs;
 
-        if (wsDesc->ws_onOpen != NULL)
-          wsConnectionDesc->connectionUserData = wsDesc->ws_onOpen(wsDesc->wsUserData,
-                                                                   wsConnectionDesc);
-        else
-          wsConnectionDesc->connectionUserData = NULL;
-      } else {
-        ezwebsocket_log(EZLOG_ERROR, "checkWsHandshakeReply failed\n");
-      }
+  pthread_mutex_lock(&upgradeMutex);
+  for (pnt = &wsDesc->upgrades; *pnt; pnt = &(*pnt)->next) {
+    if (((*pnt)->socketConnectionDesc == socketConnectionDesc) && ((*pnt)->h2Stream == h2Stream))
       break;
-    }
-    return len;
+  }
 
-  case WS_STATE_CONNECTED:
-    switch (parseWebsocketHeader(msg, len, &wsHeader)) {
-    case -1:
-      ezwebsocket_log(EZLOG_ERROR, "couldn't parse header\n");
-      websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_PROTOCOL_ERROR);
-      return len;
+  upgrade = *pnt;
+  if (!upgrade) {
+    pthread_mutex_unlock(&upgradeMutex);
+    return -1;
+  }
 
-    case 0:
+  if (upgrade->verdict == WS_UPGRADE_PENDING) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remainingMs = ((upgrade->deadline.tv_sec - now.tv_sec) * 1000000000LL +
+                   (upgrade->deadline.tv_nsec - now.tv_nsec) + 999999) /
+                  1000000;
+    if (remainingMs > 0) {
+      // the request stays in the buffer until websocketUpgrade_complete resumes reading
+      if (h2Stream)
+        http2_pauseStream(h2Stream, remainingMs);
+      else
+        socketServer_pauseReading(socketConnectionDesc, remainingMs);
+      pthread_mutex_unlock(&upgradeMutex);
       return 0;
+    }
+    ezwebsocket_log(EZLOG_ERROR, "upgrade request timed out\n");
+    upgrade->verdict = WS_UPGRADE_REJECT;
+    upgrade->status = 503;
+  }
+
+  *pnt = upgrade->next;
+  *verdict = upgrade->verdict;
+  *status = upgrade->status;
+  pthread_mutex_unlock(&upgradeMutex);
+  refcnt_unref(upgrade);
+
+  return 1;
+}
+
+/**
+ * \brief Removes the upgrade request of a connection that was closed before its verdict was
+ *        applied
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor
+ * \param *socketConnectionDesc The connection descriptor of the socket
+ * \param *h2Stream The http/2 stream of the request (NULL for HTTP/1.1)
+ */
+static void
+cancelUpgrade(struct websocket_server_desc *wsDesc,
+              struct socket_connection_desc *socketConnectionDesc, struct http2_stream *h2Stream)
+{
+  struct websocket_upgrade **pnt;
+  struct websocket_upgrade *upgrade;
+
+  pthread_mutex_lock(&upgradeMutex);
+  for (pnt = &wsDesc->upgrades; *pnt; pnt = &(*pnt)->next) {
+    if (((*pnt)->socketConnectionDesc == socketConnectionDesc) && ((*pnt)->h2Stream == h2Stream))
       break;
+  }
+  upgrade = *pnt;
+  if (upgrade) {
+    *pnt = upgrade->next;
+    upgrade->closed = true;
+  }
+  pthread_mutex_unlock(&upgradeMutex);
+
+  if (upgrade)
+    refcnt_unref(upgrade);
+}
+
+/**
+ * \brief Returns the reason phrase of the given http status
+ *
+ * \param status The http status
+ *
+ * \return The reason phrase
+ */
+static const char *
+httpReason(int status)
+{
+  switch (status) {
+  case 400:
+    return "Bad Request";
+  case 401:
+    return "Unauthorized";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 429:
+    return "Too Many Requests";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "Rejected";
+  }
+}
+
+//! blueprint for the reply to rejected upgrade requests
+#define WS_UPGRADE_REJECT_BLUEPRINT                                                                \
+  "HTTP/1.1 %d %s\r\n"                                                                             \
+  "Connection: close\r\n"                                                                          \
+  "Content-Length: 0\r\n"                                                                          \
+  "\r\n"
+
+/**
+ * \brief Checks the upgrade request with ws_onUpgradeRequest before any connection state is
+ *        allocated, rejected requests get a minimal http reply and the connection is closed
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor
+ * \param *socketConnectionDesc The connection descriptor of the socket
+ * \param *msg Pointer to the received data
+ * \param len The length of the received data
+ * \param[out] *consumed Pointer to where the amount of bytes read is stored (if NULL is returned)
+ *
+ * \return The websocket connection descriptor if the upgrade was accepted else NULL
+ */
+static struct websocket_connection_desc *
+checkUpgradeRequest(struct websocket_server_desc *wsDesc,
+                    struct socket_connection_desc *socketConnectionDesc, const char *msg,
+                    size_t len, size_t *consumed)
+{
+  struct websocket_connection_desc *wsConnectionDesc = NULL;
+  enum ws_upgrade_verdict verdict = WS_UPGRADE_REJECT;
+  char reply[sizeof(WS_UPGRADE_REJECT_BLUEPRINT) + 32];
+  char key[WS_HS_KEY_LEN];
+  const char *end;
+  int status = 503;
+  int rc;
+
+  *consumed = 0;
+
+  // the streams of a http/2 connection pass ws_onUpgradeRequest one by one when they are opened
+  if (wsDesc->h2Callbacks) {
+    switch (http2_checkPreface(msg, len)) {
+    case 0:
+      return NULL;
 
     case 1:
+      wsConnectionDesc = createServerConnection(wsDesc, socketConnectionDesc);
+      break;
+
+    default:
       break;
     }
-    printWsHeader(&wsHeader);
+  }
 
-    switch (parseMessage(wsConnectionDesc, msg, len, &wsHeader)) {
-    case WS_MSG_STATE_NO_USER_DATA:
-      wsConnectionDesc->timeout.tv_nsec = 0;
-      wsConnectionDesc->timeout.tv_sec = 0;
-      return wsHeader.payloadLength + wsHeader.payloadStartOffset;
+  if (!wsConnectionDesc) {
+    // the request is checked once it's complete
+    end = strnstr((char *) msg, "\r\n\r\n", len);
+    if (!end)
+      return NULL;
+
+    rc = takeUpgrade(wsDesc, socketConnectionDesc, NULL, &verdict, &status);
+    if (rc < 0) {
+      if (parseHttpHeader(msg, len, key) < 0) {
+        verdict = WS_UPGRADE_REJECT;
+        status = 400;
+      } else if (startUpgrade(wsDesc, socketConnectionDesc, NULL, msg, end + 4 - msg) == 0) {
+        rc = takeUpgrade(wsDesc, socketConnectionDesc, NULL, &verdict, &status);
+      }
+    }
+    if (rc == 0)
+      return NULL;
 
-    case WS_MSG_STATE_USER_DATA:
-      callOnMessage(wsConnectionDesc);
-      if (wsConnectionDesc->lastMessage.data)
-        refcnt_unref(wsConnectionDesc->lastMessage.data);
-      wsConnectionDesc->lastMessage.data = NULL;
-      wsConnectionDesc->lastMessage.complete = false;
-      wsConnectionDesc->lastMessage.firstReceived = false;
-      wsConnectionDesc->lastMessage.len = 0;
-      wsConnectionDesc->timeout.tv_nsec = 0;
-      wsConnectionDesc->timeout.tv_sec = 0;
-      return wsHeader.payloadLength + wsHeader.payloadStartOffset;
+    if (verdict == WS_UPGRADE_ACCEPT)
+      wsConnectionDesc = createServerConnection(wsDesc, socketConnectionDesc);
+  }
 
-    case WS_MSG_STATE_INCOMPLETE:
-      clock_gettime(CLOCK_MONOTONIC, &now);
-      if (wsConnectionDesc->timeout.tv_sec == (wsConnectionDesc->timeout.tv_nsec == 0)) {
-        wsConnectionDesc->timeout = now;
-      } else if (wsConnectionDesc->timeout.tv_sec > now.tv_sec + MESSAGE_TIMEOUT_S) {
-        free(wsConnectionDesc->lastMessage.data);
-        wsConnectionDesc->lastMessage.data = NULL;
-        wsConnectionDesc->lastMessage.len = 0;
-        wsConnectionDesc->lastMessage.complete = 0;
-        wsConnectionDesc->timeout.tv_sec = 0;
-        wsConnectionDesc->timeout.tv_nsec = 0;
-        ezwebsocket_log(EZLOG_ERROR, "message timeout");
-        return len;
-      }
-      return 0;
+  *consumed = len;
+  if (!wsConnectionDesc) {
+    if ((status < 400) || (status > 599))
+      status = 403;
+    snprintf(reply, sizeof(reply), WS_UPGRADE_REJECT_BLUEPRINT, status, httpReason(status));
+    socketServer_send(socketConnectionDesc, reply, strlen(reply));
+    socketServer_closeConnection(socketConnectionDesc);
+    return NULL;
+  }
 
-    case WS_MSG_STATE_ERROR:
-      if (wsConnectionDesc->lastMessage.data && wsConnectionDesc->lastMessage.complete)
-        refcnt_unref(wsConnectionDesc->lastMessage.data);
-      else
-        free(wsConnectionDesc->lastMessage.data);
-      wsConnectionDesc->lastMessage.data = NULL;
-      wsConnectionDesc->lastMessage.len = 0;
-      wsConnectionDesc->lastMessage.complete = 0;
-      wsConnectionDesc->timeout.tv_sec = 0;
-      wsConnectionDesc->timeout.tv_nsec = 0;
-      return len;
+  socketServer_setConnectionUserData(socketConnectionDesc, wsConnectionDesc);
+  return wsConnectionDesc;
+}
 
-    default:
-      ezwebsocket_log(EZLOG_ERROR, "unexpected return value\n");
-      return len;
+/**
+ * \brief Function that gets called when a connection to a client is established
+ *         allocates and initialises the wsClientDesc
+ *
+ * \param *socketUserData: In this case this is the websocket descriptor
+ * \param *socketConnectionDesc The connection descriptor from the socket server
+ *
+ * \return Pointer to the websocket connection descriptor (NULL => the upgrade request is
+ *         checked with ws_onUpgradeRequest first)
+ */
+static void *
+websocketServer_onOpen(void *socketUserData, struct socket_connection_desc *socketConnectionDesc)
+{
+  struct websocket_server_desc *wsDesc = socketUserData;
+  struct websocket_connection_desc *wsConnectionDesc;
+  const void *handoverState;
+  size_t handoverStateLen;
+
+  if (wsDesc == NULL) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): wsDesc must not be NULL!\n", __func__);
+    return NULL;
+  }
+
+  if (socketConnectionDesc == NULL) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): socketClientDesc must not be NULL!\n", __func__);
+    return NULL;
+  }
+
+  handoverState = socket_get_handover_state(socketConnectionDesc, &handoverStateLen);
+
+  // no state is allocated for connections until their upgrade request is accepted
+  if (wsDesc->ws_onUpgradeRequest && !handoverState)
+    return NULL;
+
+  wsConnectionDesc = createServerConnection(wsDesc, socketConnectionDesc);
+  if (!wsConnectionDesc)
+    return NULL;
+
+  if (handoverState) {
+    // the connection was taken over from another process so the handshake is already done
+    wsConnectionDesc->state = WS_STATE_CONNECTED;
+    if (wsDesc->ws_onTakeover != NULL)
+      wsConnectionDesc->connectionUserData = wsDesc->ws_onTakeover(wsDesc->wsSocketUserData, wsDesc,
+                                                                   wsConnectionDesc, handoverState,
+                                                                   handoverStateLen);
+    else if (wsDesc->ws_onOpen != NULL)
+      wsConnectionDesc->connectionUserData = wsDesc->ws_onOpen(wsDesc->wsSocketUserData, wsDesc,
+                                                               wsConnectionDesc);
+  }
+
+  return wsConnectionDesc;
+}
+
+/**
+ * \brief Function that get's called when a websocket client connection is
+ *        established
+ *
+ * \param *socketUserData In this case this is the websocket descriptor
+ * \param *socketDesc The socket descriptor of the socket client
+ *
+ * \return Pointer to the websocket connection descriptor
+ */
+static void *
+websocketClient_onOpen(void *socketUserData, void *socketDesc)
+{
+  struct websocket_connection_desc *wsConnectionDesc = socketUserData;
+  struct websocket_client_desc *wsDesc = wsConnectionDesc->wsDesc.wsClientDesc;
+  (void) socketDesc;
+
+  if (sendWsHandshakeRequest(wsConnectionDesc)) {
+    return wsDesc->connection;
+  } else {
+    wsConnectionDesc->state = WS_STATE_CLOSED;
+    return NULL;
+  }
+}
+
+/**
+ * \brief gets called when the websocket is closed
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+callOnClose(struct websocket_connection_desc *wsConnectionDesc)
+{
+  switch (wsConnectionDesc->wsType) {
+  case WS_TYPE_SERVER:
+    if (wsConnectionDesc->wsDesc.wsServerDesc->ws_onClose != NULL) {
+      wsConnectionDesc->wsDesc.wsServerDesc
+        ->ws_onClose(wsConnectionDesc->wsDesc.wsServerDesc,
+                     wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData, wsConnectionDesc,
+                     wsConnectionDesc->connectionUserData);
+    } else if (wsConnectionDesc->wsDesc.wsServerDesc->ws_onCloseLegacy != NULL) {
+      wsConnectionDesc->wsDesc.wsServerDesc
+        ->ws_onCloseLegacy(wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData,
+                           wsConnectionDesc, wsConnectionDesc->connectionUserData);
     }
     break;
 
-  case WS_STATE_CLOSED:
-    ezwebsocket_log(EZLOG_ERROR, "websocket closed ignoring message\n");
-    return len;
-
-  default:
+  case WS_TYPE_CLIENT:
+    if (wsConnectionDesc->wsDesc.wsClientDesc->ws_onClose != NULL)
+      wsConnectionDesc->wsDesc.wsClientDesc
+        ->ws_onClose(wsConnectionDesc->wsDesc.wsClientDesc->wsUserData, wsConnectionDesc,
+                     wsConnectionDesc->connectionUserData);
     break;
   }
+}
 
-  return 0;
+/**
+ * \brief Function that gets called when the socket server wants an fd to be (un)watched
+ *
+ * \param *socketUserData In this case this is the websocket descriptor
+ * \param fd The file descriptor
+ * \param events The poll events that should be watched (0 => stop watching)
+ */
+static void
+websocketServer_onWatch(void *socketUserData, int fd, int events)
+{
+  struct websocket_server_desc *wsDesc = socketUserData;
+
+  wsDesc->ws_onWatch(wsDesc->wsSocketUserData, fd, events);
 }
 
 /**
- * \brief frees the given connection
+ * \brief Function that gets called on the thread of a connection when its wakeup is due
  *
- * \param *connection pointer to the websocket connection descriptor
+ * \param *socketUserData In this case this is the websocket descriptor
+ * \param *socketConnectionDesc The connection descriptor from the socket server
+ * \param *wsConnectionDescriptor The websocket connection descriptor
+ */
+static void
+websocketServer_onWakeup(void *socketUserData, void *socketConnectionDesc,
+                         void *wsConnectionDescriptor)
+{
+  struct websocket_connection_desc *wsConnectionDesc = wsConnectionDescriptor;
+  (void) socketUserData;
+  (void) socketConnectionDesc;
+
+  // paused http/2 streams are resumed on the thread of the connection
+  if (wsConnectionDesc && wsConnectionDesc->h2Session)
+    http2_wakeup(wsConnectionDesc->h2Session);
+}
+
+/**
+ * \brief Function that gets called when the socket client wants an fd to be (un)watched
  *
- * \note this function is passed to refcnt_allocate to free the connection in
- *       case of websocket client
+ * \param *socketUserData In this case this is the websocket connection descriptor
+ * \param fd The file descriptor
+ * \param events The poll events that should be watched (0 => stop watching)
  */
 static void
-freeConnection(void *connection)
+websocketClient_onWatch(void *socketUserData, int fd, int events)
 {
-  struct websocket_connection_desc *wsConnectionDesc = connection;
+  struct websocket_connection_desc *wsConnectionDesc = socketUserData;
+  struct websocket_client_desc *wsDesc = wsConnectionDesc->wsDesc.wsClientDesc;
 
-  if (wsConnectionDesc == NULL)
-    return;
+  wsDesc->ws_onWatch(wsDesc->wsUserData, fd, events);
+}
 
-  if (wsConnectionDesc->wsDesc.wsClientDesc != NULL) {
-    if (wsConnectionDesc->socketClientDesc != NULL) {
-      socketClient_close(wsConnectionDesc->socketClientDesc);
-      wsConnectionDesc->socketClientDesc = NULL;
-    }
+//! mutex that protects the pairing of connections in proxy mode
+static pthread_mutex_t relayMutex = PTHREAD_MUTEX_INITIALIZER;
+//! mutex that protects the list of replay rings
+static pthread_mutex_t replayMutex = PTHREAD_MUTEX_INITIALIZER;
+//! all replay rings (closed connections are removed from their subscribers)
+static struct websocket_replay *replays;
 
-    free(wsConnectionDesc->wsDesc.wsClientDesc->address);
-    wsConnectionDesc->wsDesc.wsClientDesc->address = NULL;
-    free(wsConnectionDesc->wsDesc.wsClientDesc->port);
-    wsConnectionDesc->wsDesc.wsClientDesc->port = NULL;
-    free(wsConnectionDesc->wsDesc.wsClientDesc->endpoint);
-    wsConnectionDesc->wsDesc.wsClientDesc->endpoint = NULL;
-    free(wsConnectionDesc->wsDesc.wsClientDesc->wsKey);
-    wsConnectionDesc->wsDesc.wsClientDesc->wsKey = NULL;
-    free(wsConnectionDesc->wsDesc.wsClientDesc);
-    wsConnectionDesc->wsDesc.wsClientDesc = NULL;
+/**
+ * \brief Removes the subscriber with the given index
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param idx The index of the subscriber
+ *
+ * \note must be called with the lock held
+ */
+static void
+replayRemoveSubscriber(struct websocket_replay *replay, size_t idx)
+{
+  __atomic_sub_fetch(&replay->subscribers[idx]->replaySubscriptions, 1, __ATOMIC_RELAXED);
+  refcnt_unref(replay->subscribers[idx]);
+  replay->subscribers[idx] = replay->subscribers[--replay->numSubscribers];
+}
+
+/**
+ * \brief Removes the given connection from the subscribers if it's subscribed
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \note must be called with the lock held
+ */
+static void
+replayRemoveConnection(struct websocket_replay *replay,
+                       struct websocket_connection_desc *wsConnectionDesc)
+{
+  size_t i;
+
+  for (i = 0; i < replay->numSubscribers; i++) {
+    if (replay->subscribers[i] == wsConnectionDesc) {
+      replayRemoveSubscriber(replay, i);
+      break;
+    }
+  }
+}
+
+/**
+ * \brief Removes a closed connection from all replay rings it's subscribed to
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+unsubscribeReplays(struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct websocket_replay *replay;
+
+  if (!__atomic_load_n(&wsConnectionDesc->replaySubscriptions, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock(&replayMutex);
+  for (replay = replays; replay; replay = replay->next) {
+    pthread_mutex_lock(&replay->lock);
+    replayRemoveConnection(replay, wsConnectionDesc);
+    pthread_mutex_unlock(&replay->lock);
+  }
+  pthread_mutex_unlock(&replayMutex);
+}
+
+/**
+ * \brief Forwards a received frame to the paired connection (proxy mode), the frame is
+ *        forwarded as it is if neither side masks else it's remasked in one pass
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *data Pointer to the frame (must be received completely)
+ * \param *header Pointer to the parsed header of the frame
+ *
+ * \return 0 if the frame was forwarded else -1 (the connection isn't paired)
+ */
+static int
+relayFrame(struct websocket_connection_desc *wsConnectionDesc, const unsigned char *data,
+           const struct ws_header *header)
+{
+  struct websocket_connection_desc *peer;
+  unsigned char *sendBuffer;
+  unsigned char frameHeader[14];
+  int headerLength;
+  unsigned long mask = 0;
+  unsigned long inMask = 0;
+  bool masked;
+  bool closing = false;
+
+  pthread_mutex_lock(&relayMutex);
+  peer = wsConnectionDesc->relayPeer;
+  if (peer) {
+    refcnt_ref(peer);
+    if (header->opcode == WS_OPCODE_DISCONNECT) {
+      // the close handshake is passed through, the second close frame ends both connections
+      wsConnectionDesc->relayClosing = true;
+      closing = peer->relayClosing;
+      wsConnectionDesc->state = WS_STATE_CLOSING;
+      peer->state = WS_STATE_CLOSING;
+    }
+  }
+  pthread_mutex_unlock(&relayMutex);
+  if (!peer)
+    return -1;
+
+  masked = (peer->wsType == WS_TYPE_CLIENT);
+  if (!masked && !header->masked) {
+    sendRaw(peer, (void *) data, header->payloadStartOffset + header->payloadLength);
+  } else {
+    if (masked)
+      mask = random_u32();
+    if (header->masked)
+      inMask = ((unsigned long) header->mask[0] << 24) | (header->mask[1] << 16) |
+               (header->mask[2] << 8) | header->mask[3];
+
+    headerLength = createWebsocketHeader(frameHeader, header->opcode, header->fin, masked, mask,
+                                         header->payloadLength);
+    sendBuffer = malloc(headerLength + header->payloadLength);
+    if (sendBuffer) {
+      memcpy(sendBuffer, frameHeader, headerLength);
+      // unmasking and masking are a single XOR with both masks
+      copyMasked(&sendBuffer[headerLength], &data[header->payloadStartOffset], inMask ^ mask,
+                 header->payloadLength);
+      sendRaw(peer, sendBuffer, headerLength + header->payloadLength);
+      free(sendBuffer);
+    } else {
+      ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    }
+  }
+
+  if (closing) {
+    closeTransport(wsConnectionDesc);
+    closeTransport(peer);
+  }
+  refcnt_unref(peer);
+
+  return 0;
+}
+
+/**
+ * \brief Dissolves the pairing of the given connection (proxy mode) and closes the paired
+ *        connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+unrelay(struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct websocket_connection_desc *peer;
+  bool paired;
+
+  pthread_mutex_lock(&relayMutex);
+  peer = wsConnectionDesc->relayPeer;
+  wsConnectionDesc->relayPeer = NULL;
+  paired = peer && (peer->relayPeer == wsConnectionDesc);
+  if (paired)
+    peer->relayPeer = NULL;
+  pthread_mutex_unlock(&relayMutex);
+
+  if (!peer)
+    return;
+
+  if (peer->state == WS_STATE_CONNECTED)
+    websocket_closeConnection(peer, WS_CLOSE_CODE_GOING_AWAY);
+  else
+    closeTransport(peer);
+
+  if (paired)
+    refcnt_unref(wsConnectionDesc);
+  refcnt_unref(peer);
+}
+
+/**
+ * \brief function that gets called when a connection to a client is closed
+ *         frees the websocket client descriptor
+ *
+ * \param *socketUserData The websocket descriptor
+ * \param *socketConnectionDesc The connection descriptor from the socket server/client
+ * \param *wsConnectionDescriptor The websocket connection descriptor
+ *
+ */
+static void
+websocket_onClose(void *socketUserData, void *socketConnectionDesc, void *wsConnectionDescriptor)
+{
+  struct websocket_connection_desc *wsConnectionDesc = wsConnectionDescriptor;
+  struct websocket_server_desc *wsDesc = socketUserData;
+
+  if (wsConnectionDesc == NULL) {
+    // the connection was closed before its upgrade request was accepted
+    if (wsDesc && wsDesc->ws_onUpgradeRequest && socketConnectionDesc) {
+      cancelUpgrade(wsDesc, socketConnectionDesc, NULL);
+      return;
+    }
+    ezwebsocket_log(EZLOG_ERROR, "%s(): wsConnectionDesc must not be NULL!\n", __func__);
+    return;
+  }
+
+  // a http/2 stream can be closed while its upgrade request is pending
+  if (wsConnectionDesc->h2Stream && (wsConnectionDesc->state == WS_STATE_HANDSHAKE) &&
+      wsDesc->ws_onUpgradeRequest)
+    cancelUpgrade(wsDesc, socketConnectionDesc, wsConnectionDesc->h2Stream);
+
+  // closing the http/2 session closes all websockets it carries
+  if (wsConnectionDesc->h2Session) {
+    http2_close(wsConnectionDesc->h2Session);
+    wsConnectionDesc->h2Session = NULL;
+  }
+
+  if (wsConnectionDesc->lastMessage.data && wsConnectionDesc->lastMessage.complete)
+    refcnt_unref(wsConnectionDesc->lastMessage.data);
+  else
+    free(wsConnectionDesc->lastMessage.data);
+  wsConnectionDesc->lastMessage.data = NULL;
+
+  if (wsConnectionDesc->relayPeer)
+    unrelay(wsConnectionDesc);
+
+  if (wsConnectionDesc->session)
+    detachSession(wsConnectionDesc);
+
+  unsubscribeReplays(wsConnectionDesc);
+
+  if ((wsConnectionDesc->state == WS_STATE_CONNECTED) ||
+      (wsConnectionDesc->state == WS_STATE_CLOSING)) {
+    wsConnectionDesc->state = WS_STATE_CLOSED;
+
+    if (wsConnectionDesc->multiplexed)
+      closeChannels(wsConnectionDesc);
+    callOnClose(wsConnectionDesc);
+  } else {
+    wsConnectionDesc->state = WS_STATE_CLOSED;
+  }
+
+  // the socket is released with the connection descriptor, another thread may still send
+  if (wsConnectionDesc->wsType ==
+      WS_TYPE_SERVER) // in client mode the connection descriptor is not allocated
+    refcnt_unref(wsConnectionDesc);
+}
+
+/**
+ * \brief Gets called when a message was received on the websocket
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+callOnMessage(struct websocket_connection_desc *wsConnectionDesc)
+{
+  switch (wsConnectionDesc->wsType) {
+  case WS_TYPE_SERVER: {
+    if (wsConnectionDesc->wsDesc.wsServerDesc->ws_onMessage) {
+      wsConnectionDesc->wsDesc.wsServerDesc
+        ->ws_onMessage(wsConnectionDesc->wsDesc.wsServerDesc->wsSocketUserData, wsConnectionDesc,
+                       wsConnectionDesc->connectionUserData, wsConnectionDesc->lastMessage.dataType,
+                       wsConnectionDesc->lastMessage.data, wsConnectionDesc->lastMessage.len);
+    }
+  } break;
+
+  case WS_TYPE_CLIENT: {
+    if (wsConnectionDesc->wsDesc.wsClientDesc->ws_onMessage) {
+      wsConnectionDesc->wsDesc.wsClientDesc
+        ->ws_onMessage(wsConnectionDesc->wsDesc.wsClientDesc->wsUserData, wsConnectionDesc,
+                       wsConnectionDesc->connectionUserData, wsConnectionDesc->lastMessage.dataType,
+                       wsConnectionDesc->lastMessage.data, wsConnectionDesc->lastMessage.len);
+    }
+  } break;
+  }
+}
+
+//! the time reading is paused while the receive queue is full (checked again afterwards)
+#define RECV_QUEUE_PAUSE_MS 5
+
+/**
+ * \brief Checks if a received frame completes a message that goes into the receive queue of
+ *        the server
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *header Pointer to the header of the frame
+ * \param len The length of the received data
+ *
+ * \return true if a slot of the receive queue is needed
+ */
+static bool
+needsRecvSlot(struct websocket_connection_desc *wsConnectionDesc, const struct ws_header *header,
+              size_t len)
+{
+  if ((wsConnectionDesc->wsType != WS_TYPE_SERVER) ||
+      !wsConnectionDesc->wsDesc.wsServerDesc->recvQueue || wsConnectionDesc->multiplexed)
+    return false;
+
+  if (!header->fin || (len < header->payloadStartOffset + header->payloadLength))
+    return false;
+
+  return (header->opcode == WS_OPCODE_TEXT) || (header->opcode == WS_OPCODE_BINARY) ||
+         (header->opcode == WS_OPCODE_CONTINUATION);
+}
+
+/**
+ * \brief Puts the received message into the receive queue of the server (into the slot that was
+ *        reserved before), the queue takes over the message buffer
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+static void
+queueMessage(struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct ws_message message;
+
+  refcnt_ref(wsConnectionDesc);
+  message.connection = wsConnectionDesc;
+  message.connectionUserData = wsConnectionDesc->connectionUserData;
+  message.dataType = wsConnectionDesc->lastMessage.dataType;
+  message.data = wsConnectionDesc->lastMessage.data;
+  message.len = wsConnectionDesc->lastMessage.len;
+  wsConnectionDesc->lastMessage.data = NULL;
+
+  msgQueue_push(wsConnectionDesc->wsDesc.wsServerDesc->recvQueue, &message);
+}
+
+//! the result of the inbound rate limit check of a frame
+enum ws_rate_state {
+  //! the frame can be processed
+  WS_RATE_STATE_OK,
+  //! reading has to be paused (the frame stays in the buffer)
+  WS_RATE_STATE_PAUSE,
+  //! the frame has to be dropped
+  WS_RATE_STATE_DROP,
+};
+
+//! the maximum time reading is paused at once (the limit is checked again afterwards)
+#define RATE_LIMIT_MAX_PAUSE_MS 1000
+
+/**
+ * \brief Checks a received frame against the rate limits of the connection and the endpoint
+ *        and takes the tokens if it's within the limits
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor (server only)
+ * \param *header Pointer to the header of the frame (the frame must be received completely)
+ * \param *pauseMs Pointer to where the time to pause is stored (WS_RATE_STATE_PAUSE)
+ *
+ * \return The state that indicates how the frame has to be handled
+ */
+static enum ws_rate_state
+checkRateLimit(struct websocket_connection_desc *wsConnectionDesc, const struct ws_header *header,
+               int *pauseMs)
+{
+  struct websocket_server_desc *wsDesc = wsConnectionDesc->wsDesc.wsServerDesc;
+  double bytes = header->payloadStartOffset + header->payloadLength;
+  double msgs = header->opcode == WS_OPCODE_CONTINUATION ? 0 : 1;
+  enum ws_rate_limit_action action;
+  int connWait, endpointWait;
+
+  // close frames always get through so the closing handshake can complete
+  if (header->opcode == WS_OPCODE_DISCONNECT)
+    return WS_RATE_STATE_OK;
+
+  if (wsConnectionDesc->dropping && (header->opcode == WS_OPCODE_CONTINUATION)) {
+    wsConnectionDesc->dropping = !header->fin;
+    return WS_RATE_STATE_DROP;
+  }
+
+  connWait = tokenBucket_wait(&wsConnectionDesc->msgBucket, msgs);
+  if (!connWait)
+    connWait = tokenBucket_wait(&wsConnectionDesc->byteBucket, bytes);
+
+  pthread_mutex_lock(&wsDesc->rateMutex);
+  endpointWait = tokenBucket_wait(&wsDesc->endpointMsgBucket, msgs);
+  if (!endpointWait)
+    endpointWait = tokenBucket_wait(&wsDesc->endpointByteBucket, bytes);
+  if (!connWait && !endpointWait) {
+    tokenBucket_take(&wsDesc->endpointMsgBucket, msgs);
+    tokenBucket_take(&wsDesc->endpointByteBucket, bytes);
+  } else {
+    wsDesc->rateLimited++;
+  }
+  pthread_mutex_unlock(&wsDesc->rateMutex);
+
+  if (!connWait && !endpointWait) {
+    tokenBucket_take(&wsConnectionDesc->msgBucket, msgs);
+    tokenBucket_take(&wsConnectionDesc->byteBucket, bytes);
+    return WS_RATE_STATE_OK;
+  }
+
+  // if both limits are exceeded the stricter action is taken
+  if (!endpointWait)
+    action = wsConnectionDesc->rateLimit.action;
+  else if (!connWait)
+    action = wsDesc->endpointRateLimit.action;
+  else
+    action = wsConnectionDesc->rateLimit.action > wsDesc->endpointRateLimit.action
+               ? wsConnectionDesc->rateLimit.action
+               : wsDesc->endpointRateLimit.action;
+
+  switch (action) {
+  case WS_RATE_LIMIT_PAUSE:
+    *pauseMs = connWait > endpointWait ? connWait : endpointWait;
+    if (*pauseMs > RATE_LIMIT_MAX_PAUSE_MS)
+      *pauseMs = RATE_LIMIT_MAX_PAUSE_MS;
+    return WS_RATE_STATE_PAUSE;
+
+  case WS_RATE_LIMIT_DROP:
+    // a message that is dropped partly is dropped completely
+    if (header->opcode == WS_OPCODE_CONTINUATION) {
+      free(wsConnectionDesc->lastMessage.data);
+      wsConnectionDesc->lastMessage.data = NULL;
+      wsConnectionDesc->lastMessage.len = 0;
+      wsConnectionDesc->lastMessage.firstReceived = false;
+      wsConnectionDesc->timeout.tv_sec = 0;
+      wsConnectionDesc->timeout.tv_nsec = 0;
+    }
+    if ((header->opcode == WS_OPCODE_TEXT) || (header->opcode == WS_OPCODE_BINARY) ||
+        (header->opcode == WS_OPCODE_CONTINUATION))
+      wsConnectionDesc->dropping = !header->fin;
+    return WS_RATE_STATE_DROP;
+
+  case WS_RATE_LIMIT_CLOSE:
+  default:
+    ezwebsocket_log(EZLOG_DEBUG, "rate limit exceeded closing connection\n");
+    websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_POLICY_VIOLATION);
+    return WS_RATE_STATE_DROP;
+  }
+}
+
+/**
+ * \brief Turns the given connection into a http/2 connection that carries websockets
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *socketConnectionDesc The descriptor of the underlying socket
+ * \param *msg Pointer to the received data (starts with the connection preface)
+ * \param len The length of msg
+ *
+ * \return the amount of bytes read
+ */
+static size_t
+openHttp2Session(struct websocket_connection_desc *wsConnectionDesc,
+                 struct socket_connection_desc *socketConnectionDesc, void *msg, size_t len)
+{
+  wsConnectionDesc->h2Session = http2_open(wsConnectionDesc->wsDesc.wsServerDesc->h2Callbacks,
+                                           wsConnectionDesc, socketConnectionDesc);
+  if (!wsConnectionDesc->h2Session) {
+    ezwebsocket_log(EZLOG_ERROR, "http2_open failed\n");
+    socketServer_closeConnection(socketConnectionDesc);
+    return len;
+  }
+
+  return http2_process(wsConnectionDesc->h2Session, msg, len);
+}
+
+//! the maximum number of frames that are scanned at once
+#define WS_SCAN_BATCH 32
+//! the known opcodes as bit mask
+#define WS_VALID_OPCODES                                                                           \
+  ((1 << WS_OPCODE_CONTINUATION) | (1 << WS_OPCODE_TEXT) | (1 << WS_OPCODE_BINARY) |               \
+   (1 << WS_OPCODE_DISCONNECT) | (1 << WS_OPCODE_PING) | (1 << WS_OPCODE_PONG))
+
+//! a complete frame that was found by scanFrames
+struct ws_frame_desc {
+  //! the offset of the frame in the buffer
+  size_t offset;
+  //! the parsed header
+  struct ws_header header;
+};
+
+/**
+ * \brief Walks over the received data once and collects the complete frames
+ *        (frames with a 64 bit length and invalid headers end the scan, they are handled by
+ *        parseWebsocketHeader)
+ *
+ * \param *data Pointer to the received data
+ * \param len The length of the data
+ * \param[out] *frames Pointer to where the frames should be written to
+ * \param max The maximum number of frames
+ *
+ * \return The number of frames
+ */
+static size_t
+scanFrames(const unsigned char *data, size_t len, struct ws_frame_desc *frames, size_t max)
+{
+  const unsigned char *frame;
+  struct ws_header *header;
+  size_t count = 0;
+  size_t offset = 0;
+  size_t headerLength;
+  size_t payloadLength;
+
+  while ((count < max) && (len - offset >= 2)) {
+    frame = &data[offset];
+    if ((frame[0] & 0x70) || !((WS_VALID_OPCODES >> (frame[0] & 0x0F)) & 1))
+      break;
+
+    // the 7 bit length is the fast path for small frames
+    payloadLength = frame[1] & 0x7F;
+    headerLength = 2;
+    if (payloadLength == EXTENDED_16BIT_PAYLOAD_LENGTH) {
+      if (len - offset < 4)
+        break;
+      payloadLength = (frame[2] << 8) | frame[3];
+      headerLength = 4;
+    } else if (payloadLength == EXTENDED_64BIT_PAYLOAD_LENGTH) {
+      break;
+    }
+    if (frame[1] & 0x80)
+      headerLength += 4;
+    if (len - offset < headerLength + payloadLength)
+      break;
+
+    header = &frames[count].header;
+    header->fin = (frame[0] & 0x80) ? true : false;
+    header->opcode = frame[0] & 0x0F;
+    header->masked = (frame[1] & 0x80) ? true : false;
+    if (header->masked)
+      memcpy(header->mask, &frame[headerLength - 4], sizeof(header->mask));
+    header->payloadLength = payloadLength;
+    header->payloadStartOffset = headerLength;
+    frames[count].offset = offset;
+    count++;
+    offset += headerLength + payloadLength;
+  }
+
+  return count;
+}
+
+/**
+ * \brief Processes a websocket frame of a connected websocket
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *socketConnectionDesc The descriptor of the underlying socket
+ * \param *msg Pointer to the frame
+ * \param len The length of the received data (including the data after the frame)
+ * \param *wsHeader Pointer to the parsed header of the frame
+ *
+ * \return the amount of bytes read
+ */
+static size_t
+processFrame(struct websocket_connection_desc *wsConnectionDesc, void *socketConnectionDesc,
+             void *msg, size_t len, struct ws_header *wsHeader)
+{
+  struct msg_queue *recvQueue = NULL;
+  enum ws_msg_state state;
+  struct timespec now;
+  int pauseMs;
+
+  // the rate limit is checked before anything is copied or dispatched
+  if ((wsConnectionDesc->wsType == WS_TYPE_SERVER) &&
+      (len >= wsHeader->payloadStartOffset + wsHeader->payloadLength)) {
+    switch (checkRateLimit(wsConnectionDesc, wsHeader, &pauseMs)) {
+    case WS_RATE_STATE_PAUSE:
+      // a http/2 stream is paused on its own, it holds back its window until it's resumed
+      if (wsConnectionDesc->h2Stream)
+        http2_pauseStream(wsConnectionDesc->h2Stream, pauseMs);
+      else
+        socketServer_pauseReading(socketConnectionDesc, pauseMs);
+      return 0;
+
+    case WS_RATE_STATE_DROP:
+      return wsHeader->payloadLength + wsHeader->payloadStartOffset;
+
+    case WS_RATE_STATE_OK:
+      break;
+    }
+  }
+
+  // proxy mode: the frame is forwarded without reassembly (unmasked frames from clients
+  // take the regular path that rejects them)
+  if (wsConnectionDesc->relayPeer &&
+      (wsHeader->masked || (wsConnectionDesc->wsType != WS_TYPE_SERVER))) {
+    if (len < wsHeader->payloadStartOffset + wsHeader->payloadLength)
+      return 0;
+    if (relayFrame(wsConnectionDesc, msg, wsHeader) == 0)
+      return wsHeader->payloadLength + wsHeader->payloadStartOffset;
+  }
+
+  // a message is only taken from the buffer if there's space for it in the receive queue
+  if (needsRecvSlot(wsConnectionDesc, wsHeader, len)) {
+    recvQueue = wsConnectionDesc->wsDesc.wsServerDesc->recvQueue;
+    if (!msgQueue_reserve(recvQueue)) {
+      if (wsConnectionDesc->h2Stream)
+        http2_pauseStream(wsConnectionDesc->h2Stream, RECV_QUEUE_PAUSE_MS);
+      else
+        socketServer_pauseReading(socketConnectionDesc, RECV_QUEUE_PAUSE_MS);
+      return 0;
+    }
+  }
+
+  state = parseMessage(wsConnectionDesc, msg, len, wsHeader);
+  if (recvQueue && (state != WS_MSG_STATE_USER_DATA))
+    msgQueue_unreserve(recvQueue);
+
+  switch (state) {
+  case WS_MSG_STATE_NO_USER_DATA:
+    wsConnectionDesc->timeout.tv_nsec = 0;
+    wsConnectionDesc->timeout.tv_sec = 0;
+    return wsHeader->payloadLength + wsHeader->payloadStartOffset;
+
+  case WS_MSG_STATE_USER_DATA:
+    if (wsConnectionDesc->multiplexed)
+      dispatchChannelMessage(wsConnectionDesc);
+    else if (recvQueue)
+      queueMessage(wsConnectionDesc);
+    else if (!wsConnectionDesc->resumable || takeSessionSeq(wsConnectionDesc))
+      callOnMessage(wsConnectionDesc);
+    if (wsConnectionDesc->lastMessage.data)
+      refcnt_unref(wsConnectionDesc->lastMessage.data);
+    wsConnectionDesc->lastMessage.data = NULL;
+    wsConnectionDesc->lastMessage.complete = false;
+    wsConnectionDesc->lastMessage.firstReceived = false;
+    wsConnectionDesc->lastMessage.len = 0;
+    wsConnectionDesc->timeout.tv_nsec = 0;
+    wsConnectionDesc->timeout.tv_sec = 0;
+    return wsHeader->payloadLength + wsHeader->payloadStartOffset;
+
+  case WS_MSG_STATE_INCOMPLETE:
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (wsConnectionDesc->timeout.tv_sec == (wsConnectionDesc->timeout.tv_nsec == 0)) {
+      wsConnectionDesc->timeout = now;
+    } else if (wsConnectionDesc->timeout.tv_sec > now.tv_sec + MESSAGE_TIMEOUT_S) {
+      free(wsConnectionDesc->lastMessage.data);
+      wsConnectionDesc->lastMessage.data = NULL;
+      wsConnectionDesc->lastMessage.len = 0;
+      wsConnectionDesc->lastMessage.complete = 0;
+      wsConnectionDesc->timeout.tv_sec = 0;
+      wsConnectionDesc->timeout.tv_nsec = 0;
+      ezwebsocket_log(EZLOG_ERROR, "message timeout");
+      return len;
+    }
+    return 0;
+
+  case WS_MSG_STATE_ERROR:
+    if (wsConnectionDesc->lastMessage.data && wsConnectionDesc->lastMessage.complete)
+      refcnt_unref(wsConnectionDesc->lastMessage.data);
+    else
+      free(wsConnectionDesc->lastMessage.data);
+    wsConnectionDesc->lastMessage.data = NULL;
+    wsConnectionDesc->lastMessage.len = 0;
+    wsConnectionDesc->lastMessage.complete = 0;
+    wsConnectionDesc->timeout.tv_sec = 0;
+    wsConnectionDesc->timeout.tv_nsec = 0;
+    return len;
+
+  default:
+    ezwebsocket_log(EZLOG_ERROR, "unexpected return value\n");
+    return len;
+  }
+}
+
+/**
+ * \brief Processes the frames that were found by scanFrames
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *socketConnectionDesc The descriptor of the underlying socket
+ * \param *msg Pointer to the buffer containing the data
+ * \param len The length of msg
+ * \param *frames Pointer to the frames
+ * \param count The number of frames (at least 1)
+ *
+ * \return the amount of bytes read
+ */
+static size_t
+processFrames(struct websocket_connection_desc *wsConnectionDesc, void *socketConnectionDesc,
+              unsigned char *msg, size_t len, const struct ws_frame_desc *frames, size_t count)
+{
+  struct ws_header header;
+  size_t frameLength = 0;
+  size_t consumed;
+  size_t i;
+
+  // every frame after the first one uses up the read budget of the server
+  if ((count > 1) && (wsConnectionDesc->wsType == WS_TYPE_SERVER) && !wsConnectionDesc->h2Stream)
+    count = 1 + socketServer_takeReadBudget(socketConnectionDesc, count - 1);
+
+  for (i = 0; i < count; i++) {
+    header = frames[i].header;
+    frameLength = header.payloadStartOffset + header.payloadLength;
+    consumed = processFrame(wsConnectionDesc, socketConnectionDesc, &msg[frames[i].offset],
+                            len - frames[i].offset, &header);
+    if ((consumed != frameLength) || ((wsConnectionDesc->state != WS_STATE_CONNECTED) &&
+                                      (wsConnectionDesc->state != WS_STATE_CLOSING)))
+      return frames[i].offset + consumed;
+  }
+
+  return frames[count - 1].offset + frameLength;
+}
+
+/**
+ * \brief Function that gets called when a message arrives at the socket server
+ *
+ * \param *socketUserData In this case this is the websocket descriptor
+ * \param *socketConnectionDesc The descriptor of the underlying socket
+ * \param *connectionDescriptor The websocket connection descriptor
+ * \param *msg Pointer to the buffer containing the data
+ * \param len The length of msg
+ *
+ * \return the amount of bytes read
+ *
+ */
+static size_t
+websocket_onMessage(void *socketUserData, void *socketConnectionDesc, void *connectionDescriptor,
+                    void *msg, size_t len)
+{
+  struct websocket_connection_desc *wsConnectionDesc = connectionDescriptor;
+  struct ws_frame_desc frames[WS_SCAN_BATCH];
+  struct ws_header wsHeader = { 0 };
+  size_t count;
+
+  char key[WS_HS_KEY_LEN];
+  char *replyKey;
+  size_t consumed;
+
+  if (socketConnectionDesc == NULL) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): socketConnectionDesc must not be NULL!\n", __func__);
+    return 0;
+  }
+
+  if (wsConnectionDesc == NULL) {
+    // servers with ws_onUpgradeRequest allocate the connection once the upgrade is accepted
+    struct websocket_server_desc *wsDesc = socketUserData;
+
+    if (!wsDesc || !wsDesc->ws_onUpgradeRequest) {
+      ezwebsocket_log(EZLOG_ERROR, "%s(): wsConnectionDesc must not be NULL!\n", __func__);
+      return 0;
+    }
+
+    wsConnectionDesc = checkUpgradeRequest(wsDesc, socketConnectionDesc, msg, len, &consumed);
+    if (!wsConnectionDesc)
+      return consumed;
+  }
+
+  if (wsConnectionDesc->h2Session)
+    return http2_process(wsConnectionDesc->h2Session, msg, len);
+
+  switch (wsConnectionDesc->state) {
+  case WS_STATE_HANDSHAKE:
+    switch (wsConnectionDesc->wsType) {
+    case WS_TYPE_SERVER:
+      if (wsConnectionDesc->wsDesc.wsServerDesc->h2Callbacks) {
+        // prior knowledge http/2 (h2c) carrying websockets (RFC 8441)
+        switch (http2_checkPreface(msg, len)) {
+        case 0:
+          return 0;
+
+        case 1:
+          return openHttp2Session(wsConnectionDesc, socketConnectionDesc, msg, len);
+
+        default:
+          break;
+        }
+      }
+
+      if (parseHttpHeader(msg, len, key) == 0) {
+        struct websocket_server_desc *wsDesc = socketUserData;
+
+        replyKey = calculateSecWebSocketAccept(key);
+        if (replyKey == NULL) {
+          ezwebsocket_log(EZLOG_ERROR, "%s(): calculateSecWebSocketAccept failed!\n", __func__);
+          return 0;
+        }
+
+        ezwebsocket_log(EZLOG_DEBUG, "%s() replyKey:%s\n", __func__, replyKey);
+
+        if (wsDesc->channels && hasWsProtocol(msg, len, WS_CHANNEL_PROTOCOL)) {
+          wsConnectionDesc->channels = calloc(WS_CHANNEL_MAX + 1,
+                                              sizeof(struct websocket_channel *));
+          wsConnectionDesc->multiplexed = (wsConnectionDesc->channels != NULL);
+        }
+
+        if (wsDesc->resumable && !wsConnectionDesc->multiplexed &&
+            hasWsProtocol(msg, len, WS_RESUME_PROTOCOL)) {
+          if (openSession(wsConnectionDesc, socketConnectionDesc, replyKey, msg, len) < 0) {
+            free(replyKey);
+            closeTransport(wsConnectionDesc);
+            return len;
+          }
+        } else {
+          sendWsHandshakeReply(socketConnectionDesc, replyKey,
+                               wsConnectionDesc->multiplexed ? WS_CHANNEL_PROTOCOL_HEADER : "");
+        }
+
+        free(replyKey);
+        wsConnectionDesc->state = WS_STATE_CONNECTED;
+        if (wsDesc->ws_onOpen != NULL)
+          wsConnectionDesc->connectionUserData = wsDesc->ws_onOpen(wsDesc->wsSocketUserData, wsDesc,
+                                                                   wsConnectionDesc);
+
+        if (wsDesc->ws_onOpenLegacy != NULL)
+          wsConnectionDesc->connectionUserData = wsDesc->ws_onOpenLegacy(wsDesc, wsConnectionDesc);
+      } else {
+        ezwebsocket_log(EZLOG_ERROR, "parseHttpHeader failed\n");
+      }
+      break;
+
+    case WS_TYPE_CLIENT:
+      if (checkWsHandshakeReply(wsConnectionDesc, msg, &len)) {
+        struct websocket_client_desc *wsDesc = wsConnectionDesc->wsDesc.wsClientDesc;
+
+        wsConnectionDesc->state = WS_STATE_CONNECTED;
+        socketClient_setTimeout(socketConnectionDesc, -1);
+
+        if (wsDesc->ws_onOpen != NULL)
+          wsConnectionDesc->connectionUserData = wsDesc->ws_onOpen(wsDesc->wsUserData,
+                                                                   wsConnectionDesc);
+        else
+          wsConnectionDesc->connectionUserData = NULL;
+      } else {
+        ezwebsocket_log(EZLOG_ERROR, "checkWsHandshakeReply failed\n");
+      }
+      break;
+    }
+    return len;
+
+  case WS_STATE_CONNECTED:
+  case WS_STATE_CLOSING:
+    count = scanFrames(msg, len, frames, WS_SCAN_BATCH);
+    if (count)
+      return processFrames(wsConnectionDesc, socketConnectionDesc, msg, len, frames, count);
+
+    switch (parseWebsocketHeader(msg, len, &wsHeader)) {
+    case -1:
+      ezwebsocket_log(EZLOG_ERROR, "couldn't parse header\n");
+      websocket_closeConnection(wsConnectionDesc, WS_CLOSE_CODE_PROTOCOL_ERROR);
+      return len;
+
+    case 0:
+      return 0;
+      break;
+
+    case 1:
+      break;
+    }
+    printWsHeader(&wsHeader);
+
+    return processFrame(wsConnectionDesc, socketConnectionDesc, msg, len, &wsHeader);
+
+  case WS_STATE_CLOSED:
+    ezwebsocket_log(EZLOG_ERROR, "websocket closed ignoring message\n");
+    return len;
+
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+//! the upgrade request of a http/2 stream that is built by appendStreamHeader
+struct ws_stream_request {
+  //! the buffer (NULL => only the length is counted)
+  char *buffer;
+  //! the length of the request
+  size_t len;
+};
+
+/**
+ * \brief Appends a request header of a http/2 stream to the upgrade request (the pseudo
+ *        headers are skipped)
+ *
+ * \param *ctx Pointer to the request (struct ws_stream_request)
+ * \param *name The header name
+ * \param *value The header value
+ */
+static void
+appendStreamHeader(void *ctx, const char *name, const char *value)
+{
+  struct ws_stream_request *request = ctx;
+  size_t nameLen = strlen(name);
+  size_t valueLen = strlen(value);
+
+  // a line break in a header would fake further headers
+  if ((name[0] == ':') || strpbrk(name, "\r\n") || strpbrk(value, "\r\n"))
+    return;
+
+  if (request->buffer) {
+    memcpy(&request->buffer[request->len], name, nameLen);
+    memcpy(&request->buffer[request->len + nameLen], ": ", 2);
+    memcpy(&request->buffer[request->len + nameLen + 2], value, valueLen);
+    memcpy(&request->buffer[request->len + nameLen + 2 + valueLen], "\r\n", 2);
+  }
+  request->len += nameLen + valueLen + 4;
+}
+
+/**
+ * \brief Passes the extended CONNECT request of a http/2 stream to ws_onUpgradeRequest, the
+ *        request line is "CONNECT <:path> HTTP/2" and :authority is passed as host header
+ *
+ * \param *wsDesc Pointer to the websocket server descriptor
+ * \param *socketConnectionDesc The connection descriptor of the socket
+ * \param *stream The http/2 stream
+ *
+ * \return 0 if successful else -1
+ */
+static int
+startStreamUpgrade(struct websocket_server_desc *wsDesc,
+                   struct socket_connection_desc *socketConnectionDesc,
+                   struct http2_stream *stream)
+{
+  struct ws_stream_request request = { 0 };
+  const char *path = http2_getHeader(stream, ":path");
+  const char *authority = http2_getHeader(stream, ":authority");
+  const char *format;
+  size_t headLen;
+  int rc;
+
+  if (authority && strpbrk(authority, "\r\n"))
+    authority = NULL;
+  format = authority ? "CONNECT %s HTTP/2\r\nhost: %s\r\n" : "CONNECT %s HTTP/2\r\n";
+
+  // the length is counted first
+  headLen = snprintf(NULL, 0, format, path, authority);
+  request.len = headLen;
+  http2_forEachHeader(stream, appendStreamHeader, &request);
+  request.buffer = malloc(request.len + 3);
+  if (!request.buffer) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    return -1;
+  }
+
+  snprintf(request.buffer, headLen + 1, format, path, authority);
+  request.len = headLen;
+  http2_forEachHeader(stream, appendStreamHeader, &request);
+  memcpy(&request.buffer[request.len], "\r\n", 2);
+  request.len += 2;
+
+  rc = startUpgrade(wsDesc, socketConnectionDesc, stream, request.buffer, request.len);
+  free(request.buffer);
+
+  return rc;
+}
+
+/**
+ * \brief Rejects the upgrade request of a http/2 stream with the given status
+ *
+ * \param *stream The http/2 stream
+ * \param status The http status (400 - 599, else 403 is used)
+ */
+static void
+rejectStreamUpgrade(struct http2_stream *stream, int status)
+{
+  if ((status < 400) || (status > 599))
+    status = 403;
+  http2_rejectStream(stream, status);
+}
+
+/**
+ * \brief Accepts the websocket of a http/2 stream and calls ws_onOpen
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor of the stream
+ *
+ * \return 0 if successful else -1
+ */
+static int
+acceptStreamConnection(struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct websocket_server_desc *wsDesc = wsConnectionDesc->wsDesc.wsServerDesc;
+  struct http2_stream *stream = wsConnectionDesc->h2Stream;
+  const char *protocols;
+
+  protocols = http2_getHeader(stream, "sec-websocket-protocol");
+  if (wsDesc->channels && protocols &&
+      hasProtocolToken(protocols, protocols + strlen(protocols), WS_CHANNEL_PROTOCOL)) {
+    wsConnectionDesc->channels = calloc(WS_CHANNEL_MAX + 1, sizeof(struct websocket_channel *));
+    wsConnectionDesc->multiplexed = (wsConnectionDesc->channels != NULL);
+  }
+
+  if (http2_acceptStream(stream, wsConnectionDesc->multiplexed ? WS_CHANNEL_PROTOCOL : NULL) < 0)
+    return -1;
+
+  wsConnectionDesc->state = WS_STATE_CONNECTED;
+  if (wsDesc->ws_onOpen != NULL)
+    wsConnectionDesc->connectionUserData = wsDesc->ws_onOpen(wsDesc->wsSocketUserData, wsDesc,
+                                                             wsConnectionDesc);
+
+  if (wsDesc->ws_onOpenLegacy != NULL)
+    wsConnectionDesc->connectionUserData = wsDesc->ws_onOpenLegacy(wsDesc, wsConnectionDesc);
+
+  return 0;
+}
+
+/**
+ * \brief Function that gets called when a websocket is requested on a http/2 stream
+ *        (extended CONNECT, RFC 8441), the stream stays in the handshake state while
+ *        ws_onUpgradeRequest is pending
+ *
+ * \param *userData The websocket connection descriptor of the http/2 connection
+ * \param *stream The http/2 stream
+ *
+ * \return Pointer to the websocket connection descriptor of the stream or NULL to refuse it
+ */
+static void *
+http2_onStreamOpen(void *userData, struct http2_stream *stream)
+{
+  struct websocket_connection_desc *carrier = userData;
+  struct websocket_server_desc *wsDesc = carrier->wsDesc.wsServerDesc;
+  struct websocket_connection_desc *wsConnectionDesc;
+  enum ws_upgrade_verdict verdict = WS_UPGRADE_REJECT;
+  const char *version;
+  const char *path;
+  int status = 503;
+
+  version = http2_getHeader(stream, "sec-websocket-version");
+  if (!version || strcmp(version, "13")) {
+    ezwebsocket_log(EZLOG_ERROR, "unsupported websocket version\n");
+    return NULL;
+  }
+
+  wsConnectionDesc = refcnt_allocate(sizeof(struct websocket_connection_desc), destroyConnection);
+  if (!wsConnectionDesc) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return NULL;
+  }
+  memset(wsConnectionDesc, 0, sizeof(struct websocket_connection_desc));
+  pthread_mutex_init(&wsConnectionDesc->channelMutex, NULL);
+  pthread_mutex_init(&wsConnectionDesc->outboxMutex, NULL);
+  wsConnectionDesc->wsType = WS_TYPE_SERVER;
+  refcnt_ref(carrier->socketClientDesc);
+  wsConnectionDesc->socketClientDesc = carrier->socketClientDesc;
+  refcnt_ref(stream);
+  wsConnectionDesc->h2Stream = stream;
+  wsConnectionDesc->state = WS_STATE_HANDSHAKE;
+  wsConnectionDesc->wsDesc.wsServerDesc = wsDesc;
+  websocket_setRateLimit(wsConnectionDesc, &wsDesc->rateLimit);
+
+  if (wsDesc->ws_onUpgradeRequest) {
+    path = http2_getHeader(stream, ":path");
+    if (!path || strpbrk(path, " \r\n")) {
+      status = 400;
+    } else if (startStreamUpgrade(wsDesc, carrier->socketClientDesc, stream) == 0) {
+      // a pending request is taken by http2_onStreamData once the stream is resumed
+      if (takeUpgrade(wsDesc, carrier->socketClientDesc, stream, &verdict, &status) == 0)
+        return wsConnectionDesc;
+    }
+
+    if (verdict != WS_UPGRADE_ACCEPT) {
+      rejectStreamUpgrade(stream, status);
+      goto REFUSE;
+    }
+  }
+
+  if (acceptStreamConnection(wsConnectionDesc) < 0)
+    goto REFUSE;
+
+  return wsConnectionDesc;
+
+REFUSE:
+  refcnt_unref(wsConnectionDesc->socketClientDesc);
+  wsConnectionDesc->socketClientDesc = NULL;
+  refcnt_unref(wsConnectionDesc);
+  return NULL;
+}
+
+/**
+ * \brief Function that gets called when data arrives on a http/2 stream
+ *
+ * \param *userData The websocket connection descriptor of the http/2 connection
+ * \param *stream The http/2 stream
+ * \param *streamUserData The websocket connection descriptor of the stream
+ * \param *data Pointer to the data
+ * \param len The length of the data
+ *
+ * \return the amount of bytes read
+ */
+static size_t
+http2_onStreamData(void *userData, struct http2_stream *stream, void *streamUserData, void *data,
+                   size_t len)
+{
+  struct websocket_connection_desc *wsConnectionDesc = streamUserData;
+  struct websocket_server_desc *wsDesc = wsConnectionDesc->wsDesc.wsServerDesc;
+  enum ws_upgrade_verdict verdict = WS_UPGRADE_REJECT;
+  int status = 503;
+  (void) userData;
+
+  // the stream is resumed once the verdict of its upgrade request is known (or it timed out)
+  if (wsConnectionDesc->state == WS_STATE_HANDSHAKE) {
+    if (takeUpgrade(wsDesc, wsConnectionDesc->socketClientDesc, stream, &verdict, &status) == 0)
+      return 0;
+
+    if (verdict != WS_UPGRADE_ACCEPT) {
+      rejectStreamUpgrade(stream, status);
+      return len;
+    }
+
+    if (acceptStreamConnection(wsConnectionDesc) < 0) {
+      http2_rejectStream(stream, 503);
+      return len;
+    }
+  }
+
+  if (!len)
+    return 0;
+
+  return websocket_onMessage(wsDesc, wsConnectionDesc->socketClientDesc, wsConnectionDesc, data,
+                             len);
+}
+
+/**
+ * \brief Function that gets called when a http/2 stream is closed
+ *
+ * \param *userData The websocket connection descriptor of the http/2 connection
+ * \param *stream The http/2 stream
+ * \param *streamUserData The websocket connection descriptor of the stream
+ */
+static void
+http2_onStreamClose(void *userData, struct http2_stream *stream, void *streamUserData)
+{
+  struct websocket_connection_desc *wsConnectionDesc = streamUserData;
+  (void) userData;
+  (void) stream;
+
+  websocket_onClose(wsConnectionDesc->wsDesc.wsServerDesc, wsConnectionDesc->socketClientDesc,
+                    wsConnectionDesc);
+}
+
+/**
+ * \brief Function that gets called when the http/2 session sends data
+ *
+ * \param *transport The socket connection descriptor
+ * \param *iov Pointer to the buffers
+ * \param iovcnt The number of buffers
+ *
+ * \return 0 if successful, 1 if the pacing queue is full or -1 in case of error
+ */
+static int
+http2_onSend(void *transport, const struct iovec *iov, size_t iovcnt)
+{
+  if (socketServer_sendv(transport, iov, iovcnt) == 0)
+    return 0;
+
+  return errno == EAGAIN ? 1 : -1;
+}
+
+/**
+ * \brief Function that gets called when the http/2 session closes the connection
+ *
+ * \param *transport The socket connection descriptor
+ */
+static void
+http2_onClose(void *transport)
+{
+  socketServer_closeConnection(transport);
+}
+
+/**
+ * \brief Function that gets called when the http/2 session wants http2_wakeup to be called
+ *
+ * \param *transport The socket connection descriptor
+ * \param timeoutMs The time in milliseconds
+ */
+static void
+http2_onWakeup(void *transport, int timeoutMs)
+{
+  socketServer_wakeup(transport, timeoutMs);
+}
+
+//! the callbacks of the http/2 sessions
+static const struct http2_callbacks http2Callbacks = {
+  .onStreamOpen = http2_onStreamOpen,
+  .onStreamData = http2_onStreamData,
+  .onStreamClose = http2_onStreamClose,
+  .send = http2_onSend,
+  .close = http2_onClose,
+  .wakeup = http2_onWakeup,
+};
+
+/**
+ * \brief Sends binary or text data through websockets
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return 0 if successful else -1
+ *
+ */
+int
+websocket_sendData(struct websocket_connection_desc *wsConnectionDesc, enum ws_data_type dataType,
+                   const void *msg, size_t len)
+{
+  unsigned char opcode;
+  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return -1;
+
+  switch (dataType) {
+  case WS_DATA_TYPE_BINARY:
+    opcode = WS_OPCODE_BINARY;
+    break;
+
+  case WS_DATA_TYPE_TEXT:
+    opcode = WS_OPCODE_TEXT;
+    break;
+
+  default:
+    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
+    return -1;
+  }
+
+  if (wsConnectionDesc->session)
+    return sendSessionMessage(wsConnectionDesc, opcode, msg, len);
+
+  return sendDataLowLevel(wsConnectionDesc, opcode, true, masked, msg, len);
+}
+
+//! the number of buffers that websocket_sendDataV passes on the stack (more are allocated)
+#define WS_SENDV_STACK_IOV 16
+
+/**
+ * \brief Sends an unmasked frame whose payload is spread over several buffers, the buffers are
+ *        passed to the transport behind the header without copying them
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param opcode The opcode to use
+ * \param *iov Pointer to the buffers of the payload
+ * \param iovcnt The number of buffers
+ * \param len The payload length (the sum of the buffer lengths)
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendFramev(struct websocket_connection_desc *wsConnectionDesc, enum ws_opcode opcode,
+           const struct iovec *iov, size_t iovcnt, size_t len)
+{
+  struct iovec stackVec[WS_SENDV_STACK_IOV + 1];
+  struct iovec *vec = stackVec;
+  unsigned char header[14]; // the maximum size of a websocket header is 14
+  int rc;
+
+  if (iovcnt > WS_SENDV_STACK_IOV) {
+    vec = malloc((iovcnt + 1) * sizeof(struct iovec));
+    if (!vec) {
+      ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+      return -1;
+    }
+  }
+
+  vec[0].iov_base = header;
+  vec[0].iov_len = createWebsocketHeader(header, opcode, true, false, 0, len);
+  memcpy(&vec[1], iov, iovcnt * sizeof(struct iovec));
+  rc = sendRawv(wsConnectionDesc, vec, iovcnt + 1);
+
+  if (vec != stackVec)
+    free(vec);
+
+  return rc;
+}
+
+/**
+ * \brief Sends a masked frame whose payload is spread over several buffers, the buffers are
+ *        masked in one pass while they are copied behind the header
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param opcode The opcode to use
+ * \param *iov Pointer to the buffers of the payload
+ * \param iovcnt The number of buffers
+ * \param len The payload length (the sum of the buffer lengths)
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendMaskedFramev(struct websocket_connection_desc *wsConnectionDesc, enum ws_opcode opcode,
+                 const struct iovec *iov, size_t iovcnt, size_t len)
+{
+  unsigned char header[14]; // the maximum size of a websocket header is 14
+  unsigned char *sendBuffer;
+  unsigned long mask;
+  size_t headerLength;
+  size_t offset = 0;
+  size_t i;
+  int rc;
+
+  mask = random_u32();
+  headerLength = createWebsocketHeader(header, opcode, true, true, mask, len);
+
+  sendBuffer = malloc(headerLength + len);
+  if (!sendBuffer) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    return -1;
+  }
+  memcpy(sendBuffer, header, headerLength);
+  for (i = 0; i < iovcnt; i++) {
+    // the mask continues where the previous buffer ended
+    copyMasked(&sendBuffer[headerLength + offset], iov[i].iov_base, rotateMask(mask, offset),
+               iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+
+  rc = sendRaw(wsConnectionDesc, sendBuffer, headerLength + len);
+  free(sendBuffer);
+
+  return rc;
+}
+
+/**
+ * \brief Sends one binary or text message whose payload is spread over several buffers
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *iov Pointer to the buffers of the payload
+ * \param iovcnt The number of buffers
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocket_sendDataV(struct websocket_connection_desc *wsConnectionDesc,
+                    enum ws_data_type dataType, const struct iovec *iov, int iovcnt)
+{
+  unsigned char opcode;
+  unsigned char *msg;
+  size_t len = 0;
+  size_t offset;
+  int rc;
+  int i;
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return -1;
+
+  switch (dataType) {
+  case WS_DATA_TYPE_BINARY:
+    opcode = WS_OPCODE_BINARY;
+    break;
+
+  case WS_DATA_TYPE_TEXT:
+    opcode = WS_OPCODE_TEXT;
+    break;
+
+  default:
+    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
+    return -1;
+  }
+
+  if ((iovcnt < 0) || (iovcnt && !iov)) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): invalid buffers\n", __func__);
+    return -1;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    if (len + iov[i].iov_len < len) {
+      ezwebsocket_log(EZLOG_ERROR, "%s(): message too long\n", __func__);
+      return -1;
+    }
+    len += iov[i].iov_len;
+  }
+
+  // the frames of a session are kept for the replay so the payload is joined
+  if (wsConnectionDesc->session) {
+    msg = malloc(len ? len : 1);
+    if (!msg) {
+      ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+      return -1;
+    }
+    for (i = 0, offset = 0; i < iovcnt; offset += iov[i].iov_len, i++)
+      memcpy(&msg[offset], iov[i].iov_base, iov[i].iov_len);
+    rc = sendSessionMessage(wsConnectionDesc, opcode, msg, len);
+    free(msg);
+    return rc;
+  }
+
+  if (wsConnectionDesc->wsType == WS_TYPE_CLIENT)
+    return sendMaskedFramev(wsConnectionDesc, opcode, iov, iovcnt, len);
+
+  return sendFramev(wsConnectionDesc, opcode, iov, iovcnt, len);
+}
+
+/**
+ * \brief Sends fragmented binary or text data through websockets
+ *         use websocket_sendDataFragmetedCont for further fragments
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return 0 if successful else -1
+ *
+ */
+int
+websocket_sendDataFragmentedStart(struct websocket_connection_desc *wsConnectionDesc,
+                                  enum ws_data_type dataType, const void *msg, size_t len)
+{
+  unsigned char opcode;
+  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return -1;
+
+  // the messages of a session are replayed as a whole
+  if (wsConnectionDesc->session) {
+    ezwebsocket_log(EZLOG_ERROR, "resumable connections don't support fragmented messages\n");
+    return -1;
+  }
+
+  switch (dataType) {
+  case WS_DATA_TYPE_BINARY:
+    opcode = WS_OPCODE_BINARY;
+    break;
+
+  case WS_DATA_TYPE_TEXT:
+    opcode = WS_OPCODE_TEXT;
+    break;
+
+  default:
+    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
+    return -1;
+  }
+
+  return sendDataLowLevel(wsConnectionDesc, opcode, false, masked, msg, len);
+}
+
+/**
+ * \brief Continues a fragmented send
+ *         use sendDataFragmentedStop to stop the transmission
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param fin True => this is the last fragment else false
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return 0 if successful else -1
+ *
+ */
+int
+websocket_sendDataFragmentedCont(struct websocket_connection_desc *wsConnectionDesc, bool fin,
+                                 const void *msg, size_t len)
+{
+  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return -1;
+
+  return sendDataLowLevel(wsConnectionDesc, WS_OPCODE_CONTINUATION, fin, masked, msg, len);
+}
+
+/**
+ * \brief Closes the given websocket connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param code The closing code
+ */
+void
+websocket_closeConnection(struct websocket_connection_desc *wsConnectionDesc,
+                          enum ws_close_code code)
+{
+  unsigned char help[2];
+  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+
+  help[0] = (unsigned long) code >> 8;
+  help[1] = (unsigned long) code & 0xFF;
+
+  // in closing state the close frame was already sent
+  if (wsConnectionDesc->state != WS_STATE_CLOSING)
+    sendDataLowLevel(wsConnectionDesc, WS_OPCODE_DISCONNECT, true, masked, help, 2);
+
+  if (wsConnectionDesc->lastMessage.data && wsConnectionDesc->lastMessage.complete)
+    refcnt_unref(wsConnectionDesc->lastMessage.data);
+  else
+    free(wsConnectionDesc->lastMessage.data);
+
+  wsConnectionDesc->lastMessage.data = NULL;
+  wsConnectionDesc->lastMessage.len = 0;
+  wsConnectionDesc->lastMessage.complete = 0;
+
+  closeTransport(wsConnectionDesc);
+}
+
+/**
+ * \brief returns the user data of the given client
+ *
+ * \param *wsConnectionDesc Pointer to the websocket client descriptor
+ *
+ * \ŗeturn The user data of the given connection
+ *
+ */
+void *
+websocket_getConnectionUserData(struct websocket_connection_desc *wsConnectionDesc)
+{
+  return wsConnectionDesc->connectionUserData;
+}
+
+/**
+ * \brief Changes the inbound rate limit of the given server connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *rateLimit Pointer to the new limit (the buckets start full)
+ *
+ * \return 0 if successful else -1 (not a server connection)
+ */
+int
+websocket_setRateLimit(struct websocket_connection_desc *wsConnectionDesc,
+                       const struct ws_rate_limit *rateLimit)
+{
+  if (wsConnectionDesc->wsType != WS_TYPE_SERVER)
+    return -1;
+
+  wsConnectionDesc->rateLimit = *rateLimit;
+  tokenBucket_init(&wsConnectionDesc->msgBucket, rateLimit->msgsPerSec, rateLimit->msgsBurst);
+  tokenBucket_init(&wsConnectionDesc->byteBucket, rateLimit->bytesPerSec, rateLimit->bytesBurst);
+  return 0;
+}
+
+/**
+ * \brief Changes the egress rate of the given server connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param bytesPerSec The rate in bytes per second (0 => unlimited)
+ *
+ * \return 0 if successful else -1 (not a server connection or an HTTP/2 stream)
+ */
+int
+websocket_setPacingRate(struct websocket_connection_desc *wsConnectionDesc,
+                        unsigned long bytesPerSec)
+{
+  // the streams share the transport so only the whole connection can be paced
+  if ((wsConnectionDesc->wsType != WS_TYPE_SERVER) || wsConnectionDesc->h2Stream)
+    return -1;
+
+  socketServer_setPacingRate(wsConnectionDesc->socketClientDesc, bytesPerSec);
+  return 0;
+}
+
+/**
+ * \brief Encodes a text or binary message once so that it can be sent to several server
+ *        connections without copying it again
+ *
+ * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return The prepared frame (release it with websocket_unref) or NULL in case of error
+ */
+struct websocket_frame *
+websocket_prepareFrame(enum ws_data_type dataType, const void *msg, size_t len)
+{
+  enum ws_opcode opcode;
+
+  switch (dataType) {
+  case WS_DATA_TYPE_BINARY:
+    opcode = WS_OPCODE_BINARY;
+    break;
+
+  case WS_DATA_TYPE_TEXT:
+    opcode = WS_OPCODE_TEXT;
+    break;
+
+  default:
+    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
+    return NULL;
+  }
+
+  return allocFrame(opcode, NULL, 0, msg, len);
+}
+
+/**
+ * \brief Queues a prepared frame for the given server connection, the messages of a session
+ *        get their sequence number
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *frame Pointer to the prepared frame
+ * \param limited true if the connection is closed instead of exceeding WS_OUTBOX_MAX bytes
+ *
+ * \return 0 if successful else -1
+ */
+static int
+queuePreparedFrame(struct websocket_connection_desc *wsConnectionDesc,
+                   struct websocket_frame *frame, bool limited)
+{
+  struct ws_header header;
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return -1;
+
+  // the messages of a session need their own sequence number
+  if (wsConnectionDesc->session) {
+    if (parseWebsocketHeader(frame->data, frame->len, &header) != 1)
+      return -1;
+    return queueSessionMessage(wsConnectionDesc, header.opcode,
+                               &frame->data[header.payloadStartOffset], header.payloadLength,
+                               limited);
+  }
+
+  return queueFrame(wsConnectionDesc, frame, limited);
+}
+
+/**
+ * \brief Sends a prepared frame through the given server connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *frame Pointer to the prepared frame
+ *
+ * \return 0 if successful else -1
+ *
+ * \note the frame is sent after the frames that replay rings queued for the connection before
+ */
+int
+websocket_sendFrame(struct websocket_connection_desc *wsConnectionDesc,
+                    const struct websocket_frame *frame)
+{
+  int rc;
+
+  if (wsConnectionDesc->wsType != WS_TYPE_SERVER) {
+    ezwebsocket_log(EZLOG_ERROR, "prepared frames can only be sent by servers\n");
+    return -1;
+  }
+
+  // the outbox only takes a reference, the frame itself isn't changed
+  rc = queuePreparedFrame(wsConnectionDesc, (struct websocket_frame *) frame, true);
+  if (flushOutbox(wsConnectionDesc) < 0)
+    rc = -1;
+
+  return rc;
+}
+
+/**
+ * \brief Pairs two connections so that the frames received on one are forwarded to the other
+ *        (proxy mode)
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param *peer Pointer to the websocket connection descriptor of the other side
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocket_relay(struct websocket_connection_desc *wsConnectionDesc,
+                struct websocket_connection_desc *peer)
+{
+  int rc = -1;
+
+  if ((wsConnectionDesc == NULL) || (peer == NULL) || (wsConnectionDesc == peer)) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): invalid connections\n", __func__);
+    return -1;
+  }
+
+  pthread_mutex_lock(&relayMutex);
+  if ((wsConnectionDesc->state != WS_STATE_CONNECTED) || (peer->state != WS_STATE_CONNECTED)) {
+    ezwebsocket_log(EZLOG_ERROR, "only connected websockets can be paired\n");
+  } else if (wsConnectionDesc->relayPeer || peer->relayPeer) {
+    ezwebsocket_log(EZLOG_ERROR, "connection is already paired\n");
+  } else if (wsConnectionDesc->multiplexed || peer->multiplexed || wsConnectionDesc->session ||
+             peer->session || wsConnectionDesc->resumable || peer->resumable ||
+             wsConnectionDesc->lastMessage.firstReceived || peer->lastMessage.firstReceived) {
+    ezwebsocket_log(EZLOG_ERROR,
+                    "connection can't be paired (multiplexed, resumable or within a message)\n");
+  } else {
+    refcnt_ref(peer);
+    wsConnectionDesc->relayPeer = peer;
+    refcnt_ref(wsConnectionDesc);
+    peer->relayPeer = wsConnectionDesc;
+    rc = 0;
+  }
+  pthread_mutex_unlock(&relayMutex);
+
+  return rc;
+}
+
+/**
+ * \brief Creates a replay ring for a topic
+ *
+ * \param maxFrames The maximum number of frames that are kept
+ * \param maxAgeMs The maximum age of the frames that are kept in milliseconds (0 => unlimited)
+ *
+ * \return The replay descriptor or NULL in case of error
+ */
+struct websocket_replay *
+websocketReplay_create(unsigned long maxFrames, unsigned long maxAgeMs)
+{
+  struct websocket_replay *replay;
+
+  if (maxFrames == 0) {
+    ezwebsocket_log(EZLOG_ERROR, "maxFrames must not be 0\n");
+    return NULL;
+  }
+
+  replay = calloc(1, sizeof(struct websocket_replay));
+  if (!replay) {
+    ezwebsocket_log(EZLOG_ERROR, "calloc failed\n");
+    return NULL;
+  }
+
+  replay->entries = calloc(maxFrames, sizeof(struct replay_entry));
+  if (!replay->entries) {
+    ezwebsocket_log(EZLOG_ERROR, "calloc failed\n");
+    free(replay);
+    return NULL;
+  }
+  replay->maxFrames = maxFrames;
+  replay->maxAgeMs = maxAgeMs;
+  pthread_mutex_init(&replay->lock, NULL);
+
+  pthread_mutex_lock(&replayMutex);
+  replay->next = replays;
+  replays = replay;
+  pthread_mutex_unlock(&replayMutex);
+
+  return replay;
+}
+
+/**
+ * \brief Releases the given replay ring with all its frames and subscriptions
+ *
+ * \param *replay Pointer to the replay descriptor
+ */
+void
+websocketReplay_destroy(struct websocket_replay *replay)
+{
+  struct websocket_replay **iter;
+
+  if (!replay)
+    return;
+
+  pthread_mutex_lock(&replayMutex);
+  for (iter = &replays; *iter; iter = &(*iter)->next) {
+    if (*iter == replay) {
+      *iter = replay->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&replayMutex);
+
+  for (; replay->count; replay->count--) {
+    refcnt_unref(replay->entries[replay->head].frame);
+    replay->head = (replay->head + 1) % replay->maxFrames;
+  }
+  while (replay->numSubscribers)
+    replayRemoveSubscriber(replay, 0);
+
+  pthread_mutex_destroy(&replay->lock);
+  free(replay->subscribers);
+  free(replay->entries);
+  free(replay);
+}
+
+/**
+ * \brief Removes the frames that exceeded the maximum age from the ring
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *now Pointer to the current time
+ *
+ * \note must be called with the lock held
+ */
+static void
+replayExpire(struct websocket_replay *replay, const struct timespec *now)
+{
+  struct replay_entry *entry;
+  long ageMs;
+
+  if (!replay->maxAgeMs)
+    return;
+
+  while (replay->count) {
+    entry = &replay->entries[replay->head];
+    ageMs = (now->tv_sec - entry->time.tv_sec) * 1000 +
+            (now->tv_nsec - entry->time.tv_nsec) / 1000000;
+    if (ageMs < 0 || (unsigned long) ageMs <= replay->maxAgeMs)
+      break;
+    refcnt_unref(entry->frame);
+    replay->head = (replay->head + 1) % replay->maxFrames;
+    replay->count--;
+  }
+}
+
+/**
+ * \brief Appends a prepared frame to the ring (the oldest frame is dropped if the ring is
+ *        full) and sends it to all subscribers
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *frame Pointer to the prepared frame (the ring takes its own reference)
+ *
+ * \return The number of subscribers the frame was sent to (or queued for if another thread is
+ *         sending to the subscriber)
+ *
+ * \note subscribers that are closed or fail to receive the frame are removed
+ */
+int
+websocketReplay_publish(struct websocket_replay *replay, struct websocket_frame *frame)
+{
+  struct websocket_connection_desc **subscribers;
+  struct replay_entry *entry;
+  struct timespec now;
+  size_t numSubscribers;
+  size_t numQueued = 0;
+  size_t numFailed = 0;
+  size_t i;
+  int sent = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  refcnt_ref(frame);
+
+  pthread_mutex_lock(&replay->lock);
+  replayExpire(replay, &now);
+  if (replay->count == replay->maxFrames) {
+    refcnt_unref(replay->entries[replay->head].frame);
+    replay->head = (replay->head + 1) % replay->maxFrames;
+    replay->count--;
+  }
+  entry = &replay->entries[(replay->head + replay->count) % replay->maxFrames];
+  entry->frame = frame;
+  entry->time = now;
+  replay->count++;
+
+  // the frame is queued for the subscribers under the lock so that every subscriber gets the
+  // frames in the order of the ring, the subscribers that failed are put at the end
+  numSubscribers = replay->numSubscribers;
+  subscribers = malloc((numSubscribers + 1) * sizeof(struct websocket_connection_desc *));
+  if (subscribers) {
+    for (i = 0; i < numSubscribers; i++) {
+      refcnt_ref(replay->subscribers[i]);
+      if (queuePreparedFrame(replay->subscribers[i], frame, true) < 0)
+        subscribers[numSubscribers - ++numFailed] = replay->subscribers[i];
+      else
+        subscribers[numQueued++] = replay->subscribers[i];
+    }
+  } else {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    numSubscribers = 0;
+  }
+  pthread_mutex_unlock(&replay->lock);
+
+  // a subscriber that is sent to by another thread already gets the frame from that thread, so
+  // the publisher doesn't wait for the sends of others
+  for (i = 0; i < numSubscribers; i++) {
+    if ((flushOutbox(subscribers[i]) < 0) || (i >= numQueued))
+      continue;
+    sent++;
+    // the connections that received the frame are kept
+    refcnt_unref(subscribers[i]);
+    subscribers[i] = NULL;
+  }
+
+  for (i = 0; i < numSubscribers; i++) {
+    if (!subscribers[i])
+      continue;
+    pthread_mutex_lock(&replay->lock);
+    replayRemoveConnection(replay, subscribers[i]);
+    pthread_mutex_unlock(&replay->lock);
+    refcnt_unref(subscribers[i]);
+  }
+  free(subscribers);
+
+  return sent;
+}
+
+/**
+ * \brief Sends all frames of the ring to the given server connection with vectored sends and
+ *        subscribes it to the frames that are published afterwards (no gap, no duplicates)
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocketReplay_subscribe(struct websocket_replay *replay,
+                          struct websocket_connection_desc *wsConnectionDesc)
+{
+  struct websocket_connection_desc **subscribers;
+  struct timespec now;
+  unsigned long i;
+  int rc = -1;
+
+  if (wsConnectionDesc->wsType != WS_TYPE_SERVER) {
+    ezwebsocket_log(EZLOG_ERROR, "only server connections can subscribe\n");
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&replay->lock);
+
+  for (i = 0; i < replay->numSubscribers; i++) {
+    if (replay->subscribers[i] == wsConnectionDesc) {
+      ezwebsocket_log(EZLOG_ERROR, "connection is already subscribed\n");
+      goto UNLOCK;
+    }
+  }
+
+  if (replay->numSubscribers == replay->maxSubscribers) {
+    subscribers = realloc(replay->subscribers, (replay->maxSubscribers * 2 + 8) *
+                                                   sizeof(struct websocket_connection_desc *));
+    if (!subscribers) {
+      ezwebsocket_log(EZLOG_ERROR, "realloc failed\n");
+      goto UNLOCK;
+    }
+    replay->subscribers = subscribers;
+    replay->maxSubscribers = replay->maxSubscribers * 2 + 8;
+  }
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    goto UNLOCK;
+
+  // the ring is queued before any frame that is published afterwards
+  replayExpire(replay, &now);
+  for (i = 0; i < replay->count; i++) {
+    if (queuePreparedFrame(wsConnectionDesc,
+                           replay->entries[(replay->head + i) % replay->maxFrames].frame,
+                           false) < 0)
+      goto UNLOCK;
+  }
+
+  refcnt_ref(wsConnectionDesc);
+  __atomic_add_fetch(&wsConnectionDesc->replaySubscriptions, 1, __ATOMIC_RELAXED);
+  replay->subscribers[replay->numSubscribers++] = wsConnectionDesc;
+  rc = 0;
+
+UNLOCK:
+  pthread_mutex_unlock(&replay->lock);
+
+  if ((flushOutbox(wsConnectionDesc) < 0) && (rc == 0)) {
+    pthread_mutex_lock(&replay->lock);
+    replayRemoveConnection(replay, wsConnectionDesc);
+    pthread_mutex_unlock(&replay->lock);
+    rc = -1;
+  }
+  return rc;
+}
+
+/**
+ * \brief Unsubscribes the given connection from the replay ring
+ *
+ * \param *replay Pointer to the replay descriptor
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ */
+void
+websocketReplay_unsubscribe(struct websocket_replay *replay,
+                            struct websocket_connection_desc *wsConnectionDesc)
+{
+  pthread_mutex_lock(&replay->lock);
+  replayRemoveConnection(replay, wsConnectionDesc);
+  pthread_mutex_unlock(&replay->lock);
+}
+
+/**
+ * \brief Creates a shared memory bus that passes prepared frames to other processes
+ *
+ * \param size The size of the ring in bytes
+ *
+ * \return The bus or NULL in case of error
+ */
+struct websocket_bus *
+websocketBus_create(size_t size)
+{
+  struct websocket_bus *bus;
+
+  bus = calloc(1, sizeof(struct websocket_bus));
+  if (!bus) {
+    ezwebsocket_log(EZLOG_ERROR, "calloc failed\n");
+    return NULL;
+  }
+
+  bus->ring = shmRing_create(size);
+  if (!bus->ring) {
+    free(bus);
+    return NULL;
+  }
+
+  return bus;
+}
+
+/**
+ * \brief Returns the memfd of the bus that is passed to the other processes
+ *
+ * \param *bus Pointer to the bus
+ *
+ * \return The memfd or -1 if the bus was attached
+ */
+int
+websocketBus_getFd(struct websocket_bus *bus)
+{
+  return shmRing_getFd(bus->ring);
+}
+
+/**
+ * \brief Writes a prepared frame to the bus and wakes the attached processes
+ *
+ * \param *bus Pointer to the bus
+ * \param *frame Pointer to the prepared frame
+ *
+ * \return 0 if successful else -1
+ */
+int
+websocketBus_publish(struct websocket_bus *bus, struct websocket_frame *frame)
+{
+  return shmRing_write(bus->ring, frame->data, frame->len);
+}
+
+/**
+ * \brief Reads the frames of the bus and passes them to the callback
+ *
+ * \param *arg Pointer to the bus
+ *
+ * \return NULL
+ */
+static void *
+busThread(void *arg)
+{
+  struct websocket_bus *bus = arg;
+  struct websocket_frame *frame;
+  bool lost = false;
+  uint64_t pos;
+  size_t len;
+
+  pos = shmRing_head(bus->ring);
+  while (!__atomic_load_n(&bus->stop, __ATOMIC_ACQUIRE)) {
+    // the first read only returns the length of the frame
+    len = shmRing_read(bus->ring, &pos, NULL, 0, &lost);
+    if (!len) {
+      shmRing_wait(bus->ring, pos, 1000);
+      continue;
+    }
+
+    frame = refcnt_allocate(sizeof(struct websocket_frame) + len, NULL);
+    if (!frame) {
+      // skip the frames that can't be received
+      pos = shmRing_head(bus->ring);
+      lost = true;
+      continue;
+    }
+
+    frame->len = shmRing_read(bus->ring, &pos, frame->data, len, &lost);
+    if (frame->len && (frame->len <= len)) {
+      bus->ws_onFrame(bus->userData, frame, lost);
+      lost = false;
+    }
+    refcnt_unref(frame);
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief Attaches to a bus that was created by another process
+ *
+ * \param fd The memfd of the bus
+ * \param *ws_onFrame Callback that is called for every published frame
+ * \param *userData The user data that is passed to the callback
+ *
+ * \return The bus or NULL in case of error
+ */
+struct websocket_bus *
+websocketBus_attach(int fd,
+                    void (*ws_onFrame)(void *userData, struct websocket_frame *frame, bool lost),
+                    void *userData)
+{
+  struct websocket_bus *bus;
+
+  if (!ws_onFrame) {
+    ezwebsocket_log(EZLOG_ERROR, "ws_onFrame must be set\n");
+    return NULL;
+  }
+
+  bus = calloc(1, sizeof(struct websocket_bus));
+  if (!bus) {
+    ezwebsocket_log(EZLOG_ERROR, "calloc failed\n");
+    return NULL;
+  }
+
+  bus->ring = shmRing_attach(fd);
+  if (!bus->ring) {
+    free(bus);
+    return NULL;
+  }
+  bus->ws_onFrame = ws_onFrame;
+  bus->userData = userData;
+
+  if (pthread_create(&bus->tid, NULL, busThread, bus) != 0) {
+    ezwebsocket_log(EZLOG_ERROR, "pthread_create failed\n");
+    shmRing_close(bus->ring);
+    free(bus);
+    return NULL;
+  }
+
+  return bus;
+}
+
+/**
+ * \brief Closes the given bus (stops the reader thread of an attached bus)
+ *
+ * \param *bus Pointer to the bus
+ */
+void
+websocketBus_close(struct websocket_bus *bus)
+{
+  if (!bus)
+    return;
+
+  if (bus->ws_onFrame) {
+    __atomic_store_n(&bus->stop, true, __ATOMIC_RELEASE);
+    shmRing_wake(bus->ring);
+    pthread_join(bus->tid, NULL);
+  }
+  shmRing_close(bus->ring);
+  free(bus);
+}
+
+/**
+ * \brief Returns if the connection uses multiplexed channels
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return True if the subprotocol for multiplexed channels was negotiated else false
+ */
+bool
+websocketConnection_isMultiplexed(struct websocket_connection_desc *wsConnectionDesc)
+{
+  return wsConnectionDesc->multiplexed;
+}
+
+/**
+ * \brief Returns the token of the resumable session of the connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return The token or NULL if the connection has no resumable session
+ */
+const char *
+websocketConnection_getSessionToken(struct websocket_connection_desc *wsConnectionDesc)
+{
+  if (wsConnectionDesc->session)
+    return wsConnectionDesc->session->token;
+
+  return wsConnectionDesc->resumable ? wsConnectionDesc->sessionToken : NULL;
+}
+
+/**
+ * \brief Returns the sequence number of the last message of the resumable session, that is the
+ *        last sent message for servers and the last received message for clients
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return The sequence number (0 => no message yet or no resumable session)
+ */
+unsigned long long
+websocketConnection_getSessionSeq(struct websocket_connection_desc *wsConnectionDesc)
+{
+  unsigned long long seq;
+
+  if (!wsConnectionDesc->session)
+    return wsConnectionDesc->sessionSeq;
+
+  pthread_mutex_lock(&wsConnectionDesc->session->lock);
+  seq = wsConnectionDesc->session->seq;
+  pthread_mutex_unlock(&wsConnectionDesc->session->lock);
+  return seq;
+}
+
+/**
+ * \brief Returns if the connection continues a previous session
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return True if the session was resumed else false (new session or not resumable)
+ */
+bool
+websocketConnection_isResumed(struct websocket_connection_desc *wsConnectionDesc)
+{
+  return wsConnectionDesc->resumed;
+}
+
+/**
+ * \brief Returns the request target of the upgrade request
+ *
+ * \param *upgrade Pointer to the upgrade request
+ *
+ * \return The request target
+ */
+const char *
+websocketUpgrade_getPath(struct websocket_upgrade *upgrade)
+{
+  return upgrade->path;
+}
+
+/**
+ * \brief Returns the value of a header of the upgrade request
+ *
+ * \param *upgrade Pointer to the upgrade request
+ * \param *name The name of the header (case insensitive)
+ *
+ * \return The value or NULL if the header is missing
+ */
+const char *
+websocketUpgrade_getHeader(struct websocket_upgrade *upgrade, const char *name)
+{
+  size_t nameLen = strlen(name);
+  const char *end = upgrade->request + upgrade->len;
+  const char *line;
+
+  // the lines are terminated by "\0\n" and the first one is the request line
+  line = memchr(upgrade->request, '\n', upgrade->len);
+  while (line && (line < end)) {
+    if (*line == '\n')
+      line++;
+    if ((strncasecmp(line, name, nameLen) == 0) && (line[nameLen] == ':')) {
+      line += nameLen + 1;
+      while ((*line == ' ') || (*line == '\t'))
+        line++;
+      return line;
+    }
+    line += strlen(line) + 1;
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief Returns the ip address of the client that sent the upgrade request
+ *
+ * \param *upgrade Pointer to the upgrade request
+ *
+ * \return The ip address as string
+ */
+const char *
+websocketUpgrade_getPeerIp(struct websocket_upgrade *upgrade)
+{
+  return socket_get_peer_ip(upgrade->socketConnectionDesc);
+}
+
+/**
+ * \brief Passes the verdict of a pending upgrade request and releases the reference of the
+ *        application, reading is resumed so that the verdict is applied by the I/O thread
+ *
+ * \param *upgrade Pointer to the upgrade request
+ * \param accept true to continue with the websocket handshake
+ * \param status The http status of a rejected request
+ */
+void
+websocketUpgrade_complete(struct websocket_upgrade *upgrade, bool accept, int status)
+{
+  bool resumeStream = false;
+
+  pthread_mutex_lock(&upgradeMutex);
+  if ((upgrade->verdict == WS_UPGRADE_PENDING) && !upgrade->closed) {
+    upgrade->verdict = accept ? WS_UPGRADE_ACCEPT : WS_UPGRADE_REJECT;
+    upgrade->status = status;
+    if (upgrade->h2Stream)
+      resumeStream = true;
+    else
+      socketServer_resumeReading(upgrade->socketConnectionDesc);
+  }
+  pthread_mutex_unlock(&upgradeMutex);
+
+  // the session may close streams while it's unlocked so the stream is resumed without the mutex
+  if (resumeStream)
+    http2_resumeStream(upgrade->h2Stream);
+
+  refcnt_unref(upgrade);
+}
+
+/**
+ * \brief Opens a logical channel on a multiplexed connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ * \param channelId The channel id (1 - WS_CHANNEL_MAX)
+ * \param *init Pointer to the callbacks, the receive window and the user data
+ *
+ * \return The channel or NULL in case of error
+ */
+struct websocket_channel *
+websocketChannel_open(struct websocket_connection_desc *wsConnectionDesc, unsigned int channelId,
+                      const struct ws_channel_init *init)
+{
+  struct websocket_channel *channel;
+
+  if (!wsConnectionDesc->multiplexed) {
+    ezwebsocket_log(EZLOG_ERROR, "connection is not multiplexed\n");
+    return NULL;
+  }
+
+  if ((channelId == WS_CHANNEL_CONTROL) || (channelId > WS_CHANNEL_MAX)) {
+    ezwebsocket_log(EZLOG_ERROR, "invalid channel id %u\n", channelId);
+    return NULL;
+  }
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return NULL;
+
+  pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+  if (wsConnectionDesc->channels[channelId]) {
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    ezwebsocket_log(EZLOG_ERROR, "channel %u is already open\n", channelId);
+    return NULL;
+  }
+  channel = addChannel(wsConnectionDesc, channelId, init);
+  pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+  if (!channel)
+    return NULL;
+
+  if (sendChannelControl(wsConnectionDesc, WS_CHANNEL_CTRL_OPEN, channelId, init->window) < 0) {
+    pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+    if (wsConnectionDesc->channels[channelId] == channel)
+      wsConnectionDesc->channels[channelId] = NULL;
+    channel->closed = true;
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    refcnt_unref(channel);
+    return NULL;
+  }
+
+  return channel;
+}
+
+/**
+ * \brief Sends binary or text data through the given channel
+ *
+ * \param *channel Pointer to the channel
+ * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
+ * \param *msg The payload data
+ * \param len The payload length
+ *
+ * \return 0 if successful else -1 (e.g. no credits left)
+ */
+int
+websocketChannel_send(struct websocket_channel *channel, enum ws_data_type dataType,
+                      const void *msg, size_t len)
+{
+  struct websocket_connection_desc *wsConnectionDesc = channel->connection;
+  unsigned char prefix = channel->id;
+  enum ws_opcode opcode;
+
+  switch (dataType) {
+  case WS_DATA_TYPE_BINARY:
+    opcode = WS_OPCODE_BINARY;
+    break;
+
+  case WS_DATA_TYPE_TEXT:
+    opcode = WS_OPCODE_TEXT;
+    break;
+
+  default:
+    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
+    return -1;
+  }
+
+  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+    return -1;
+
+  pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+  if (channel->closed || !channel->open ||
+      (channel->peerWindow && (channel->credit <= 0))) {
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    return -1;
+  }
+  // the last message may exceed the credits so that big messages don't block forever
+  if (channel->peerWindow)
+    channel->credit -= len;
+  pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+
+  return sendDataLowLevelPrefixed(wsConnectionDesc, opcode, true,
+                                  wsConnectionDesc->wsType == WS_TYPE_CLIENT, &prefix,
+                                  sizeof(prefix), msg, len);
+}
+
+/**
+ * \brief Returns the number of bytes that can be sent through the channel until the peer
+ *        grants new credits
+ *
+ * \param *channel Pointer to the channel
+ *
+ * \return The number of bytes (0 if the channel isn't open yet, LONG_MAX => unlimited)
+ */
+long
+websocketChannel_getCredit(struct websocket_channel *channel)
+{
+  long credit;
+
+  pthread_mutex_lock(&channel->connection->channelMutex);
+  if (!channel->open || channel->closed)
+    credit = 0;
+  else if (!channel->peerWindow)
+    credit = LONG_MAX;
+  else
+    credit = channel->credit > 0 ? channel->credit : 0;
+  pthread_mutex_unlock(&channel->connection->channelMutex);
+
+  return credit;
+}
+
+/**
+ * \brief Closes the given channel (ws_onClose of the channel isn't called)
+ *
+ * \param *channel Pointer to the channel (must not be used afterwards)
+ */
+void
+websocketChannel_close(struct websocket_channel *channel)
+{
+  struct websocket_connection_desc *wsConnectionDesc = channel->connection;
+
+  pthread_mutex_lock(&wsConnectionDesc->channelMutex);
+  if (channel->closed) {
+    pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+    return;
+  }
+  channel->closed = true;
+  wsConnectionDesc->channels[channel->id] = NULL;
+  pthread_mutex_unlock(&wsConnectionDesc->channelMutex);
+
+  sendChannelControl(wsConnectionDesc, WS_CHANNEL_CTRL_CLOSE, channel->id, 0);
+  refcnt_unref(channel);
+}
+
+//! the presets of the socket options
+static const struct ws_socket_options socketProfiles[] = {
+  [WS_SOCKET_PROFILE_DEFAULT] = { .noDelay = 1 },
+  [WS_SOCKET_PROFILE_LOW_LATENCY] = { .noDelay = 1,
+                                      .quickAck = 1,
+                                      .notSentLowat = 16384,
+                                      .busyPollUs = 50 },
+  [WS_SOCKET_PROFILE_THROUGHPUT] = { .noDelay = -1, .sndBuf = 4194304, .rcvBuf = 4194304 },
+  [WS_SOCKET_PROFILE_MEMORY_LEAN] = { .noDelay = 1,
+                                      .sndBuf = 16384,
+                                      .rcvBuf = 16384,
+                                      .notSentLowat = 4096 },
+};
+
+/**
+ * \brief returns the value of an option or the preset if it isn't set
+ *
+ * \param value The value of the option (0 => not set)
+ * \param preset The value of the preset
+ *
+ * \return the value that should be used
+ */
+static int
+socketOption(int value, int preset)
+{
+  return value ? value : preset;
+}
+
+/**
+ * \brief resolves the websocket socket options and their profile to the options of a socket
+ *
+ * \param *wsOptions Pointer to the websocket socket options
+ * \param server true => the options are used for a server (keepalive is on by default)
+ * \param *options Pointer to where the resolved options should be stored
+ */
+static void
+resolveSocketOptions(const struct ws_socket_options *wsOptions, bool server,
+                     struct socket_options *options)
+{
+  const struct ws_socket_options *profile = &socketProfiles[WS_SOCKET_PROFILE_DEFAULT];
+
+  if ((wsOptions->profile >= 0) &&
+      ((size_t) wsOptions->profile < sizeof(socketProfiles) / sizeof(socketProfiles[0])))
+    profile = &socketProfiles[wsOptions->profile];
+  else
+    ezwebsocket_log(EZLOG_ERROR, "unknown socket profile using the default\n");
+
+  options->noDelay = socketOption(wsOptions->noDelay, profile->noDelay) > 0;
+  options->quickAck = socketOption(wsOptions->quickAck, profile->quickAck) > 0;
+  options->keepalive = socketOption(wsOptions->keepalive, server ? 1 : -1) > 0;
+  options->keepIdleSec = socketOption(wsOptions->keepIdleSec, server ? 180 : 0);
+  options->keepCnt = socketOption(wsOptions->keepCnt, server ? 3 : 0);
+  options->keepIntvlSec = socketOption(wsOptions->keepIntvlSec, server ? 10 : 0);
+  options->sndBuf = socketOption(wsOptions->sndBuf, profile->sndBuf);
+  options->rcvBuf = socketOption(wsOptions->rcvBuf, profile->rcvBuf);
+  options->notSentLowat = socketOption(wsOptions->notSentLowat, profile->notSentLowat);
+  options->busyPollUs = socketOption(wsOptions->busyPollUs, profile->busyPollUs);
+}
+
+//! the number of messages that are taken from the receive queue at once when it's closed
+#define WS_RECV_DRAIN_BATCH 64
+
+/**
+ * \brief Frees the receive queue of the server when the last reference is gone
+ *
+ * \param *ptr Pointer to the websocket server descriptor
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+destroyServer(void *ptr)
+{
+  struct websocket_server_desc *wsDesc = ptr;
+
+  if (wsDesc->recvQueue)
+    msgQueue_destroy(wsDesc->recvQueue);
+}
+
+//! the reply that is sent to connections that are rejected because of a limit
+#define WS_REJECT_REPLY                                                                            \
+  "HTTP/1.1 503 Service Unavailable\r\n"                                                           \
+  "Connection: close\r\n"                                                                          \
+  "Content-Length: 0\r\n"                                                                          \
+  "Retry-After: 1\r\n"                                                                             \
+  "\r\n"
+
+/**
+ * \brief opens a websocket server on the given address or listening socket
+ *
+ * \param *wsInit Pointer to the init struct
+ * \param *websocketUserData userData for the socket
+ * \param listenFd The already listening socket that should be used (-1 => use address and port)
+ *
+ * \return The websocket descriptor or NULL in case of error
+ */
+static struct websocket_server_desc *
+openServer(struct websocket_server_init *wsInit, void *websocketUserData, int listenFd)
+{
+  struct socket_server_init socketInit = { 0 };
+  struct websocket_server_desc *wsDesc;
+
+  wsDesc = refcnt_allocate(sizeof(struct websocket_server_desc), destroyServer);
+  if (!wsDesc) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return NULL;
+  }
+  memset(wsDesc, 0, sizeof(struct websocket_server_desc));
+
+  wsDesc->ws_onOpen = wsInit->ws_onOpen;
+  wsDesc->ws_onClose = wsInit->ws_onClose;
+  wsDesc->ws_onCloseLegacy = NULL;
+  wsDesc->ws_onMessage = wsInit->ws_onMessage;
+  wsDesc->ws_onWatch = wsInit->ws_onWatch;
+  wsDesc->ws_onHandover = wsInit->ws_onHandover;
+  wsDesc->ws_onTakeover = wsInit->ws_onTakeover;
+  wsDesc->wsSocketUserData = websocketUserData;
+  wsDesc->rateLimit = wsInit->rateLimit;
+  wsDesc->endpointRateLimit = wsInit->endpointRateLimit;
+  wsDesc->channels = wsInit->channels;
+  wsDesc->ws_onChannelOpen = wsInit->ws_onChannelOpen;
+  wsDesc->h2Callbacks = wsInit->http2 ? &http2Callbacks : NULL;
+  wsDesc->resumable = wsInit->resumable;
+  wsDesc->sessionFrames = wsInit->sessionFrames ? wsInit->sessionFrames
+                                                : WS_SESSION_FRAMES_DEFAULT;
+  wsDesc->sessionTimeoutMs = wsInit->sessionTimeoutMs ? wsInit->sessionTimeoutMs
+                                                      : WS_SESSION_TIMEOUT_MS_DEFAULT;
+  wsDesc->ws_onUpgradeRequest = wsInit->ws_onUpgradeRequest;
+  wsDesc->upgradeTimeoutMs = wsInit->upgradeTimeoutMs ? wsInit->upgradeTimeoutMs
+                                                      : WS_UPGRADE_TIMEOUT_MS_DEFAULT;
+  if (wsInit->recvQueueDepth) {
+    wsDesc->recvQueue = msgQueue_create(wsInit->recvQueueDepth, sizeof(struct ws_message));
+    if (!wsDesc->recvQueue) {
+      ezwebsocket_log(EZLOG_ERROR, "msgQueue_create failed\n");
+      refcnt_unref(wsDesc);
+      return NULL;
+    }
+  }
+  tokenBucket_init(&wsDesc->endpointMsgBucket, wsInit->endpointRateLimit.msgsPerSec,
+                   wsInit->endpointRateLimit.msgsBurst);
+  tokenBucket_init(&wsDesc->endpointByteBucket, wsInit->endpointRateLimit.bytesPerSec,
+                   wsInit->endpointRateLimit.bytesBurst);
+  pthread_mutex_init(&wsDesc->rateMutex, NULL);
+  pthread_mutex_init(&wsDesc->sessionMutex, NULL);
+
+  socketInit.address = wsInit->address;
+  socketInit.port = wsInit->port;
+  socketInit.listenFd = listenFd;
+  socketInit.maxConnections = wsInit->maxConnections;
+  socketInit.maxBufferMemory = wsInit->maxBufferMemory;
+  socketInit.backlog = wsInit->backlog;
+  socketInit.deferAcceptSec = wsInit->deferAcceptSec;
+  socketInit.unixMode = wsInit->unixMode;
+  socketInit.readBudgetBytes = wsInit->readBudgetBytes ? wsInit->readBudgetBytes
+                                                        : READ_BUDGET_BYTES_DEFAULT;
+  socketInit.readBudgetMsgs = wsInit->readBudgetMsgs ? wsInit->readBudgetMsgs
+                                                      : READ_BUDGET_MSGS_DEFAULT;
+  socketInit.pacingRate = wsInit->pacingRate;
+  socketInit.serverPacingRate = wsInit->serverPacingRate;
+  resolveSocketOptions(&wsInit->socketOptions, true, &socketInit.options);
+  socketInit.rejectMsg = WS_REJECT_REPLY;
+  socketInit.socket_onOpen = websocketServer_onOpen;
+  socketInit.socket_onClose = websocket_onClose;
+  socketInit.socket_onMessage = websocket_onMessage;
+  socketInit.socket_onWatch = wsInit->ws_onWatch ? websocketServer_onWatch : NULL;
+  socketInit.socket_onWakeup = websocketServer_onWakeup;
+
+  wsDesc->socketDesc = socketServer_open(&socketInit, wsDesc);
+  if (!wsDesc->socketDesc) {
+    ezwebsocket_log(EZLOG_ERROR, "socketServer_open failed\n");
+    pthread_mutex_destroy(&wsDesc->rateMutex);
+    pthread_mutex_destroy(&wsDesc->sessionMutex);
+    refcnt_unref(wsDesc);
+    return NULL;
+  }
+
+  return wsDesc;
+}
+
+/**
+ * \brief opens a websocket server
+ *
+ * \param *wsInit Pointer to the init struct
+ * \param *websocketUserData userData for the socket
+ *
+ * \return The websocket descriptor or NULL in case of error
+ *         it can be passed to websocket_ref if it is used
+ *         at more places
+ */
+struct websocket_server_desc *
+websocketServer_open(struct websocket_server_init *wsInit, void *websocketUserData)
+{
+  return openServer(wsInit, websocketUserData, -1);
+}
+
+/**
+ * \brief closes the given websocket server
+ *        and decreases the reference counter of wsDesc by 1
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ *
+ */
+void
+websocketServer_close(struct websocket_server_desc *wsDesc)
+{
+  struct ws_message messages[WS_RECV_DRAIN_BATCH];
+  struct ws_session *session;
+  struct websocket_upgrade *upgrade;
+  size_t count;
+
+  socketServer_close(wsDesc->socketDesc);
+  while (wsDesc->sessions) {
+    session = wsDesc->sessions;
+    wsDesc->sessions = session->next;
+    refcnt_unref(session);
+  }
+  pthread_mutex_lock(&upgradeMutex);
+  while (wsDesc->upgrades) {
+    upgrade = wsDesc->upgrades;
+    wsDesc->upgrades = upgrade->next;
+    upgrade->closed = true;
+    refcnt_unref(upgrade);
+  }
+  pthread_mutex_unlock(&upgradeMutex);
+  // the consumers that wait return, the messages that weren't taken are dropped
+  if (wsDesc->recvQueue) {
+    msgQueue_close(wsDesc->recvQueue);
+    while ((count = msgQueue_pop(wsDesc->recvQueue, messages, WS_RECV_DRAIN_BATCH, 0)) > 0)
+      websocket_releaseMessages(messages, count);
+  }
+  pthread_mutex_destroy(&wsDesc->rateMutex);
+  pthread_mutex_destroy(&wsDesc->sessionMutex);
+  refcnt_unref(wsDesc);
+}
+
+/**
+ * \brief returns the statistics of the given websocket server
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param *stats Pointer to where the statistics should be stored
+ */
+void
+websocketServer_getStats(struct websocket_server_desc *wsDesc, struct websocket_server_stats *stats)
+{
+  struct socket_server_stats socketStats;
+
+  socketServer_getStats(wsDesc->socketDesc, &socketStats);
+  stats->connections = socketStats.connections;
+  stats->bufferMemory = socketStats.bufferMemory;
+  stats->rejectedNoFd = socketStats.rejectedNoFd;
+  stats->rejectedBudget = socketStats.rejectedBudget;
+  stats->listenerPauses = socketStats.listenerPauses;
+  stats->paused = socketStats.paused;
+  pthread_mutex_lock(&wsDesc->rateMutex);
+  stats->rateLimited = wsDesc->rateLimited;
+  pthread_mutex_unlock(&wsDesc->rateMutex);
+}
+
+/**
+ * \brief Takes up to max messages from the receive queue of the server
+ *
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param *msgs Pointer to where the messages should be stored
+ * \param max The maximum number of messages
+ * \param timeoutMs The maximum time to wait for the first message in milliseconds
+ *                  (-1 => infinite, 0 => don't wait)
+ *
+ * \return The number of messages (0 => timeout or the server was closed)
+ */
+size_t
+websocketServer_recvBatch(struct websocket_server_desc *wsDesc, struct ws_message *msgs,
+                          size_t max, int timeoutMs)
+{
+  if (!wsDesc->recvQueue) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): the server has no receive queue\n", __func__);
+    return 0;
+  }
+
+  return msgQueue_pop(wsDesc->recvQueue, msgs, max, timeoutMs);
+}
+
+/**
+ * \brief Releases the payloads and connections of messages from websocketServer_recvBatch
+ *
+ * \param *msgs Pointer to the messages
+ * \param count The number of messages
+ */
+void
+websocket_releaseMessages(struct ws_message *msgs, size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (msgs[i].data)
+      refcnt_unref(msgs[i].data);
+    refcnt_unref(msgs[i].connection);
+    msgs[i].data = NULL;
+    msgs[i].connection = NULL;
   }
 }
 
 /**
- * \brief Sends binary or text data through websockets
+ * \brief Sends the going away close frame to the given connection
+ *
+ * \param *wsConnectionDesc Pointer to the websocket connection descriptor
+ *
+ * \return True if the close frame was sent else false (the connection should be closed)
+ */
+static bool
+sendGoingAway(struct websocket_connection_desc *wsConnectionDesc)
+{
+  unsigned char code[2];
+
+  if ((wsConnectionDesc == NULL) || (wsConnectionDesc->state != WS_STATE_CONNECTED))
+    return false;
+
+  code[0] = WS_CLOSE_CODE_GOING_AWAY >> 8;
+  code[1] = WS_CLOSE_CODE_GOING_AWAY & 0xFF;
+
+  wsConnectionDesc->state = WS_STATE_CLOSING;
+  return sendDataLowLevel(wsConnectionDesc, WS_OPCODE_DISCONNECT, true, false, code,
+                          sizeof(code)) == 0;
+}
+
+/**
+ * \brief Sends the going away close frame to the websocket of the given http/2 stream
+ *        (used for draining)
  *
- * \param *wsConnectionDesc Pointer to the websocket connection descriptor
- * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
- * \param *msg The payload data
- * \param len The payload length
+ * \param *ctx Unused
+ * \param *stream The http/2 stream
+ * \param *streamUserData The websocket connection descriptor of the stream
+ */
+static void
+drainStream(void *ctx, struct http2_stream *stream, void *streamUserData)
+{
+  struct websocket_connection_desc *wsConnectionDesc = streamUserData;
+  (void) ctx;
+
+  // a stream whose upgrade request is pending has no response yet
+  if (wsConnectionDesc->state == WS_STATE_HANDSHAKE)
+    http2_rejectStream(stream, 503);
+  else if (!sendGoingAway(wsConnectionDesc))
+    http2_closeStream(stream);
+}
+
+/**
+ * \brief Sends the going away close frame to the given connection (used for draining)
  *
- * \return 0 if successful else -1
+ * \param *ctx Unused
+ * \param *socketConnectionDesc The connection descriptor from the socket server
+ * \param *connectionUserData The websocket connection descriptor
  *
+ * \return True if the connection should be closed immediately else false
  */
-int
-websocket_sendData(struct websocket_connection_desc *wsConnectionDesc, enum ws_data_type dataType,
-                   const void *msg, size_t len)
+static bool
+drainConnection(void *ctx, struct socket_connection_desc *socketConnectionDesc,
+                void *connectionUserData)
 {
-  unsigned char opcode;
-  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
-
-  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
-    return -1;
-
-  switch (dataType) {
-  case WS_DATA_TYPE_BINARY:
-    opcode = WS_OPCODE_BINARY;
-    break;
-
-  case WS_DATA_TYPE_TEXT:
-    opcode = WS_OPCODE_TEXT;
-    break;
+  struct websocket_connection_desc *wsConnectionDesc = connectionUserData;
+  (void) socketConnectionDesc;
 
-  default:
-    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
-    return -1;
+  // the http/2 connection is closed by the session once the last stream is closed
+  if ((wsConnectionDesc != NULL) && wsConnectionDesc->h2Session) {
+    http2_forEachStream(wsConnectionDesc->h2Session, drainStream, ctx);
+    http2_goAway(wsConnectionDesc->h2Session);
+    return false;
   }
 
-  return sendDataLowLevel(wsConnectionDesc, opcode, true, masked, msg, len);
+  return !sendGoingAway(wsConnectionDesc);
 }
 
 /**
- * \brief Sends fragmented binary or text data through websockets
- *         use websocket_sendDataFragmetedCont for further fragments
- *
- * \param *wsConnectionDesc Pointer to the websocket connection descriptor
- * \param dataType The datatype (WS_DATA_TYPE_BINARY or WS_DATA_TYPE_TEXT)
- * \param *msg The payload data
- * \param len The payload length
+ * \brief drains the given websocket server
+ *        stops accepting, sends a going away close frame to every connection and waits for the
+ *        close handshakes, connections that are still open after the timeout are closed
  *
- * \return 0 if successful else -1
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param timeoutMs The maximum time to wait for the close handshakes in milliseconds
  *
+ * \return The number of connections that had to be closed forcefully
  */
 int
-websocket_sendDataFragmentedStart(struct websocket_connection_desc *wsConnectionDesc,
-                                  enum ws_data_type dataType, const void *msg, size_t len)
+websocketServer_drain(struct websocket_server_desc *wsDesc, int timeoutMs)
 {
-  unsigned char opcode;
-  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+  socketServer_stopAccepting(wsDesc->socketDesc);
+  socketServer_forEachConnection(wsDesc->socketDesc, drainConnection, NULL);
+  return socketServer_drain(wsDesc->socketDesc, timeoutMs);
+}
 
-  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
-    return -1;
+//! the maximum number of received but unprocessed bytes of a connection that is handed over
+#define HANDOVER_MAX_PENDING 16384
+
+//! the message types of the handover protocol
+enum handover_msg_type {
+  //! the message contains the listening socket
+  HANDOVER_MSG_LISTENER,
+  //! the message contains a connection, its pending data and its application state
+  HANDOVER_MSG_CONNECTION,
+  //! the handover is complete
+  HANDOVER_MSG_END,
+};
 
-  switch (dataType) {
-  case WS_DATA_TYPE_BINARY:
-    opcode = WS_OPCODE_BINARY;
-    break;
+//! header of a handover message (followed by the pending data and the application state)
+struct handover_msg {
+  //! the message type (enum handover_msg_type)
+  uint32_t type;
+  //! the length of the pending data
+  uint32_t pendingLen;
+  //! the length of the application state
+  uint32_t stateLen;
+};
 
-  case WS_DATA_TYPE_TEXT:
-    opcode = WS_OPCODE_TEXT;
-    break;
+//! context that is used while handing over the connections
+struct handover_ctx {
+  //! pointer to the websocket descriptor
+  struct websocket_server_desc *wsDesc;
+  //! the unix socket that is connected to the other process
+  int fd;
+  //! mutex that protects count
+  pthread_mutex_t mutex;
+  //! the number of connections that were handed over
+  int count;
+};
 
-  default:
-    ezwebsocket_log(EZLOG_ERROR, "unknown data type\n");
+/**
+ * \brief Sends a handover message with an optional file descriptor
+ *
+ * \param fd The unix socket that is connected to the other process
+ * \param type The message type
+ * \param passFd The file descriptor that should be passed (-1 => none)
+ * \param *pending The pending data of the connection (can be NULL)
+ * \param pendingLen The length of the pending data
+ * \param *state The application state of the connection (can be NULL)
+ * \param stateLen The length of the application state
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendHandoverMsg(int fd, enum handover_msg_type type, int passFd, const void *pending,
+                size_t pendingLen, const void *state, size_t stateLen)
+{
+  struct handover_msg msg = { .type = type, .pendingLen = pendingLen, .stateLen = stateLen };
+  struct iovec iov[3] = {
+    { .iov_base = &msg, .iov_len = sizeof(msg) },
+    { .iov_base = (void *) pending, .iov_len = pendingLen },
+    { .iov_base = (void *) state, .iov_len = stateLen },
+  };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msgHdr = { 0 };
+  struct cmsghdr *cmsg;
+
+  msgHdr.msg_iov = iov;
+  msgHdr.msg_iovlen = 3;
+
+  if (passFd >= 0) {
+    memset(&control, 0, sizeof(control));
+    msgHdr.msg_control = control.buf;
+    msgHdr.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msgHdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+  }
+
+  if (sendmsg(fd, &msgHdr, MSG_NOSIGNAL) < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "sendmsg failed: %s\n", strerror(errno));
     return -1;
   }
 
-  return sendDataLowLevel(wsConnectionDesc, opcode, false, masked, msg, len);
+  return 0;
 }
 
 /**
- * \brief Continues a fragmented send
- *         use sendDataFragmentedStop to stop the transmission
- *
- * \param *wsConnectionDesc Pointer to the websocket connection descriptor
- * \param fin True => this is the last fragment else false
- * \param *msg The payload data
- * \param len The payload length
+ * \brief Receives a handover message
  *
- * \return 0 if successful else -1
+ * \param fd The unix socket that is connected to the other process
+ * \param *buffer The buffer for the message
+ * \param len The size of the buffer
+ * \param *passFd Pointer to where the passed file descriptor should be stored (-1 => none)
  *
+ * \return The message type or -1 in case of error
  */
-int
-websocket_sendDataFragmentedCont(struct websocket_connection_desc *wsConnectionDesc, bool fin,
-                                 const void *msg, size_t len)
+static int
+recvHandoverMsg(int fd, void *buffer, size_t len, int *passFd)
 {
-  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+  struct handover_msg *msg = buffer;
+  struct iovec iov = { .iov_base = buffer, .iov_len = len };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msgHdr = { 0 };
+  struct cmsghdr *cmsg;
+  ssize_t n;
+
+  *passFd = -1;
+  msgHdr.msg_iov = &iov;
+  msgHdr.msg_iovlen = 1;
+  msgHdr.msg_control = control.buf;
+  msgHdr.msg_controllen = sizeof(control.buf);
+
+  n = recvmsg(fd, &msgHdr, MSG_CMSG_CLOEXEC);
+  if (n < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "recvmsg failed: %s\n", strerror(errno));
+    return -1;
+  }
 
-  if (wsConnectionDesc->state != WS_STATE_CONNECTED)
+  for (cmsg = CMSG_FIRSTHDR(&msgHdr); cmsg; cmsg = CMSG_NXTHDR(&msgHdr, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+      memcpy(passFd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (((size_t) n < sizeof(*msg)) || (msgHdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      ((size_t) n != sizeof(*msg) + msg->pendingLen + msg->stateLen)) {
+    ezwebsocket_log(EZLOG_ERROR, "invalid handover message\n");
+    if (*passFd >= 0)
+      close(*passFd);
+    *passFd = -1;
     return -1;
+  }
 
-  return sendDataLowLevel(wsConnectionDesc, WS_OPCODE_CONTINUATION, fin, masked, msg, len);
+  return msg->type;
 }
 
 /**
- * \brief Closes the given websocket connection
+ * \brief Hands over the given connection to the other process
  *
- * \param *wsConnectionDesc Pointer to the websocket connection descriptor
- * \param code The closing code
+ * \param *ctx Pointer to the handover context
+ * \param *socketConnectionDesc The connection descriptor from the socket server
+ * \param *connectionUserData The websocket connection descriptor
+ * \param fd The file descriptor of the connection
+ * \param *pending The data that was received but not processed yet
+ * \param pendingLen The length of the pending data
+ *
+ * \return true if the connection was handed over else false
  */
-void
-websocket_closeConnection(struct websocket_connection_desc *wsConnectionDesc,
-                          enum ws_close_code code)
+static bool
+handoverConnection(void *ctx, struct socket_connection_desc *socketConnectionDesc,
+                   void *connectionUserData, int fd, const void *pending, size_t pendingLen)
 {
-  unsigned char help[2];
-  bool masked = (wsConnectionDesc->wsType == WS_TYPE_CLIENT);
+  struct handover_ctx *handoverCtx = ctx;
+  struct websocket_server_desc *wsDesc = handoverCtx->wsDesc;
+  struct websocket_connection_desc *wsConnectionDesc = connectionUserData;
+  void *state = NULL;
+  size_t stateLen = 0;
+  int rc;
+  (void) socketConnectionDesc;
 
-  help[0] = (unsigned long) code >> 8;
-  help[1] = (unsigned long) code & 0xFF;
+  // only connections that are between two messages can be handed over
+  if ((wsConnectionDesc == NULL) || (wsConnectionDesc->state != WS_STATE_CONNECTED) ||
+      wsConnectionDesc->lastMessage.firstReceived || (pendingLen > HANDOVER_MAX_PENDING))
+    return false;
 
-  sendDataLowLevel(wsConnectionDesc, WS_OPCODE_DISCONNECT, true, masked, help, 2);
+  // the channels, the relay pairing, the session and the http/2 state can't be handed over
+  if (wsConnectionDesc->multiplexed || wsConnectionDesc->relayPeer || wsConnectionDesc->session ||
+      wsConnectionDesc->h2Session)
+    return false;
 
-  if (wsConnectionDesc->lastMessage.data && wsConnectionDesc->lastMessage.complete)
-    refcnt_unref(wsConnectionDesc->lastMessage.data);
-  else
-    free(wsConnectionDesc->lastMessage.data);
+  if (wsDesc->ws_onHandover) {
+    state = malloc(WS_HANDOVER_STATE_MAX);
+    if (!state) {
+      ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+      return false;
+    }
+    stateLen = wsDesc->ws_onHandover(wsDesc->wsSocketUserData, wsConnectionDesc,
+                                     wsConnectionDesc->connectionUserData, state,
+                                     WS_HANDOVER_STATE_MAX);
+    if (stateLen > WS_HANDOVER_STATE_MAX) {
+      ezwebsocket_log(EZLOG_ERROR, "handover state too big\n");
+      free(state);
+      return false;
+    }
+  }
 
-  wsConnectionDesc->lastMessage.data = NULL;
-  wsConnectionDesc->lastMessage.len = 0;
-  wsConnectionDesc->lastMessage.complete = 0;
+  rc = sendHandoverMsg(handoverCtx->fd, HANDOVER_MSG_CONNECTION, fd, pending, pendingLen, state,
+                       stateLen);
+  free(state);
+  if (rc < 0)
+    return false;
 
-  switch (wsConnectionDesc->wsType) {
-  case WS_TYPE_SERVER:
-    socketServer_closeConnection(wsConnectionDesc->socketClientDesc);
-    break;
+  pthread_mutex_lock(&handoverCtx->mutex);
+  handoverCtx->count++;
+  pthread_mutex_unlock(&handoverCtx->mutex);
 
-  case WS_TYPE_CLIENT:
-    socketClient_closeConnection(wsConnectionDesc->socketClientDesc);
-    break;
-  }
+  return true;
 }
 
 /**
- * \brief returns the user data of the given client
- *
- * \param *wsConnectionDesc Pointer to the websocket client descriptor
+ * \brief hands over the listening socket (and the connections) of the given websocket server
+ *        to another process that calls websocketServer_takeover
  *
- * \ŗeturn The user data of the given connection
+ * \param *wsDesc Pointer to the websocket descriptor
+ * \param *path The path of the unix socket that is used for the handover
+ * \param connections true => hand over the established connections too
+ * \param timeoutMs The maximum time to wait for the other process in milliseconds
  *
+ * \return The number of connections that were handed over or -1 in case of error
  */
-void *
-websocket_getConnectionUserData(struct websocket_connection_desc *wsConnectionDesc)
+int
+websocketServer_handover(struct websocket_server_desc *wsDesc, const char *path, bool connections,
+                         int timeoutMs)
 {
-  return wsConnectionDesc->connectionUserData;
+  struct handover_ctx handoverCtx = { .wsDesc = wsDesc, .fd = -1, .count = 0 };
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct pollfd pfd;
+  int unixFd;
+  int listenFd;
+  int rc;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): path too long\n", __func__);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  unixFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (unixFd < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "socket failed\n");
+    return -1;
+  }
+
+  unlink(path);
+  if ((bind(unixFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(unixFd, 1) < 0)) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): couldn't listen on %s\n", __func__, path);
+    close(unixFd);
+    return -1;
+  }
+
+  pfd.fd = unixFd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeoutMs) > 0)
+    handoverCtx.fd = accept4(unixFd, NULL, NULL, SOCK_CLOEXEC);
+  close(unixFd);
+  unlink(path);
+
+  if (handoverCtx.fd < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): no process to hand over to\n", __func__);
+    return -1;
+  }
+
+  listenFd = socketServer_detachListener(wsDesc->socketDesc);
+  if (listenFd < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): server isn't listening\n", __func__);
+    close(handoverCtx.fd);
+    return -1;
+  }
+
+  rc = sendHandoverMsg(handoverCtx.fd, HANDOVER_MSG_LISTENER, listenFd, NULL, 0, NULL, 0);
+  close(listenFd);
+  if (rc < 0) {
+    close(handoverCtx.fd);
+    return -1;
+  }
+
+  if (connections) {
+    pthread_mutex_init(&handoverCtx.mutex, NULL);
+    socketServer_handover(wsDesc->socketDesc, handoverConnection, &handoverCtx);
+    pthread_mutex_destroy(&handoverCtx.mutex);
+  }
+
+  rc = sendHandoverMsg(handoverCtx.fd, HANDOVER_MSG_END, -1, NULL, 0, NULL, 0);
+  close(handoverCtx.fd);
+
+  return rc < 0 ? -1 : handoverCtx.count;
 }
 
 /**
- * \brief opens a websocket server
+ * \brief opens a websocket server with the listening socket (and the connections) of another
+ *        process that calls websocketServer_handover
  *
  * \param *wsInit Pointer to the init struct
  * \param *websocketUserData userData for the socket
+ * \param *path The path of the unix socket that is used for the handover
  *
  * \return The websocket descriptor or NULL in case of error
- *         it can be passed to websocket_ref if it is used
- *         at more places
  */
 struct websocket_server_desc *
-websocketServer_open(struct websocket_server_init *wsInit, void *websocketUserData)
+websocketServer_takeover(struct websocket_server_init *wsInit, void *websocketUserData,
+                         const char *path)
 {
-  struct socket_server_init socketInit;
-  struct websocket_server_desc *wsDesc;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct timeval tv = { .tv_sec = MESSAGE_TIMEOUT_S, .tv_usec = 0 };
+  struct websocket_server_desc *wsDesc = NULL;
+  struct handover_msg *msg;
+  char *buffer = NULL;
+  size_t bufferLen;
+  int unixFd;
+  int passFd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): path too long\n", __func__);
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
 
-  wsDesc = refcnt_allocate(sizeof(struct websocket_server_desc), NULL);
-  if (!wsDesc) {
-    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+  unixFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (unixFd < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "socket failed\n");
     return NULL;
   }
-  memset(wsDesc, 0, sizeof(struct websocket_server_desc));
 
-  wsDesc->ws_onOpen = wsInit->ws_onOpen;
-  wsDesc->ws_onClose = wsInit->ws_onClose;
-  wsDesc->ws_onCloseLegacy = NULL;
-  wsDesc->ws_onMessage = wsInit->ws_onMessage;
-  wsDesc->wsSocketUserData = websocketUserData;
+  if (connect(unixFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): couldn't connect to %s\n", __func__, path);
+    goto ERROR;
+  }
 
-  socketInit.address = wsInit->address;
-  socketInit.port = wsInit->port;
-  socketInit.socket_onOpen = websocketServer_onOpen;
-  socketInit.socket_onClose = websocket_onClose;
-  socketInit.socket_onMessage = websocket_onMessage;
+  if (setsockopt(unixFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    ezwebsocket_log(EZLOG_ERROR, "setsockopt SO_RCVTIMEO failed\n");
 
-  wsDesc->socketDesc = socketServer_open(&socketInit, wsDesc);
-  if (!wsDesc->socketDesc) {
-    ezwebsocket_log(EZLOG_ERROR, "socketServer_open failed\n");
-    refcnt_unref(wsDesc);
-    return NULL;
+  bufferLen = sizeof(struct handover_msg) + HANDOVER_MAX_PENDING + WS_HANDOVER_STATE_MAX;
+  buffer = malloc(bufferLen);
+  if (!buffer) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    goto ERROR;
   }
+  msg = (struct handover_msg *) buffer;
 
-  return wsDesc;
-}
+  if ((recvHandoverMsg(unixFd, buffer, bufferLen, &passFd) != HANDOVER_MSG_LISTENER) ||
+      (passFd < 0)) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): didn't receive the listening socket\n", __func__);
+    if (passFd >= 0)
+      close(passFd);
+    goto ERROR;
+  }
 
-/**
- * \brief closes the given websocket server
- *        and decreases the reference counter of wsDesc by 1
- *
- * \param *wsDesc Pointer to the websocket descriptor
- *
- */
-void
-websocketServer_close(struct websocket_server_desc *wsDesc)
-{
-  socketServer_close(wsDesc->socketDesc);
-  refcnt_unref(wsDesc);
+  wsDesc = openServer(wsInit, websocketUserData, passFd);
+  if (!wsDesc) {
+    close(passFd);
+    goto ERROR;
+  }
+
+  for (;;) {
+    switch (recvHandoverMsg(unixFd, buffer, bufferLen, &passFd)) {
+    case HANDOVER_MSG_CONNECTION:
+      if (passFd < 0)
+        continue;
+      if (socketServer_adoptConnection(wsDesc->socketDesc, passFd, &buffer[sizeof(*msg)],
+                                       msg->pendingLen, &buffer[sizeof(*msg) + msg->pendingLen],
+                                       msg->stateLen) < 0)
+        ezwebsocket_log(EZLOG_ERROR, "socketServer_adoptConnection failed\n");
+      continue;
+
+    case HANDOVER_MSG_END:
+      break;
+
+    default:
+      // the listening socket works anyway so keep the server running
+      ezwebsocket_log(EZLOG_ERROR, "%s(): handover incomplete\n", __func__);
+      if (passFd >= 0)
+        close(passFd);
+      break;
+    }
+    break;
+  }
+
+ERROR:
+  free(buffer);
+  close(unixFd);
+  return wsDesc;
 }
 
 /**
@@ -1720,11 +6225,13 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
   struct socket_client_init socketInit = { 0 };
   struct websocket_connection_desc *wsConnection;
 
-  wsConnection = refcnt_allocate(sizeof(struct websocket_connection_desc), freeConnection);
+  wsConnection = refcnt_allocate(sizeof(struct websocket_connection_desc), destroyConnection);
   if (wsConnection == NULL) {
     goto ERROR;
   }
   memset(wsConnection, 0, sizeof(struct websocket_connection_desc));
+  pthread_mutex_init(&wsConnection->channelMutex, NULL);
+  pthread_mutex_init(&wsConnection->outboxMutex, NULL);
 
   wsConnection->wsType = WS_TYPE_CLIENT;
   wsConnection->state = WS_STATE_HANDSHAKE;
@@ -1745,6 +6252,18 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
   wsConnection->wsDesc.wsClientDesc->ws_onOpen = wsInit->ws_onOpen;
   wsConnection->wsDesc.wsClientDesc->ws_onClose = wsInit->ws_onClose;
   wsConnection->wsDesc.wsClientDesc->ws_onMessage = wsInit->ws_onMessage;
+  wsConnection->wsDesc.wsClientDesc->ws_onWatch = wsInit->ws_onWatch;
+  wsConnection->wsDesc.wsClientDesc->channels = wsInit->channels;
+  wsConnection->wsDesc.wsClientDesc->ws_onChannelOpen = wsInit->ws_onChannelOpen;
+  wsConnection->wsDesc.wsClientDesc->resumable = wsInit->resumable;
+  if (wsInit->resumable && wsInit->resumeToken) {
+    if (strlen(wsInit->resumeToken) != WS_SESSION_TOKEN_LEN) {
+      ezwebsocket_log(EZLOG_ERROR, "invalid session token\n");
+      goto ERROR;
+    }
+    strcpy(wsConnection->wsDesc.wsClientDesc->resumeToken, wsInit->resumeToken);
+    wsConnection->wsDesc.wsClientDesc->resumeSeq = wsInit->resumeSeq;
+  }
   wsConnection->wsDesc.wsClientDesc->connection = wsConnection;
 
   wsConnection->socketClientDesc = NULL;
@@ -1753,7 +6272,9 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
     ezwebsocket_log(EZLOG_ERROR, "strdup failed\n");
     goto ERROR;
   }
-  wsConnection->wsDesc.wsClientDesc->port = strdup(wsInit->port);
+  // the port isn't used for unix sockets
+  wsConnection->wsDesc.wsClientDesc->port =
+    strdup(unixSocket_isAddress(wsInit->address) ? "0" : wsInit->port);
   if (wsConnection->wsDesc.wsClientDesc->port == NULL) {
     ezwebsocket_log(EZLOG_ERROR, "strdup failed\n");
     goto ERROR;
@@ -1764,22 +6285,27 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
     goto ERROR;
   }
 
-  uint32_t tempPort = strtoul(wsInit->port, NULL, 10);
-  if ((tempPort == 0) || (tempPort > USHRT_MAX)) {
+  uint32_t tempPort = strtoul(wsConnection->wsDesc.wsClientDesc->port, NULL, 10);
+  if (((tempPort == 0) || (tempPort > USHRT_MAX)) && !unixSocket_isAddress(wsInit->address)) {
     ezwebsocket_log(EZLOG_ERROR, "port outside allowed range\n");
     goto ERROR;
   }
 
   socketInit.port = tempPort;
-  socketInit.keepalive = wsInit->keepalive;
-  socketInit.keep_idle_sec = wsInit->keep_idle_sec;
-  socketInit.keep_cnt = wsInit->keep_cnt;
-  socketInit.keep_intvl = wsInit->keep_intvl;
+  resolveSocketOptions(&wsInit->socketOptions, false, &socketInit.options);
+  if (wsInit->keepalive) {
+    socketInit.options.keepalive = true;
+    socketInit.options.keepIdleSec = wsInit->keep_idle_sec;
+    socketInit.options.keepCnt = wsInit->keep_cnt;
+    socketInit.options.keepIntvlSec = wsInit->keep_intvl;
+  }
   socketInit.secure = wsInit->secure;
+  socketInit.tlsRecordSize = wsInit->tlsRecordSize;
   socketInit.address = wsInit->address;
   socketInit.socket_onOpen = websocketClient_onOpen;
   socketInit.socket_onClose = websocket_onClose;
   socketInit.socket_onMessage = websocket_onMessage;
+  socketInit.socket_onWatch = wsInit->ws_onWatch ? websocketClient_onWatch : NULL;
 
   wsConnection->socketClientDesc = socketClient_open(&socketInit, wsConnection);
   if (!wsConnection->socketClientDesc) {
@@ -1789,6 +6315,12 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
 
   socketClient_start(wsConnection->socketClientDesc);
 
+  // in threadless mode ws_onOpen signals the completed handshake
+  if (wsInit->ws_onWatch) {
+    socketClient_setTimeout(wsConnection->socketClientDesc, MESSAGE_TIMEOUT_S * 1000);
+    return wsConnection;
+  }
+
   struct timespec timeoutStartTime;
   struct timespec currentTime;
 
@@ -1801,6 +6333,9 @@ websocketClient_open(struct websocket_client_init *wsInit, void *websocketUserDa
     usleep(10000);
   }
 
+  if (wsConnection->state != WS_STATE_CONNECTED)
+    goto ERROR;
+
   return wsConnection;
 
 ERROR:
@@ -1867,6 +6402,33 @@ websocket_unref(void *ptr)
   refcnt_unref(ptr);
 }
 
+/**
+ * \brief Processes the events of an fd that was passed to ws_onWatch (threadless mode),
+ *        the connections that used up their read budget (round robin) and all expired timeouts
+ *
+ * \param fd The file descriptor (use -1 if only the timeouts should be processed)
+ * \param events The poll events that occured on the fd
+ *
+ * \return 0 if successful else -1 (fd unknown)
+ */
+int
+websocket_process(int fd, int events)
+{
+  return eventLoop_process(fd, events);
+}
+
+/**
+ * \brief Returns the time until websocket_process has to be called for the next timeout
+ *
+ * \return The timeout in milliseconds (0 if a connection has data left that exceeded its read
+ *         budget) or -1 if there is no timeout pending
+ */
+int
+websocket_nextTimeout(void)
+{
+  return eventLoop_nextTimeout();
+}
+
 /* ------------------------------ LEGACY FUNCTIONS ------------------------------ */
 
 /**
@@ -1884,7 +6446,7 @@ websocket_unref(void *ptr)
 void *
 websocket_open(struct websocket_init *wsInit, void *websocketUserData)
 {
-  struct socket_server_init socketInit;
+  struct socket_server_init socketInit = { 0 };
   struct websocket_server_desc *wsDesc;
 
   wsDesc = refcnt_allocate(sizeof(struct websocket_server_desc), NULL);
@@ -1902,16 +6464,23 @@ websocket_open(struct websocket_init *wsInit, void *websocketUserData)
   wsDesc->ws_onMessage = (void (*)(void *, struct websocket_connection_desc *, void *,
                                    enum ws_data_type, void *, size_t)) wsInit->ws_onMessage;
   wsDesc->wsSocketUserData = websocketUserData;
+  pthread_mutex_init(&wsDesc->rateMutex, NULL);
+  pthread_mutex_init(&wsDesc->sessionMutex, NULL);
 
   socketInit.address = wsInit->address;
   socketInit.port = wsInit->port;
   socketInit.socket_onOpen = websocketServer_onOpen;
   socketInit.socket_onClose = websocket_onClose;
   socketInit.socket_onMessage = websocket_onMessage;
+  socketInit.listenFd = -1;
+  socketInit.rejectMsg = WS_REJECT_REPLY;
+  resolveSocketOptions(&socketProfiles[WS_SOCKET_PROFILE_DEFAULT], true, &socketInit.options);
 
   wsDesc->socketDesc = socketServer_open(&socketInit, wsDesc);
   if (!wsDesc->socketDesc) {
     ezwebsocket_log(EZLOG_ERROR, "socketServer_open failed\n");
+    pthread_mutex_destroy(&wsDesc->rateMutex);
+    pthread_mutex_destroy(&wsDesc->sessionMutex);
     refcnt_unref(wsDesc);
     return NULL;
   }
@@ -0,0 +1,1820 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "http2.h"
+#include "utils/dyn_buffer.h"
+#include "utils/hpack.h"
+#include "utils/ref_count.h"
+#include <ezwebsocket_log.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! the connection preface of the client
+#define H2_PREFACE            "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+//! the length of the connection preface
+#define H2_PREFACE_LEN        24
+//! the length of a frame header
+#define H2_FRAME_HEADER_LEN   9
+//! the maximum frame size we accept (SETTINGS_MAX_FRAME_SIZE is never raised)
+#define H2_MAX_FRAME_SIZE     16384
+//! the initial window size defined by RFC 7540
+#define H2_DEFAULT_WINDOW     65535
+//! the largest allowed window
+#define H2_MAX_WINDOW         0x7FFFFFFF
+//! the receive window of a stream
+#define H2_STREAM_WINDOW      (256 * 1024)
+//! the receive window of the connection
+#define H2_CONNECTION_WINDOW  (1024 * 1024)
+//! the maximum number of concurrent streams of a session
+#define H2_MAX_STREAMS        100
+//! the maximum number of headers of a request
+#define H2_MAX_HEADERS        64
+//! the maximum size of a header block
+#define H2_MAX_HEADER_BLOCK   (64 * 1024)
+//! the maximum amount of data that is queued per stream while the window is exhausted
+#define H2_MAX_PENDING        (16 * 1024 * 1024)
+//! the amount of queued frames at which the data of the streams waits until they were sent
+#define H2_MAX_QUEUED         (256 * 1024)
+
+//! the frame types
+enum h2_frame_type {
+  H2_FRAME_DATA = 0x0,
+  H2_FRAME_HEADERS = 0x1,
+  H2_FRAME_PRIORITY = 0x2,
+  H2_FRAME_RST_STREAM = 0x3,
+  H2_FRAME_SETTINGS = 0x4,
+  H2_FRAME_PUSH_PROMISE = 0x5,
+  H2_FRAME_PING = 0x6,
+  H2_FRAME_GOAWAY = 0x7,
+  H2_FRAME_WINDOW_UPDATE = 0x8,
+  H2_FRAME_CONTINUATION = 0x9,
+};
+
+//! the frame flags
+enum h2_flag {
+  H2_FLAG_END_STREAM = 0x01,
+  H2_FLAG_ACK = 0x01,
+  H2_FLAG_END_HEADERS = 0x04,
+  H2_FLAG_PADDED = 0x08,
+  H2_FLAG_PRIORITY = 0x20,
+};
+
+//! the settings identifiers
+enum h2_setting {
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+  H2_SETTINGS_ENABLE_CONNECT_PROTOCOL = 0x8,
+};
+
+//! the error codes
+enum h2_error {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_CANCEL = 0x8,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+//! a header of a request
+struct http2_header {
+  //! the header name (lower case)
+  char *name;
+  //! the header value
+  char *value;
+};
+
+//! structure that contains information about a stream
+struct http2_stream {
+  //! pointer to the session (referenced)
+  struct http2_session *session;
+  //! the stream id
+  uint32_t id;
+  //! the user data that was returned by onStreamOpen
+  void *userData;
+  //! indicates that onStreamOpen accepted the stream
+  bool accepted;
+  //! indicates that the response headers were sent
+  bool responded;
+  //! indicates that the stream was removed from the session
+  bool closed;
+  //! indicates that the peer ended the stream
+  bool remoteEnd;
+  //! indicates that END_STREAM is sent once the pending data is sent
+  bool endPending;
+  //! indicates that no data is passed to onStreamData until resumeTime (http2_pauseStream)
+  bool paused;
+  //! the time when a paused stream is resumed (CLOCK_MONOTONIC)
+  struct timespec resumeTime;
+  //! the send window of the stream
+  long long sendWindow;
+  //! the receive window of the stream
+  long long recvWindow;
+  //! the processed bytes that weren't acknowledged with a WINDOW_UPDATE yet
+  size_t recvUnacked;
+  //! the bytes at the end of received that are held back while the stream is paused (the
+  //! window isn't given back for them until they are processed)
+  size_t recvHeld;
+  //! the headers of the request
+  struct http2_header headers[H2_MAX_HEADERS];
+  //! the number of headers
+  size_t numHeaders;
+  //! data that waits for the send window
+  struct dyn_buffer pending;
+  //! data that was received but not processed by onStreamData yet
+  struct dyn_buffer received;
+  //! the next stream that waits for onStreamClose
+  struct http2_stream *nextClosed;
+};
+
+//! structure that contains information about a session
+struct http2_session {
+  //! the callbacks
+  struct http2_callbacks callbacks;
+  //! the user data that is passed to the callbacks
+  void *userData;
+  //! the transport that is passed to send and close
+  void *transport;
+  //! mutex that protects the session state, the streams and the output
+  pthread_mutex_t lock;
+  //! the hpack decoder of the session
+  struct hpack_table decoder;
+  //! the open streams
+  struct http2_stream *streams[H2_MAX_STREAMS];
+  //! the number of open streams
+  size_t numStreams;
+  //! the highest stream id that was opened by the peer
+  uint32_t lastStreamId;
+  //! indicates that the connection preface was received
+  bool prefaceReceived;
+  //! indicates that no new streams are accepted
+  bool goingAway;
+  //! indicates that the session failed or was closed
+  bool closed;
+  //! indicates that http2_process is running (stream close callbacks are deferred)
+  bool processing;
+  //! the send window of the connection
+  long long sendWindow;
+  //! the processed bytes that weren't acknowledged with a WINDOW_UPDATE yet
+  size_t recvUnacked;
+  //! the initial send window of new streams (SETTINGS_INITIAL_WINDOW_SIZE of the peer)
+  long long peerInitialWindow;
+  //! the maximum frame size of the peer
+  size_t peerMaxFrameSize;
+  //! the header block that is currently received
+  struct dyn_buffer headerBlock;
+  //! the stream id of the header block that is currently received (0 => none)
+  uint32_t headerStreamId;
+  //! indicates that the header block that is currently received ends the stream
+  bool headerEndStream;
+  //! streams that were closed and wait for onStreamClose
+  struct http2_stream *closedStreams;
+  //! the frames that are queued for the transport
+  struct dyn_buffer output;
+  //! indicates that a thread writes the output to the transport
+  bool sending;
+  //! indicates that the transport is closed once the output was written
+  bool closePending;
+};
+
+/**
+ * \brief reads a 32 bit big endian value
+ *
+ * \param *data Pointer to the data
+ *
+ * \return The value
+ */
+static uint32_t
+readU32(const unsigned char *data)
+{
+  return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) |
+         data[3];
+}
+
+/**
+ * \brief writes a 32 bit big endian value
+ *
+ * \param *data Pointer to where the value is stored
+ * \param value The value
+ */
+static void
+writeU32(unsigned char *data, uint32_t value)
+{
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+/**
+ * \brief creates a frame header
+ *
+ * \param *header Pointer to where the header is stored (H2_FRAME_HEADER_LEN bytes)
+ * \param type The frame type
+ * \param flags The frame flags
+ * \param streamId The stream id
+ * \param len The length of the payload
+ */
+static void
+createFrameHeader(unsigned char *header, enum h2_frame_type type, unsigned char flags,
+                  uint32_t streamId, size_t len)
+{
+  header[0] = len >> 16;
+  header[1] = len >> 8;
+  header[2] = len;
+  header[3] = type;
+  header[4] = flags;
+  writeU32(&header[5], streamId & H2_MAX_WINDOW);
+}
+
+/**
+ * \brief queues a frame for the transport, it's written once the session lock is released
+ *        (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param type The frame type
+ * \param flags The frame flags
+ * \param streamId The stream id
+ * \param *payload Pointer to the payload
+ * \param len The length of the payload
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendFrame(struct http2_session *session, enum h2_frame_type type, unsigned char flags,
+          uint32_t streamId, const void *payload, size_t len)
+{
+  size_t size = H2_FRAME_HEADER_LEN + len;
+
+  if (session->closed)
+    return -1;
+
+  // the output at least doubles when it grows so that queuing many small frames stays cheap
+  if (DYNBUFFER_BYTES_FREE(&session->output) < size) {
+    if (dynBuffer_increase_to(&session->output,
+                              size > DYNBUFFER_SIZE(&session->output)
+                                ? size
+                                : DYNBUFFER_SIZE(&session->output)) < 0) {
+      // the frames that were queued are lost so the session can't go on
+      session->closed = true;
+      session->callbacks.close(session->transport);
+      return -1;
+    }
+  }
+
+  createFrameHeader((unsigned char *) DYNBUFFER_WRITE_POS(&session->output), type, flags,
+                    streamId, len);
+  DYNBUFFER_INCREASE_WRITE_POS(&session->output, H2_FRAME_HEADER_LEN);
+  if (len) {
+    memcpy(DYNBUFFER_WRITE_POS(&session->output), payload, len);
+    DYNBUFFER_INCREASE_WRITE_POS(&session->output, len);
+  }
+
+  return 0;
+}
+
+/**
+ * \brief sends a frame with a 32 bit payload (RST_STREAM, WINDOW_UPDATE)
+ *
+ * \param *session Pointer to the session
+ * \param type The frame type
+ * \param streamId The stream id
+ * \param value The value
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendFrameU32(struct http2_session *session, enum h2_frame_type type, uint32_t streamId,
+             uint32_t value)
+{
+  unsigned char payload[4];
+
+  writeU32(payload, value);
+  return sendFrame(session, type, 0, streamId, payload, sizeof(payload));
+}
+
+/**
+ * \brief marks the session as closed, the transport is closed once the queued frames were
+ *        written (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ */
+static void
+closeTransport(struct http2_session *session)
+{
+  session->closed = true;
+  session->closePending = true;
+}
+
+/**
+ * \brief sends GOAWAY with the given error and closes the transport (the session lock must be
+ *        held)
+ *
+ * \param *session Pointer to the session
+ * \param error The error code
+ */
+static void
+connectionError(struct http2_session *session, enum h2_error error)
+{
+  unsigned char payload[8];
+
+  if (session->closed)
+    return;
+
+  ezwebsocket_log(EZLOG_ERROR, "http2 connection error %d\n", error);
+  writeU32(&payload[0], session->lastStreamId);
+  writeU32(&payload[4], error);
+  sendFrame(session, H2_FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+  closeTransport(session);
+}
+
+/**
+ * \brief gives the peer the receive window back for bytes that were processed or discarded,
+ *        WINDOW_UPDATE is sent once half of a window was used (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param *stream Pointer to the stream or NULL if only the connection window is affected
+ * \param len The number of bytes
+ */
+static void
+releaseWindow(struct http2_session *session, struct http2_stream *stream, size_t len)
+{
+  session->recvUnacked += len;
+  if (session->recvUnacked >= H2_CONNECTION_WINDOW / 2) {
+    sendFrameU32(session, H2_FRAME_WINDOW_UPDATE, 0, session->recvUnacked);
+    session->recvUnacked = 0;
+  }
+
+  // the peer doesn't send on a stream it ended
+  if (!stream || stream->closed || stream->remoteEnd)
+    return;
+  stream->recvUnacked += len;
+  if (stream->recvUnacked >= H2_STREAM_WINDOW / 2) {
+    sendFrameU32(session, H2_FRAME_WINDOW_UPDATE, stream->id, stream->recvUnacked);
+    stream->recvWindow += stream->recvUnacked;
+    stream->recvUnacked = 0;
+  }
+}
+
+/**
+ * \brief frees the given stream when the last reference is gone
+ *
+ * \param *ptr Pointer to the stream
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+freeStream(void *ptr)
+{
+  struct http2_stream *stream = ptr;
+  size_t i;
+
+  for (i = 0; i < stream->numHeaders; i++)
+    free(stream->headers[i].name);
+  if (stream->pending.buffer)
+    dynBuffer_delete(&stream->pending);
+  if (stream->received.buffer)
+    dynBuffer_delete(&stream->received);
+  refcnt_unref(stream->session);
+}
+
+/**
+ * \brief frees the given session when the last reference is gone
+ *
+ * \param *ptr Pointer to the session
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+freeSession(void *ptr)
+{
+  struct http2_session *session = ptr;
+
+  hpack_free(&session->decoder);
+  if (session->headerBlock.buffer)
+    dynBuffer_delete(&session->headerBlock);
+  if (session->output.buffer)
+    dynBuffer_delete(&session->output);
+  pthread_mutex_destroy(&session->lock);
+}
+
+/**
+ * \brief removes the given stream from the session, onStreamClose is called by notifyClosed
+ *        (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param *stream Pointer to the stream
+ */
+static void
+removeStream(struct http2_session *session, struct http2_stream *stream)
+{
+  size_t i;
+
+  if (stream->closed)
+    return;
+
+  for (i = 0; i < session->numStreams; i++) {
+    if (session->streams[i] == stream) {
+      session->streams[i] = session->streams[--session->numStreams];
+      break;
+    }
+  }
+  stream->closed = true;
+  // the reference of the session is passed on to the list
+  stream->nextClosed = session->closedStreams;
+  session->closedStreams = stream;
+
+  // the data that was held back for the stream is discarded
+  releaseWindow(session, NULL, stream->recvHeld);
+  stream->recvHeld = 0;
+
+  if (session->goingAway && !session->numStreams && !session->closed)
+    closeTransport(session);
+}
+
+/**
+ * \brief calls onStreamClose for the streams that were removed from the session
+ *
+ * \param *session Pointer to the session
+ */
+static void
+notifyClosed(struct http2_session *session)
+{
+  struct http2_stream *stream;
+
+  refcnt_ref(session);
+  for (;;) {
+    pthread_mutex_lock(&session->lock);
+    stream = session->closedStreams;
+    if (stream)
+      session->closedStreams = stream->nextClosed;
+    pthread_mutex_unlock(&session->lock);
+    if (!stream)
+      break;
+
+    if (stream->accepted)
+      session->callbacks.onStreamClose(session->userData, stream, stream->userData);
+    refcnt_unref(stream);
+  }
+  refcnt_unref(session);
+}
+
+/**
+ * \brief looks up a stream of the session (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param streamId The stream id
+ *
+ * \return Pointer to the stream or NULL if there is no open stream with this id
+ */
+static struct http2_stream *
+findStream(struct http2_session *session, uint32_t streamId)
+{
+  size_t i;
+
+  for (i = 0; i < session->numStreams; i++) {
+    if (session->streams[i]->id == streamId)
+      return session->streams[i];
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief queues as much of the given data as the send windows and the output allow (the
+ *        session lock must be held)
+ *
+ * \param *stream Pointer to the stream
+ * \param *data Pointer to the data
+ * \param len The length of the data
+ *
+ * \return The number of bytes that were queued or -1 on error
+ */
+static long
+writeData(struct http2_stream *stream, const unsigned char *data, size_t len)
+{
+  struct http2_session *session = stream->session;
+  size_t sent = 0;
+  size_t chunk;
+
+  while ((len - sent) && (DYNBUFFER_SIZE(&session->output) < H2_MAX_QUEUED)) {
+    chunk = len - sent;
+    if ((long long) chunk > stream->sendWindow)
+      chunk = stream->sendWindow > 0 ? stream->sendWindow : 0;
+    if ((long long) chunk > session->sendWindow)
+      chunk = session->sendWindow > 0 ? session->sendWindow : 0;
+    if (chunk > session->peerMaxFrameSize)
+      chunk = session->peerMaxFrameSize;
+    if (!chunk)
+      break;
+
+    if (sendFrame(session, H2_FRAME_DATA, 0, stream->id, &data[sent], chunk) < 0)
+      return -1;
+    stream->sendWindow -= chunk;
+    session->sendWindow -= chunk;
+    sent += chunk;
+  }
+
+  return sent;
+}
+
+/**
+ * \brief sends the pending data of the stream and ends the stream if requested (the session
+ *        lock must be held)
+ *
+ * \param *stream Pointer to the stream
+ */
+static void
+flushStream(struct http2_stream *stream)
+{
+  struct http2_session *session = stream->session;
+  long sent;
+
+  if (stream->closed)
+    return;
+
+  if (DYNBUFFER_SIZE(&stream->pending)) {
+    sent = writeData(stream, (unsigned char *) DYNBUFFER_BUFFER(&stream->pending),
+                     DYNBUFFER_SIZE(&stream->pending));
+    if (sent < 0) {
+      removeStream(session, stream);
+      return;
+    }
+    dynBuffer_removeLeadingBytes(&stream->pending, sent);
+  }
+
+  if (stream->endPending && !DYNBUFFER_SIZE(&stream->pending)) {
+    sendFrame(session, H2_FRAME_DATA, H2_FLAG_END_STREAM, stream->id, NULL, 0);
+    // tell the peer to stop sending (like closing a socket)
+    if (!stream->remoteEnd)
+      sendFrameU32(session, H2_FRAME_RST_STREAM, stream->id, H2_NO_ERROR);
+    removeStream(session, stream);
+  }
+}
+
+/**
+ * \brief sends the pending data of all streams (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ */
+static void
+flushStreams(struct http2_session *session)
+{
+  size_t i;
+
+  // flushStream may remove the stream so the list is walked backwards
+  for (i = session->numStreams; i > 0; i--)
+    flushStream(session->streams[i - 1]);
+}
+
+/**
+ * \brief writes the queued frames to the transport, only one thread writes at a time so that
+ *        the frames keep their order, the others just queue theirs (the session lock must be
+ *        held, it's released while the transport is written)
+ *
+ * \param *session Pointer to the session
+ */
+static void
+flushOutput(struct http2_session *session)
+{
+  struct dyn_buffer output;
+  struct iovec iov;
+  int rc;
+
+  while (!session->sending && DYNBUFFER_SIZE(&session->output)) {
+    output = session->output;
+    dynBuffer_init(&session->output);
+    session->sending = true;
+    pthread_mutex_unlock(&session->lock);
+
+    iov.iov_base = DYNBUFFER_BUFFER(&output);
+    iov.iov_len = DYNBUFFER_SIZE(&output);
+    rc = session->callbacks.send(session->transport, &iov, 1);
+
+    pthread_mutex_lock(&session->lock);
+    session->sending = false;
+    if (rc > 0) {
+      // the frames go back in front of the ones that were queued meanwhile and are sent again
+      // with the next wakeup (http2_wakeup)
+      if (DYNBUFFER_SIZE(&session->output)) {
+        if (dynBuffer_increase_to(&output, DYNBUFFER_SIZE(&session->output)) < 0) {
+          rc = -1;
+        } else {
+          memcpy(DYNBUFFER_WRITE_POS(&output), DYNBUFFER_BUFFER(&session->output),
+                 DYNBUFFER_SIZE(&session->output));
+          DYNBUFFER_INCREASE_WRITE_POS(&output, DYNBUFFER_SIZE(&session->output));
+          dynBuffer_delete(&session->output);
+        }
+      }
+      if (rc > 0) {
+        session->output = output;
+        break;
+      }
+    }
+    dynBuffer_delete(&output);
+    if (rc < 0) {
+      if (session->output.buffer)
+        dynBuffer_delete(&session->output);
+      session->closePending = false;
+      if (!session->closed) {
+        session->closed = true;
+        session->callbacks.close(session->transport);
+      }
+      return;
+    }
+
+    // the data that waited for space in the output is next
+    if (!session->closed)
+      flushStreams(session);
+  }
+
+  // the transport is closed once the frames in front of it are out (e.g. GOAWAY)
+  if (!session->sending && session->closePending && !DYNBUFFER_SIZE(&session->output)) {
+    session->closePending = false;
+    session->callbacks.close(session->transport);
+  }
+}
+
+/**
+ * \brief writes the queued frames, unlocks the session and calls onStreamClose for the
+ *        removed streams unless http2_process is running (it does that when it's done)
+ *
+ * \param *session Pointer to the session
+ */
+static void
+unlockSession(struct http2_session *session)
+{
+  bool notify;
+
+  flushOutput(session);
+  notify = !session->processing && session->closedStreams;
+  pthread_mutex_unlock(&session->lock);
+  if (notify)
+    notifyClosed(session);
+}
+
+/**
+ * \brief checks if the given data starts with the HTTP/2 connection preface
+ *
+ * \param *data Pointer to the received data
+ * \param len The length of the data
+ *
+ * \return 1 if the preface is complete, 0 if more data is needed, -1 if it's not HTTP/2
+ */
+int
+http2_checkPreface(const void *data, size_t len)
+{
+  if (memcmp(data, H2_PREFACE, len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN))
+    return -1;
+
+  return len >= H2_PREFACE_LEN ? 1 : 0;
+}
+
+/**
+ * \brief opens a server session on the given transport and sends the SETTINGS of the server
+ *
+ * \param *callbacks Pointer to the callbacks (copied)
+ * \param *userData Pointer that is passed to the callbacks
+ * \param *transport Pointer that is passed to send and close
+ *
+ * \return Pointer to the session (release it with http2_close) or NULL on error
+ */
+struct http2_session *
+http2_open(const struct http2_callbacks *callbacks, void *userData, void *transport)
+{
+  struct http2_session *session;
+  unsigned char settings[18];
+  bool failed;
+
+  session = refcnt_allocate(sizeof(struct http2_session), freeSession);
+  if (!session) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return NULL;
+  }
+  memset(session, 0, sizeof(struct http2_session));
+  session->callbacks = *callbacks;
+  session->userData = userData;
+  session->transport = transport;
+  pthread_mutex_init(&session->lock, NULL);
+  hpack_init(&session->decoder, HPACK_DEFAULT_TABLE_SIZE);
+  dynBuffer_init(&session->headerBlock);
+  dynBuffer_init(&session->output);
+  session->sendWindow = H2_DEFAULT_WINDOW;
+  session->peerInitialWindow = H2_DEFAULT_WINDOW;
+  session->peerMaxFrameSize = H2_MAX_FRAME_SIZE;
+
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_ENABLE_CONNECT_PROTOCOL;
+  writeU32(&settings[2], 1);
+  settings[6] = 0;
+  settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+  writeU32(&settings[8], H2_STREAM_WINDOW);
+  settings[12] = 0;
+  settings[13] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  writeU32(&settings[14], H2_MAX_STREAMS);
+
+  pthread_mutex_lock(&session->lock);
+  sendFrame(session, H2_FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+  sendFrameU32(session, H2_FRAME_WINDOW_UPDATE, 0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+  flushOutput(session);
+  failed = session->closed;
+  pthread_mutex_unlock(&session->lock);
+
+  if (failed) {
+    refcnt_unref(session);
+    return NULL;
+  }
+
+  return session;
+}
+
+/**
+ * \brief stores a header of a new stream (hpack_decode callback)
+ *
+ * \param *ctx Pointer to the stream
+ * \param *name The header name
+ * \param nameLen The length of the name
+ * \param *value The header value
+ * \param valueLen The length of the value
+ *
+ * \return 0 if successful else -1
+ */
+static int
+storeHeader(void *ctx, const char *name, size_t nameLen, const char *value, size_t valueLen)
+{
+  struct http2_stream *stream = ctx;
+  struct http2_header *header;
+
+  if (stream->numHeaders >= H2_MAX_HEADERS)
+    return -1;
+
+  header = &stream->headers[stream->numHeaders];
+  header->name = malloc(nameLen + valueLen + 2);
+  if (!header->name)
+    return -1;
+  memcpy(header->name, name, nameLen);
+  header->name[nameLen] = '\0';
+  header->value = &header->name[nameLen + 1];
+  memcpy(header->value, value, valueLen);
+  header->value[valueLen] = '\0';
+  stream->numHeaders++;
+
+  return 0;
+}
+
+/**
+ * \brief ignores a header (hpack_decode callback for trailers and refused streams)
+ *
+ * \return always 0
+ */
+static int
+ignoreHeader(void *ctx, const char *name, size_t nameLen, const char *value, size_t valueLen)
+{
+  (void) ctx;
+  (void) name;
+  (void) nameLen;
+  (void) value;
+  (void) valueLen;
+
+  return 0;
+}
+
+/**
+ * \brief sends a response that only consists of a status (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param streamId The stream id
+ * \param *status The status code
+ * \param *protocol The value of sec-websocket-protocol (NULL => not sent)
+ * \param endStream True if the stream is ended with the response
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sendResponse(struct http2_session *session, uint32_t streamId, const char *status,
+             const char *protocol, bool endStream)
+{
+  unsigned char block[256];
+  size_t len;
+  size_t n;
+
+  len = hpack_encodeLiteral(block, sizeof(block), ":status", status);
+  if (!len)
+    return -1;
+  if (protocol) {
+    n = hpack_encodeLiteral(&block[len], sizeof(block) - len, "sec-websocket-protocol", protocol);
+    if (!n)
+      return -1;
+    len += n;
+  }
+
+  return sendFrame(session, H2_FRAME_HEADERS,
+                   H2_FLAG_END_HEADERS | (endStream ? H2_FLAG_END_STREAM : 0), streamId, block,
+                   len);
+}
+
+/**
+ * \brief handles the end of the stream by the peer, a paused stream ends once the data it
+ *        holds was passed on (the session lock must be held)
+ *
+ * \param *stream Pointer to the stream
+ */
+static void
+endRemote(struct http2_stream *stream)
+{
+  stream->remoteEnd = true;
+  if (stream->paused)
+    return;
+  stream->endPending = true;
+  flushStream(stream);
+}
+
+/**
+ * \brief handles a complete header block (the session lock must be held, it's released
+ *        while onStreamOpen is called)
+ *
+ * \param *session Pointer to the session
+ *
+ * \return 0 if successful else -1 (connection error)
+ */
+static int
+handleHeaderBlock(struct http2_session *session)
+{
+  uint32_t streamId = session->headerStreamId;
+  bool endStream = session->headerEndStream;
+  struct http2_stream *stream;
+  const char *method;
+  const char *protocol;
+  void *userData;
+  int rc;
+
+  session->headerStreamId = 0;
+
+  stream = findStream(session, streamId);
+  if (stream || (streamId <= session->lastStreamId)) {
+    // trailers (they still have to be decoded to keep the dynamic table in sync)
+    rc = hpack_decode(&session->decoder, (unsigned char *) DYNBUFFER_BUFFER(&session->headerBlock),
+                      DYNBUFFER_SIZE(&session->headerBlock), ignoreHeader, NULL);
+    dynBuffer_delete(&session->headerBlock);
+    if (rc < 0) {
+      connectionError(session, H2_COMPRESSION_ERROR);
+      return -1;
+    }
+    if (stream && endStream)
+      endRemote(stream);
+    return 0;
+  }
+
+  session->lastStreamId = streamId;
+  stream = refcnt_allocate(sizeof(struct http2_stream), freeStream);
+  if (!stream) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    dynBuffer_delete(&session->headerBlock);
+    connectionError(session, H2_INTERNAL_ERROR);
+    return -1;
+  }
+  memset(stream, 0, sizeof(struct http2_stream));
+  refcnt_ref(session);
+  stream->session = session;
+  stream->id = streamId;
+  stream->sendWindow = session->peerInitialWindow;
+  stream->recvWindow = H2_STREAM_WINDOW;
+  dynBuffer_init(&stream->pending);
+  dynBuffer_init(&stream->received);
+
+  rc = hpack_decode(&session->decoder, (unsigned char *) DYNBUFFER_BUFFER(&session->headerBlock),
+                    DYNBUFFER_SIZE(&session->headerBlock), storeHeader, stream);
+  dynBuffer_delete(&session->headerBlock);
+  if (rc < 0) {
+    refcnt_unref(stream);
+    connectionError(session, H2_COMPRESSION_ERROR);
+    return -1;
+  }
+
+  if (session->goingAway || (session->numStreams >= H2_MAX_STREAMS)) {
+    sendFrameU32(session, H2_FRAME_RST_STREAM, streamId, H2_REFUSED_STREAM);
+    refcnt_unref(stream);
+    return 0;
+  }
+
+  // only extended CONNECT requests for websockets are supported (RFC 8441)
+  method = http2_getHeader(stream, ":method");
+  protocol = http2_getHeader(stream, ":protocol");
+  if (!method || strcmp(method, "CONNECT") || !protocol || strcmp(protocol, "websocket")) {
+    sendResponse(session, streamId, "400", NULL, true);
+    refcnt_unref(stream);
+    return 0;
+  }
+
+  session->streams[session->numStreams++] = stream;
+  pthread_mutex_unlock(&session->lock);
+  userData = session->callbacks.onStreamOpen(session->userData, stream);
+  pthread_mutex_lock(&session->lock);
+
+  if (stream->closed)
+    return 0;
+
+  if (!userData) {
+    sendFrameU32(session, H2_FRAME_RST_STREAM, streamId,
+                 stream->responded ? H2_CANCEL : H2_REFUSED_STREAM);
+    removeStream(session, stream);
+    return 0;
+  }
+
+  stream->userData = userData;
+  stream->accepted = true;
+  if (endStream)
+    endRemote(stream);
+
+  return 0;
+}
+
+/**
+ * \brief resets a stream whose receive buffer couldn't be allocated (the session lock must be
+ *        held)
+ *
+ * \param *session Pointer to the session
+ * \param *stream Pointer to the stream
+ */
+static void
+receiveFailed(struct http2_session *session, struct http2_stream *stream)
+{
+  sendFrameU32(session, H2_FRAME_RST_STREAM, stream->id, H2_INTERNAL_ERROR);
+  removeStream(session, stream);
+}
+
+/**
+ * \brief passes received data to onStreamData, the data that wasn't processed is kept for the
+ *        next time and the receive windows are given back for the rest (the session lock must
+ *        be held, it's released during the callback)
+ *
+ * \param *session Pointer to the session
+ * \param *stream Pointer to the stream
+ * \param *data Pointer to the data
+ * \param len The length of the data
+ * \param resumed true if the stream was resumed (onStreamData is called even without data)
+ */
+static void
+deliverData(struct http2_session *session, struct http2_stream *stream, unsigned char *data,
+            size_t len, bool resumed)
+{
+  bool buffered = (DYNBUFFER_SIZE(&stream->received) != 0) || stream->paused;
+  size_t processed;
+  size_t left;
+
+  // a paused stream collects the data until it's resumed
+  if (buffered) {
+    if (len) {
+      if (dynBuffer_increase_to(&stream->received, len) < 0) {
+        receiveFailed(session, stream);
+        return;
+      }
+      memcpy(DYNBUFFER_WRITE_POS(&stream->received), data, len);
+      DYNBUFFER_INCREASE_WRITE_POS(&stream->received, len);
+    }
+    data = (unsigned char *) DYNBUFFER_BUFFER(&stream->received);
+    len = DYNBUFFER_SIZE(&stream->received);
+  }
+
+  // only the thread of http2_process touches the receive buffer so it stays valid without the
+  // lock
+  processed = 0;
+  while (((processed < len) || resumed) && !stream->closed && !stream->paused) {
+    size_t count;
+
+    resumed = false;
+    pthread_mutex_unlock(&session->lock);
+    count = session->callbacks.onStreamData(session->userData, stream, stream->userData,
+                                            len ? &data[processed] : NULL, len - processed);
+    pthread_mutex_lock(&session->lock);
+    if (!count)
+      break;
+    processed += count < len - processed ? count : len - processed;
+  }
+
+  if (stream->closed)
+    return;
+
+  left = len - processed;
+  if (buffered) {
+    if (processed)
+      dynBuffer_removeLeadingBytes(&stream->received, processed);
+  } else if (left) {
+    if (dynBuffer_increase_to(&stream->received, left) < 0) {
+      receiveFailed(session, stream);
+      return;
+    }
+    memcpy(DYNBUFFER_WRITE_POS(&stream->received), &data[processed], left);
+    DYNBUFFER_INCREASE_WRITE_POS(&stream->received, left);
+  }
+
+  // the window is given back once the data was processed, an incomplete frame that is left
+  // counts as processed unless the stream was paused (else a frame that is larger than the
+  // window would never be complete)
+  if (!stream->paused) {
+    releaseWindow(session, stream, stream->recvHeld);
+    stream->recvHeld = 0;
+  } else if (left < stream->recvHeld) {
+    releaseWindow(session, stream, stream->recvHeld - left);
+    stream->recvHeld = left;
+  }
+}
+
+/**
+ * \brief handles a DATA frame (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param flags The frame flags
+ * \param streamId The stream id
+ * \param *payload Pointer to the payload
+ * \param len The length of the payload
+ *
+ * \return 0 if successful else -1 (connection error)
+ */
+static int
+handleData(struct http2_session *session, unsigned char flags, uint32_t streamId,
+           unsigned char *payload, size_t len)
+{
+  struct http2_stream *stream;
+  size_t dataLen = len;
+
+  if (!streamId) {
+    connectionError(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  if (flags & H2_FLAG_PADDED) {
+    if (!len || (payload[0] >= len)) {
+      connectionError(session, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    dataLen = len - 1 - payload[0];
+    payload++;
+  }
+
+  stream = findStream(session, streamId);
+  if (!stream) {
+    if (streamId > session->lastStreamId) {
+      connectionError(session, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    // the data of closed streams is discarded
+    releaseWindow(session, NULL, len);
+    return 0;
+  }
+
+  stream->recvWindow -= len;
+  if (stream->recvWindow < 0) {
+    sendFrameU32(session, H2_FRAME_RST_STREAM, streamId, H2_FLOW_CONTROL_ERROR);
+    removeStream(session, stream);
+    releaseWindow(session, NULL, len);
+    return 0;
+  }
+  if (flags & H2_FLAG_END_STREAM)
+    stream->remoteEnd = true;
+
+  // the padding is discarded, the windows are given back for the data once it was processed
+  releaseWindow(session, stream, len - dataLen);
+  if (dataLen && stream->accepted) {
+    stream->recvHeld += dataLen;
+    deliverData(session, stream, payload, dataLen, false);
+  } else {
+    releaseWindow(session, stream, dataLen);
+  }
+
+  if ((flags & H2_FLAG_END_STREAM) && !stream->closed)
+    endRemote(stream);
+
+  return 0;
+}
+
+/**
+ * \brief handles a HEADERS or CONTINUATION frame (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param type The frame type
+ * \param flags The frame flags
+ * \param streamId The stream id
+ * \param *payload Pointer to the payload
+ * \param len The length of the payload
+ *
+ * \return 0 if successful else -1 (connection error)
+ */
+static int
+handleHeaders(struct http2_session *session, enum h2_frame_type type, unsigned char flags,
+              uint32_t streamId, const unsigned char *payload, size_t len)
+{
+  size_t skip = 0;
+  size_t padding = 0;
+
+  if (type == H2_FRAME_HEADERS) {
+    if (!(streamId & 1)) {
+      connectionError(session, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    if (flags & H2_FLAG_PADDED) {
+      if (!len) {
+        connectionError(session, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      padding = payload[0];
+      skip = 1;
+    }
+    if (flags & H2_FLAG_PRIORITY)
+      skip += 5;
+    if (skip + padding > len) {
+      connectionError(session, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    session->headerStreamId = streamId;
+    session->headerEndStream = flags & H2_FLAG_END_STREAM;
+  } else if (!session->headerStreamId || (streamId != session->headerStreamId)) {
+    connectionError(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  len -= skip + padding;
+  if (DYNBUFFER_SIZE(&session->headerBlock) + len > H2_MAX_HEADER_BLOCK) {
+    connectionError(session, H2_ENHANCE_YOUR_CALM);
+    return -1;
+  }
+  if (dynBuffer_increase_to(&session->headerBlock, len ? len : 1) < 0) {
+    connectionError(session, H2_INTERNAL_ERROR);
+    return -1;
+  }
+  memcpy(DYNBUFFER_WRITE_POS(&session->headerBlock), &payload[skip], len);
+  DYNBUFFER_INCREASE_WRITE_POS(&session->headerBlock, len);
+
+  if (flags & H2_FLAG_END_HEADERS)
+    return handleHeaderBlock(session);
+
+  return 0;
+}
+
+/**
+ * \brief handles a SETTINGS frame (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param flags The frame flags
+ * \param streamId The stream id
+ * \param *payload Pointer to the payload
+ * \param len The length of the payload
+ *
+ * \return 0 if successful else -1 (connection error)
+ */
+static int
+handleSettings(struct http2_session *session, unsigned char flags, uint32_t streamId,
+               const unsigned char *payload, size_t len)
+{
+  size_t i, j;
+  uint32_t value;
+
+  if (streamId) {
+    connectionError(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+  if (flags & H2_FLAG_ACK)
+    return 0;
+  if (len % 6) {
+    connectionError(session, H2_FRAME_SIZE_ERROR);
+    return -1;
+  }
+
+  for (i = 0; i < len; i += 6) {
+    value = readU32(&payload[i + 2]);
+    switch ((payload[i] << 8) | payload[i + 1]) {
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > H2_MAX_WINDOW) {
+        connectionError(session, H2_FLOW_CONTROL_ERROR);
+        return -1;
+      }
+      for (j = 0; j < session->numStreams; j++)
+        session->streams[j]->sendWindow += (long long) value - session->peerInitialWindow;
+      session->peerInitialWindow = value;
+      break;
+
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      if ((value < H2_MAX_FRAME_SIZE) || (value > 0xFFFFFF)) {
+        connectionError(session, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      session->peerMaxFrameSize = value;
+      break;
+
+    default:
+      // the dynamic table of the peer isn't used by the encoder so the rest doesn't matter
+      break;
+    }
+  }
+
+  sendFrame(session, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+  flushStreams(session);
+
+  return 0;
+}
+
+/**
+ * \brief handles a WINDOW_UPDATE frame (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param streamId The stream id
+ * \param *payload Pointer to the payload
+ * \param len The length of the payload
+ *
+ * \return 0 if successful else -1 (connection error)
+ */
+static int
+handleWindowUpdate(struct http2_session *session, uint32_t streamId, const unsigned char *payload,
+                   size_t len)
+{
+  struct http2_stream *stream;
+  uint32_t increment;
+
+  if (len != 4) {
+    connectionError(session, H2_FRAME_SIZE_ERROR);
+    return -1;
+  }
+  increment = readU32(payload) & H2_MAX_WINDOW;
+
+  if (!streamId) {
+    session->sendWindow += increment;
+    if (!increment || (session->sendWindow > H2_MAX_WINDOW)) {
+      connectionError(session, !increment ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+      return -1;
+    }
+    flushStreams(session);
+    return 0;
+  }
+
+  stream = findStream(session, streamId);
+  if (!stream)
+    return 0;
+  stream->sendWindow += increment;
+  if (!increment || (stream->sendWindow > H2_MAX_WINDOW)) {
+    sendFrameU32(session, H2_FRAME_RST_STREAM, streamId,
+                 !increment ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+    removeStream(session, stream);
+    return 0;
+  }
+  flushStream(stream);
+
+  return 0;
+}
+
+/**
+ * \brief handles a frame (the session lock must be held)
+ *
+ * \param *session Pointer to the session
+ * \param type The frame type
+ * \param flags The frame flags
+ * \param streamId The stream id
+ * \param *payload Pointer to the payload
+ * \param len The length of the payload
+ *
+ * \return 0 if successful else -1 (connection error)
+ */
+static int
+handleFrame(struct http2_session *session, enum h2_frame_type type, unsigned char flags,
+            uint32_t streamId, unsigned char *payload, size_t len)
+{
+  struct http2_stream *stream;
+
+  // a header block must not be interrupted by other frames
+  if (session->headerStreamId && (type != H2_FRAME_CONTINUATION)) {
+    connectionError(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  switch (type) {
+  case H2_FRAME_DATA:
+    return handleData(session, flags, streamId, payload, len);
+
+  case H2_FRAME_HEADERS:
+  case H2_FRAME_CONTINUATION:
+    return handleHeaders(session, type, flags, streamId, payload, len);
+
+  case H2_FRAME_RST_STREAM:
+    if (!streamId || (len != 4)) {
+      connectionError(session, !streamId ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      return -1;
+    }
+    stream = findStream(session, streamId);
+    if (stream)
+      removeStream(session, stream);
+    return 0;
+
+  case H2_FRAME_SETTINGS:
+    return handleSettings(session, flags, streamId, payload, len);
+
+  case H2_FRAME_PUSH_PROMISE:
+    connectionError(session, H2_PROTOCOL_ERROR);
+    return -1;
+
+  case H2_FRAME_PING:
+    if (streamId || (len != 8)) {
+      connectionError(session, streamId ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      return -1;
+    }
+    if (!(flags & H2_FLAG_ACK))
+      sendFrame(session, H2_FRAME_PING, H2_FLAG_ACK, 0, payload, len);
+    return 0;
+
+  case H2_FRAME_GOAWAY:
+    session->goingAway = true;
+    if (!session->numStreams && !session->closed)
+      closeTransport(session);
+    return 0;
+
+  case H2_FRAME_WINDOW_UPDATE:
+    return handleWindowUpdate(session, streamId, payload, len);
+
+  case H2_FRAME_PRIORITY:
+  default:
+    // unknown frames must be ignored
+    return 0;
+  }
+}
+
+/**
+ * \brief processes the data that was received on the transport of the session
+ *
+ * \param *session Pointer to the session
+ * \param *data Pointer to the received data
+ * \param len The length of the data
+ *
+ * \return The number of bytes that were processed (incomplete frames are left)
+ */
+size_t
+http2_process(struct http2_session *session, void *data, size_t len)
+{
+  unsigned char *pos = data;
+  size_t frameLen;
+  size_t processed = 0;
+
+  refcnt_ref(session);
+  pthread_mutex_lock(&session->lock);
+  session->processing = true;
+
+  if (!session->prefaceReceived) {
+    switch (http2_checkPreface(data, len)) {
+    case -1:
+      connectionError(session, H2_PROTOCOL_ERROR);
+      break;
+
+    case 0:
+      goto EXIT;
+
+    default:
+      session->prefaceReceived = true;
+      processed = H2_PREFACE_LEN;
+      break;
+    }
+  }
+
+  while (!session->closed && (len - processed >= H2_FRAME_HEADER_LEN)) {
+    frameLen = (pos[processed] << 16) | (pos[processed + 1] << 8) | pos[processed + 2];
+    if (frameLen > H2_MAX_FRAME_SIZE) {
+      connectionError(session, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (len - processed - H2_FRAME_HEADER_LEN < frameLen)
+      break;
+
+    if (handleFrame(session, pos[processed + 3], pos[processed + 4],
+                    readU32(&pos[processed + 5]) & H2_MAX_WINDOW,
+                    &pos[processed + H2_FRAME_HEADER_LEN], frameLen) < 0)
+      break;
+    processed += H2_FRAME_HEADER_LEN + frameLen;
+  }
+
+EXIT:
+  // nothing is processed anymore once the session failed
+  if (session->closed)
+    processed = len;
+  session->processing = false;
+  unlockSession(session);
+  refcnt_unref(session);
+
+  return processed;
+}
+
+/**
+ * \brief sends GOAWAY, no new streams are accepted and the transport is closed once the last
+ *        stream is closed
+ *
+ * \param *session Pointer to the session
+ */
+void
+http2_goAway(struct http2_session *session)
+{
+  unsigned char payload[8];
+
+  pthread_mutex_lock(&session->lock);
+  if (!session->goingAway) {
+    session->goingAway = true;
+    writeU32(&payload[0], session->lastStreamId);
+    writeU32(&payload[4], H2_NO_ERROR);
+    sendFrame(session, H2_FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+  }
+  if (!session->numStreams && !session->closed)
+    closeTransport(session);
+  unlockSession(session);
+}
+
+/**
+ * \brief calls the given function for every accepted stream of the session
+ *
+ * \param *session Pointer to the session
+ * \param *func The function that is called (without the session lock)
+ * \param *ctx Pointer that is passed to the function
+ */
+void
+http2_forEachStream(struct http2_session *session,
+                    void (*func)(void *ctx, struct http2_stream *stream, void *streamUserData),
+                    void *ctx)
+{
+  struct http2_stream *streams[H2_MAX_STREAMS];
+  size_t numStreams = 0;
+  size_t i;
+
+  pthread_mutex_lock(&session->lock);
+  for (i = 0; i < session->numStreams; i++) {
+    if (session->streams[i]->accepted) {
+      refcnt_ref(session->streams[i]);
+      streams[numStreams++] = session->streams[i];
+    }
+  }
+  pthread_mutex_unlock(&session->lock);
+
+  for (i = 0; i < numStreams; i++) {
+    func(ctx, streams[i], streams[i]->userData);
+    refcnt_unref(streams[i]);
+  }
+}
+
+/**
+ * \brief closes all streams of the session and releases it (the transport is closed by the
+ *        caller)
+ *
+ * \param *session Pointer to the session
+ */
+void
+http2_close(struct http2_session *session)
+{
+  pthread_mutex_lock(&session->lock);
+  session->closed = true;
+  while (session->numStreams)
+    removeStream(session, session->streams[session->numStreams - 1]);
+  unlockSession(session);
+
+  refcnt_unref(session);
+}
+
+/**
+ * \brief returns the value of a request header of the given stream
+ *
+ * \param *stream Pointer to the stream
+ * \param *name The header name (lower case)
+ *
+ * \return The value or NULL if the header wasn't sent
+ */
+const char *
+http2_getHeader(struct http2_stream *stream, const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < stream->numHeaders; i++) {
+    if (!strcmp(stream->headers[i].name, name))
+      return stream->headers[i].value;
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief calls the given function with every request header of the given stream (the pseudo
+ *        headers included)
+ *
+ * \param *stream Pointer to the stream
+ * \param *func The function that is called with the header name (lower case) and value
+ * \param *ctx The context that is passed to func
+ */
+void
+http2_forEachHeader(struct http2_stream *stream,
+                    void (*func)(void *ctx, const char *name, const char *value), void *ctx)
+{
+  size_t i;
+
+  for (i = 0; i < stream->numHeaders; i++)
+    func(ctx, stream->headers[i].name, stream->headers[i].value);
+}
+
+/**
+ * \brief accepts the extended CONNECT request of the stream (sends :status 200)
+ *
+ * \param *stream Pointer to the stream
+ * \param *protocol The selected subprotocol (NULL => none)
+ *
+ * \return 0 if successful else -1
+ */
+int
+http2_acceptStream(struct http2_stream *stream, const char *protocol)
+{
+  struct http2_session *session = stream->session;
+  int rc = -1;
+
+  pthread_mutex_lock(&session->lock);
+  if (!stream->closed && !stream->responded) {
+    rc = sendResponse(session, stream->id, "200", protocol, false);
+    stream->responded = true;
+  }
+  unlockSession(session);
+
+  return rc;
+}
+
+/**
+ * \brief refuses the extended CONNECT request of the stream with the given status (a stream
+ *        that was already accepted is reset), the stream is closed afterwards
+ *
+ * \param *stream Pointer to the stream
+ * \param status The http status (e.g. 403)
+ *
+ * \return 0 if successful else -1
+ */
+int
+http2_rejectStream(struct http2_stream *stream, int status)
+{
+  struct http2_session *session = stream->session;
+  char text[12];
+  int rc = -1;
+
+  pthread_mutex_lock(&session->lock);
+  if (!stream->closed) {
+    if (!stream->responded) {
+      snprintf(text, sizeof(text), "%d", status);
+      rc = sendResponse(session, stream->id, text, NULL, true);
+      stream->responded = true;
+      // the rest of the request isn't needed anymore
+      if (!stream->remoteEnd)
+        sendFrameU32(session, H2_FRAME_RST_STREAM, stream->id, H2_NO_ERROR);
+    } else {
+      rc = sendFrameU32(session, H2_FRAME_RST_STREAM, stream->id, H2_CANCEL);
+    }
+    removeStream(session, stream);
+  }
+  unlockSession(session);
+
+  return rc;
+}
+
+/**
+ * \brief sends data from several buffers on the given stream as a whole, data that exceeds the
+ *        send windows is queued until the peer sends WINDOW_UPDATE
+ *
+ * \param *stream Pointer to the stream
+ * \param *iov Pointer to the buffers
+ * \param iovcnt The number of buffers
+ *
+ * \return 0 if successful else -1 (nothing was sent or the stream was reset)
+ */
+int
+http2_sendv(struct http2_stream *stream, const struct iovec *iov, size_t iovcnt)
+{
+  struct http2_session *session = stream->session;
+  const unsigned char *data;
+  size_t total = 0;
+  size_t len;
+  long sent;
+  size_t i;
+  int rc = -1;
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+
+  pthread_mutex_lock(&session->lock);
+  if (stream->closed || stream->endPending)
+    goto EXIT;
+
+  // the peer must never get a part of the data so the space is checked up front
+  if (DYNBUFFER_SIZE(&stream->pending) + total > H2_MAX_PENDING) {
+    ezwebsocket_log(EZLOG_ERROR, "http2 send window exhausted\n");
+    goto EXIT;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    data = iov[i].iov_base;
+    len = iov[i].iov_len;
+    sent = 0;
+    if (!DYNBUFFER_SIZE(&stream->pending)) {
+      sent = writeData(stream, data, len);
+      if (sent < 0) {
+        removeStream(session, stream);
+        goto EXIT;
+      }
+    }
+
+    if ((size_t) sent < len) {
+      if (dynBuffer_increase_to(&stream->pending, len - sent) < 0) {
+        // a part of the data might be queued already
+        sendFrameU32(session, H2_FRAME_RST_STREAM, stream->id, H2_INTERNAL_ERROR);
+        removeStream(session, stream);
+        goto EXIT;
+      }
+      memcpy(DYNBUFFER_WRITE_POS(&stream->pending), &data[sent], len - sent);
+      DYNBUFFER_INCREASE_WRITE_POS(&stream->pending, len - sent);
+    }
+  }
+  rc = 0;
+
+EXIT:
+  unlockSession(session);
+
+  return rc;
+}
+
+/**
+ * \brief sends data on the given stream, data that exceeds the send windows is queued until
+ *        the peer sends WINDOW_UPDATE
+ *
+ * \param *stream Pointer to the stream
+ * \param *data Pointer to the data
+ * \param len The length of the data
+ *
+ * \return 0 if successful else -1
+ */
+int
+http2_send(struct http2_stream *stream, const void *data, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) data;
+  iov.iov_len = len;
+
+  return http2_sendv(stream, &iov, 1);
+}
+
+/**
+ * \brief stops passing the data of the stream to onStreamData until the given time has passed
+ *        or http2_resumeStream is called, the receive window isn't given back for the data that
+ *        arrives meanwhile so the peer has to stop once it's used up
+ *
+ * \param *stream Pointer to the stream
+ * \param timeoutMs The time in milliseconds
+ *
+ * \note the data that onStreamData is called with when the stream is paused is passed again
+ *       unless it's counted in the return value
+ */
+void
+http2_pauseStream(struct http2_stream *stream, int timeoutMs)
+{
+  struct http2_session *session = stream->session;
+  bool wakeup;
+
+  pthread_mutex_lock(&session->lock);
+  wakeup = !stream->closed;
+  if (wakeup) {
+    stream->paused = true;
+    clock_gettime(CLOCK_MONOTONIC, &stream->resumeTime);
+    stream->resumeTime.tv_sec += timeoutMs / 1000;
+    stream->resumeTime.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (stream->resumeTime.tv_nsec >= 1000000000L) {
+      stream->resumeTime.tv_sec++;
+      stream->resumeTime.tv_nsec -= 1000000000L;
+    }
+  }
+  unlockSession(session);
+
+  if (wakeup)
+    session->callbacks.wakeup(session->transport, timeoutMs);
+}
+
+/**
+ * \brief ends the pause of http2_pauseStream early, can be called from any thread (the stream
+ *        is resumed by http2_wakeup)
+ *
+ * \param *stream Pointer to the stream
+ */
+void
+http2_resumeStream(struct http2_stream *stream)
+{
+  struct http2_session *session = stream->session;
+  bool wakeup;
+
+  pthread_mutex_lock(&session->lock);
+  wakeup = !stream->closed && stream->paused;
+  if (wakeup)
+    clock_gettime(CLOCK_MONOTONIC, &stream->resumeTime);
+  unlockSession(session);
+
+  if (wakeup)
+    session->callbacks.wakeup(session->transport, 0);
+}
+
+/**
+ * \brief resumes the streams whose pause is over and passes the data they hold to
+ *        onStreamData, has to be called on the thread of http2_process once the time that was
+ *        passed to the wakeup callback has passed
+ *
+ * \param *session Pointer to the session
+ */
+void
+http2_wakeup(struct http2_session *session)
+{
+  struct http2_stream *streams[H2_MAX_STREAMS];
+  struct http2_stream *stream;
+  size_t numStreams = 0;
+  struct timespec now;
+  long long remainingMs;
+  long long nextMs = -1;
+  size_t i;
+
+  refcnt_ref(session);
+  pthread_mutex_lock(&session->lock);
+  session->processing = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < session->numStreams; i++) {
+    stream = session->streams[i];
+    if (!stream->paused)
+      continue;
+    remainingMs = ((stream->resumeTime.tv_sec - now.tv_sec) * 1000000000LL +
+                   (stream->resumeTime.tv_nsec - now.tv_nsec) + 999999) /
+                  1000000;
+    if (remainingMs > 0) {
+      if ((nextMs < 0) || (remainingMs < nextMs))
+        nextMs = remainingMs;
+      continue;
+    }
+    stream->paused = false;
+    refcnt_ref(stream);
+    streams[numStreams++] = stream;
+  }
+
+  // the list of the session changes while the lock is released for onStreamData
+  for (i = 0; i < numStreams; i++) {
+    stream = streams[i];
+    if (!stream->closed)
+      deliverData(session, stream, NULL, 0, true);
+    if (!stream->closed && stream->remoteEnd && !stream->endPending)
+      endRemote(stream);
+    refcnt_unref(stream);
+  }
+
+  session->processing = false;
+  unlockSession(session);
+
+  // a stream that was paused again has asked for its own wakeup
+  if (nextMs >= 0)
+    session->callbacks.wakeup(session->transport, nextMs > INT_MAX ? INT_MAX : nextMs);
+  refcnt_unref(session);
+}
+
+/**
+ * \brief closes the given stream, END_STREAM is sent after the pending data and onStreamClose
+ *        is called once it's sent
+ *
+ * \param *stream Pointer to the stream
+ */
+void
+http2_closeStream(struct http2_stream *stream)
+{
+  struct http2_session *session = stream->session;
+
+  pthread_mutex_lock(&session->lock);
+  if (!stream->closed && !stream->endPending) {
+    stream->endPending = true;
+    flushStream(stream);
+  }
+  unlockSession(session);
+}
@@ -0,0 +1,95 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HTTP2_H_
+#define HTTP2_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+//! prototype for the http/2 session (one per transport connection)
+struct http2_session;
+//! prototype for a http/2 stream (reference counted with refcnt_ref/refcnt_unref)
+struct http2_stream;
+
+//! callbacks of a http/2 session
+struct http2_callbacks {
+  //! called when an extended CONNECT request with the protocol "websocket" was received, it
+  //! calls http2_acceptStream and returns the stream user data (NULL => the stream is refused)
+  void *(*onStreamOpen)(void *userData, struct http2_stream *stream);
+  //! called when data was received on a stream, returns the number of bytes that were
+  //! processed (the rest is passed again together with the next data), after a pause it's
+  //! called once even if there is no data (len == 0)
+  size_t (*onStreamData)(void *userData, struct http2_stream *stream, void *streamUserData,
+                         void *data, size_t len);
+  //! called when a stream is closed (by the peer, by http2_closeStream or by http2_close)
+  void (*onStreamClose)(void *userData, struct http2_stream *stream, void *streamUserData);
+  //! called to send data over the transport, returns 0 if successful, 1 if the transport can't
+  //! take the data now (it's passed again after the next wakeup, nothing must be sent) or -1
+  int (*send)(void *transport, const struct iovec *iov, size_t iovcnt);
+  //! called to close the transport (e.g. after a protocol error)
+  void (*close)(void *transport);
+  //! called to have http2_wakeup called on the thread of http2_process once the given time
+  //! has passed (an earlier wakeup that is already requested must be kept)
+  void (*wakeup)(void *transport, int timeoutMs);
+};
+
+int
+http2_checkPreface(const void *data, size_t len);
+struct http2_session *
+http2_open(const struct http2_callbacks *callbacks, void *userData, void *transport);
+size_t
+http2_process(struct http2_session *session, void *data, size_t len);
+void
+http2_goAway(struct http2_session *session);
+void
+http2_forEachStream(struct http2_session *session,
+                    void (*func)(void *ctx, struct http2_stream *stream, void *streamUserData),
+                    void *ctx);
+void
+http2_close(struct http2_session *session);
+const char *
+http2_getHeader(struct http2_stream *stream, const char *name);
+void
+http2_forEachHeader(struct http2_stream *stream,
+                    void (*func)(void *ctx, const char *name, const char *value), void *ctx);
+int
+http2_acceptStream(struct http2_stream *stream, const char *protocol);
+int
+http2_rejectStream(struct http2_stream *stream, int status);
+int
+http2_send(struct http2_stream *stream, const void *data, size_t len);
+int
+http2_sendv(struct http2_stream *stream, const struct iovec *iov, size_t iovcnt);
+void
+http2_pauseStream(struct http2_stream *stream, int timeoutMs);
+void
+http2_resumeStream(struct http2_stream *stream);
+void
+http2_wakeup(struct http2_session *session);
+void
+http2_closeStream(struct http2_stream *stream);
+
+#endif /* HTTP2_H_ */
@@ -25,27 +25,50 @@
 #include "config.h"
 
 #include "socket_client.h"
+#include "utils/event_loop.h"
 #include "utils/ref_count.h"
+#include "utils/unix_socket.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ezwebsocket_log.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAVE_OPENSSL
+#include <openssl/err.h>
 #include <openssl/ssl.h>
 #endif /* HAVE_OPENSSL */
 
 //! the minimum buffer allocation size
 #define MIN_ALLOC_SIZE 2048
+//! the time the client thread waits for data at once in milliseconds (the state is checked
+//! afterwards)
+#define POLL_TIMEOUT_MS 300
+//! the time the TLS handshake and a blocked TLS write may take in milliseconds
+#define TLS_TIMEOUT_MS 10000
+//! the smallest and the largest payload of a TLS record
+#define TLS_RECORD_MIN 512
+#define TLS_RECORD_MAX 16384
+//! the overhead of IP/TCP options and the TLS record (header, MAC, padding) within a segment
+#define TLS_RECORD_OVERHEAD 100
+//! the largest record size that is used while the connection starts or after it was idle
+//! (used if the MSS is unknown or larger e.g. on loopback)
+#define TLS_RECORD_SMALL 1400
+//! the number of records after which the record size is doubled (dynamic record sizing)
+#define TLS_RECORD_GROW_COUNT 64
+//! the idle time after which small records are used again in milliseconds
+#define TLS_RECORD_IDLE_MS 1000
 
 //! States of the socket client
 enum socket_client_state {
@@ -66,6 +89,8 @@ struct socket_client_desc {
   void *(*socket_onOpen)(void *socketUserData, void *socketDesc);
   //! callback function that gets called when the socket is closed
   void (*socket_onClose)(void *socketUserData, void *socketDesc, void *sessionData);
+  //! callback function that gets called when the fd should be (un)watched (NULL => threaded mode)
+  void (*socket_onWatch)(void *socketUserData, int fd, int events);
   //! Pointer to the socket user data
   void *socketUserData;
   //! the thread ID of the socket client thread
@@ -78,6 +103,8 @@ struct socket_client_desc {
   void *sessionData;
   //! the socket descriptor
   int socketFd;
+  //! the options of the socket
+  struct socket_options options;
   //! the state of the socket
   volatile enum socket_client_state state;
   //! indicates if the task is still running
@@ -85,11 +112,379 @@ struct socket_client_desc {
   //! init done signal
   pthread_mutex_t initDoneSignal;
 #ifdef HAVE_OPENSSL
+  //! the TLS context (NULL => plain connection)
   SSL_CTX *ssl_ctx;
+  //! the TLS connection on the non-blocking socket (NULL => plain connection)
   SSL *ssl;
+  //! mutex that serializes the calls into the TLS connection
+  pthread_mutex_t sslMutex;
+  //! mutex that serializes the writers, a write that has to be retried keeps it while it waits
+  //! without sslMutex so that the reader isn't blocked
+  pthread_mutex_t sslWriteMutex;
+  //! indicates that OpenSSL has to write (e.g. during a renegotiation) before it can read again
+  bool sslWantWrite;
+  //! the fixed maximum payload of a TLS record (0 => dynamic record sizing)
+  size_t tlsRecordSize;
+  //! the record size that fits in one TCP segment (dynamic record sizing)
+  size_t tlsSmallRecord;
+  //! the current maximum payload of a TLS record (dynamic record sizing)
+  size_t tlsCurrentRecord;
+  //! the bytes that were written with the current record size (dynamic record sizing)
+  size_t tlsSentAtSize;
+  //! the time of the last write (CLOCK_MONOTONIC, dynamic record sizing)
+  struct timespec tlsLastWrite;
 #endif
 };
 
+#ifdef HAVE_OPENSSL
+/**
+ * \brief Waits until the socket is ready for what OpenSSL asked for
+ *
+ * \param fd The file descriptor of the socket
+ * \param sslError SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE
+ * \param timeoutMs The maximum time to wait in milliseconds
+ *
+ * \return 0 if the socket is ready else -1 (timeout or error)
+ */
+static int
+waitSsl(int fd, int sslError, int timeoutMs)
+{
+  struct pollfd pfd;
+  int rc;
+
+  pfd.fd = fd;
+  pfd.events = sslError == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+  do {
+    rc = poll(&pfd, 1, timeoutMs);
+  } while ((rc < 0) && (errno == EINTR));
+
+  return rc > 0 ? 0 : -1;
+}
+
+/**
+ * \brief Returns the milliseconds until the given time
+ *
+ * \param *deadline Pointer to the time (CLOCK_MONOTONIC)
+ *
+ * \return The remaining milliseconds (<= 0 => expired)
+ */
+static long long
+remainingMs(const struct timespec *deadline)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/**
+ * \brief Performs the TLS handshake on the non-blocking socket
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ *
+ * \return 0 if successful else -1
+ */
+static int
+sslHandshake(struct socket_client_desc *socketDesc)
+{
+  struct timespec deadline;
+  long long remaining;
+  int rc;
+  int err;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += TLS_TIMEOUT_MS / 1000;
+
+  for (;;) {
+    rc = SSL_connect(socketDesc->ssl);
+    if (rc == 1)
+      return 0;
+
+    err = SSL_get_error(socketDesc->ssl, rc);
+    if ((err != SSL_ERROR_WANT_READ) && (err != SSL_ERROR_WANT_WRITE)) {
+      ezwebsocket_log(EZLOG_ERROR, "SSL_connect failed: %s\n",
+                      ERR_reason_error_string(ERR_get_error()));
+      return -1;
+    }
+
+    remaining = remainingMs(&deadline);
+    if ((remaining <= 0) || (waitSsl(socketDesc->socketFd, err, remaining) < 0)) {
+      ezwebsocket_log(EZLOG_ERROR, "TLS handshake timed out\n");
+      return -1;
+    }
+  }
+}
+
+/**
+ * \brief Reads all records that are available, the ones that are already decrypted and
+ *        buffered in OpenSSL and the ones on the socket, until OpenSSL needs more data
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ *
+ * \return 0 if successful or -1 if the connection was closed or failed
+ */
+static int
+sslRead(struct socket_client_desc *socketDesc)
+{
+  int n;
+  int err;
+
+  for (;;) {
+    if (DYNBUFFER_BYTES_FREE(&socketDesc->buffer) < MIN_ALLOC_SIZE) {
+      if (dynBuffer_increase_to(&(socketDesc->buffer), MIN_ALLOC_SIZE) < 0)
+        return -1;
+    }
+
+    pthread_mutex_lock(&socketDesc->sslMutex);
+    n = SSL_read(socketDesc->ssl, DYNBUFFER_WRITE_POS(&(socketDesc->buffer)),
+                 DYNBUFFER_BYTES_FREE(&socketDesc->buffer));
+    err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(socketDesc->ssl, n);
+    pthread_mutex_unlock(&socketDesc->sslMutex);
+
+    switch (err) {
+    case SSL_ERROR_NONE:
+      DYNBUFFER_INCREASE_WRITE_POS((&(socketDesc->buffer)), n);
+      break;
+
+    case SSL_ERROR_WANT_READ:
+      socketDesc->sslWantWrite = false;
+      return 0;
+
+    case SSL_ERROR_WANT_WRITE:
+      socketDesc->sslWantWrite = true;
+      return 0;
+
+    case SSL_ERROR_ZERO_RETURN:
+      return -1;
+
+    case SSL_ERROR_SYSCALL:
+      // the peer closed the connection without a close_notify
+      if (!ERR_peek_error())
+        return -1;
+      ezwebsocket_log(EZLOG_ERROR, "SSL_read failed: %s\n",
+                      ERR_reason_error_string(ERR_get_error()));
+      return -1;
+
+    default:
+      ezwebsocket_log(EZLOG_ERROR, "SSL_read failed: %s\n",
+                      ERR_reason_error_string(ERR_get_error()));
+      return -1;
+    }
+  }
+}
+
+/**
+ * \brief Determines the record size that fits in one TCP segment
+ *
+ * \param fd The file descriptor of the connected socket
+ *
+ * \return The payload size of a small record
+ */
+static size_t
+smallRecordSize(int fd)
+{
+  socklen_t len = sizeof(int);
+  int mss;
+
+  if ((getsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) < 0) ||
+      (mss <= TLS_RECORD_MIN + TLS_RECORD_OVERHEAD))
+    return TLS_RECORD_SMALL;
+
+  mss -= TLS_RECORD_OVERHEAD;
+  return mss > TLS_RECORD_SMALL ? TLS_RECORD_SMALL : mss;
+}
+
+/**
+ * \brief Adapts the size of the TLS records to the traffic before data is written: small
+ *        records while the connection starts or after it was idle so that the first byte can
+ *        be decrypted as soon as one segment arrived, larger ones while a lot of data is sent
+ *
+ * \param *socketDesc Pointer to the socket descriptor (sslMutex must be locked)
+ * \param len The length of the data that is written next
+ */
+static void
+sizeRecords(struct socket_client_desc *socketDesc, size_t len)
+{
+  struct timespec now;
+  size_t recordSize;
+  long long idleMs;
+
+  if (socketDesc->tlsRecordSize)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  idleMs = (now.tv_sec - socketDesc->tlsLastWrite.tv_sec) * 1000LL +
+           (now.tv_nsec - socketDesc->tlsLastWrite.tv_nsec) / 1000000;
+  socketDesc->tlsLastWrite = now;
+
+  recordSize = socketDesc->tlsCurrentRecord;
+  if (idleMs >= TLS_RECORD_IDLE_MS) {
+    recordSize = socketDesc->tlsSmallRecord;
+    socketDesc->tlsSentAtSize = 0;
+  } else if ((recordSize < TLS_RECORD_MAX) &&
+             (socketDesc->tlsSentAtSize >= TLS_RECORD_GROW_COUNT * recordSize)) {
+    recordSize = recordSize * 2 > TLS_RECORD_MAX ? TLS_RECORD_MAX : recordSize * 2;
+    socketDesc->tlsSentAtSize = 0;
+  }
+  socketDesc->tlsSentAtSize += len;
+
+  // the write buffer keeps the size of the maximum fragment so only the split size is changed
+  if (recordSize != socketDesc->tlsCurrentRecord) {
+    SSL_set_split_send_fragment(socketDesc->ssl, recordSize);
+    socketDesc->tlsCurrentRecord = recordSize;
+  }
+}
+
+/**
+ * \brief Writes the data over the TLS connection, waits while the socket is full or while a
+ *        renegotiation needs to read
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ * \param *msg Pointer to the data
+ * \param len The length of the data
+ *
+ * \return 0 if successful else -1
+ *
+ * \note sslMutex is released while waiting, the reader can go on and drain the socket
+ */
+static int
+sslWrite(struct socket_client_desc *socketDesc, const void *msg, size_t len)
+{
+  struct timespec deadline;
+  long long remaining;
+  int rc = 1;
+  int err;
+
+  if (!len)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += TLS_TIMEOUT_MS / 1000;
+
+  pthread_mutex_lock(&socketDesc->sslWriteMutex);
+  pthread_mutex_lock(&socketDesc->sslMutex);
+  sizeRecords(socketDesc, len);
+  for (;;) {
+    // partial writes aren't enabled so the whole buffer is written at once
+    rc = SSL_write(socketDesc->ssl, msg, len);
+    if (rc > 0)
+      break;
+
+    // OpenSSL requires that the same buffer is passed again, sslWriteMutex keeps the other
+    // writers out until then
+    err = SSL_get_error(socketDesc->ssl, rc);
+    if ((err != SSL_ERROR_WANT_READ) && (err != SSL_ERROR_WANT_WRITE)) {
+      ezwebsocket_log(EZLOG_ERROR, "SSL_write failed: %s\n",
+                      ERR_reason_error_string(ERR_get_error()));
+      break;
+    }
+    pthread_mutex_unlock(&socketDesc->sslMutex);
+
+    remaining = remainingMs(&deadline);
+    if ((socketDesc->state != SOCKET_CLIENT_STATE_CONNECTED) || (remaining <= 0)) {
+      ezwebsocket_log(EZLOG_ERROR, "SSL_write timed out\n");
+      goto EXIT;
+    }
+    // the reader may consume the data a renegotiation waits for so it's retried regularly
+    if ((err == SSL_ERROR_WANT_READ) && (remaining > POLL_TIMEOUT_MS))
+      remaining = POLL_TIMEOUT_MS;
+    waitSsl(socketDesc->socketFd, err, remaining);
+    pthread_mutex_lock(&socketDesc->sslMutex);
+  }
+  pthread_mutex_unlock(&socketDesc->sslMutex);
+
+EXIT:
+  pthread_mutex_unlock(&socketDesc->sslWriteMutex);
+
+  return rc > 0 ? 0 : -1;
+}
+#endif /* HAVE_OPENSSL */
+
+/**
+ * \brief Reads the available data of the socket and passes it to socket_onMessage
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ */
+static void
+socketClientRead(struct socket_client_desc *socketDesc)
+{
+  int n;
+  size_t count;
+  size_t offset = 0;
+  int increase;
+  size_t bytesFree;
+  bool first;
+
+#ifdef HAVE_OPENSSL
+  if (socketDesc->ssl) {
+    if (sslRead(socketDesc) < 0)
+      socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
+  } else
+#endif /* HAVE_OPENSSL */
+  {
+    first = true;
+    increase = 1;
+    do {
+      bytesFree = DYNBUFFER_BYTES_FREE(&socketDesc->buffer);
+      if (DYNBUFFER_BYTES_FREE(&socketDesc->buffer) < MIN_ALLOC_SIZE) {
+        dynBuffer_increase_to(&(socketDesc->buffer), MIN_ALLOC_SIZE * increase);
+        bytesFree = DYNBUFFER_BYTES_FREE(&socketDesc->buffer);
+        increase++;
+      }
+      n = recv(socketDesc->socketFd, DYNBUFFER_WRITE_POS(&(socketDesc->buffer)), bytesFree,
+               MSG_DONTWAIT);
+      if (first && (n == 0)) {
+        socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
+        break;
+      }
+      first = false;
+
+      if (n >= 0)
+        DYNBUFFER_INCREASE_WRITE_POS((&(socketDesc->buffer)), n);
+      else
+        break;
+    } while (((size_t) n == bytesFree) && (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED));
+  }
+
+  socketOptions_rearm(socketDesc->socketFd, &socketDesc->options);
+
+  if ((socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED) &&
+      DYNBUFFER_SIZE(&(socketDesc->buffer))) {
+    // the processed data is removed once at the end instead of after every message
+    do {
+      count = socketDesc->socket_onMessage(socketDesc->socketUserData, socketDesc,
+                                           socketDesc->sessionData,
+                                           DYNBUFFER_BUFFER(&(socketDesc->buffer)) + offset,
+                                           DYNBUFFER_SIZE(&(socketDesc->buffer)) - offset);
+      offset += count;
+    } while (count && (DYNBUFFER_SIZE(&(socketDesc->buffer)) > offset) &&
+             (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED));
+    dynBuffer_removeLeadingBytes(&(socketDesc->buffer), offset);
+  }
+}
+
+/**
+ * \brief Finishes the connection (calls socket_onClose)
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ */
+static void
+socketClientFinish(struct socket_client_desc *socketDesc)
+{
+  dynBuffer_delete(&(socketDesc->buffer));
+
+  if (socketDesc->socket_onClose != NULL)
+    socketDesc->socket_onClose(socketDesc->socketUserData, socketDesc, socketDesc->sessionData);
+
+  if (socketDesc->socket_onWatch) {
+    eventLoop_remove(socketDesc->socketFd);
+    socketDesc->socket_onWatch(socketDesc->socketUserData, socketDesc->socketFd, 0);
+  }
+
+  socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
+  socketDesc->taskRunning = false;
+}
+
 /**
  * \brief The socket client thread
  *
@@ -101,13 +496,8 @@ static void *
 socketClientThread(void *socketDescriptor)
 {
   struct socket_client_desc *socketDesc = socketDescriptor;
-  fd_set readfds;
-  int n;
-  size_t count;
-  int increase;
-  size_t bytesFree;
-  bool first;
-  struct timeval tv;
+  struct pollfd pfd;
+  int timeoutMs;
 
   // wait for start signal
   pthread_mutex_lock(&socketDesc->initDoneSignal);
@@ -116,63 +506,62 @@ socketClientThread(void *socketDescriptor)
     socketDesc->sessionData = socketDesc->socket_onOpen(socketDesc->socketUserData, socketDesc);
 
   while (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED) {
-    tv.tv_sec = 0;
-    tv.tv_usec = 300000;
-    FD_ZERO(&readfds);
-    FD_SET(socketDesc->socketFd, &readfds);
-    if (select(socketDesc->socketFd + 1, &readfds, NULL, NULL, &tv) > 0) {
-      if (FD_ISSET(socketDesc->socketFd, &readfds)) {
-        first = true;
-        increase = 1;
-        do {
-          bytesFree = DYNBUFFER_BYTES_FREE(&socketDesc->buffer);
-          if (DYNBUFFER_BYTES_FREE(&socketDesc->buffer) < MIN_ALLOC_SIZE) {
-            dynBuffer_increase_to(&(socketDesc->buffer), MIN_ALLOC_SIZE * increase);
-            bytesFree = DYNBUFFER_BYTES_FREE(&socketDesc->buffer);
-            increase++;
-          }
+    pfd.fd = socketDesc->socketFd;
+    pfd.events = POLLIN;
+    timeoutMs = POLL_TIMEOUT_MS;
 #ifdef HAVE_OPENSSL
-          if (socketDesc->ssl)
-            n = SSL_read(socketDesc->ssl, DYNBUFFER_WRITE_POS(&(socketDesc->buffer)), bytesFree);
-          else
-#endif /* HAVE_OPENSSL */
-            n = recv(socketDesc->socketFd, DYNBUFFER_WRITE_POS(&(socketDesc->buffer)), bytesFree,
-                     MSG_DONTWAIT);
-          if (first && (n == 0)) {
-            socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
-            break;
-          }
-          first = false;
-
-          if (n >= 0)
-            DYNBUFFER_INCREASE_WRITE_POS((&(socketDesc->buffer)), n);
-          else
-            break;
-        } while (((size_t) n == bytesFree) && (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED));
-
-        if (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED) {
-          do {
-            count = socketDesc->socket_onMessage(socketDesc->socketUserData, socketDesc,
-                                                 socketDesc->sessionData,
-                                                 DYNBUFFER_BUFFER(&(socketDesc->buffer)),
-                                                 DYNBUFFER_SIZE(&(socketDesc->buffer)));
-            dynBuffer_removeLeadingBytes(&(socketDesc->buffer), count);
-          } while (count && DYNBUFFER_SIZE(&(socketDesc->buffer)) &&
-                   (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED));
-        }
-      }
+    if (socketDesc->ssl) {
+      // a handshake message (e.g. of a renegotiation) has to be written before reading goes on
+      if (socketDesc->sslWantWrite)
+        pfd.events = POLLOUT;
+      // records that a write decrypted are already buffered in OpenSSL
+      pthread_mutex_lock(&socketDesc->sslMutex);
+      if (SSL_pending(socketDesc->ssl) > 0)
+        timeoutMs = 0;
+      pthread_mutex_unlock(&socketDesc->sslMutex);
     }
+#endif /* HAVE_OPENSSL */
+    if ((poll(&pfd, 1, timeoutMs) > 0) || !timeoutMs)
+      socketClientRead(socketDesc);
   }
 
-  dynBuffer_delete(&(socketDesc->buffer));
+  socketClientFinish(socketDesc);
 
-  if (socketDesc->socket_onClose != NULL)
-    socketDesc->socket_onClose(socketDesc->socketUserData, socketDesc, socketDesc->sessionData);
+  return NULL;
+}
 
-  socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
-  socketDesc->taskRunning = false;
+/**
+ * \brief Handles the events of the socket in threadless mode
+ *
+ * \param *ctx Pointer to the socket descriptor
+ * \param fd The file descriptor of the socket
+ * \param events The events that occured on the fd (0 => timeout expired)
+ */
+static void
+socketClientProcess(void *ctx, int fd, int events)
+{
+  struct socket_client_desc *socketDesc = ctx;
+#ifdef HAVE_OPENSSL
+  bool sslWantWrite = socketDesc->sslWantWrite;
+#endif /* HAVE_OPENSSL */
+  (void) fd;
 
-  return NULL;
+  if (!events) {
+    ezwebsocket_log(EZLOG_ERROR, "socket client timeout\n");
+    socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECT_REQUEST;
+  } else if (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED) {
+    socketClientRead(socketDesc);
+#ifdef HAVE_OPENSSL
+    // OpenSSL waits for the socket to become writable before it can read again
+    if ((socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED) &&
+        (socketDesc->sslWantWrite != sslWantWrite))
+      socketDesc->socket_onWatch(socketDesc->socketUserData, socketDesc->socketFd,
+                                 socketDesc->sslWantWrite ? POLLOUT : POLLIN);
+#endif /* HAVE_OPENSSL */
+  }
+
+  if (socketDesc->taskRunning && (socketDesc->state != SOCKET_CLIENT_STATE_CONNECTED))
+    socketClientFinish(socketDesc);
 }
 
 /**
@@ -199,10 +588,10 @@ socketClient_send(void *socketDescriptor, void *msg, size_t len)
 
 #ifdef HAVE_OPENSSL
   if (socketDesc->ssl)
-    rc = SSL_write(socketDesc->ssl, msg, len);
-  else
+    return sslWrite(socketDesc, msg, len);
 #endif /* HAVE_OPENSSL */
-    rc = send(socketDesc->socketFd, msg, len, MSG_NOSIGNAL);
+
+  rc = send(socketDesc->socketFd, msg, len, MSG_NOSIGNAL);
   if (rc == -1) {
     ezwebsocket_log(EZLOG_ERROR, "send failed: %s\n", strerror(errno));
   }
@@ -221,6 +610,18 @@ socketClient_start(void *socketDescriptor)
   struct socket_client_desc *socketDesc = socketDescriptor;
 
   pthread_mutex_unlock(&socketDesc->initDoneSignal);
+
+  if (socketDesc->socket_onWatch) {
+    if (socketDesc->socket_onOpen != NULL)
+      socketDesc->sessionData = socketDesc->socket_onOpen(socketDesc->socketUserData, socketDesc);
+
+    if (eventLoop_add(socketDesc->socketFd, socketClientProcess, socketDesc) < 0) {
+      socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECT_REQUEST;
+      socketClientFinish(socketDesc);
+      return;
+    }
+    socketDesc->socket_onWatch(socketDesc->socketUserData, socketDesc->socketFd, POLLIN);
+  }
 }
 
 /**
@@ -245,14 +646,36 @@ socketClient_open(struct socket_client_init *socketInit, void *socketUserData)
   socketDesc->socket_onOpen = socketInit->socket_onOpen;
   socketDesc->socket_onClose = socketInit->socket_onClose;
   socketDesc->socket_onMessage = socketInit->socket_onMessage;
+  socketDesc->socket_onWatch = socketInit->socket_onWatch;
+  socketDesc->options = socketInit->options;
   socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
+  socketDesc->socketFd = -1;
 
   pthread_mutex_init(&socketDesc->initDoneSignal, NULL);
   pthread_mutex_lock(&socketDesc->initDoneSignal);
+#ifdef HAVE_OPENSSL
+  pthread_mutex_init(&socketDesc->sslMutex, NULL);
+  pthread_mutex_init(&socketDesc->sslWriteMutex, NULL);
+#endif /* HAVE_OPENSSL */
 
   dynBuffer_init(&socketDesc->buffer);
 
-  socketDesc->socketFd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_storage server;
+  socklen_t serverLen;
+
+  memset(&server, 0, sizeof(server));
+  if (unixSocket_isAddress(socketInit->address)) {
+    if (unixSocket_getAddress(socketInit->address, (struct sockaddr_un *) &server, &serverLen) < 0)
+      goto ERROR;
+    socketOptions_removeTcp(&socketDesc->options);
+  } else {
+    ((struct sockaddr_in *) &server)->sin_addr.s_addr = inet_addr(socketInit->address);
+    ((struct sockaddr_in *) &server)->sin_family = AF_INET;
+    ((struct sockaddr_in *) &server)->sin_port = htons(socketInit->port);
+    serverLen = sizeof(struct sockaddr_in);
+  }
+
+  socketDesc->socketFd = socket(server.ss_family, SOCK_STREAM, 0);
   if (socketDesc->socketFd < 0) {
     ezwebsocket_log(EZLOG_ERROR, "failed to create socket\n");
     goto ERROR;
@@ -270,46 +693,54 @@ socketClient_open(struct socket_client_init *socketInit, void *socketUserData)
                  sizeof(timeout)) < 0)
     ezwebsocket_log(EZLOG_ERROR, "setsockopt failed\n");
 
-  struct sockaddr_in server;
-
-  server.sin_addr.s_addr = inet_addr(socketInit->address);
-  server.sin_family = AF_INET;
-  server.sin_port = htons(socketInit->port);
+  // the buffer sizes have to be set before connecting
+  socketOptions_apply(socketDesc->socketFd, &socketDesc->options);
 
   // Connect to remote server
-  if (connect(socketDesc->socketFd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+  if (connect(socketDesc->socketFd, (struct sockaddr *) &server, serverLen) < 0) {
     ezwebsocket_log(EZLOG_ERROR, "connection failed\n");
     goto ERROR;
   }
 
-  int optval = socketInit->keepalive == true;
-
-  if (setsockopt(socketDesc->socketFd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval)) < 0) {
-    ezwebsocket_log(EZLOG_ERROR, "setsockopt SO_KEEPALIVE failed\n");
-  }
-
-  optval = socketInit->keep_idle_sec;
-  if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_KEEPIDLE, &optval, sizeof(optval)) < 0) {
-    ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_KEEPIDLE failed\n");
-  }
-
-  optval = socketInit->keep_cnt;
-  if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_KEEPCNT, &optval, sizeof(optval)) < 0) {
-    ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_KEEPCNT failed\n");
-  }
-
-  optval = socketInit->keep_intvl;
-  if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_KEEPINTVL, &optval, sizeof(optval)) < 0) {
-    ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_KEEPINTVL failed\n");
-  }
-
 #ifdef HAVE_OPENSSL
   if (socketInit->secure) {
     ezwebsocket_log(EZLOG_DEBUG, "use secure websocket\n");
     socketDesc->ssl_ctx = SSL_CTX_new(SSLv23_method());
+    if (!socketDesc->ssl_ctx) {
+      ezwebsocket_log(EZLOG_ERROR, "SSL_CTX_new failed\n");
+      goto ERROR;
+    }
     socketDesc->ssl = SSL_new(socketDesc->ssl_ctx);
-    SSL_set_fd(socketDesc->ssl, socketDesc->socketFd);
-    SSL_connect(socketDesc->ssl);
+    if (!socketDesc->ssl || !SSL_set_fd(socketDesc->ssl, socketDesc->socketFd)) {
+      ezwebsocket_log(EZLOG_ERROR, "SSL_new failed\n");
+      goto ERROR;
+    }
+
+    // the TLS connection is driven as a state machine on the non-blocking socket so that
+    // records buffered in OpenSSL are drained and WANT_READ/WANT_WRITE are handled
+    if (fcntl(socketDesc->socketFd, F_SETFL, fcntl(socketDesc->socketFd, F_GETFL) | O_NONBLOCK) <
+        0) {
+      ezwebsocket_log(EZLOG_ERROR, "fcntl failed\n");
+      goto ERROR;
+    }
+
+    if (sslHandshake(socketDesc) < 0)
+      goto ERROR;
+
+    // the connection starts with records that fit in one segment (dynamic record sizing)
+    socketDesc->tlsRecordSize = socketInit->tlsRecordSize;
+    if (socketDesc->tlsRecordSize) {
+      if (socketDesc->tlsRecordSize < TLS_RECORD_MIN)
+        socketDesc->tlsRecordSize = TLS_RECORD_MIN;
+      if (socketDesc->tlsRecordSize > TLS_RECORD_MAX)
+        socketDesc->tlsRecordSize = TLS_RECORD_MAX;
+      SSL_set_max_send_fragment(socketDesc->ssl, socketDesc->tlsRecordSize);
+    } else {
+      socketDesc->tlsSmallRecord = smallRecordSize(socketDesc->socketFd);
+      socketDesc->tlsCurrentRecord = socketDesc->tlsSmallRecord;
+      SSL_set_split_send_fragment(socketDesc->ssl, socketDesc->tlsCurrentRecord);
+      clock_gettime(CLOCK_MONOTONIC, &socketDesc->tlsLastWrite);
+    }
   }
 #else
   if (socketInit->secure) {
@@ -321,6 +752,10 @@ socketClient_open(struct socket_client_init *socketInit, void *socketUserData)
   socketDesc->state = SOCKET_CLIENT_STATE_CONNECTED;
   socketDesc->taskRunning = true;
 
+  // in threadless mode the connection is driven by socketClientProcess
+  if (socketDesc->socket_onWatch)
+    return socketDesc;
+
   if (pthread_create(&socketDesc->tid, NULL, socketClientThread, socketDesc) != 0) {
     socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
     socketDesc->taskRunning = false;
@@ -350,20 +785,30 @@ socketClient_close(void *socketDescriptor)
   if (socketDesc == NULL)
     return;
 
-  socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECT_REQUEST;
-  while (socketDesc->taskRunning)
-    usleep(30000);
+  socketClient_closeConnection(socketDesc);
+  if (socketDesc->socket_onWatch && socketDesc->taskRunning)
+    socketClientFinish(socketDesc);
 
   pthread_mutex_unlock(&socketDesc->initDoneSignal);
-  pthread_mutex_destroy(&socketDesc->initDoneSignal);
 
   if (socketDesc->tidValid) {
-    socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECTED;
+    // the thread was woken up by the shutdown in socketClient_closeConnection
     pthread_join(socketDesc->tid, NULL);
     socketDesc->tidValid = false;
     dynBuffer_delete(&socketDesc->buffer);
   }
 
+  pthread_mutex_destroy(&socketDesc->initDoneSignal);
+
+#ifdef HAVE_OPENSSL
+  if (socketDesc->ssl)
+    SSL_free(socketDesc->ssl);
+  if (socketDesc->ssl_ctx)
+    SSL_CTX_free(socketDesc->ssl_ctx);
+  pthread_mutex_destroy(&socketDesc->sslWriteMutex);
+  pthread_mutex_destroy(&socketDesc->sslMutex);
+#endif /* HAVE_OPENSSL */
+
   if (socketDesc->socketFd != -1) {
     close(socketDesc->socketFd);
     socketDesc->socketFd = -1;
@@ -381,5 +826,25 @@ void
 socketClient_closeConnection(void *socketDescriptor)
 {
   struct socket_client_desc *socketDesc = socketDescriptor;
+
+  // the shutdown wakes up the client thread (or the event loop) immediately
+  if (socketDesc->state == SOCKET_CLIENT_STATE_CONNECTED)
+    shutdown(socketDesc->socketFd, SHUT_RDWR);
   socketDesc->state = SOCKET_CLIENT_STATE_DISCONNECT_REQUEST;
 }
+
+/**
+ * \brief Closes the connection if the timeout isn't cleared in time
+ *        (only used in threadless mode)
+ *
+ * \param *socketDescriptor Pointer to the socket descriptor
+ * \param timeoutMs The timeout in milliseconds (< 0 clears the timeout)
+ */
+void
+socketClient_setTimeout(void *socketDescriptor, int timeoutMs)
+{
+  struct socket_client_desc *socketDesc = socketDescriptor;
+
+  if (socketDesc->socket_onWatch && socketDesc->taskRunning)
+    eventLoop_setTimeout(socketDesc->socketFd, timeoutMs);
+}
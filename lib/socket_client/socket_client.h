@@ -27,6 +27,7 @@
 #define SOCKET_CLIENT_SOCKET_CLIENT_H_
 
 #include "utils/dyn_buffer.h"
+#include "utils/socket_options.h"
 #include <stddef.h>
 #include <stdbool.h>
 
@@ -39,19 +40,18 @@ struct socket_client_init {
   void *(*socket_onOpen)(void *socketUserData, void *socketDesc);
   //! callback that should be called when the socket is closed use NULL if not used
   void (*socket_onClose)(void *socketUserData, void *socketDesc, void *sessionData);
-  //! the remote port we want to connect to
+  //! callback that is called when the fd should be (un)watched by an external event loop
+  //! (events == 0 => stop watching) if set no thread is started (use NULL if not used)
+  void (*socket_onWatch)(void *socketUserData, int fd, int events);
+  //! the remote port we want to connect to (ignored for unix sockets)
   unsigned short port;
-  //! the address we want to connect to
+  //! the address we want to connect to ("unix:/path" or "unix:@name" => unix socket)
   const char *address;
-  //! Enable or disable keepalive
-  bool keepalive;
-  //! How long to wait before sending out the first probe on an idle connection
-  int keep_idle_sec;
-  //! The number of unanswered probes required to force closure of the socket
-  int keep_cnt;
-  //! The frequency of keepalive packets after the first one is sent
-  int keep_intvl;
+  //! the options of the socket (including keepalive)
+  struct socket_options options;
   int secure;
+  //! the maximum payload of a TLS record (0 => dynamic record sizing)
+  size_t tlsRecordSize;
 };
 
 int
@@ -64,5 +64,7 @@ void
 socketClient_close(void *socketDescriptor);
 void
 socketClient_closeConnection(void *socketDescriptor);
+void
+socketClient_setTimeout(void *socketDescriptor, int timeoutMs);
 
 #endif /* SOCKET_CLIENT_SOCKET_CLIENT_H_ */
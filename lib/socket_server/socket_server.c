@@ -22,26 +22,45 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include "socket_server.h"
 
 #include "utils/dyn_buffer.h"
+#include "utils/event_loop.h"
 #include "utils/ref_count.h"
+#include "utils/token_bucket.h"
+#include "utils/unix_socket.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ezwebsocket_log.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 //! starting size of the message buffer (will be increased everytime the buffer is to small)
 #define READ_SIZE 1024
+//! the time in milliseconds the user space pacing may send at once
+#define PACING_BURST_MS 10
+//! the minimum number of bytes the user space pacing may send at once
+#define PACING_BURST_MIN 16384
+//! the maximum number of bytes a connection queues for the user space pacing, further sends
+//! fail with EAGAIN until it was sent
+#define PACING_MAX_QUEUED (4 * 1024 * 1024)
 
 //! States of the socket connection
 enum socket_connection_state {
@@ -49,6 +68,8 @@ enum socket_connection_state {
   SOCKET_SESSION_STATE_CONNECTED,
   //! socket disconnected state
   SOCKET_SESSION_STATE_DISCONNECTED,
+  //! socket is about to be handed over to another process
+  SOCKET_SESSION_STATE_HANDOVER,
 };
 
 //! structure that holds information about the connection
@@ -57,6 +78,8 @@ struct socket_connection_desc {
   volatile enum socket_connection_state state;
   //! file descriptor for the connection
   int connectionSocketFd;
+  //! mutex that prevents the fd from being closed while it's shut down
+  pthread_mutex_t fdMutex;
   //! pointer to the socket descriptor
   struct socket_server_desc *socketDesc;
   //! the thread id of the connectionThread
@@ -65,24 +88,130 @@ struct socket_connection_desc {
   struct dyn_buffer buffer;
   //! the user data for the connection
   void *connectionUserData;
-  //! ipv4 string from peer
-  char peer_ip[16];
-  //! ipv4 string from server
-  char server_ip[16];
+  //! the state that was handed over by the previous process (only valid during socket_onOpen)
+  void *handoverState;
+  //! the length of the handover state
+  size_t handoverStateLen;
+  //! the buffer memory that is accounted for this connection in the socket descriptor
+  size_t bufferMemory;
+  //! the address of the peer as returned by accept (peerAddrLen == 0 => unknown)
+  struct sockaddr_storage peerAddr;
+  //! the length of the peer address
+  socklen_t peerAddrLen;
+  //! ip string from peer (formatted on first use)
+  char peer_ip[INET6_ADDRSTRLEN];
+  //! ip string from server (formatted on first use)
+  char server_ip[INET6_ADDRSTRLEN];
+  //! the message budget of the running dispatch (NULL => unlimited)
+  unsigned long *msgBudget;
+  //! indicates that reading is paused (see socketServer_pauseReading)
+  bool readPaused;
+  //! the time when reading is resumed (CLOCK_MONOTONIC)
+  struct timespec resumeTime;
+  //! condition that wakes up a paused connection thread (used with fdMutex)
+  pthread_cond_t resumeCond;
+  //! indicates that the connection is closed at drainTime (threadless socketServer_drain)
+  bool draining;
+  //! the time when a draining connection is closed (CLOCK_MONOTONIC)
+  struct timespec drainTime;
+  //! indicates that socket_onWakeup is called at wakeupTime (see socketServer_wakeup)
+  bool wakeupArmed;
+  //! the time when socket_onWakeup is called (CLOCK_MONOTONIC)
+  struct timespec wakeupTime;
+  //! eventfd that interrupts the poll of the connection thread, it's created with the first
+  //! wakeup that the connection thread arms itself (threaded mode else -1)
+  int wakeupFd;
+  //! indicates that the read budget was used up and there's data left to read or dispatch
+  bool readPending;
+  //! mutex that protects paceBucket and paced, it's held while a paced connection sends so that
+  //! the data keeps its order
+  pthread_mutex_t paceMutex;
+  //! token bucket that paces the sends if the kernel can't do it (rate 0 => not used)
+  struct token_bucket paceBucket;
+  //! indicates that paceBucket was used once (the sends go through the pacing from then on)
+  bool pacing;
+  //! the data that waits for the pacing tokens, it's sent when the wakeup is due
+  struct dyn_buffer paced;
+  //! indicates that the connection is counted in numHandovers of the server (protected by
+  //! listMutex of the server)
+  bool handoverPending;
+  //! indicates that the connection should be closed if the handover fails
+  bool closeAfterHandover;
 };
 
+/**
+ * \brief formats the ip address of the given socket address
+ *
+ * \param *addr Pointer to the socket address
+ * \param *str Pointer to where the string should be stored
+ * \param len The size of str
+ */
+static void
+formatIp(const struct sockaddr_storage *addr, char *str, socklen_t len)
+{
+  const void *ip;
+
+  switch (addr->ss_family) {
+  case AF_INET:
+    ip = &((const struct sockaddr_in *) addr)->sin_addr;
+    break;
+  case AF_INET6:
+    ip = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    break;
+  default:
+    return;
+  }
+
+  if (!inet_ntop(addr->ss_family, ip, str, len))
+    str[0] = '\0';
+}
+
 const char *
 socket_get_server_ip(struct socket_connection_desc *desc)
 {
+  struct sockaddr_storage addr;
+  socklen_t addrLen = sizeof(addr);
+
+  pthread_mutex_lock(&desc->fdMutex);
+  if (!desc->server_ip[0] && (desc->connectionSocketFd >= 0)) {
+    if (!getsockname(desc->connectionSocketFd, (struct sockaddr *) &addr, &addrLen))
+      formatIp(&addr, desc->server_ip, sizeof(desc->server_ip));
+    else
+      ezwebsocket_log(EZLOG_ERROR, "error getsockname\n");
+  }
+  pthread_mutex_unlock(&desc->fdMutex);
+
   return desc->server_ip;
 }
 
 const char *
 socket_get_peer_ip(struct socket_connection_desc *desc)
 {
+  pthread_mutex_lock(&desc->fdMutex);
+  if (!desc->peer_ip[0]) {
+    if (!desc->peerAddrLen && (desc->connectionSocketFd >= 0)) {
+      desc->peerAddrLen = sizeof(desc->peerAddr);
+      if (getpeername(desc->connectionSocketFd, (struct sockaddr *) &desc->peerAddr,
+                      &desc->peerAddrLen)) {
+        ezwebsocket_log(EZLOG_ERROR, "error getpeername\n");
+        desc->peerAddrLen = 0;
+      }
+    }
+    if (desc->peerAddrLen)
+      formatIp(&desc->peerAddr, desc->peer_ip, sizeof(desc->peer_ip));
+  }
+  pthread_mutex_unlock(&desc->fdMutex);
+
   return desc->peer_ip;
 }
 
+const void *
+socket_get_handover_state(struct socket_connection_desc *desc, size_t *len)
+{
+  *len = desc->handoverStateLen;
+  return desc->handoverState;
+}
+
 //! structure needed for the linked list that contains all connections
 struct socket_connection_list_element {
   //! descriptor of the connection
@@ -97,6 +226,8 @@ struct socket_server_desc {
   struct socket_connection_list_element *list;
   //! mutex that protects access to the list
   pthread_mutex_t listMutex;
+  //! condition that is signaled when a connection was removed from the list
+  pthread_cond_t listCond;
   //! function that should be called when data is received
   size_t (*socket_onMessage)(void *socketUserData, void *connectionDesc, void *connectionUserData,
                              void *msg, size_t len);
@@ -104,10 +235,16 @@ struct socket_server_desc {
   void *(*socket_onOpen)(void *socketUserData, struct socket_connection_desc *connectionDesc);
   //! function that should be called when a connection is closed
   void (*socket_onClose)(void *socketUserData, void *connectionDesc, void *connectionUserData);
+  //! function that should be called when an fd should be (un)watched (NULL => threaded mode)
+  void (*socket_onWatch)(void *socketUserData, int fd, int events);
+  //! function that should be called when a wakeup of a connection is due (can be NULL)
+  void (*socket_onWakeup)(void *socketUserData, void *connectionDesc, void *connectionUserData);
   //! user data for the server socket
   void *socketUserData;
-  //! file descriptor of the socket
+  //! file descriptor of the socket (-1 if no longer accepting)
   int socketFd;
+  //! eventfd that wakes up the socketServerThread
+  int wakeupFd;
   //! file descriptor set for read
   fd_set readfds;
   //! indicates if the socket is still running
@@ -116,6 +253,45 @@ struct socket_server_desc {
   pthread_t tid;
   //! the current number of connections
   unsigned long numConnections;
+  //! the number of closed connections that still access the server descriptor
+  unsigned long numFinishing;
+  //! function that hands over a connection (see socketServer_handover)
+  bool (*handoverFunc)(void *ctx, struct socket_connection_desc *desc, void *connectionUserData,
+                       int fd, const void *pending, size_t pendingLen);
+  //! the context that is passed to handoverFunc
+  void *handoverCtx;
+  //! the number of connections that still have to be handed over
+  unsigned long numHandovers;
+  //! the maximum number of connections (0 => unlimited)
+  unsigned long maxConnections;
+  //! the maximum memory for receive buffers of all connections (0 => unlimited)
+  size_t maxBufferMemory;
+  //! the memory that is currently used for receive buffers
+  size_t bufferMemory;
+  //! message that is sent to connections that are rejected (can be NULL)
+  const char *rejectMsg;
+  //! spare fd that is released to be able to reject connections when no fds are left
+  int spareFd;
+  //! indicates that no fd is left to reject connections
+  bool fdExhausted;
+  //! indicates if the listener is paused
+  volatile bool paused;
+  //! the statistics of the server
+  struct socket_server_stats stats;
+  //! the socket options of the server
+  struct socket_options options;
+  //! path of the unix socket file that is removed when the server stops accepting (can be NULL)
+  char *unixPath;
+  //! the maximum number of bytes read from a connection at once (0 => unlimited)
+  size_t readBudgetBytes;
+  //! the maximum number of socket_onMessage calls for a connection at once (0 => unlimited)
+  unsigned long readBudgetMsgs;
+  //! the egress rate of every new connection in bytes per second (0 => unlimited)
+  unsigned long pacingRate;
+  //! mutex that protects paceBucket
+  pthread_mutex_t paceMutex;
+  //! token bucket that limits the egress rate of all connections together (rate 0 => unlimited)
+  struct token_bucket paceBucket;
 };
 
 /**
@@ -183,6 +359,7 @@ removeConnection(struct socket_server_desc *socketDesc, struct socket_connection
         free(listElement);
         rc = 0;
         socketDesc->numConnections--;
+        pthread_cond_broadcast(&socketDesc->listCond);
         break;
       }
       previousListElement = listElement;
@@ -209,312 +386,1450 @@ closeAllConnections(struct socket_server_desc *socketDesc)
   {
     listElement = socketDesc->list;
     while (listElement) {
-      listElement = listElement->next;
       socketServer_closeConnection(listElement->desc);
+      listElement = listElement->next;
     }
   }
   pthread_mutex_unlock(&socketDesc->listMutex);
 }
 
 /**
- * \brief connection thread
+ * \brief checks if the budget of the socket server is exhausted (listMutex must be locked)
  *
- * \param *params Pointer to the connectionDesc (steals the reference)
+ * \param *socketDesc Pointer to the socket descriptor
  *
- * \return NULL
+ * \return true if no more connections should be accepted else false
  */
-static void *
-connectionThread(void *params)
+static bool
+budgetExhausted(struct socket_server_desc *socketDesc)
 {
-  struct socket_connection_desc *connectionDesc = params;
-  fd_set readfds;
-  int n;
-  size_t count;
-  int increase;
-  size_t bytesFree;
-  bool first;
-  struct timeval tv;
+  if (socketDesc->maxConnections && (socketDesc->numConnections >= socketDesc->maxConnections))
+    return true;
 
-  pthread_detach(pthread_self());
+  return socketDesc->maxBufferMemory && (socketDesc->bufferMemory >= socketDesc->maxBufferMemory);
+}
 
-  connectionDesc->connectionUserData = connectionDesc->socketDesc
-                                         ->socket_onOpen(connectionDesc->socketDesc->socketUserData,
-                                                         connectionDesc);
+/**
+ * \brief pauses the listener if the budget is exhausted and resumes it once it recovered
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ */
+static void
+updateListener(struct socket_server_desc *socketDesc)
+{
+  uint64_t wakeup = 1;
+  bool pause;
+  bool changed;
 
-  FD_ZERO(&readfds);
-  FD_SET(connectionDesc->connectionSocketFd, &readfds);
-  while (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED) {
-    tv.tv_sec = 0;
-    tv.tv_usec = 300000;
-    FD_ZERO(&readfds);
-    FD_SET(connectionDesc->connectionSocketFd, &readfds);
-    if (select(connectionDesc->connectionSocketFd + 1, &readfds, NULL, NULL, &tv) > 0) {
-      if (FD_ISSET(connectionDesc->connectionSocketFd, &readfds)) {
-        first = true;
-        increase = 1;
-        do {
-          bytesFree = DYNBUFFER_BYTES_FREE(&connectionDesc->buffer);
-          if (DYNBUFFER_BYTES_FREE(&connectionDesc->buffer) < READ_SIZE) {
-            dynBuffer_increase_to(&(connectionDesc->buffer), READ_SIZE * increase);
-            bytesFree = DYNBUFFER_BYTES_FREE(&connectionDesc->buffer);
-            increase++;
-          }
-          n = recv(connectionDesc->connectionSocketFd,
-                   DYNBUFFER_WRITE_POS(&(connectionDesc->buffer)), bytesFree, MSG_DONTWAIT);
-          if (first && (n == 0)) {
-            connectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
-            break;
-          }
-          first = false;
-
-          if (n >= 0)
-            DYNBUFFER_INCREASE_WRITE_POS((&(connectionDesc->buffer)), n);
-          else
-            break;
-        } while (((size_t) n == bytesFree) &&
-                 (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED));
-
-        if (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED) {
-          do {
-            count = connectionDesc->socketDesc
-                      ->socket_onMessage(connectionDesc->socketDesc->socketUserData, connectionDesc,
-                                         connectionDesc->connectionUserData,
-                                         DYNBUFFER_BUFFER(&(connectionDesc->buffer)),
-                                         DYNBUFFER_SIZE(&(connectionDesc->buffer)));
-            dynBuffer_removeLeadingBytes(&(connectionDesc->buffer), count);
-          } while (count && DYNBUFFER_SIZE(&(connectionDesc->buffer)) &&
-                   (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED));
-        }
-      }
-    }
+  pthread_mutex_lock(&socketDesc->listMutex);
+  pause = socketDesc->fdExhausted || budgetExhausted(socketDesc);
+  changed = (pause != socketDesc->paused) && (socketDesc->socketFd >= 0);
+  if (changed) {
+    socketDesc->paused = pause;
+    if (pause)
+      socketDesc->stats.listenerPauses++;
   }
+  pthread_mutex_unlock(&socketDesc->listMutex);
 
-  dynBuffer_delete(&(connectionDesc->buffer));
+  if (!changed)
+    return;
 
-  connectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
-  connectionDesc->socketDesc->socket_onClose(connectionDesc->socketDesc->socketUserData,
-                                             connectionDesc, connectionDesc->connectionUserData);
-  close(connectionDesc->connectionSocketFd);
-  removeConnection(connectionDesc->socketDesc, connectionDesc);
+  ezwebsocket_log(EZLOG_INFO, "%s listener\n", pause ? "pausing" : "resuming");
+  if (socketDesc->socket_onWatch) {
+    socketDesc->socket_onWatch(socketDesc->socketUserData, socketDesc->socketFd,
+                               pause ? 0 : POLLIN);
+  } else if (!pause) {
+    if (write(socketDesc->wakeupFd, &wakeup, sizeof(wakeup)) != sizeof(wakeup))
+      ezwebsocket_log(EZLOG_ERROR, "couldn't wake up socket server thread\n");
+  }
+}
 
-  refcnt_unref(connectionDesc);
+/**
+ * \brief updates the buffer memory of the socket server with the current size of the
+ *        receive buffer of the connection
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+updateBufferMemory(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
 
-  return NULL;
+  if (connectionDesc->buffer.size == connectionDesc->bufferMemory)
+    return;
+
+  pthread_mutex_lock(&socketDesc->listMutex);
+  socketDesc->bufferMemory -= connectionDesc->bufferMemory;
+  socketDesc->bufferMemory += connectionDesc->buffer.size;
+  pthread_mutex_unlock(&socketDesc->listMutex);
+  connectionDesc->bufferMemory = connectionDesc->buffer.size;
+
+  if (socketDesc->maxBufferMemory)
+    updateListener(socketDesc);
 }
 
-// usage: snprintf(str,sizeof(str),"%d.%d.%d.%d",FMT_IP(int));
-#define FMT_IP(ip)                                                                                 \
-  (ip & 0xFF000000) >> 24, (ip & 0x00FF0000) >> 16, (ip & 0x0000FF00) >> 8, ip & 0x000000FF
+/**
+ * \brief Passes the buffered data of the connection to socket_onMessage
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *budget Pointer to the number of socket_onMessage calls that are left, it's decreased
+ *                with every call (NULL => unlimited)
+ *
+ * \return false if the budget was used up before all the data was processed else true
+ */
+static bool
+connectionDispatch(struct socket_connection_desc *connectionDesc, unsigned long *budget)
+{
+  size_t count;
+  size_t offset = 0;
+  bool done = true;
+
+  if ((connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED) &&
+      DYNBUFFER_SIZE(&(connectionDesc->buffer))) {
+    connectionDesc->msgBudget = budget;
+    // the processed data is removed once at the end instead of after every message
+    do {
+      if (budget) {
+        if (!*budget) {
+          done = false;
+          break;
+        }
+        (*budget)--;
+      }
+      count = connectionDesc->socketDesc
+                ->socket_onMessage(connectionDesc->socketDesc->socketUserData, connectionDesc,
+                                   connectionDesc->connectionUserData,
+                                   DYNBUFFER_BUFFER(&(connectionDesc->buffer)) + offset,
+                                   DYNBUFFER_SIZE(&(connectionDesc->buffer)) - offset);
+      offset += count;
+    } while (count && (DYNBUFFER_SIZE(&(connectionDesc->buffer)) > offset) &&
+             (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED));
+    connectionDesc->msgBudget = NULL;
+    dynBuffer_removeLeadingBytes(&(connectionDesc->buffer), offset);
+  }
+
+  return done;
+}
 
 /**
- * \brief starts a new connection
+ * \brief Takes read budget for messages that socket_onMessage processes in addition to the
+ *        first one of a call (e.g. a batch of small frames)
  *
- * \param socketFd The socket file descriptor
- * \param socketDesc Pointer to the socket descriptor
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param max The number of additional messages that are wanted
  *
- * \return 0 if successful else -1
+ * \return The number of additional messages that may be processed (<= max)
  */
-static int
-startConnection(int socketFd, struct socket_server_desc *socketDesc)
+unsigned long
+socketServer_takeReadBudget(struct socket_connection_desc *connectionDesc, unsigned long max)
 {
-  struct socket_connection_desc *desc;
-  struct sockaddr_in sock_addr = { 0 };
-  socklen_t sock_addr_len = sizeof(sock_addr);
+  unsigned long *budget = connectionDesc->msgBudget;
+
+  if (!budget)
+    return max;
+  if (max > *budget)
+    max = *budget;
+  *budget -= max;
+  return max;
+}
 
-  desc = refcnt_allocate(sizeof(struct socket_connection_desc), NULL);
-  if (!desc) {
-    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
-    return -1;
+/**
+ * \brief Marks that the connection used up its read budget, in threadless mode it's queued
+ *        behind the other ready connections of the event loop (round robin)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionYield(struct socket_connection_desc *connectionDesc)
+{
+  connectionDesc->readPending = true;
+  if (connectionDesc->socketDesc->socket_onWatch)
+    eventLoop_requeue(connectionDesc->connectionSocketFd);
+}
+
+/**
+ * \brief Reads the available data of the connection and passes it to socket_onMessage
+ *        (limited by the read budget of the server)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionRead(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+  unsigned long msgBudget = socketDesc->readBudgetMsgs;
+  unsigned long *msgBudgetPtr = socketDesc->readBudgetMsgs ? &msgBudget : NULL;
+  size_t byteBudget = socketDesc->readBudgetBytes;
+  bool exhausted;
+  int n;
+  int increase;
+  size_t bytesFree;
+  bool first;
+
+  // the data that was left over the last time is processed first
+  if (connectionDesc->readPending) {
+    connectionDesc->readPending = false;
+    if (!connectionDispatch(connectionDesc, msgBudgetPtr)) {
+      connectionYield(connectionDesc);
+      updateBufferMemory(connectionDesc);
+      return;
+    }
   }
 
-  memset(desc, 0, sizeof(struct socket_connection_desc));
+  first = true;
+  increase = 1;
+  do {
+    bytesFree = DYNBUFFER_BYTES_FREE(&connectionDesc->buffer);
+    if (DYNBUFFER_BYTES_FREE(&connectionDesc->buffer) < READ_SIZE) {
+      dynBuffer_increase_to(&(connectionDesc->buffer), READ_SIZE * increase);
+      bytesFree = DYNBUFFER_BYTES_FREE(&connectionDesc->buffer);
+      increase++;
+    }
+    if (socketDesc->readBudgetBytes && (bytesFree > byteBudget))
+      bytesFree = byteBudget;
+    n = recv(connectionDesc->connectionSocketFd, DYNBUFFER_WRITE_POS(&(connectionDesc->buffer)),
+             bytesFree, MSG_DONTWAIT);
+    if (first && ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                               (errno != EINTR)))) {
+      // a requested handover is still carried out (the new process sees the closed peer)
+      pthread_mutex_lock(&connectionDesc->fdMutex);
+      if (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED)
+        connectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+      pthread_mutex_unlock(&connectionDesc->fdMutex);
+      break;
+    }
+    first = false;
 
-  if (!getsockname(socketFd, (struct sockaddr *) &sock_addr, &sock_addr_len))
-    snprintf(desc->server_ip, sizeof(desc->server_ip), "%d.%d.%d.%d",
-             FMT_IP(htonl(sock_addr.sin_addr.s_addr)));
-  else
-    ezwebsocket_log(EZLOG_ERROR, "error getsockname\n");
+    if (n < 0)
+      break;
 
-  if (!getpeername(socketFd, (struct sockaddr *) &sock_addr, &sock_addr_len))
-    snprintf(desc->peer_ip, sizeof(desc->peer_ip), "%d.%d.%d.%d",
-             FMT_IP(htonl(sock_addr.sin_addr.s_addr)));
-  else
-    ezwebsocket_log(EZLOG_ERROR, "error getpeername\n");
+    DYNBUFFER_INCREASE_WRITE_POS((&(connectionDesc->buffer)), n);
+    if (socketDesc->readBudgetBytes)
+      byteBudget -= n;
+  } while (((size_t) n == bytesFree) && (!socketDesc->readBudgetBytes || byteBudget) &&
+           (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED));
 
-  desc->connectionSocketFd = socketFd;
-  desc->socketDesc = socketDesc;
-  dynBuffer_init(&(desc->buffer));
-  desc->connectionUserData = NULL;
+  // if the byte budget is used up there might be more data in the socket
+  exhausted = socketDesc->readBudgetBytes && !byteBudget;
 
-  addConnection(socketDesc, desc);
-  desc->state = SOCKET_SESSION_STATE_CONNECTED;
+  socketOptions_rearm(connectionDesc->connectionSocketFd, &socketDesc->options);
 
-  if (pthread_create(&desc->tid, NULL, connectionThread, desc) != 0) {
-    ezwebsocket_log(EZLOG_ERROR, "pthread_create failed\n");
-    refcnt_unref(desc);
-    return -1;
-  }
+  if (!connectionDispatch(connectionDesc, msgBudgetPtr))
+    exhausted = true;
 
-  return 0;
+  if (exhausted && (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED) &&
+      !connectionDesc->readPaused)
+    connectionYield(connectionDesc);
+
+  updateBufferMemory(connectionDesc);
 }
 
 /**
- * \brief closes the given connection
+ * \brief Sets the given time to the given number of milliseconds from now
  *
- * \param *socketConnectionDesc Pointer to the socket connection descriptor
+ * \param *deadline Pointer to the time (CLOCK_MONOTONIC)
+ * \param timeoutMs The milliseconds
  */
-void
-socketServer_closeConnection(struct socket_connection_desc *socketConnectionDesc)
+static void
+setDeadline(struct timespec *deadline, int timeoutMs)
 {
-  refcnt_ref(socketConnectionDesc);
-  socketConnectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
-  refcnt_unref(socketConnectionDesc);
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeoutMs / 1000;
+  deadline->tv_nsec += (timeoutMs % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
 }
 
 /**
- * \brief sends the given data over the given socket
+ * \brief Returns the milliseconds until the given time
  *
- * \param *connectionDesc Pointer to the connection descriptor
- * \param *msg Pointer to the data
- * \param len The length of the data
+ * \param *deadline Pointer to the time (CLOCK_MONOTONIC)
+ * \param *now Pointer to the current time
  *
- * \return 0 if successful else -1
+ * \return The milliseconds (<= 0 => the time has passed)
  */
-int
-socketServer_send(struct socket_connection_desc *connectionDesc, void *msg, size_t len)
+static long long
+msUntil(const struct timespec *deadline, const struct timespec *now)
 {
-  int rc;
-  if (connectionDesc->state == SOCKET_SESSION_STATE_DISCONNECTED)
-    return -1;
-
-  rc = send(connectionDesc->connectionSocketFd, msg, len, MSG_NOSIGNAL);
-  if (rc == -1) {
-    ezwebsocket_log(EZLOG_ERROR, "send failed: %s\n", strerror(errno));
-  }
-  return ((size_t) rc == len ? 0 : -1);
+  // rounded up so a deadline doesn't expire too early
+  return ((deadline->tv_sec - now->tv_sec) * 1000000000LL + (deadline->tv_nsec - now->tv_nsec) +
+          999999) /
+         1000000;
 }
 
 /**
- * \brief processes connection requests
- *
- * \param *sockDesc Pointer to the socket descriptor
- *
- * \return NULL
+ * \brief Arms the timeout of the connection in the event loop for the earliest of the end of
+ *        the pause, the end of the drain and the wakeup (threadless mode)
  *
+ * \param *connectionDesc Pointer to the connection descriptor
  */
-static void *
-socketServerThread(void *sockDesc)
+static void
+connectionArmTimeout(struct socket_connection_desc *connectionDesc)
 {
-  struct socket_server_desc *socketDesc = sockDesc;
-  int socketChildFd;
-  socklen_t connectionAddrLen;
-  struct sockaddr_in connectionAddr;
-  struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
-  int res;
+  struct timespec now;
+  long long timeoutMs = LLONG_MAX;
+  long long ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  if (connectionDesc->readPaused)
+    timeoutMs = msUntil(&connectionDesc->resumeTime, &now);
+  if (connectionDesc->draining) {
+    ms = msUntil(&connectionDesc->drainTime, &now);
+    if (ms < timeoutMs)
+      timeoutMs = ms;
+  }
+  if (connectionDesc->wakeupArmed) {
+    ms = msUntil(&connectionDesc->wakeupTime, &now);
+    if (ms < timeoutMs)
+      timeoutMs = ms;
+  }
 
-  connectionAddrLen = sizeof(connectionAddr);
+  if (timeoutMs == LLONG_MAX)
+    timeoutMs = -1; // nothing to wait for
+  else if (timeoutMs < 0)
+    timeoutMs = 0;
+  else if (timeoutMs > INT_MAX)
+    timeoutMs = INT_MAX;
 
-  while (socketDesc->running) {
+  if (connectionDesc->connectionSocketFd >= 0)
+    eventLoop_setTimeout(connectionDesc->connectionSocketFd, timeoutMs);
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+}
 
-    FD_ZERO(&socketDesc->readfds);                      // initialize the fd set
-    FD_SET(socketDesc->socketFd, &socketDesc->readfds); // add socket fd
+/**
+ * \brief Arms the wakeup of the connection unless an earlier one is armed already
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param timeoutMs The time in milliseconds (0 => as soon as possible)
+ * \param createFd true to create the eventfd of the connection thread even if it's called from
+ *                 another thread
+ */
+static void
+connectionSetWakeup(struct socket_connection_desc *connectionDesc, int timeoutMs, bool createFd)
+{
+  struct timespec wakeupTime;
+  uint64_t wakeup = 1;
+
+  setDeadline(&wakeupTime, timeoutMs);
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  if (!connectionDesc->socketDesc->socket_onWatch && (connectionDesc->wakeupFd < 0) &&
+      (createFd || pthread_equal(pthread_self(), connectionDesc->tid))) {
+    connectionDesc->wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (connectionDesc->wakeupFd < 0)
+      ezwebsocket_log(EZLOG_ERROR, "eventfd failed\n");
+  }
+  if (!connectionDesc->wakeupArmed ||
+      (wakeupTime.tv_sec < connectionDesc->wakeupTime.tv_sec) ||
+      ((wakeupTime.tv_sec == connectionDesc->wakeupTime.tv_sec) &&
+       (wakeupTime.tv_nsec < connectionDesc->wakeupTime.tv_nsec))) {
+    connectionDesc->wakeupArmed = true;
+    connectionDesc->wakeupTime = wakeupTime;
+    if ((connectionDesc->wakeupFd >= 0) &&
+        (write(connectionDesc->wakeupFd, &wakeup, sizeof(wakeup)) != sizeof(wakeup)))
+      ezwebsocket_log(EZLOG_ERROR, "couldn't wake up connection thread\n");
+    pthread_cond_signal(&connectionDesc->resumeCond);
+  }
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
 
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
+  if (connectionDesc->socketDesc->socket_onWatch)
+    connectionArmTimeout(connectionDesc);
+}
 
-    res = select(socketDesc->socketFd + 1, &socketDesc->readfds, NULL, NULL, &timeout);
-    if (res < 0) {
-      ezwebsocket_log(EZLOG_ERROR, "ERROR in select\n");
+/**
+ * \brief Writes the given buffers to the socket of the connection with as few syscalls as
+ *        possible
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *iov Pointer to the buffers
+ * \param iovcnt The number of buffers
+ *
+ * \return 0 if successful else -1
+ */
+static int
+connectionWrite(struct socket_connection_desc *connectionDesc, const struct iovec *iov,
+                size_t iovcnt)
+{
+  struct iovec vec[IOV_MAX];
+  struct msghdr msgHdr;
+  size_t idx = 0;
+  size_t offset = 0;
+  size_t cnt;
+  ssize_t rc;
+
+  while (idx < iovcnt) {
+    // fill the next chunk, the first buffer may be partially sent already
+    for (cnt = 0; cnt < IOV_MAX && idx + cnt < iovcnt; cnt++)
+      vec[cnt] = iov[idx + cnt];
+    vec[0].iov_base = (unsigned char *) vec[0].iov_base + offset;
+    vec[0].iov_len -= offset;
+
+    memset(&msgHdr, 0, sizeof(msgHdr));
+    msgHdr.msg_iov = vec;
+    msgHdr.msg_iovlen = cnt;
+    rc = sendmsg(connectionDesc->connectionSocketFd, &msgHdr, MSG_NOSIGNAL);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      ezwebsocket_log(EZLOG_ERROR, "sendmsg failed: %s\n", strerror(errno));
+      return -1;
     }
 
-    if (res > 0) {
-      // process connection requeusts
-      if (FD_ISSET(socketDesc->socketFd, &(socketDesc->readfds))) {
-        // wait for connection requests
-        socketChildFd = accept(socketDesc->socketFd, (struct sockaddr *) &connectionAddr,
-                               &connectionAddrLen);
-        if (socketChildFd < 0)
-          ezwebsocket_log(EZLOG_ERROR, "ERROR on accept\n");
-
-        if (startConnection(socketChildFd, socketDesc) < 0)
-          ezwebsocket_log(EZLOG_ERROR, "startConnection failed\n");
-      }
+    // skip what was sent
+    rc += offset;
+    while (idx < iovcnt && (size_t) rc >= iov[idx].iov_len) {
+      rc -= iov[idx].iov_len;
+      idx++;
     }
+    offset = rc;
   }
-  return NULL;
+  return 0;
 }
 
 /**
- * \brief opens a socket server
+ * \brief Takes the tokens for the given number of bytes from the token buckets of the
+ *        connection and the server if both of them allow it (the paceMutex of the connection
+ *        must be held)
  *
- * \param *socketInit Pointer to the socket init struct
- * \param *socketUserData Pointer to the user data that should be used
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param len The number of bytes
  *
- * \return pointer to the socket descriptor
+ * \return 0 if the tokens were taken else the time to wait in milliseconds
  */
-struct socket_server_desc *
-socketServer_open(struct socket_server_init *socketInit, void *socketUserData)
+static int
+connectionTakeTokens(struct socket_connection_desc *connectionDesc, size_t len)
 {
-  int optval;
-  struct addrinfo hints, *serverinfo, *iter;
-  struct socket_server_desc *socketDesc;
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+  int serverWaitMs;
+  int waitMs;
+
+  pthread_mutex_lock(&socketDesc->paceMutex);
+  waitMs = tokenBucket_wait(&connectionDesc->paceBucket, len);
+  serverWaitMs = tokenBucket_wait(&socketDesc->paceBucket, len);
+  if (serverWaitMs > waitMs)
+    waitMs = serverWaitMs;
+  if (!waitMs) {
+    tokenBucket_take(&connectionDesc->paceBucket, len);
+    tokenBucket_take(&socketDesc->paceBucket, len);
+  }
+  pthread_mutex_unlock(&socketDesc->paceMutex);
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
+  return waitMs;
+}
 
-  if (getaddrinfo(socketInit->address, socketInit->port, &hints, &serverinfo) != 0) {
-    ezwebsocket_log(EZLOG_ERROR, "getaddrinfo failed\n");
-    return NULL;
+/**
+ * \brief Sends the data that waits for the pacing tokens as far as the token buckets allow it,
+ *        the wakeup is armed for the rest (called on the thread of the connection)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionSendPaced(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+  struct iovec iov;
+  int waitMs = 0;
+
+  pthread_mutex_lock(&connectionDesc->paceMutex);
+  while (DYNBUFFER_SIZE(&connectionDesc->paced) &&
+         (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED)) {
+    // the data is sent in bursts so that the rate stays smooth
+    iov.iov_base = DYNBUFFER_BUFFER(&connectionDesc->paced);
+    iov.iov_len = DYNBUFFER_SIZE(&connectionDesc->paced);
+    if ((connectionDesc->paceBucket.rate > 0) && (iov.iov_len > connectionDesc->paceBucket.burst))
+      iov.iov_len = connectionDesc->paceBucket.burst;
+    if ((socketDesc->paceBucket.rate > 0) && (iov.iov_len > socketDesc->paceBucket.burst))
+      iov.iov_len = socketDesc->paceBucket.burst;
+
+    waitMs = connectionTakeTokens(connectionDesc, iov.iov_len);
+    if (waitMs)
+      break;
+
+    if (connectionWrite(connectionDesc, &iov, 1) < 0) {
+      dynBuffer_delete(&connectionDesc->paced);
+      break;
+    }
+    dynBuffer_removeLeadingBytes(&connectionDesc->paced, iov.iov_len);
   }
+  pthread_mutex_unlock(&connectionDesc->paceMutex);
 
-  socketDesc = malloc(sizeof(struct socket_server_desc));
-  if (!socketDesc) {
-    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
-    return NULL;
-  }
+  if (waitMs)
+    connectionSetWakeup(connectionDesc, waitMs, true);
+}
 
-  socketDesc->socket_onClose = socketInit->socket_onClose;
-  socketDesc->socket_onOpen = socketInit->socket_onOpen;
-  socketDesc->socket_onMessage = socketInit->socket_onMessage;
-  socketDesc->socketUserData = socketUserData;
-  socketDesc->list = NULL;
-  socketDesc->numConnections = 0;
-  pthread_mutex_init(&socketDesc->listMutex, NULL);
+/**
+ * \brief Sends the given buffers, if user space pacing is used and the token buckets don't
+ *        allow to send them now (or other data waits already) they are queued and sent when
+ *        the wakeup of the connection is due, the sending thread never waits for the tokens
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *iov Pointer to the buffers
+ * \param iovcnt The number of buffers
+ * \param paced false if the data doesn't use up the pacing tokens (e.g. control frames)
+ *
+ * \return 0 if successful else -1 (errno is EAGAIN if the pacing queue is full, nothing was
+ *         sent or queued then)
+ */
+static int
+connectionSend(struct socket_connection_desc *connectionDesc, const struct iovec *iov,
+               size_t iovcnt, bool paced)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+  size_t queued;
+  size_t len = 0;
+  size_t i;
+  int waitMs = 0;
+  int rc;
 
-  for (iter = serverinfo; iter != NULL; iter = iter->ai_next) {
-    if ((socketDesc->socketFd = socket(iter->ai_family, iter->ai_socktype, iter->ai_protocol)) <
-        0) {
-      ezwebsocket_log(EZLOG_ERROR, "socket failed\n");
-      continue;
-    }
+  if (connectionDesc->state != SOCKET_SESSION_STATE_CONNECTED)
+    return -1;
 
-    optval = 1;
-    if (setsockopt(socketDesc->socketFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-      ezwebsocket_log(EZLOG_ERROR, "setsockopt SO_REUSEADDR failed\n");
+  if (!connectionDesc->pacing && (socketDesc->paceBucket.rate <= 0))
+    return connectionWrite(connectionDesc, iov, iovcnt);
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  pthread_mutex_lock(&connectionDesc->paceMutex);
+  // the data must not overtake the data that waits for the tokens
+  queued = DYNBUFFER_SIZE(&connectionDesc->paced);
+  if (!queued) {
+    if (paced)
+      waitMs = connectionTakeTokens(connectionDesc, len);
+    if (!waitMs) {
+      rc = connectionWrite(connectionDesc, iov, iovcnt);
+      pthread_mutex_unlock(&connectionDesc->paceMutex);
+      return rc;
     }
+  } else if (queued + len > PACING_MAX_QUEUED) {
+    pthread_mutex_unlock(&connectionDesc->paceMutex);
+    errno = EAGAIN;
+    return -1;
+  }
 
-    optval = 1;
-    if (setsockopt(socketDesc->socketFd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval)) < 0) {
-      ezwebsocket_log(EZLOG_ERROR, "setsockopt SO_KEEPALIVE failed\n");
+  // a failed allocation loses the queued data so the connection can't be used anymore
+  if (dynBuffer_increase_to(&connectionDesc->paced, len) < 0) {
+    pthread_mutex_unlock(&connectionDesc->paceMutex);
+    ezwebsocket_log(EZLOG_ERROR, "dynBuffer_increase_to failed\n");
+    socketServer_closeConnection(connectionDesc);
+    return -1;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(DYNBUFFER_WRITE_POS(&connectionDesc->paced), iov[i].iov_base, iov[i].iov_len);
+    DYNBUFFER_INCREASE_WRITE_POS(&connectionDesc->paced, iov[i].iov_len);
+  }
+  pthread_mutex_unlock(&connectionDesc->paceMutex);
+
+  // the wakeup is armed already if other data waits
+  if (!queued)
+    connectionSetWakeup(connectionDesc, waitMs, true);
+
+  return 0;
+}
+
+/**
+ * \brief Sends the paced data and calls socket_onWakeup if the wakeup of the connection is
+ *        due
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ *
+ * \return true if the wakeup was due else false
+ */
+static bool
+connectionWakeup(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+  struct timespec now;
+  bool due;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  due = connectionDesc->wakeupArmed && (msUntil(&connectionDesc->wakeupTime, &now) <= 0);
+  if (due)
+    connectionDesc->wakeupArmed = false;
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  // the wakeup also lets the user of the connection send again once the paced data is out
+  if (due)
+    connectionSendPaced(connectionDesc);
+  if (due && socketDesc->socket_onWakeup &&
+      (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED))
+    socketDesc->socket_onWakeup(socketDesc->socketUserData, connectionDesc,
+                                connectionDesc->connectionUserData);
+
+  return due;
+}
+
+/**
+ * \brief Resumes reading from a connection that was paused with socketServer_pauseReading
+ *        and processes the data that is still in the buffer
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionResume(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+
+  connectionDesc->readPaused = false;
+  if (socketDesc->socket_onWatch && (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED))
+    socketDesc->socket_onWatch(socketDesc->socketUserData, connectionDesc->connectionSocketFd,
+                               POLLIN);
+
+  connectionDispatch(connectionDesc, NULL);
+  updateBufferMemory(connectionDesc);
+}
+
+/**
+ * \brief Waits until reading from a paused connection may be resumed (threaded mode)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionPaused(struct socket_connection_desc *connectionDesc)
+{
+  struct timespec now;
+  long long remainingMs;
+  long long wakeupMs;
+
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  remainingMs = msUntil(&connectionDesc->resumeTime, &now);
+
+  if (remainingMs > 0) {
+    // the state is checked at least every 300ms like in the poll loop
+    if (remainingMs > 300)
+      remainingMs = 300;
+    // the connection thread calls socket_onWakeup when it's due
+    if (connectionDesc->wakeupArmed) {
+      wakeupMs = msUntil(&connectionDesc->wakeupTime, &now);
+      if (wakeupMs < remainingMs)
+        remainingMs = wakeupMs > 0 ? wakeupMs : 0;
+    }
+    now.tv_sec += remainingMs / 1000;
+    now.tv_nsec += (remainingMs % 1000) * 1000000L;
+    if (now.tv_nsec >= 1000000000L) {
+      now.tv_sec++;
+      now.tv_nsec -= 1000000000L;
+    }
+    // socketServer_resumeReading, socketServer_wakeup and socketServer_closeConnection wake it
+    // up earlier
+    pthread_cond_timedwait(&connectionDesc->resumeCond, &connectionDesc->fdMutex, &now);
+    pthread_mutex_unlock(&connectionDesc->fdMutex);
+    return;
+  }
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  connectionResume(connectionDesc);
+}
+
+/**
+ * \brief Removes the connection from the handovers the server waits for
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+handoverDone(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+
+  pthread_mutex_lock(&socketDesc->listMutex);
+  if (connectionDesc->handoverPending) {
+    connectionDesc->handoverPending = false;
+    socketDesc->numHandovers--;
+    pthread_cond_broadcast(&socketDesc->listCond);
+  }
+  pthread_mutex_unlock(&socketDesc->listMutex);
+}
+
+/**
+ * \brief Hands over the connection with the handoverFunc of the socket server
+ *        on success the connection is closed in this process else it stays connected
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionHandover(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+  bool handedOver;
+
+  handedOver = socketDesc->handoverFunc(socketDesc->handoverCtx, connectionDesc,
+                                        connectionDesc->connectionUserData,
+                                        connectionDesc->connectionSocketFd,
+                                        DYNBUFFER_BUFFER(&(connectionDesc->buffer)),
+                                        DYNBUFFER_SIZE(&(connectionDesc->buffer)));
+
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  if (connectionDesc->state == SOCKET_SESSION_STATE_HANDOVER) {
+    if (handedOver || !connectionDesc->closeAfterHandover) {
+      connectionDesc->state = handedOver ? SOCKET_SESSION_STATE_DISCONNECTED
+                                         : SOCKET_SESSION_STATE_CONNECTED;
+    } else {
+      // socketServer_closeConnection was called during the handover
+      shutdown(connectionDesc->connectionSocketFd, SHUT_RDWR);
+      connectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+    }
+  }
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  handoverDone(connectionDesc);
+}
+
+/**
+ * \brief Closes the connection and releases the reference of the connection handler
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionFinish(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+
+  dynBuffer_delete(&(connectionDesc->buffer));
+  updateBufferMemory(connectionDesc);
+
+  // waits for socketServer_forEachConnection to finish with this connection
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  connectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  socketDesc->socket_onClose(socketDesc->socketUserData, connectionDesc,
+                             connectionDesc->connectionUserData);
+  if (socketDesc->socket_onWatch) {
+    eventLoop_remove(connectionDesc->connectionSocketFd);
+    socketDesc->socket_onWatch(socketDesc->socketUserData, connectionDesc->connectionSocketFd, 0);
+  }
+
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  close(connectionDesc->connectionSocketFd);
+  connectionDesc->connectionSocketFd = -1;
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  // a connection that was closed before its handover started must not be waited for
+  handoverDone(connectionDesc);
+
+  // socketServer_close must not free the server before the listener is updated
+  pthread_mutex_lock(&socketDesc->listMutex);
+  socketDesc->numFinishing++;
+  pthread_mutex_unlock(&socketDesc->listMutex);
+
+  removeConnection(socketDesc, connectionDesc);
+
+  // the fd is free again so the spare fd can be restored
+  pthread_mutex_lock(&socketDesc->listMutex);
+  socketDesc->fdExhausted = false;
+  if (socketDesc->spareFd < 0)
+    socketDesc->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  pthread_mutex_unlock(&socketDesc->listMutex);
+  updateListener(socketDesc);
+
+  pthread_mutex_lock(&socketDesc->listMutex);
+  socketDesc->numFinishing--;
+  pthread_cond_broadcast(&socketDesc->listCond);
+  pthread_mutex_unlock(&socketDesc->listMutex);
+
+  refcnt_unref(connectionDesc);
+}
+
+/**
+ * \brief Releases the handover state and processes the data that was handed over
+ *        (has to be called after socket_onOpen)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+static void
+connectionOpened(struct socket_connection_desc *connectionDesc)
+{
+  free(connectionDesc->handoverState);
+  connectionDesc->handoverState = NULL;
+  connectionDesc->handoverStateLen = 0;
+
+  connectionDispatch(connectionDesc, NULL);
+  updateBufferMemory(connectionDesc);
+}
+
+/**
+ * \brief connection thread
+ *
+ * \param *params Pointer to the connectionDesc (steals the reference)
+ *
+ * \return NULL
+ */
+static void *
+connectionThread(void *params)
+{
+  struct socket_connection_desc *connectionDesc = params;
+  struct pollfd fds[2];
+  struct timespec now;
+  long long timeoutMs;
+  uint64_t wakeup;
+
+  pthread_detach(pthread_self());
+  // socketServer_wakeup checks it before pthread_create returns
+  connectionDesc->tid = pthread_self();
+
+  connectionDesc->connectionUserData = connectionDesc->socketDesc
+                                         ->socket_onOpen(connectionDesc->socketDesc->socketUserData,
+                                                         connectionDesc);
+  connectionOpened(connectionDesc);
+
+  fds[0].fd = connectionDesc->connectionSocketFd;
+  fds[0].events = POLLIN;
+  fds[1].events = POLLIN;
+
+  do {
+    while (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED) {
+      if (connectionWakeup(connectionDesc))
+        continue;
+
+      if (connectionDesc->readPaused) {
+        connectionPaused(connectionDesc);
+        continue;
+      }
+
+      if (connectionDesc->readPending) {
+        connectionRead(connectionDesc);
+        continue;
+      }
+
+      // the state is checked at least every 300ms, socketServer_wakeup interrupts the poll
+      timeoutMs = 300;
+      pthread_mutex_lock(&connectionDesc->fdMutex);
+      if (connectionDesc->wakeupArmed) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (msUntil(&connectionDesc->wakeupTime, &now) < timeoutMs)
+          timeoutMs = msUntil(&connectionDesc->wakeupTime, &now);
+      }
+      pthread_mutex_unlock(&connectionDesc->fdMutex);
+      if (timeoutMs <= 0)
+        continue;
+
+      // a negative fd is ignored by poll
+      fds[1].fd = connectionDesc->wakeupFd;
+      if (poll(fds, 2, timeoutMs) > 0) {
+        if ((fds[1].revents & POLLIN) &&
+            (read(connectionDesc->wakeupFd, &wakeup, sizeof(wakeup)) != sizeof(wakeup)))
+          ezwebsocket_log(EZLOG_ERROR, "couldn't read wakeup fd\n");
+        if (fds[0].revents)
+          connectionRead(connectionDesc);
+      }
+    }
+
+    if (connectionDesc->state == SOCKET_SESSION_STATE_HANDOVER)
+      connectionHandover(connectionDesc);
+  } while (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED);
+
+  connectionFinish(connectionDesc);
+
+  return NULL;
+}
+
+/**
+ * \brief Handles the events of a connection in threadless mode
+ *
+ * \param *ctx Pointer to the connection descriptor
+ * \param fd The file descriptor of the connection
+ * \param events The events that occured on the fd
+ */
+static void
+connectionProcess(void *ctx, int fd, int events)
+{
+  struct socket_connection_desc *connectionDesc = ctx;
+  struct timespec now;
+  bool resume;
+  (void) fd;
+
+  if (!events) {
+    connectionWakeup(connectionDesc);
+
+    // the timeout is armed for the earliest deadline, the drain ends the connection even if it's
+    // paused
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&connectionDesc->fdMutex);
+    resume = connectionDesc->readPaused && (msUntil(&connectionDesc->resumeTime, &now) <= 0);
+    pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+    if (connectionDesc->draining && (msUntil(&connectionDesc->drainTime, &now) <= 0)) {
+      ezwebsocket_log(EZLOG_DEBUG, "drain timeout closing connection\n");
+      connectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+    } else if (resume) {
+      connectionResume(connectionDesc);
+    }
+
+    if (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED)
+      connectionArmTimeout(connectionDesc);
+  } else if (!connectionDesc->readPaused &&
+             (connectionDesc->state == SOCKET_SESSION_STATE_CONNECTED)) {
+    connectionRead(connectionDesc);
+  }
+
+  if (connectionDesc->state != SOCKET_SESSION_STATE_CONNECTED)
+    connectionFinish(connectionDesc);
+}
+
+/**
+ * \brief frees the resources of a connection descriptor
+ *
+ * \param *connectionDescriptor Pointer to the connection descriptor
+ *
+ * \note this function is passed to refcnt_allocate
+ */
+static void
+freeConnectionDesc(void *connectionDescriptor)
+{
+  struct socket_connection_desc *desc = connectionDescriptor;
+
+  free(desc->handoverState);
+  dynBuffer_delete(&desc->paced);
+  if (desc->wakeupFd >= 0)
+    close(desc->wakeupFd);
+  pthread_cond_destroy(&desc->resumeCond);
+  pthread_mutex_destroy(&desc->fdMutex);
+  pthread_mutex_destroy(&desc->paceMutex);
+}
+
+/**
+ * \brief starts a new connection
+ *
+ * \param socketFd The socket file descriptor
+ * \param socketDesc Pointer to the socket descriptor
+ * \param *peerAddr The address of the peer as returned by accept or NULL if unknown
+ * \param peerAddrLen The length of the peer address
+ * \param *pending Data that was already received (handover) or NULL
+ * \param pendingLen The length of the pending data
+ * \param *state The state that was handed over by the previous process or NULL
+ * \param stateLen The length of the state
+ *
+ * \return 0 if successful else -1
+ */
+static int
+startConnection(int socketFd, struct socket_server_desc *socketDesc,
+                const struct sockaddr_storage *peerAddr, socklen_t peerAddrLen, const void *pending,
+                size_t pendingLen, const void *state, size_t stateLen)
+{
+  struct socket_connection_desc *desc;
+  pthread_condattr_t condAttr;
+
+  desc = refcnt_allocate(sizeof(struct socket_connection_desc), freeConnectionDesc);
+  if (!desc) {
+    ezwebsocket_log(EZLOG_ERROR, "refcnt_allocate failed\n");
+    return -1;
+  }
+
+  memset(desc, 0, sizeof(struct socket_connection_desc));
+
+  // the ip strings are formatted when they are needed
+  if (peerAddr && (peerAddrLen <= sizeof(desc->peerAddr))) {
+    memcpy(&desc->peerAddr, peerAddr, peerAddrLen);
+    desc->peerAddrLen = peerAddrLen;
+  }
+
+  desc->connectionSocketFd = socketFd;
+  desc->wakeupFd = -1;
+  pthread_mutex_init(&desc->fdMutex, NULL);
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  pthread_cond_init(&desc->resumeCond, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+  pthread_mutex_init(&desc->paceMutex, NULL);
+  desc->socketDesc = socketDesc;
+  dynBuffer_init(&(desc->buffer));
+  dynBuffer_init(&desc->paced);
+  desc->connectionUserData = NULL;
+
+  if (pendingLen) {
+    if (dynBuffer_increase_to(&(desc->buffer), pendingLen) < 0) {
+      ezwebsocket_log(EZLOG_ERROR, "dynBuffer_increase_to failed\n");
+      goto ERROR;
+    }
+    memcpy(DYNBUFFER_WRITE_POS(&(desc->buffer)), pending, pendingLen);
+    DYNBUFFER_INCREASE_WRITE_POS(&(desc->buffer), pendingLen);
+  }
+
+  if (state) {
+    desc->handoverState = malloc(stateLen ? stateLen : 1);
+    if (!desc->handoverState) {
+      ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+      goto ERROR;
+    }
+    memcpy(desc->handoverState, state, stateLen);
+    desc->handoverStateLen = stateLen;
+  }
+
+  if (socketDesc->pacingRate)
+    socketServer_setPacingRate(desc, socketDesc->pacingRate);
+
+  addConnection(socketDesc, desc);
+  desc->state = SOCKET_SESSION_STATE_CONNECTED;
+
+  if (socketDesc->socket_onWatch) {
+    desc->connectionUserData = socketDesc->socket_onOpen(socketDesc->socketUserData, desc);
+    connectionOpened(desc);
+    if ((desc->state != SOCKET_SESSION_STATE_CONNECTED) ||
+        (eventLoop_add(socketFd, connectionProcess, desc) < 0)) {
+      desc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+      connectionFinish(desc);
+      return -1;
+    }
+    socketDesc->socket_onWatch(socketDesc->socketUserData, socketFd, POLLIN);
+    return 0;
+  }
+
+  if (pthread_create(&desc->tid, NULL, connectionThread, desc) != 0) {
+    ezwebsocket_log(EZLOG_ERROR, "pthread_create failed\n");
+    refcnt_unref(desc);
+    return -1;
+  }
+
+  return 0;
+
+ERROR:
+  dynBuffer_delete(&(desc->buffer));
+  close(socketFd);
+  refcnt_unref(desc);
+  return -1;
+}
+
+/**
+ * \brief closes the given connection
+ *
+ * \param *socketConnectionDesc Pointer to the socket connection descriptor
+ */
+void
+socketServer_closeConnection(struct socket_connection_desc *socketConnectionDesc)
+{
+  refcnt_ref(socketConnectionDesc);
+  pthread_mutex_lock(&socketConnectionDesc->fdMutex);
+  // the shutdown wakes up the connection thread (or the event loop) immediately
+  if ((socketConnectionDesc->state == SOCKET_SESSION_STATE_CONNECTED) &&
+      (socketConnectionDesc->connectionSocketFd >= 0))
+    shutdown(socketConnectionDesc->connectionSocketFd, SHUT_RDWR);
+  // a running handover decides what happens to the connection
+  if (socketConnectionDesc->state == SOCKET_SESSION_STATE_HANDOVER)
+    socketConnectionDesc->closeAfterHandover = true;
+  else
+    socketConnectionDesc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+  pthread_cond_signal(&socketConnectionDesc->resumeCond);
+  pthread_mutex_unlock(&socketConnectionDesc->fdMutex);
+  refcnt_unref(socketConnectionDesc);
+}
+
+/**
+ * \brief returns the burst of a pacing token bucket
+ *
+ * \param rate The rate in bytes per second
+ *
+ * \return The number of bytes that may be sent at once
+ */
+static unsigned long
+pacingBurst(unsigned long rate)
+{
+  unsigned long burst = rate / 1000 * PACING_BURST_MS;
+
+  return burst > PACING_BURST_MIN ? burst : PACING_BURST_MIN;
+}
+
+/**
+ * \brief sends the given data over the given socket
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *msg Pointer to the data
+ * \param len The length of the data
+ *
+ * \return 0 if successful else -1 (errno is EAGAIN if the pacing queue of the connection is
+ *         full, nothing was sent then)
+ */
+int
+socketServer_send(struct socket_connection_desc *connectionDesc, void *msg, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = msg;
+  iov.iov_len = len;
+  return connectionSend(connectionDesc, &iov, 1, true);
+}
+
+/**
+ * \brief sends the given control data (e.g. a close or pong frame) over the given socket, it
+ *        doesn't use up the pacing tokens but it keeps its order behind the paced data
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *msg Pointer to the data
+ * \param len The length of the data
+ *
+ * \return 0 if successful else -1
+ */
+int
+socketServer_sendControl(struct socket_connection_desc *connectionDesc, void *msg, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = msg;
+  iov.iov_len = len;
+  return connectionSend(connectionDesc, &iov, 1, false);
+}
+
+/**
+ * \brief sends the given buffers over the given socket with as few syscalls as possible
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *iov Pointer to the buffers
+ * \param iovcnt The number of buffers
+ *
+ * \return 0 if successful else -1 (errno is EAGAIN if the pacing queue of the connection is
+ *         full, nothing was sent then)
+ */
+int
+socketServer_sendv(struct socket_connection_desc *connectionDesc, const struct iovec *iov,
+                   size_t iovcnt)
+{
+  return connectionSend(connectionDesc, iov, iovcnt, true);
+}
+
+/**
+ * \brief stops reading from the connection for the given time, the data that is already
+ *        received stays in the buffer and is passed to socket_onMessage again afterwards
+ *        (the peer is slowed down by the flow control of the transport)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param timeoutMs The time in milliseconds
+ *
+ * \note must only be called from socket_onMessage
+ */
+void
+socketServer_pauseReading(struct socket_connection_desc *connectionDesc, int timeoutMs)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+
+  bool wasPaused = connectionDesc->readPaused;
+
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  setDeadline(&connectionDesc->resumeTime, timeoutMs);
+  connectionDesc->readPaused = true;
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  if (socketDesc->socket_onWatch) {
+    if (!wasPaused)
+      socketDesc->socket_onWatch(socketDesc->socketUserData, connectionDesc->connectionSocketFd,
+                                 0);
+    // a running drain keeps its deadline
+    connectionArmTimeout(connectionDesc);
+  }
+}
+
+/**
+ * \brief ends the pause of socketServer_pauseReading early, can be called from any thread
+ *        (in threadless mode the connection is resumed by the next call of eventLoop_process)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ */
+void
+socketServer_resumeReading(struct socket_connection_desc *connectionDesc)
+{
+  struct socket_server_desc *socketDesc = connectionDesc->socketDesc;
+
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  clock_gettime(CLOCK_MONOTONIC, &connectionDesc->resumeTime);
+  if (socketDesc->socket_onWatch && connectionDesc->readPaused &&
+      (connectionDesc->connectionSocketFd >= 0))
+    eventLoop_setTimeout(connectionDesc->connectionSocketFd, 0);
+  pthread_cond_signal(&connectionDesc->resumeCond);
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+}
+
+/**
+ * \brief has socket_onWakeup called on the thread of the connection once the given time has
+ *        passed, an earlier wakeup that is already armed is kept, can be called from any thread
+ *        (in threadless mode a wakeup from another thread is handled by the next call of
+ *        eventLoop_process, in threaded mode within 300ms unless the connection thread armed a
+ *        wakeup before)
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param timeoutMs The time in milliseconds (0 => as soon as possible)
+ */
+void
+socketServer_wakeup(struct socket_connection_desc *connectionDesc, int timeoutMs)
+{
+  // the eventfd is only needed for wakeups from other threads, they come after the connection
+  // thread armed one itself (e.g. a pause that is ended early)
+  connectionSetWakeup(connectionDesc, timeoutMs, false);
+}
+
+/**
+ * \brief replaces the user data of the connection that is passed to the callbacks
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param *connectionUserData The new user data
+ *
+ * \note must only be called from socket_onMessage
+ */
+void
+socketServer_setConnectionUserData(struct socket_connection_desc *connectionDesc,
+                                   void *connectionUserData)
+{
+  connectionDesc->connectionUserData = connectionUserData;
+}
+
+/**
+ * \brief limits the egress rate of the given connection, tcp connections are paced by the
+ *        kernel (SO_MAX_PACING_RATE) otherwise the data that exceeds a token bucket is queued
+ *        and sent by the thread of the connection
+ *
+ * \param *connectionDesc Pointer to the connection descriptor
+ * \param rate The rate in bytes per second (0 => unlimited)
+ */
+void
+socketServer_setPacingRate(struct socket_connection_desc *connectionDesc, unsigned long rate)
+{
+  unsigned long bucketRate = rate;
+
+  pthread_mutex_lock(&connectionDesc->fdMutex);
+  if ((connectionDesc->connectionSocketFd >= 0) &&
+      (socketOptions_setPacingRate(connectionDesc->connectionSocketFd, rate) == 0))
+    bucketRate = 0;
+  pthread_mutex_unlock(&connectionDesc->fdMutex);
+
+  pthread_mutex_lock(&connectionDesc->paceMutex);
+  tokenBucket_init(&connectionDesc->paceBucket, bucketRate, pacingBurst(bucketRate));
+  // the queued data keeps its order even if the rate is removed later
+  if (bucketRate)
+    connectionDesc->pacing = true;
+  pthread_mutex_unlock(&connectionDesc->paceMutex);
+}
+
+/**
+ * \brief sends the reject message to the given connection and closes it
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ * \param fd The file descriptor of the connection
+ */
+static void
+rejectConnection(struct socket_server_desc *socketDesc, int fd)
+{
+  char discard[256];
+
+  if (socketDesc->rejectMsg &&
+      (send(fd, socketDesc->rejectMsg, strlen(socketDesc->rejectMsg),
+            MSG_NOSIGNAL | MSG_DONTWAIT) < 0))
+    ezwebsocket_log(EZLOG_DEBUG, "couldn't send reject message\n");
+
+  // read what's already there so that the peer gets a FIN instead of a RST
+  if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) < 0)
+    ezwebsocket_log(EZLOG_DEBUG, "nothing received from rejected connection\n");
+  shutdown(fd, SHUT_WR);
+  close(fd);
+}
+
+/**
+ * \brief rejects a connection request when no fd is left by releasing the spare fd
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ *
+ * \return true if a connection request was rejected else false
+ */
+static bool
+rejectWithSpareFd(struct socket_server_desc *socketDesc)
+{
+  int spareFd;
+  int fd;
+
+  pthread_mutex_lock(&socketDesc->listMutex);
+  spareFd = socketDesc->spareFd;
+  socketDesc->spareFd = -1;
+  if (spareFd < 0)
+    socketDesc->fdExhausted = true;
+  pthread_mutex_unlock(&socketDesc->listMutex);
+
+  if (spareFd < 0) {
+    // no way to reject the request so pause until a connection is closed
+    updateListener(socketDesc);
+    return false;
+  }
+
+  close(spareFd);
+  fd = accept(socketDesc->socketFd, NULL, NULL);
+  if (fd >= 0) {
+    rejectConnection(socketDesc, fd);
+    pthread_mutex_lock(&socketDesc->listMutex);
+    socketDesc->stats.rejectedNoFd++;
+    pthread_mutex_unlock(&socketDesc->listMutex);
+  }
+
+  spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  pthread_mutex_lock(&socketDesc->listMutex);
+  if (socketDesc->spareFd < 0)
+    socketDesc->spareFd = spareFd;
+  else if (spareFd >= 0)
+    close(spareFd);
+  if (socketDesc->spareFd < 0)
+    socketDesc->fdExhausted = true;
+  pthread_mutex_unlock(&socketDesc->listMutex);
+
+  updateListener(socketDesc);
+
+  return fd >= 0;
+}
+
+/**
+ * \brief accepts all pending connection requests
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ */
+static void
+acceptConnections(struct socket_server_desc *socketDesc)
+{
+  int socketChildFd;
+  socklen_t connectionAddrLen;
+  struct sockaddr_storage connectionAddr;
+  bool exhausted;
+
+  // accept until the backlog is empty or the listener gets paused
+  while (socketDesc->running && !socketDesc->paused) {
+    connectionAddrLen = sizeof(connectionAddr);
+    socketChildFd = accept4(socketDesc->socketFd, (struct sockaddr *) &connectionAddr,
+                            &connectionAddrLen, SOCK_CLOEXEC);
+    if (socketChildFd < 0) {
+      // EMFILE is also returned if no connection is pending
+      if ((errno == EMFILE) || (errno == ENFILE)) {
+        if (rejectWithSpareFd(socketDesc))
+          continue;
+        break;
+      }
+      if ((errno == EINTR) || (errno == ECONNABORTED))
+        continue;
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        ezwebsocket_log(EZLOG_ERROR, "ERROR on accept\n");
+      break;
+    }
+
+    pthread_mutex_lock(&socketDesc->listMutex);
+    exhausted = budgetExhausted(socketDesc);
+    if (exhausted)
+      socketDesc->stats.rejectedBudget++;
+    pthread_mutex_unlock(&socketDesc->listMutex);
+
+    if (exhausted) {
+      rejectConnection(socketDesc, socketChildFd);
+      updateListener(socketDesc);
+      continue;
+    }
+
+    if (startConnection(socketChildFd, socketDesc, &connectionAddr, connectionAddrLen, NULL, 0,
+                        NULL, 0) < 0)
+      ezwebsocket_log(EZLOG_ERROR, "startConnection failed\n");
+
+    updateListener(socketDesc);
+  }
+}
+
+/**
+ * \brief processes connection requests
+ *
+ * \param *sockDesc Pointer to the socket descriptor
+ *
+ * \return NULL
+ *
+ */
+static void *
+socketServerThread(void *sockDesc)
+{
+  struct socket_server_desc *socketDesc = sockDesc;
+  struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
+  uint64_t wakeup;
+  bool paused;
+  int res;
+  int maxFd;
+
+  maxFd = socketDesc->socketFd > socketDesc->wakeupFd ? socketDesc->socketFd
+                                                      : socketDesc->wakeupFd;
+
+  while (socketDesc->running) {
+
+    paused = socketDesc->paused;
+    FD_ZERO(&socketDesc->readfds); // initialize the fd set
+    if (!paused)
+      FD_SET(socketDesc->socketFd, &socketDesc->readfds); // add socket fd
+    FD_SET(socketDesc->wakeupFd, &socketDesc->readfds);   // add wakeup fd
+
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+
+    res = select(maxFd + 1, &socketDesc->readfds, NULL, NULL, &timeout);
+    if (res < 0) {
+      ezwebsocket_log(EZLOG_ERROR, "ERROR in select\n");
     }
 
-    optval = 180;
-    if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_KEEPIDLE, &optval, sizeof(optval)) < 0) {
-      ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_KEEPIDLE failed\n");
+    if (res > 0) {
+      if (FD_ISSET(socketDesc->wakeupFd, &(socketDesc->readfds)) &&
+          (read(socketDesc->wakeupFd, &wakeup, sizeof(wakeup)) != sizeof(wakeup)))
+        ezwebsocket_log(EZLOG_ERROR, "couldn't read wakeup fd\n");
+      // process connection requeusts
+      if (!paused && FD_ISSET(socketDesc->socketFd, &(socketDesc->readfds)))
+        acceptConnections(socketDesc);
     }
+  }
+  return NULL;
+}
+
+/**
+ * \brief Handles the events of the listening socket in threadless mode
+ *
+ * \param *ctx Pointer to the socket descriptor
+ * \param fd The file descriptor of the listening socket
+ * \param events The events that occured on the fd
+ */
+static void
+socketServerProcess(void *ctx, int fd, int events)
+{
+  struct socket_server_desc *socketDesc = ctx;
+  (void) fd;
+
+  if (events && socketDesc->running)
+    acceptConnections(socketDesc);
+}
+
+/**
+ * \brief creates the listening tcp socket and binds it to the address and port
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ * \param *socketInit Pointer to the socket_init struct
+ *
+ * \return 0 if successful else -1
+ */
+static int
+bindTcp(struct socket_server_desc *socketDesc, struct socket_server_init *socketInit)
+{
+  int optval;
+  struct addrinfo hints, *serverinfo, *iter;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if (getaddrinfo(socketInit->address, socketInit->port, &hints, &serverinfo) != 0) {
+    ezwebsocket_log(EZLOG_ERROR, "getaddrinfo failed\n");
+    return -1;
+  }
 
-    optval = 3;
-    if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_KEEPCNT, &optval, sizeof(optval)) < 0) {
-      ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_KEEPCNT failed\n");
+  for (iter = serverinfo; iter != NULL; iter = iter->ai_next) {
+    if ((socketDesc->socketFd = socket(iter->ai_family, iter->ai_socktype, iter->ai_protocol)) <
+        0) {
+      ezwebsocket_log(EZLOG_ERROR, "socket failed\n");
+      continue;
     }
 
-    optval = 10;
-    if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_KEEPINTVL, &optval, sizeof(optval)) < 0) {
-      ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_KEEPINTVL failed\n");
+    optval = 1;
+    if (setsockopt(socketDesc->socketFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+      ezwebsocket_log(EZLOG_ERROR, "setsockopt SO_REUSEADDR failed\n");
     }
 
+    // the accepted connections inherit the options of the listening socket
+    socketOptions_apply(socketDesc->socketFd, &socketDesc->options);
+
     if (bind(socketDesc->socketFd, iter->ai_addr, iter->ai_addrlen) == -1) {
       ezwebsocket_log(EZLOG_ERROR, "%s(): bind\n", __func__);
       close(socketDesc->socketFd);
@@ -526,23 +1841,491 @@ socketServer_open(struct socket_server_init *socketInit, void *socketUserData)
   if (iter == NULL) {
     ezwebsocket_log(EZLOG_ERROR, "Failed to bind to address and port\n");
     freeaddrinfo(serverinfo);
-    free(socketDesc);
-    return NULL;
+    return -1;
   }
 
   freeaddrinfo(serverinfo);
 
-  // wait for connections allow up to 10 connections in queue
-  if (listen(socketDesc->socketFd, 10) < 0)
+  if (socketInit->deferAcceptSec > 0) {
+    // only wake up when the first data (the upgrade request) has arrived
+    optval = socketInit->deferAcceptSec;
+    if (setsockopt(socketDesc->socketFd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval, sizeof(optval)) <
+        0)
+      ezwebsocket_log(EZLOG_ERROR, "setsockopt TCP_DEFER_ACCEPT failed\n");
+  }
+
+  return 0;
+}
+
+/**
+ * \brief creates the listening unix socket and binds it to the path of the address
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ * \param *socketInit Pointer to the socket_init struct
+ *
+ * \return 0 if successful else -1
+ */
+static int
+bindUnix(struct socket_server_desc *socketDesc, struct socket_server_init *socketInit)
+{
+  struct sockaddr_un addr;
+  socklen_t addrLen;
+  int probeFd;
+
+  if (unixSocket_getAddress(socketInit->address, &addr, &addrLen) < 0)
+    return -1;
+
+  socketOptions_removeTcp(&socketDesc->options);
+
+  socketDesc->socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socketDesc->socketFd < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "socket failed\n");
+    return -1;
+  }
+
+  socketOptions_apply(socketDesc->socketFd, &socketDesc->options);
+
+  if (addr.sun_path[0] != '\0') {
+    // a socket file that is left over from a previous run blocks the bind
+    // but it must not be removed if another server is still listening on it
+    probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((probeFd >= 0) && (connect(probeFd, (struct sockaddr *) &addr, addrLen) < 0) &&
+        (errno == ECONNREFUSED))
+      unlink(addr.sun_path);
+    if (probeFd >= 0)
+      close(probeFd);
+  }
+
+  if (bind(socketDesc->socketFd, (struct sockaddr *) &addr, addrLen) < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "%s(): bind failed: %s\n", __func__, strerror(errno));
+    close(socketDesc->socketFd);
+    return -1;
+  }
+
+  if (addr.sun_path[0] != '\0') {
+    if ((socketInit->unixMode != 0) && (chmod(addr.sun_path, socketInit->unixMode) < 0))
+      ezwebsocket_log(EZLOG_ERROR, "chmod of the unix socket failed\n");
+    socketDesc->unixPath = strdup(addr.sun_path);
+  }
+
+  return 0;
+}
+
+/**
+ * \brief opens a socket server
+ *
+ * \param *socketInit Pointer to the socket init struct
+ * \param *socketUserData Pointer to the user data that should be used
+ *
+ * \return pointer to the socket descriptor
+ */
+struct socket_server_desc *
+socketServer_open(struct socket_server_init *socketInit, void *socketUserData)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrLen = sizeof(addr);
+  struct socket_server_desc *socketDesc;
+
+  socketDesc = malloc(sizeof(struct socket_server_desc));
+  if (!socketDesc) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    return NULL;
+  }
+
+  socketDesc->socket_onClose = socketInit->socket_onClose;
+  socketDesc->socket_onOpen = socketInit->socket_onOpen;
+  socketDesc->socket_onMessage = socketInit->socket_onMessage;
+  socketDesc->socket_onWatch = socketInit->socket_onWatch;
+  socketDesc->socket_onWakeup = socketInit->socket_onWakeup;
+  socketDesc->socketUserData = socketUserData;
+  socketDesc->list = NULL;
+  socketDesc->numConnections = 0;
+  socketDesc->numFinishing = 0;
+  socketDesc->wakeupFd = -1;
+  socketDesc->handoverFunc = NULL;
+  socketDesc->handoverCtx = NULL;
+  socketDesc->numHandovers = 0;
+  socketDesc->maxConnections = socketInit->maxConnections;
+  socketDesc->maxBufferMemory = socketInit->maxBufferMemory;
+  socketDesc->bufferMemory = 0;
+  socketDesc->rejectMsg = socketInit->rejectMsg;
+  socketDesc->fdExhausted = false;
+  socketDesc->paused = false;
+  memset(&socketDesc->stats, 0, sizeof(socketDesc->stats));
+  socketDesc->options = socketInit->options;
+  socketDesc->unixPath = NULL;
+  socketDesc->readBudgetBytes = socketInit->readBudgetBytes;
+  socketDesc->readBudgetMsgs = socketInit->readBudgetMsgs;
+  socketDesc->pacingRate = socketInit->pacingRate;
+  tokenBucket_init(&socketDesc->paceBucket, socketInit->serverPacingRate,
+                   pacingBurst(socketInit->serverPacingRate));
+
+  if (socketInit->listenFd >= 0) {
+    // the socket is already bound and listening (e.g. taken over from another process)
+    socketDesc->socketFd = socketInit->listenFd;
+    if ((getsockname(socketDesc->socketFd, (struct sockaddr *) &addr, &addrLen) == 0) &&
+        (addr.ss_family == AF_UNIX)) {
+      socketOptions_removeTcp(&socketDesc->options);
+      if (((struct sockaddr_un *) &addr)->sun_path[0] != '\0')
+        socketDesc->unixPath = strndup(((struct sockaddr_un *) &addr)->sun_path,
+                                       sizeof(((struct sockaddr_un *) &addr)->sun_path));
+    }
+    socketOptions_apply(socketDesc->socketFd, &socketDesc->options);
+    goto LISTENING;
+  }
+
+  if (unixSocket_isAddress(socketInit->address)) {
+    if (bindUnix(socketDesc, socketInit) < 0) {
+      ezwebsocket_log(EZLOG_ERROR, "Failed to bind to unix socket\n");
+      free(socketDesc);
+      return NULL;
+    }
+  } else if (bindTcp(socketDesc, socketInit) < 0) {
+    free(socketDesc);
+    return NULL;
+  }
+
+  if (listen(socketDesc->socketFd, socketInit->backlog > 0 ? socketInit->backlog : SOMAXCONN) < 0)
     ezwebsocket_log(EZLOG_ERROR, "listen failed\n");
 
+LISTENING:
+  if (!socketDesc->socket_onWatch) {
+    socketDesc->wakeupFd = eventfd(0, EFD_CLOEXEC);
+    if (socketDesc->wakeupFd < 0) {
+      ezwebsocket_log(EZLOG_ERROR, "eventfd failed\n");
+      close(socketDesc->socketFd);
+      free(socketDesc->unixPath);
+      free(socketDesc);
+      return NULL;
+    }
+  }
+
+  pthread_condattr_t condAttr;
+
+  pthread_mutex_init(&socketDesc->listMutex, NULL);
+  pthread_mutex_init(&socketDesc->paceMutex, NULL);
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  pthread_cond_init(&socketDesc->listCond, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+
   socketDesc->running = true;
 
-  pthread_create(&socketDesc->tid, NULL, socketServerThread, socketDesc);
+  // keeps an fd in reserve to be able to reject connections if no fds are left
+  socketDesc->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (socketDesc->spareFd < 0)
+    ezwebsocket_log(EZLOG_ERROR, "couldn't open spare fd\n");
+
+  // a pending connection might be gone before it's accepted so the accept must not block
+  fcntl(socketDesc->socketFd, F_SETFL, fcntl(socketDesc->socketFd, F_GETFL) | O_NONBLOCK);
+
+  if (socketDesc->socket_onWatch) {
+    if (eventLoop_add(socketDesc->socketFd, socketServerProcess, socketDesc) < 0) {
+      if (socketDesc->spareFd >= 0)
+        close(socketDesc->spareFd);
+      close(socketDesc->socketFd);
+      pthread_cond_destroy(&socketDesc->listCond);
+      pthread_mutex_destroy(&socketDesc->listMutex);
+      pthread_mutex_destroy(&socketDesc->paceMutex);
+      free(socketDesc->unixPath);
+      free(socketDesc);
+      return NULL;
+    }
+    socketDesc->socket_onWatch(socketDesc->socketUserData, socketDesc->socketFd, POLLIN);
+  } else {
+    pthread_create(&socketDesc->tid, NULL, socketServerThread, socketDesc);
+  }
 
   return socketDesc;
 }
 
+/**
+ * \brief stops accepting new connections and detaches the listening socket from the server
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ *
+ * \return the file descriptor of the listening socket (the caller has to close it)
+ *         or -1 if the server isn't accepting anymore
+ */
+int
+socketServer_detachListener(struct socket_server_desc *socketDesc)
+{
+  uint64_t wakeup = 1;
+  int fd;
+
+  if (socketDesc->socketFd < 0)
+    return -1;
+
+  socketDesc->running = false;
+  if (socketDesc->socket_onWatch) {
+    eventLoop_remove(socketDesc->socketFd);
+    socketDesc->socket_onWatch(socketDesc->socketUserData, socketDesc->socketFd, 0);
+  } else {
+    if (write(socketDesc->wakeupFd, &wakeup, sizeof(wakeup)) != sizeof(wakeup))
+      ezwebsocket_log(EZLOG_ERROR, "couldn't wake up socket server thread\n");
+    pthread_join(socketDesc->tid, NULL);
+  }
+
+  fd = socketDesc->socketFd;
+  socketDesc->socketFd = -1;
+  return fd;
+}
+
+/**
+ * \brief stops accepting new connections and closes the listening socket
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ */
+void
+socketServer_stopAccepting(struct socket_server_desc *socketDesc)
+{
+  int fd;
+
+  fd = socketServer_detachListener(socketDesc);
+  if (fd >= 0) {
+    close(fd);
+    // a detached listener (e.g. handed over) still uses the socket file
+    if (socketDesc->unixPath)
+      unlink(socketDesc->unixPath);
+  }
+}
+
+/**
+ * \brief adds an already connected socket (e.g. taken over from another process) to the server
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ * \param fd The file descriptor of the connection (ownership is passed to the server)
+ * \param *pending Data that was already received but not processed or NULL
+ * \param pendingLen The length of the pending data
+ * \param *state State that should be available during socket_onOpen (see
+ *               socket_get_handover_state) or NULL
+ * \param stateLen The length of the state
+ *
+ * \return 0 if successful else -1
+ */
+int
+socketServer_adoptConnection(struct socket_server_desc *socketDesc, int fd, const void *pending,
+                             size_t pendingLen, const void *state, size_t stateLen)
+{
+  return startConnection(fd, socketDesc, NULL, 0, pending, pendingLen, state, stateLen);
+}
+
+/**
+ * \brief takes a snapshot of all connections
+ *
+ * \param *socketDesc Pointer to the socket descriptor
+ * \param *numDescs Pointer to where the number of connections should be stored
+ *
+ * \return NULL terminated array with a reference to every connection (has to be unreferenced
+ *         and freed) or NULL in case of error
+ */
+static struct socket_connection_desc **
+snapshotConnections(struct socket_server_desc *socketDesc, unsigned long *numDescs)
+{
+  struct socket_connection_list_element *listElement;
+  struct socket_connection_desc **descs;
+
+  *numDescs = 0;
+  pthread_mutex_lock(&socketDesc->listMutex);
+  // NULL terminated so that the allocation isn't empty without connections
+  descs = malloc((socketDesc->numConnections + 1) * sizeof(struct socket_connection_desc *));
+  if (descs) {
+    for (listElement = socketDesc->list; listElement; listElement = listElement->next) {
+      refcnt_ref(listElement->desc);
+      descs[(*numDescs)++] = listElement->desc;
+    }
+    descs[*numDescs] = NULL;
+  }
+  pthread_mutex_unlock(&socketDesc->listMutex);
+
+  if (!descs)
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+
+  return descs;
+}
+
+/**
+ * \brief hands over all open connections
+ *        every connection stops reading and func is called for it, if func returns true
+ *        the connection is closed in this process (without shutting it down) else it stays
+ *        connected
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ * \param func The function that hands over the connection, it gets the fd of the connection and
+ *             the data that was received but not processed yet
+ * \param *ctx The context that should be passed to func
+ *
+ * \note in threaded mode func is called from the connection threads, it can take up to 300ms
+ *       until a thread stops reading. The function returns after func was called for all
+ *       connections
+ */
+void
+socketServer_handover(struct socket_server_desc *socketDesc,
+                      bool (*func)(void *ctx, struct socket_connection_desc *desc,
+                                   void *connectionUserData, int fd, const void *pending,
+                                   size_t pendingLen),
+                      void *ctx)
+{
+  struct socket_connection_list_element *listElement;
+  struct socket_connection_desc **descs;
+  unsigned long numDescs;
+  unsigned long i;
+
+  socketDesc->handoverFunc = func;
+  socketDesc->handoverCtx = ctx;
+
+  if (socketDesc->socket_onWatch) {
+    descs = snapshotConnections(socketDesc, &numDescs);
+    if (!descs)
+      return;
+
+    for (i = 0; i < numDescs; i++) {
+      if (descs[i]->state == SOCKET_SESSION_STATE_CONNECTED) {
+        pthread_mutex_lock(&socketDesc->listMutex);
+        socketDesc->numHandovers++;
+        descs[i]->handoverPending = true;
+        pthread_mutex_unlock(&socketDesc->listMutex);
+        descs[i]->state = SOCKET_SESSION_STATE_HANDOVER;
+        connectionHandover(descs[i]);
+        if (descs[i]->state != SOCKET_SESSION_STATE_CONNECTED)
+          connectionFinish(descs[i]);
+      }
+      refcnt_unref(descs[i]);
+    }
+
+    free(descs);
+    return;
+  }
+
+  pthread_mutex_lock(&socketDesc->listMutex);
+  for (listElement = socketDesc->list; listElement; listElement = listElement->next) {
+    pthread_mutex_lock(&listElement->desc->fdMutex);
+    if (listElement->desc->state == SOCKET_SESSION_STATE_CONNECTED) {
+      socketDesc->numHandovers++;
+      listElement->desc->handoverPending = true;
+      listElement->desc->state = SOCKET_SESSION_STATE_HANDOVER;
+    }
+    pthread_mutex_unlock(&listElement->desc->fdMutex);
+  }
+
+  while (socketDesc->numHandovers)
+    pthread_cond_wait(&socketDesc->listCond, &socketDesc->listMutex);
+  pthread_mutex_unlock(&socketDesc->listMutex);
+}
+
+/**
+ * \brief calls the given function for every open connection
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ * \param func The function that should be called (connectionUserData is NULL if the connection
+ *             isn't opened completely) if it returns true the connection is closed
+ * \param *ctx The context that should be passed to func
+ *
+ * \note while func is running the connection won't be closed
+ */
+void
+socketServer_forEachConnection(struct socket_server_desc *socketDesc,
+                               bool (*func)(void *ctx, struct socket_connection_desc *desc,
+                                            void *connectionUserData),
+                               void *ctx)
+{
+  struct socket_connection_desc **descs;
+  unsigned long numDescs;
+  unsigned long i;
+  bool closeConnection;
+
+  descs = snapshotConnections(socketDesc, &numDescs);
+  if (!descs)
+    return;
+
+  for (i = 0; i < numDescs; i++) {
+    closeConnection = false;
+    pthread_mutex_lock(&descs[i]->fdMutex);
+    if (descs[i]->state == SOCKET_SESSION_STATE_CONNECTED)
+      closeConnection = func(ctx, descs[i], descs[i]->connectionUserData);
+    pthread_mutex_unlock(&descs[i]->fdMutex);
+
+    if (closeConnection)
+      socketServer_closeConnection(descs[i]);
+    refcnt_unref(descs[i]);
+  }
+
+  free(descs);
+}
+
+/**
+ * \brief waits until all connections are closed and closes the remaining connections
+ *        when the timeout expires
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ * \param timeoutMs The timeout in milliseconds
+ *
+ * \return the number of connections that had to be closed when the timeout expired
+ *
+ * \note in threadless mode the timeouts are handled by the event loop and 0 is returned
+ */
+int
+socketServer_drain(struct socket_server_desc *socketDesc, int timeoutMs)
+{
+  struct socket_connection_desc **descs;
+  struct timespec deadline;
+  unsigned long remaining;
+  unsigned long i;
+  int rc = 0;
+
+  setDeadline(&deadline, timeoutMs);
+
+  if (socketDesc->socket_onWatch) {
+    descs = snapshotConnections(socketDesc, &remaining);
+    if (!descs)
+      return 0;
+    // the connections are closed when the drain deadline expires, paused ones as well
+    for (i = 0; i < remaining; i++) {
+      descs[i]->draining = true;
+      descs[i]->drainTime = deadline;
+      connectionArmTimeout(descs[i]);
+      refcnt_unref(descs[i]);
+    }
+    free(descs);
+    return 0;
+  }
+
+  pthread_mutex_lock(&socketDesc->listMutex);
+  while (socketDesc->numConnections && (rc != ETIMEDOUT))
+    rc = pthread_cond_timedwait(&socketDesc->listCond, &socketDesc->listMutex, &deadline);
+  remaining = socketDesc->numConnections;
+  pthread_mutex_unlock(&socketDesc->listMutex);
+
+  if (remaining) {
+    ezwebsocket_log(EZLOG_INFO, "closing %lu remaining connections\n", remaining);
+    closeAllConnections(socketDesc);
+
+    pthread_mutex_lock(&socketDesc->listMutex);
+    while (socketDesc->numConnections)
+      pthread_cond_wait(&socketDesc->listCond, &socketDesc->listMutex);
+    pthread_mutex_unlock(&socketDesc->listMutex);
+  }
+
+  return remaining;
+}
+
+/**
+ * \brief returns the statistics of the given socket server
+ *
+ * \param *socketDesc Pointer to the socket descriptor as retrieved from socketServer_open
+ * \param *stats Pointer to where the statistics should be stored
+ */
+void
+socketServer_getStats(struct socket_server_desc *socketDesc, struct socket_server_stats *stats)
+{
+  pthread_mutex_lock(&socketDesc->listMutex);
+  *stats = socketDesc->stats;
+  stats->connections = socketDesc->numConnections;
+  stats->bufferMemory = socketDesc->bufferMemory;
+  stats->paused = socketDesc->paused;
+  pthread_mutex_unlock(&socketDesc->listMutex);
+}
+
 /**
  * \brief closes the given socket server
  *
@@ -556,12 +2339,35 @@ socketServer_close(struct socket_server_desc *socketDesc)
     return;
 
   ezwebsocket_log(EZLOG_DEBUG, "stopping socket server.\n");
-  closeAllConnections(socketDesc);
-  socketDesc->running = false;
-  pthread_join(socketDesc->tid, NULL);
-  while (socketDesc->numConnections > 0)
-    usleep(300000);
+  socketServer_stopAccepting(socketDesc);
+
+  if (socketDesc->socket_onWatch) {
+    struct socket_connection_desc *desc;
+
+    pthread_mutex_lock(&socketDesc->listMutex);
+    while (socketDesc->list) {
+      desc = socketDesc->list->desc;
+      pthread_mutex_unlock(&socketDesc->listMutex);
+      desc->state = SOCKET_SESSION_STATE_DISCONNECTED;
+      connectionFinish(desc);
+      pthread_mutex_lock(&socketDesc->listMutex);
+    }
+    pthread_mutex_unlock(&socketDesc->listMutex);
+  } else {
+    closeAllConnections(socketDesc);
+
+    pthread_mutex_lock(&socketDesc->listMutex);
+    while ((socketDesc->numConnections > 0) || (socketDesc->numFinishing > 0))
+      pthread_cond_wait(&socketDesc->listCond, &socketDesc->listMutex);
+    pthread_mutex_unlock(&socketDesc->listMutex);
+    close(socketDesc->wakeupFd);
+  }
+
+  if (socketDesc->spareFd >= 0)
+    close(socketDesc->spareFd);
+  pthread_cond_destroy(&socketDesc->listCond);
   pthread_mutex_destroy(&socketDesc->listMutex);
-  close(socketDesc->socketFd);
+  pthread_mutex_destroy(&socketDesc->paceMutex);
+  free(socketDesc->unixPath);
   free(socketDesc);
 }
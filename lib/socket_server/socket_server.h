@@ -25,7 +25,10 @@
 #ifndef SOCKET_SERVER_H_
 #define SOCKET_SERVER_H_
 
+#include "utils/socket_options.h"
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 //! prototype for the socket connection descriptor
 struct socket_connection_desc;
@@ -41,23 +44,113 @@ struct socket_server_init {
   void *(*socket_onOpen)(void *socketUserData, struct socket_connection_desc *connectionDesc);
   //! callback that is called when a connection is closed
   void (*socket_onClose)(void *socketUserData, void *connectionDesc, void *connectionUserData);
+  //! callback that is called when an fd should be (un)watched by an external event loop
+  //! (events == 0 => stop watching) if set no threads are started (use NULL if not used)
+  void (*socket_onWatch)(void *socketUserData, int fd, int events);
   //! the listening port as string
   const char *port;
-  //! the listening address as string
+  //! the listening address as string ("unix:/path" or "unix:@name" => unix socket)
   const char *address;
+  //! file descriptor of an already listening socket that should be used instead of
+  //! address and port (-1 if not used)
+  int listenFd;
+  //! the maximum number of connections (0 => unlimited)
+  unsigned long maxConnections;
+  //! the maximum memory for receive buffers of all connections (0 => unlimited)
+  size_t maxBufferMemory;
+  //! message that is sent to connections that are rejected (NULL => just close them)
+  const char *rejectMsg;
+  //! the maximum number of pending connections (0 => SOMAXCONN)
+  int backlog;
+  //! TCP_DEFER_ACCEPT timeout in seconds (0 => disabled)
+  int deferAcceptSec;
+  //! the options for the listening socket (inherited by the accepted connections)
+  struct socket_options options;
+  //! the file permissions of the unix socket (0 => keep the default of the umask)
+  unsigned int unixMode;
+  //! the maximum number of bytes that are read from a connection at once (0 => unlimited)
+  size_t readBudgetBytes;
+  //! the maximum number of socket_onMessage calls for a connection at once (0 => unlimited)
+  unsigned long readBudgetMsgs;
+  //! the egress rate of every connection in bytes per second (0 => unlimited)
+  unsigned long pacingRate;
+  //! the egress rate of all connections together in bytes per second (0 => unlimited)
+  unsigned long serverPacingRate;
+  //! callback that is called on the thread of a connection when a wakeup that was armed with
+  //! socketServer_wakeup is due, the wakeups that send the paced data call it too (use NULL if
+  //! not used)
+  void (*socket_onWakeup)(void *socketUserData, void *connectionDesc, void *connectionUserData);
+};
+
+//! statistics of a socket server
+struct socket_server_stats {
+  //! the number of open connections
+  unsigned long connections;
+  //! the memory that is used for receive buffers
+  size_t bufferMemory;
+  //! the number of connections that were rejected because no fd was left
+  unsigned long rejectedNoFd;
+  //! the number of connections that were rejected because the budget was exhausted
+  unsigned long rejectedBudget;
+  //! the number of times the listener was paused
+  unsigned long listenerPauses;
+  //! indicates if the listener is currently paused
+  bool paused;
 };
 
 void
 socketServer_closeConnection(struct socket_connection_desc *socketConnectionDesc);
 int
 socketServer_send(struct socket_connection_desc *connectionDesc, void *msg, size_t len);
+int
+socketServer_sendControl(struct socket_connection_desc *connectionDesc, void *msg, size_t len);
+int
+socketServer_sendv(struct socket_connection_desc *connectionDesc, const struct iovec *iov,
+                   size_t iovcnt);
+void
+socketServer_pauseReading(struct socket_connection_desc *connectionDesc, int timeoutMs);
+void
+socketServer_resumeReading(struct socket_connection_desc *connectionDesc);
+void
+socketServer_wakeup(struct socket_connection_desc *connectionDesc, int timeoutMs);
+void
+socketServer_setConnectionUserData(struct socket_connection_desc *connectionDesc,
+                                   void *connectionUserData);
+void
+socketServer_setPacingRate(struct socket_connection_desc *connectionDesc, unsigned long rate);
+unsigned long
+socketServer_takeReadBudget(struct socket_connection_desc *connectionDesc, unsigned long max);
 struct socket_server_desc *
 socketServer_open(struct socket_server_init *socketInit, void *socketUserData);
 void
 socketServer_close(struct socket_server_desc *socketDesc);
+void
+socketServer_stopAccepting(struct socket_server_desc *socketDesc);
+int
+socketServer_detachListener(struct socket_server_desc *socketDesc);
+int
+socketServer_adoptConnection(struct socket_server_desc *socketDesc, int fd, const void *pending,
+                             size_t pendingLen, const void *state, size_t stateLen);
+void
+socketServer_handover(struct socket_server_desc *socketDesc,
+                      bool (*func)(void *ctx, struct socket_connection_desc *desc,
+                                   void *connectionUserData, int fd, const void *pending,
+                                   size_t pendingLen),
+                      void *ctx);
+void
+socketServer_forEachConnection(struct socket_server_desc *socketDesc,
+                               bool (*func)(void *ctx, struct socket_connection_desc *desc,
+                                            void *connectionUserData),
+                               void *ctx);
+int
+socketServer_drain(struct socket_server_desc *socketDesc, int timeoutMs);
+void
+socketServer_getStats(struct socket_server_desc *socketDesc, struct socket_server_stats *stats);
 
 const char *
 socket_get_server_ip(struct socket_connection_desc *desc);
 const char *
 socket_get_peer_ip(struct socket_connection_desc *desc);
+const void *
+socket_get_handover_state(struct socket_connection_desc *desc, size_t *len);
 #endif /* SOCKET_SERVER_H_ */
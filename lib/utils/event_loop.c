@@ -0,0 +1,461 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "event_loop.h"
+
+#include <ezwebsocket_log.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! structure that holds the registration of a single fd
+struct event_loop_entry {
+  //! the handler that should be called (NULL if the fd isn't registered)
+  event_loop_handler_t handler;
+  //! the context that is passed to the handler
+  void *ctx;
+  //! indicates if the timeout is armed
+  bool timeoutArmed;
+  //! the position of the fd in the timeout heap (only valid if timeoutArmed)
+  int timeoutIndex;
+  //! the point in time (CLOCK_MONOTONIC) when the timeout expires
+  struct timespec timeout;
+  //! indicates if the fd is in the ready list
+  bool ready;
+  //! the next fd in the ready list (-1 => end of the list)
+  int nextReady;
+};
+
+//! the registered fds (indexed by the fd)
+static struct event_loop_entry *entries;
+//! the number of elements in entries
+static int numEntries;
+//! the fds with an armed timeout as a min-heap ordered by the expiry (as large as entries)
+static int *timeouts;
+//! the number of armed timeouts
+static int numTimeouts;
+//! the first fd of the ready list (-1 => empty)
+static int readyHead = -1;
+//! the last fd of the ready list (-1 => empty)
+static int readyTail = -1;
+//! the number of fds in the ready list
+static int numReady;
+//! mutex that protects the registry
+static pthread_mutex_t registryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \brief Returns the number of milliseconds from now until the given point in time
+ *
+ * \param *now The current time
+ * \param *then The point in time
+ *
+ * \return The milliseconds (negative if then is in the past)
+ */
+static long long
+diffMs(const struct timespec *now, const struct timespec *then)
+{
+  // rounded up so a timeout never expires early
+  return ((then->tv_sec - now->tv_sec) * 1000000000LL + (then->tv_nsec - now->tv_nsec) + 999999) /
+         1000000;
+}
+
+/**
+ * \brief Checks if the timeout of the first fd expires before the one of the second fd
+ *
+ * \param a The first file descriptor
+ * \param b The second file descriptor
+ *
+ * \return True if the timeout of a expires first else false
+ */
+static bool
+expiresBefore(int a, int b)
+{
+  if (entries[a].timeout.tv_sec != entries[b].timeout.tv_sec)
+    return entries[a].timeout.tv_sec < entries[b].timeout.tv_sec;
+  return entries[a].timeout.tv_nsec < entries[b].timeout.tv_nsec;
+}
+
+/**
+ * \brief Puts an fd at the given position of the timeout heap
+ *
+ * \param index The position in the heap
+ * \param fd The file descriptor
+ */
+static void
+placeTimeout(int index, int fd)
+{
+  timeouts[index] = fd;
+  entries[fd].timeoutIndex = index;
+}
+
+/**
+ * \brief Restores the heap order for the fd at the given position (registryMutex must be locked)
+ *
+ * \param index The position in the heap
+ */
+static void
+siftTimeout(int index)
+{
+  int fd = timeouts[index];
+  int child;
+
+  // towards the root while it expires before its parent
+  while ((index > 0) && expiresBefore(fd, timeouts[(index - 1) / 2])) {
+    placeTimeout(index, timeouts[(index - 1) / 2]);
+    index = (index - 1) / 2;
+  }
+
+  // towards the leaves while a child expires before it
+  for (;;) {
+    child = index * 2 + 1;
+    if (child >= numTimeouts)
+      break;
+    if ((child + 1 < numTimeouts) && expiresBefore(timeouts[child + 1], timeouts[child]))
+      child++;
+    if (!expiresBefore(timeouts[child], fd))
+      break;
+    placeTimeout(index, timeouts[child]);
+    index = child;
+  }
+  placeTimeout(index, fd);
+}
+
+/**
+ * \brief Disarms the timeout of an fd (registryMutex must be locked)
+ *
+ * \param fd The file descriptor
+ */
+static void
+disarmTimeout(int fd)
+{
+  int index = entries[fd].timeoutIndex;
+
+  if (!entries[fd].timeoutArmed)
+    return;
+
+  entries[fd].timeoutArmed = false;
+  numTimeouts--;
+  if (index < numTimeouts) {
+    placeTimeout(index, timeouts[numTimeouts]);
+    siftTimeout(index);
+  }
+}
+
+/**
+ * \brief Removes an fd from the ready list (registryMutex must be locked)
+ *
+ * \param fd The file descriptor
+ */
+static void
+removeReady(int fd)
+{
+  int prev = -1;
+  int i;
+
+  if (!entries[fd].ready)
+    return;
+
+  for (i = readyHead; (i >= 0) && (i != fd); i = entries[i].nextReady)
+    prev = i;
+
+  if (prev < 0)
+    readyHead = entries[fd].nextReady;
+  else
+    entries[prev].nextReady = entries[fd].nextReady;
+  if (readyTail == fd)
+    readyTail = prev;
+
+  entries[fd].ready = false;
+  numReady--;
+}
+
+/**
+ * \brief Registers an fd in the event loop
+ *
+ * \param fd The file descriptor
+ * \param handler The function that should be called for events of the fd
+ * \param *ctx The context that should be passed to the handler
+ *
+ * \return 0 if successful else -1
+ */
+int
+eventLoop_add(int fd, event_loop_handler_t handler, void *ctx)
+{
+  struct event_loop_entry *temp;
+  int *tempTimeouts;
+  int newNum;
+  int rc = 0;
+
+  if (fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&registryMutex);
+  {
+    if (fd >= numEntries) {
+      newNum = numEntries ? numEntries : 64;
+      while (newNum <= fd)
+        newNum *= 2;
+      // every fd is at most once in the heap so it never needs more space than entries
+      tempTimeouts = realloc(timeouts, newNum * sizeof(int));
+      if (tempTimeouts)
+        timeouts = tempTimeouts;
+      temp = tempTimeouts ? realloc(entries, newNum * sizeof(struct event_loop_entry)) : NULL;
+      if (!temp) {
+        ezwebsocket_log(EZLOG_ERROR, "realloc failed\n");
+        rc = -1;
+      } else {
+        memset(&temp[numEntries], 0, (newNum - numEntries) * sizeof(struct event_loop_entry));
+        entries = temp;
+        numEntries = newNum;
+      }
+    }
+
+    if (rc == 0) {
+      removeReady(fd);
+      disarmTimeout(fd);
+      entries[fd].handler = handler;
+      entries[fd].ctx = ctx;
+    }
+  }
+  pthread_mutex_unlock(&registryMutex);
+
+  return rc;
+}
+
+/**
+ * \brief Removes an fd from the event loop
+ *
+ * \param fd The file descriptor
+ */
+void
+eventLoop_remove(int fd)
+{
+  pthread_mutex_lock(&registryMutex);
+  if ((fd >= 0) && (fd < numEntries)) {
+    removeReady(fd);
+    disarmTimeout(fd);
+    memset(&entries[fd], 0, sizeof(struct event_loop_entry));
+  }
+  pthread_mutex_unlock(&registryMutex);
+}
+
+/**
+ * \brief Arms or disarms the timeout of a registered fd
+ *        when the timeout expires the handler is called with events = 0
+ *
+ * \param fd The file descriptor
+ * \param timeoutMs The timeout in milliseconds (< 0 disarms the timeout)
+ */
+void
+eventLoop_setTimeout(int fd, int timeoutMs)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&registryMutex);
+  if ((fd >= 0) && (fd < numEntries) && entries[fd].handler) {
+    disarmTimeout(fd);
+    if (timeoutMs >= 0) {
+      entries[fd].timeout.tv_sec = now.tv_sec + timeoutMs / 1000;
+      entries[fd].timeout.tv_nsec = now.tv_nsec + (timeoutMs % 1000) * 1000000L;
+      if (entries[fd].timeout.tv_nsec >= 1000000000L) {
+        entries[fd].timeout.tv_sec++;
+        entries[fd].timeout.tv_nsec -= 1000000000L;
+      }
+      entries[fd].timeoutArmed = true;
+      placeTimeout(numTimeouts, fd);
+      numTimeouts++;
+      siftTimeout(numTimeouts - 1);
+    }
+  }
+  pthread_mutex_unlock(&registryMutex);
+}
+
+/**
+ * \brief Appends a registered fd to the ready list, the handler is called with POLLIN in the
+ *        next call of eventLoop_process even if no events occur on the fd (fds that used up
+ *        their budget are served round robin)
+ *
+ * \param fd The file descriptor
+ */
+void
+eventLoop_requeue(int fd)
+{
+  pthread_mutex_lock(&registryMutex);
+  if ((fd >= 0) && (fd < numEntries) && entries[fd].handler && !entries[fd].ready) {
+    entries[fd].ready = true;
+    entries[fd].nextReady = -1;
+    if (readyTail < 0)
+      readyHead = fd;
+    else
+      entries[readyTail].nextReady = fd;
+    readyTail = fd;
+    numReady++;
+  }
+  pthread_mutex_unlock(&registryMutex);
+}
+
+/**
+ * \brief Processes the fds of the ready list that were queued before this call
+ */
+static void
+processReady(void)
+{
+  event_loop_handler_t handler;
+  void *ctx;
+  int count;
+  int fd;
+
+  pthread_mutex_lock(&registryMutex);
+  count = numReady;
+  pthread_mutex_unlock(&registryMutex);
+
+  // fds that are queued again by their handler are served in the next call
+  while (count-- > 0) {
+    handler = NULL;
+    pthread_mutex_lock(&registryMutex);
+    fd = readyHead;
+    if (fd >= 0) {
+      readyHead = entries[fd].nextReady;
+      if (readyHead < 0)
+        readyTail = -1;
+      entries[fd].ready = false;
+      numReady--;
+      handler = entries[fd].handler;
+      ctx = entries[fd].ctx;
+    }
+    pthread_mutex_unlock(&registryMutex);
+
+    if (!handler)
+      break;
+    handler(ctx, fd, POLLIN);
+  }
+}
+
+/**
+ * \brief Calls the handlers of the fds whose timeout expired before this call
+ */
+static void
+processTimeouts(void)
+{
+  event_loop_handler_t handler;
+  struct timespec now;
+  void *ctx;
+  int count;
+  int fd;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&registryMutex);
+  count = numTimeouts;
+  pthread_mutex_unlock(&registryMutex);
+
+  // timeouts that are armed again by their handler are served in a later call
+  while (count-- > 0) {
+    handler = NULL;
+    pthread_mutex_lock(&registryMutex);
+    if (numTimeouts && (diffMs(&now, &entries[timeouts[0]].timeout) <= 0)) {
+      fd = timeouts[0];
+      disarmTimeout(fd);
+      handler = entries[fd].handler;
+      ctx = entries[fd].ctx;
+    }
+    pthread_mutex_unlock(&registryMutex);
+
+    if (!handler)
+      break;
+    handler(ctx, fd, 0);
+  }
+}
+
+/**
+ * \brief Processes the events of the given fd, the ready list and all expired timeouts
+ *
+ * \param fd The file descriptor (-1 if only the timeouts should be processed)
+ * \param events The events that occured on the fd (POLLIN, POLLOUT, ...)
+ *
+ * \return 0 if successful else -1 (fd not registered)
+ */
+int
+eventLoop_process(int fd, int events)
+{
+  event_loop_handler_t handler = NULL;
+  void *ctx = NULL;
+  int rc = 0;
+
+  if (fd >= 0) {
+    pthread_mutex_lock(&registryMutex);
+    if (fd < numEntries) {
+      handler = entries[fd].handler;
+      ctx = entries[fd].ctx;
+      // a queued fd is handled when it's its turn
+      if (entries[fd].ready)
+        events = 0;
+    }
+    pthread_mutex_unlock(&registryMutex);
+
+    if (!handler)
+      rc = -1;
+    else if (events)
+      handler(ctx, fd, events);
+  }
+
+  processReady();
+  processTimeouts();
+
+  return rc;
+}
+
+/**
+ * \brief Returns the time until the next timeout expires
+ *
+ * \return The timeout in milliseconds (0 if a timeout already expired or an fd is ready)
+ *         or -1 if no timeout is armed
+ */
+int
+eventLoop_nextTimeout(void)
+{
+  struct timespec now;
+  long long ms = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&registryMutex);
+  if (numReady) {
+    ms = 0;
+  } else if (numTimeouts) {
+    // the first fd of the heap expires first
+    ms = diffMs(&now, &entries[timeouts[0]].timeout);
+    if (ms < 0)
+      ms = 0;
+  }
+  pthread_mutex_unlock(&registryMutex);
+
+  return ms > INT_MAX ? INT_MAX : (int) ms;
+}
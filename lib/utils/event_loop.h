@@ -0,0 +1,44 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_EVENT_LOOP_H_
+#define UTILS_EVENT_LOOP_H_
+
+//! handler that is called for a registered fd (events == 0 => the timeout of the fd expired)
+typedef void (*event_loop_handler_t)(void *ctx, int fd, int events);
+
+int
+eventLoop_add(int fd, event_loop_handler_t handler, void *ctx);
+void
+eventLoop_remove(int fd);
+void
+eventLoop_setTimeout(int fd, int timeoutMs);
+void
+eventLoop_requeue(int fd);
+int
+eventLoop_process(int fd, int events);
+int
+eventLoop_nextTimeout(void);
+
+#endif /* UTILS_EVENT_LOOP_H_ */
@@ -0,0 +1,596 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hpack.h"
+
+#include <ezwebsocket_log.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! the overhead of a dynamic table entry as defined by RFC 7541
+#define HPACK_ENTRY_OVERHEAD 32
+//! the number of entries of the static table
+#define HPACK_STATIC_ENTRIES 61
+//! the length of the longest huffman code
+#define HUFFMAN_MAX_BITS     30
+//! the number of huffman symbols (256 bytes and EOS)
+#define HUFFMAN_SYMBOLS      257
+//! the end of string symbol of the huffman code
+#define HUFFMAN_EOS          256
+
+//! the static table (RFC 7541 Appendix A)
+static const char *const staticTable[HPACK_STATIC_ENTRIES][2] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+// The huffman code of RFC 7541 Appendix B is canonical, so it's fully described by the number
+// of codes per length and the symbols sorted by code length
+//! the number of huffman codes per code length
+static const unsigned short huffmanCount[HUFFMAN_MAX_BITS + 1] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+//! the huffman symbols sorted by code length and value
+static const unsigned short huffmanSymbols[HUFFMAN_SYMBOLS] = {
+  0x30, 0x31, 0x32, 0x61, 0x63, 0x65, 0x69, 0x6f, 0x73, 0x74, 0x20, 0x25, 0x2d, 0x2e, 0x2f, 0x33,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3d, 0x41, 0x5f, 0x62, 0x64, 0x66, 0x67, 0x68, 0x6c, 0x6d,
+  0x6e, 0x70, 0x72, 0x75, 0x3a, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c,
+  0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x59, 0x6a, 0x6b, 0x71, 0x76,
+  0x77, 0x78, 0x79, 0x7a, 0x26, 0x2a, 0x2c, 0x3b, 0x58, 0x5a, 0x21, 0x22, 0x28, 0x29, 0x3f, 0x27,
+  0x2b, 0x7c, 0x23, 0x3e, 0x00, 0x24, 0x40, 0x5b, 0x5d, 0x7e, 0x5e, 0x7d, 0x3c, 0x60, 0x7b, 0x5c,
+  0xc3, 0xd0, 0x80, 0x82, 0x83, 0xa2, 0xb8, 0xc2, 0xe0, 0xe2, 0x99, 0xa1, 0xa7, 0xac, 0xb0, 0xb1,
+  0xb3, 0xd1, 0xd8, 0xd9, 0xe3, 0xe5, 0xe6, 0x81, 0x84, 0x85, 0x86, 0x88, 0x92, 0x9a, 0x9c, 0xa0,
+  0xa3, 0xa4, 0xa9, 0xaa, 0xad, 0xb2, 0xb5, 0xb9, 0xba, 0xbb, 0xbd, 0xbe, 0xc4, 0xc6, 0xe4, 0xe8,
+  0xe9, 0x01, 0x87, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8f, 0x93, 0x95, 0x96, 0x97, 0x98, 0x9b, 0x9d,
+  0x9e, 0xa5, 0xa6, 0xa8, 0xae, 0xaf, 0xb4, 0xb6, 0xb7, 0xbc, 0xbf, 0xc5, 0xe7, 0xef, 0x09, 0x8e,
+  0x90, 0x91, 0x94, 0x9f, 0xab, 0xce, 0xd7, 0xe1, 0xec, 0xed, 0xc7, 0xcf, 0xea, 0xeb, 0xc0, 0xc1,
+  0xc8, 0xc9, 0xca, 0xcd, 0xd2, 0xd5, 0xda, 0xdb, 0xee, 0xf0, 0xf2, 0xf3, 0xff, 0xcb, 0xcc, 0xd3,
+  0xd4, 0xd6, 0xdd, 0xde, 0xdf, 0xf1, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe,
+  0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x0b, 0x0c, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14,
+  0x15, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x7f, 0xdc, 0xf9, 0x0a, 0x0d, 0x16,
+  0x100,
+};
+
+/**
+ * \brief initializes the dynamic table of a decoder
+ *
+ * \param *table Pointer to the table
+ * \param limit The maximum size of the table that was announced to the peer
+ */
+void
+hpack_init(struct hpack_table *table, size_t limit)
+{
+  memset(table, 0, sizeof(struct hpack_table));
+  table->maxSize = limit;
+  table->limit = limit;
+}
+
+/**
+ * \brief removes the oldest entry of the dynamic table
+ *
+ * \param *table Pointer to the table
+ */
+static void
+evictEntry(struct hpack_table *table)
+{
+  struct hpack_entry *entry;
+
+  entry = &table->entries[(table->first + table->count - 1) % table->capacity];
+  table->size -= entry->nameLen + entry->valueLen + HPACK_ENTRY_OVERHEAD;
+  free(entry->name);
+  free(entry->value);
+  table->count--;
+}
+
+/**
+ * \brief frees the entries of the dynamic table
+ *
+ * \param *table Pointer to the table
+ */
+void
+hpack_free(struct hpack_table *table)
+{
+  while (table->count)
+    evictEntry(table);
+  free(table->entries);
+  table->entries = NULL;
+  table->capacity = 0;
+}
+
+/**
+ * \brief adds an entry to the dynamic table (older entries are evicted if necessary)
+ *
+ * \param *table Pointer to the table
+ * \param *name The header name (must not point into the table)
+ * \param nameLen The length of the name
+ * \param *value The header value
+ * \param valueLen The length of the value
+ *
+ * \return 0 if successful else -1
+ */
+static int
+addEntry(struct hpack_table *table, const char *name, size_t nameLen, const char *value,
+         size_t valueLen)
+{
+  size_t entrySize = nameLen + valueLen + HPACK_ENTRY_OVERHEAD;
+  struct hpack_entry *entries;
+  struct hpack_entry *entry;
+  size_t capacity;
+  size_t i;
+
+  while (table->count && (table->size + entrySize > table->maxSize))
+    evictEntry(table);
+
+  // an entry that is bigger than the table just empties it
+  if (entrySize > table->maxSize)
+    return 0;
+
+  if (table->count == table->capacity) {
+    capacity = table->capacity ? table->capacity * 2 : 16;
+    entries = malloc(capacity * sizeof(struct hpack_entry));
+    if (!entries) {
+      ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+      return -1;
+    }
+    for (i = 0; i < table->count; i++)
+      entries[i] = table->entries[(table->first + i) % table->capacity];
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    table->first = 0;
+  }
+
+  table->first = (table->first + table->capacity - 1) % table->capacity;
+  entry = &table->entries[table->first];
+  entry->name = malloc(nameLen + 1);
+  entry->value = malloc(valueLen + 1);
+  if (!entry->name || !entry->value) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    free(entry->name);
+    free(entry->value);
+    table->first = (table->first + 1) % table->capacity;
+    return -1;
+  }
+  memcpy(entry->name, name, nameLen);
+  entry->name[nameLen] = '\0';
+  entry->nameLen = nameLen;
+  memcpy(entry->value, value, valueLen);
+  entry->value[valueLen] = '\0';
+  entry->valueLen = valueLen;
+  table->count++;
+  table->size += entrySize;
+
+  return 0;
+}
+
+/**
+ * \brief looks up an entry of the static or the dynamic table
+ *
+ * \param *table Pointer to the dynamic table
+ * \param index The index (1 based, the dynamic table follows the static table)
+ * \param[out] **name Pointer to where the name is stored
+ * \param[out] *nameLen Pointer to where the length of the name is stored
+ * \param[out] **value Pointer to where the value is stored
+ * \param[out] *valueLen Pointer to where the length of the value is stored
+ *
+ * \return 0 if successful else -1 (invalid index)
+ */
+static int
+lookupEntry(const struct hpack_table *table, size_t index, const char **name, size_t *nameLen,
+            const char **value, size_t *valueLen)
+{
+  const struct hpack_entry *entry;
+
+  if (index == 0)
+    return -1;
+
+  if (index <= HPACK_STATIC_ENTRIES) {
+    *name = staticTable[index - 1][0];
+    *nameLen = strlen(*name);
+    *value = staticTable[index - 1][1];
+    *valueLen = strlen(*value);
+    return 0;
+  }
+
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if (index >= table->count)
+    return -1;
+
+  entry = &table->entries[(table->first + index) % table->capacity];
+  *name = entry->name;
+  *nameLen = entry->nameLen;
+  *value = entry->value;
+  *valueLen = entry->valueLen;
+  return 0;
+}
+
+/**
+ * \brief decodes an integer with the given prefix length
+ *
+ * \param **pos Pointer to the current position (is advanced)
+ * \param *end Pointer to the end of the data
+ * \param prefixBits The number of bits of the prefix
+ * \param[out] *value Pointer to where the value is stored
+ *
+ * \return 0 if successful else -1
+ */
+static int
+decodeInt(const unsigned char **pos, const unsigned char *end, int prefixBits, size_t *value)
+{
+  size_t max = (1 << prefixBits) - 1;
+  unsigned int shift = 0;
+
+  if (*pos >= end)
+    return -1;
+
+  *value = **pos & max;
+  (*pos)++;
+  if (*value < max)
+    return 0;
+
+  do {
+    // values above 2^28 are not needed for headers
+    if ((*pos >= end) || (shift > 21))
+      return -1;
+    *value += (size_t) (**pos & 0x7F) << shift;
+    shift += 7;
+  } while (*((*pos)++) & 0x80);
+
+  return 0;
+}
+
+/**
+ * \brief decodes a huffman encoded string
+ *
+ * \param *data Pointer to the encoded string
+ * \param len The length of the encoded string
+ * \param *out Pointer to where the decoded string is stored (at least len * 8 / 5 bytes)
+ *
+ * \return The length of the decoded string or -1 in case of error
+ */
+static long
+decodeHuffman(const unsigned char *data, size_t len, char *out)
+{
+  unsigned long code = 0;
+  unsigned long first = 0;
+  unsigned int index = 0;
+  unsigned int bits = 0;
+  unsigned short symbol;
+  long outLen = 0;
+  size_t i;
+  int bit;
+
+  for (i = 0; i < len; i++) {
+    for (bit = 7; bit >= 0; bit--) {
+      code |= (data[i] >> bit) & 1;
+      bits++;
+      if (code - first < huffmanCount[bits]) {
+        symbol = huffmanSymbols[index + code - first];
+        if (symbol == HUFFMAN_EOS)
+          return -1;
+        out[outLen++] = symbol;
+        code = first = index = bits = 0;
+        continue;
+      }
+      if (bits == HUFFMAN_MAX_BITS)
+        return -1;
+      index += huffmanCount[bits];
+      first = (first + huffmanCount[bits]) << 1;
+      code <<= 1;
+    }
+  }
+
+  // the padding must be a prefix of EOS (all ones) and shorter than 8 bits
+  if ((bits > 7) || ((code >> 1) != (1UL << bits) - 1))
+    return -1;
+
+  return outLen;
+}
+
+/**
+ * \brief decodes a string literal
+ *
+ * \param **pos Pointer to the current position (is advanced)
+ * \param *end Pointer to the end of the data
+ * \param[out] **str Pointer to where the string is stored (must be freed after use)
+ * \param[out] *len Pointer to where the length of the string is stored
+ *
+ * \return 0 if successful else -1
+ */
+static int
+decodeString(const unsigned char **pos, const unsigned char *end, char **str, size_t *len)
+{
+  bool huffman;
+  size_t encodedLen;
+  long decodedLen;
+
+  if (*pos >= end)
+    return -1;
+
+  huffman = (**pos & 0x80) != 0;
+  if ((decodeInt(pos, end, 7, &encodedLen) < 0) || (encodedLen > (size_t) (end - *pos)))
+    return -1;
+
+  *str = malloc(huffman ? encodedLen * 8 / 5 + 1 : encodedLen + 1);
+  if (!*str) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    return -1;
+  }
+
+  if (huffman) {
+    decodedLen = decodeHuffman(*pos, encodedLen, *str);
+    if (decodedLen < 0) {
+      free(*str);
+      *str = NULL;
+      return -1;
+    }
+    *len = decodedLen;
+  } else {
+    memcpy(*str, *pos, encodedLen);
+    *len = encodedLen;
+  }
+  (*str)[*len] = '\0';
+  *pos += encodedLen;
+
+  return 0;
+}
+
+/**
+ * \brief decodes a header block and passes the headers to the callback
+ *
+ * \param *table Pointer to the dynamic table of the decoder
+ * \param *data Pointer to the header block
+ * \param len The length of the header block
+ * \param *onHeader Callback that is called for every header (a negative return value stops
+ *                  decoding)
+ * \param *ctx Pointer that is passed to the callback
+ *
+ * \return 0 if successful else -1 (the connection must be closed with a compression error)
+ */
+int
+hpack_decode(struct hpack_table *table, const unsigned char *data, size_t len,
+             int (*onHeader)(void *ctx, const char *name, size_t nameLen, const char *value,
+                             size_t valueLen),
+             void *ctx)
+{
+  const unsigned char *pos = data;
+  const unsigned char *end = data + len;
+  const char *name;
+  const char *value;
+  char *nameBuf;
+  char *valueBuf;
+  size_t nameLen;
+  size_t valueLen;
+  size_t index;
+  bool indexing;
+  int rc;
+
+  while (pos < end) {
+    nameBuf = NULL;
+    valueBuf = NULL;
+
+    if (*pos & 0x80) {
+      // indexed header field
+      if ((decodeInt(&pos, end, 7, &index) < 0) ||
+          (lookupEntry(table, index, &name, &nameLen, &value, &valueLen) < 0))
+        return -1;
+      if (onHeader(ctx, name, nameLen, value, valueLen) < 0)
+        return -1;
+      continue;
+    }
+
+    if ((*pos & 0xE0) == 0x20) {
+      // dynamic table size update
+      if ((decodeInt(&pos, end, 5, &index) < 0) || (index > table->limit))
+        return -1;
+      table->maxSize = index;
+      while (table->count && (table->size > table->maxSize))
+        evictEntry(table);
+      continue;
+    }
+
+    // literal with incremental indexing (6 bit index) or without/never indexed (4 bit index)
+    indexing = (*pos & 0xC0) == 0x40;
+    if (decodeInt(&pos, end, indexing ? 6 : 4, &index) < 0)
+      return -1;
+
+    if (index) {
+      if (lookupEntry(table, index, &name, &nameLen, &value, &valueLen) < 0)
+        return -1;
+      // adding the entry may evict the entry the name refers to (RFC 7541 4.4)
+      if (indexing && (index > HPACK_STATIC_ENTRIES)) {
+        nameBuf = malloc(nameLen + 1);
+        if (!nameBuf) {
+          ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+          return -1;
+        }
+        memcpy(nameBuf, name, nameLen);
+        nameBuf[nameLen] = '\0';
+        name = nameBuf;
+      }
+    } else {
+      if (decodeString(&pos, end, &nameBuf, &nameLen) < 0)
+        return -1;
+      name = nameBuf;
+    }
+
+    if (decodeString(&pos, end, &valueBuf, &valueLen) < 0) {
+      free(nameBuf);
+      return -1;
+    }
+
+    rc = 0;
+    if (indexing)
+      rc = addEntry(table, name, nameLen, valueBuf, valueLen);
+    if (rc == 0)
+      rc = onHeader(ctx, name, nameLen, valueBuf, valueLen);
+    free(nameBuf);
+    free(valueBuf);
+    if (rc < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief encodes an integer with the given prefix length
+ *
+ * \param *buffer Pointer to where the integer is stored
+ * \param size The size of the buffer
+ * \param prefix The bits in front of the prefix of the first byte
+ * \param prefixBits The number of bits of the prefix
+ * \param value The value
+ *
+ * \return The number of bytes used or 0 if the buffer is too small
+ */
+static size_t
+encodeInt(unsigned char *buffer, size_t size, unsigned char prefix, int prefixBits, size_t value)
+{
+  size_t max = (1 << prefixBits) - 1;
+  size_t used = 1;
+
+  if (size < 1)
+    return 0;
+
+  if (value < max) {
+    buffer[0] = prefix | value;
+    return 1;
+  }
+
+  buffer[0] = prefix | max;
+  value -= max;
+  while (value >= 0x80) {
+    if (used >= size)
+      return 0;
+    buffer[used++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  if (used >= size)
+    return 0;
+  buffer[used++] = value;
+
+  return used;
+}
+
+/**
+ * \brief encodes a header as literal without indexing (the dynamic table of the peer isn't
+ *        touched so no encoder state is needed)
+ *
+ * \param *buffer Pointer to where the header is stored
+ * \param size The size of the buffer
+ * \param *name The header name (lower case)
+ * \param *value The header value
+ *
+ * \return The number of bytes used or 0 if the buffer is too small
+ */
+size_t
+hpack_encodeLiteral(unsigned char *buffer, size_t size, const char *name, const char *value)
+{
+  size_t nameLen = strlen(name);
+  size_t valueLen = strlen(value);
+  size_t used = 1;
+  size_t n;
+
+  if (size < 1)
+    return 0;
+  buffer[0] = 0x00;
+
+  n = encodeInt(&buffer[used], size - used, 0x00, 7, nameLen);
+  if (!n || (size - used - n < nameLen))
+    return 0;
+  used += n;
+  memcpy(&buffer[used], name, nameLen);
+  used += nameLen;
+
+  n = encodeInt(&buffer[used], size - used, 0x00, 7, valueLen);
+  if (!n || (size - used - n < valueLen))
+    return 0;
+  used += n;
+  memcpy(&buffer[used], value, valueLen);
+  used += valueLen;
+
+  return used;
+}
@@ -0,0 +1,75 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_HPACK_H_
+#define UTILS_HPACK_H_
+
+#include <stddef.h>
+
+//! the default size of the dynamic table (SETTINGS_HEADER_TABLE_SIZE)
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+//! an entry of the dynamic table
+struct hpack_entry {
+  //! the header name
+  char *name;
+  //! the length of the name
+  size_t nameLen;
+  //! the header value
+  char *value;
+  //! the length of the value
+  size_t valueLen;
+};
+
+//! the dynamic table of a decoder (RFC 7541)
+struct hpack_table {
+  //! ring of the entries
+  struct hpack_entry *entries;
+  //! the number of allocated entries
+  size_t capacity;
+  //! the index of the newest entry in the ring
+  size_t first;
+  //! the number of entries
+  size_t count;
+  //! the size of the entries as defined by RFC 7541 (length of name and value + 32)
+  size_t size;
+  //! the current maximum size
+  size_t maxSize;
+  //! the maximum size that was announced to the peer
+  size_t limit;
+};
+
+void
+hpack_init(struct hpack_table *table, size_t limit);
+void
+hpack_free(struct hpack_table *table);
+int
+hpack_decode(struct hpack_table *table, const unsigned char *data, size_t len,
+             int (*onHeader)(void *ctx, const char *name, size_t nameLen, const char *value,
+                             size_t valueLen),
+             void *ctx);
+size_t
+hpack_encodeLiteral(unsigned char *buffer, size_t size, const char *name, const char *value);
+
+#endif /* UTILS_HPACK_H_ */
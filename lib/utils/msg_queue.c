@@ -0,0 +1,286 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "msg_queue.h"
+
+#include <ezwebsocket_log.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+//! the header of a slot, the item follows it
+struct msg_queue_cell {
+  //! the position the slot can be written at (pos) or read at (pos + 1)
+  uint64_t seq;
+};
+
+//! the queue (slots are claimed with the positions as in Dmitry Vyukov's bounded queue)
+struct msg_queue {
+  //! the number of slots
+  size_t depth;
+  //! the size of an item
+  size_t itemSize;
+  //! the size of a slot (header and item, multiple of 8)
+  size_t cellSize;
+  //! the position the next item is written at
+  uint64_t enqueuePos __attribute__((aligned(64)));
+  //! the number of reserved slots (items in the queue and pushes in progress)
+  size_t reserved;
+  //! the position the next item is read from
+  uint64_t dequeuePos __attribute__((aligned(64)));
+  //! the futex the consumers wait on, it's incremented by every push
+  uint32_t seq;
+  //! the number of consumers that wait on the futex
+  uint32_t waiters;
+  //! indicates that the queue was closed (the consumers don't wait anymore)
+  bool closed;
+  //! the slots
+  unsigned char cells[] __attribute__((aligned(64)));
+};
+
+/**
+ * \brief Returns the slot of the given position
+ *
+ * \param *queue Pointer to the queue
+ * \param pos The position
+ *
+ * \return Pointer to the slot
+ */
+static struct msg_queue_cell *
+getCell(struct msg_queue *queue, uint64_t pos)
+{
+  return (struct msg_queue_cell *) (queue->cells + (pos % queue->depth) * queue->cellSize);
+}
+
+/**
+ * \brief Creates a queue
+ *
+ * \param depth The maximum number of items in the queue
+ * \param itemSize The size of an item
+ *
+ * \return Pointer to the queue or NULL in case of error
+ */
+struct msg_queue *
+msgQueue_create(size_t depth, size_t itemSize)
+{
+  struct msg_queue *queue;
+  size_t cellSize;
+  size_t i;
+
+  if (!depth || !itemSize) {
+    ezwebsocket_log(EZLOG_ERROR, "invalid queue size\n");
+    return NULL;
+  }
+
+  cellSize = (sizeof(struct msg_queue_cell) + itemSize + 7) & ~(size_t) 7;
+  if (posix_memalign((void **) &queue, 64, sizeof(struct msg_queue) + depth * cellSize)) {
+    ezwebsocket_log(EZLOG_ERROR, "posix_memalign failed\n");
+    return NULL;
+  }
+  memset(queue, 0, sizeof(struct msg_queue));
+  queue->depth = depth;
+  queue->itemSize = itemSize;
+  queue->cellSize = cellSize;
+  for (i = 0; i < depth; i++)
+    getCell(queue, i)->seq = i;
+
+  return queue;
+}
+
+/**
+ * \brief Frees the queue (the items that are still in it are dropped)
+ *
+ * \param *queue Pointer to the queue
+ */
+void
+msgQueue_destroy(struct msg_queue *queue)
+{
+  free(queue);
+}
+
+/**
+ * \brief Reserves a slot for a push
+ *
+ * \param *queue Pointer to the queue
+ *
+ * \return true if a slot was reserved, false if the queue is full
+ */
+bool
+msgQueue_reserve(struct msg_queue *queue)
+{
+  if (__atomic_add_fetch(&queue->reserved, 1, __ATOMIC_ACQ_REL) <= queue->depth)
+    return true;
+
+  __atomic_sub_fetch(&queue->reserved, 1, __ATOMIC_RELEASE);
+  return false;
+}
+
+/**
+ * \brief Returns a slot that was reserved but isn't needed
+ *
+ * \param *queue Pointer to the queue
+ */
+void
+msgQueue_unreserve(struct msg_queue *queue)
+{
+  __atomic_sub_fetch(&queue->reserved, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Pushes an item into a reserved slot and wakes the consumers that wait
+ *
+ * \param *queue Pointer to the queue
+ * \param *item Pointer to the item (itemSize bytes are copied)
+ */
+void
+msgQueue_push(struct msg_queue *queue, const void *item)
+{
+  struct msg_queue_cell *cell;
+  uint64_t pos;
+
+  pos = __atomic_fetch_add(&queue->enqueuePos, 1, __ATOMIC_RELAXED);
+  cell = getCell(queue, pos);
+  // the reservation guarantees that the slot is released, a consumer might still copy it out
+  while (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos)
+    ;
+  memcpy(cell + 1, item, queue->itemSize);
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&queue->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &queue->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * \brief Takes one item from the queue without waiting
+ *
+ * \param *queue Pointer to the queue
+ * \param *item Pointer to where the item should be copied
+ *
+ * \return true if an item was taken, false if the queue is empty
+ */
+static bool
+popOne(struct msg_queue *queue, void *item)
+{
+  struct msg_queue_cell *cell;
+  uint64_t pos;
+  uint64_t seq;
+
+  pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = getCell(queue, pos);
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos + 1) {
+      if (__atomic_compare_exchange_n(&queue->dequeuePos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    } else if (seq < pos + 1) {
+      return false;
+    } else {
+      pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(item, cell + 1, queue->itemSize);
+  __atomic_store_n(&cell->seq, pos + queue->depth, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&queue->reserved, 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+/**
+ * \brief Takes up to max items from the queue, waits until at least one item is available
+ *
+ * \param *queue Pointer to the queue
+ * \param *items Pointer to where the items should be copied (max * itemSize bytes)
+ * \param max The maximum number of items
+ * \param timeoutMs The maximum time to wait in milliseconds (-1 => infinite, 0 => don't wait)
+ *
+ * \return The number of items (0 => timeout or the queue was closed)
+ */
+size_t
+msgQueue_pop(struct msg_queue *queue, void *items, size_t max, int timeoutMs)
+{
+  struct timespec deadline;
+  struct timespec timeout;
+  struct timespec now;
+  size_t count = 0;
+  long long remainingNs;
+  uint32_t seq;
+
+  if (timeoutMs > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  for (;;) {
+    while ((count < max) && popOne(queue, (unsigned char *) items + count * queue->itemSize))
+      count++;
+    if (count || !timeoutMs || __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE))
+      return count;
+
+    if (timeoutMs > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      remainingNs = (deadline.tv_sec - now.tv_sec) * 1000000000LL +
+                    (deadline.tv_nsec - now.tv_nsec);
+      if (remainingNs <= 0)
+        return 0;
+      timeout.tv_sec = remainingNs / 1000000000LL;
+      timeout.tv_nsec = remainingNs % 1000000000LL;
+    }
+
+    // the futex value is read before the queue is checked again so that no push is missed
+    __atomic_add_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&queue->seq, __ATOMIC_SEQ_CST);
+    if (popOne(queue, items))
+      count++;
+    else if (!__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &queue->seq, FUTEX_WAIT, seq, timeoutMs > 0 ? &timeout : NULL, NULL, 0);
+    __atomic_sub_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/**
+ * \brief Closes the queue, the consumers that wait return and don't wait anymore afterwards
+ *
+ * \param *queue Pointer to the queue
+ */
+void
+msgQueue_close(struct msg_queue *queue)
+{
+  __atomic_store_n(&queue->closed, true, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&queue->seq, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &queue->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
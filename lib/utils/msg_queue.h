@@ -0,0 +1,50 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_MSG_QUEUE_H_
+#define UTILS_MSG_QUEUE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//! bounded multi producer multi consumer queue of fixed size items
+//! producers reserve a slot before they push so that a push never fails
+struct msg_queue;
+
+struct msg_queue *
+msgQueue_create(size_t depth, size_t itemSize);
+void
+msgQueue_destroy(struct msg_queue *queue);
+bool
+msgQueue_reserve(struct msg_queue *queue);
+void
+msgQueue_unreserve(struct msg_queue *queue);
+void
+msgQueue_push(struct msg_queue *queue, const void *item);
+size_t
+msgQueue_pop(struct msg_queue *queue, void *items, size_t max, int timeoutMs);
+void
+msgQueue_close(struct msg_queue *queue);
+
+#endif /* UTILS_MSG_QUEUE_H_ */
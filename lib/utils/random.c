@@ -0,0 +1,237 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "random.h"
+
+#include <errno.h>
+#include <ezwebsocket_log.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+//! the number of double rounds, ChaCha8 is plenty for masks and nonces (Go's runtime uses it
+//! for the same purpose) and more than twice as fast as ChaCha20
+#define RANDOM_DOUBLE_ROUNDS 4
+//! the number of ChaCha blocks that are generated at once
+#define RANDOM_BLOCKS 8
+//! the size of the buffer with random bytes (the first 32 bytes become the next key)
+#define RANDOM_BUF_SIZE (RANDOM_BLOCKS * 64)
+//! the number of bytes that are generated before the key is taken from getrandom again
+#define RANDOM_RESEED_BYTES (1024 * 1024)
+
+//! the per thread state of the generator
+struct random_state {
+  //! the ChaCha key
+  uint32_t key[8];
+  //! the generated bytes (consumed bytes are cleared)
+  unsigned char buf[RANDOM_BUF_SIZE];
+  //! the number of bytes that are left at the end of buf
+  size_t avail;
+  //! the number of bytes that were generated since the last seed
+  size_t generated;
+  //! the fork generation the key was seeded in (0 => not seeded)
+  unsigned int forkGen;
+};
+
+//! the generator state of the calling thread
+static __thread struct random_state state;
+//! is incremented in the child after a fork so that the threads take a new key
+static unsigned int forkGen = 1;
+static pthread_once_t forkOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * \brief Gets called in the child process after a fork
+ */
+static void
+onFork(void)
+{
+  __atomic_add_fetch(&forkGen, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Registers the fork handler
+ */
+static void
+registerFork(void)
+{
+  pthread_atfork(NULL, NULL, onFork);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)                                                                   \
+  do {                                                                                             \
+    a += b;                                                                                        \
+    d = ROTL32(d ^ a, 16);                                                                         \
+    c += d;                                                                                        \
+    b = ROTL32(b ^ c, 12);                                                                         \
+    a += b;                                                                                        \
+    d = ROTL32(d ^ a, 8);                                                                          \
+    c += d;                                                                                        \
+    b = ROTL32(b ^ c, 7);                                                                          \
+  } while (0)
+
+/**
+ * \brief Calculates a ChaCha block (RFC 8439 with RANDOM_DOUBLE_ROUNDS) with a zero nonce
+ *
+ * \param *key The key
+ * \param counter The block counter
+ * \param *out The output (64 bytes)
+ */
+static void
+chachaBlock(const uint32_t key[8], uint32_t counter, unsigned char *out)
+{
+  static const uint32_t constants[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+  uint32_t input[16], x[16];
+  int i;
+
+  memcpy(input, constants, sizeof(constants));
+  memcpy(&input[4], key, 8 * sizeof(uint32_t));
+  input[12] = counter;
+  input[13] = 0;
+  input[14] = 0;
+  input[15] = 0;
+  memcpy(x, input, sizeof(x));
+
+  for (i = 0; i < RANDOM_DOUBLE_ROUNDS; i++) {
+    QUARTERROUND(x[0], x[4], x[8], x[12]);
+    QUARTERROUND(x[1], x[5], x[9], x[13]);
+    QUARTERROUND(x[2], x[6], x[10], x[14]);
+    QUARTERROUND(x[3], x[7], x[11], x[15]);
+    QUARTERROUND(x[0], x[5], x[10], x[15]);
+    QUARTERROUND(x[1], x[6], x[11], x[12]);
+    QUARTERROUND(x[2], x[7], x[8], x[13]);
+    QUARTERROUND(x[3], x[4], x[9], x[14]);
+  }
+
+  for (i = 0; i < 16; i++)
+    x[i] += input[i];
+  // the byte order doesn't matter for random numbers
+  memcpy(out, x, sizeof(x));
+}
+
+/**
+ * \brief Takes a new key from the kernel
+ */
+static void
+seed(void)
+{
+  size_t done = 0;
+  ssize_t rc;
+
+  while (done < sizeof(state.key)) {
+    rc = getrandom((unsigned char *) state.key + done, sizeof(state.key) - done, 0);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      // mix what is available, the previous key is kept as part of the new one
+      ezwebsocket_log(EZLOG_ERROR, "getrandom failed\n");
+      state.key[0] ^= (uint32_t) time(NULL);
+      state.key[1] ^= (uint32_t) getpid();
+      state.key[2] ^= (uint32_t) (uintptr_t) &state;
+      state.key[3] ^= (uint32_t) clock();
+      break;
+    }
+    done += rc;
+  }
+  state.generated = 0;
+}
+
+/**
+ * \brief Refills the buffer of the calling thread
+ */
+static void
+refill(void)
+{
+  unsigned int gen;
+  int i;
+
+  pthread_once(&forkOnce, registerFork);
+  gen = __atomic_load_n(&forkGen, __ATOMIC_RELAXED);
+  if ((state.forkGen != gen) || (state.generated >= RANDOM_RESEED_BYTES)) {
+    seed();
+    state.forkGen = gen;
+  }
+
+  for (i = 0; i < RANDOM_BLOCKS; i++)
+    chachaBlock(state.key, i, &state.buf[i * 64]);
+  // fast key erasure: the key that produced the buffer is replaced by its first bytes
+  memcpy(state.key, state.buf, sizeof(state.key));
+  memset(state.buf, 0, sizeof(state.key));
+  state.avail = RANDOM_BUF_SIZE - sizeof(state.key);
+  state.generated += RANDOM_BUF_SIZE;
+}
+
+/**
+ * \brief Fills the buffer with unpredictable random bytes (e.g. for masks and nonces)
+ *        the generator is thread local so it doesn't lock
+ *
+ * \param *buf The buffer
+ * \param len The number of bytes
+ */
+void
+random_fill(void *buf, size_t len)
+{
+  unsigned char *out = buf;
+  size_t n, offset;
+
+  while (len) {
+    if (!state.avail || (state.forkGen != __atomic_load_n(&forkGen, __ATOMIC_RELAXED)))
+      refill();
+    n = len < state.avail ? len : state.avail;
+    offset = RANDOM_BUF_SIZE - state.avail;
+    memcpy(out, &state.buf[offset], n);
+    memset(&state.buf[offset], 0, n);
+    state.avail -= n;
+    out += n;
+    len -= n;
+  }
+}
+
+/**
+ * \brief Returns an unpredictable random number
+ *
+ * \return The random number
+ */
+uint32_t
+random_u32(void)
+{
+  uint32_t value;
+  size_t offset;
+
+  if ((state.avail < sizeof(value)) ||
+      (state.forkGen != __atomic_load_n(&forkGen, __ATOMIC_RELAXED))) {
+    random_fill(&value, sizeof(value));
+    return value;
+  }
+
+  // fast path for masks with a fixed size copy
+  offset = RANDOM_BUF_SIZE - state.avail;
+  memcpy(&value, &state.buf[offset], sizeof(value));
+  memset(&state.buf[offset], 0, sizeof(value));
+  state.avail -= sizeof(value);
+  return value;
+}
@@ -0,0 +1,422 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "shm_ring.h"
+
+#include <ezwebsocket_log.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+//! identifies a memfd that contains a ring ("EZWR")
+#define SHM_RING_MAGIC 0x455a5752
+//! the offset of the records in the memfd (the header gets its own page)
+#define SHM_RING_DATA_OFFSET 4096
+//! the minimum size of the ring
+#define SHM_RING_MIN_SIZE 65536
+//! the record is padding up to the end of the ring
+#define SHM_RING_FLAG_PAD 1
+//! records start at multiples of 16 so that a record header always fits at the end of the ring
+#define SHM_RING_ALIGN(len) (((len) + 15) & ~(size_t) 15)
+
+//! the header of the ring that is shared by all processes
+struct shm_ring_header {
+  //! SHM_RING_MAGIC
+  uint32_t magic;
+  //! padding
+  uint32_t reserved;
+  //! the size of the record area (power of 2)
+  uint64_t size;
+  //! the position after the newest record (positions increase monotonically)
+  uint64_t head __attribute__((aligned(64)));
+  //! the position of the oldest record that isn't overwritten
+  uint64_t tail;
+  //! the futex the consumers wait on, it's incremented by every write
+  uint32_t seq;
+  //! the number of consumers that wait on the futex
+  uint32_t waiters;
+};
+
+//! the header of a record in the ring
+struct shm_ring_record {
+  //! the position of the record (a mismatch indicates that it was overwritten)
+  uint64_t pos;
+  //! the length of the data that follows the header
+  uint32_t len;
+  //! SHM_RING_FLAG_*
+  uint32_t flags;
+};
+
+//! a mapping of the ring
+struct shm_ring {
+  //! the shared header
+  struct shm_ring_header *header;
+  //! the records
+  unsigned char *data;
+  //! the size of the record area
+  size_t size;
+  //! the memfd (only owned by the producer)
+  int fd;
+  //! indicates that the ring was created by this process and may be written
+  bool producer;
+};
+
+/**
+ * \brief Maps the ring of the given memfd
+ *
+ * \param fd The memfd
+ * \param size The size of the record area
+ * \param producer True if this process writes to the ring
+ *
+ * \return The ring or NULL in case of an error
+ */
+static struct shm_ring *
+mapRing(int fd, size_t size, bool producer)
+{
+  struct shm_ring *ring;
+  void *addr;
+
+  addr = mmap(NULL, SHM_RING_DATA_OFFSET + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    ezwebsocket_log(EZLOG_ERROR, "mmap failed\n");
+    return NULL;
+  }
+
+  ring = malloc(sizeof(struct shm_ring));
+  if (!ring) {
+    ezwebsocket_log(EZLOG_ERROR, "malloc failed\n");
+    munmap(addr, SHM_RING_DATA_OFFSET + size);
+    return NULL;
+  }
+  ring->header = addr;
+  ring->data = (unsigned char *) addr + SHM_RING_DATA_OFFSET;
+  ring->size = size;
+  ring->fd = fd;
+  ring->producer = producer;
+  return ring;
+}
+
+/**
+ * \brief Creates a new ring in a memfd
+ *
+ * \param size The size of the ring (it's rounded up to a power of 2, at least 64 KiB)
+ *
+ * \return The ring or NULL in case of an error
+ */
+struct shm_ring *
+shmRing_create(size_t size)
+{
+  struct shm_ring *ring;
+  size_t ringSize;
+  int fd;
+
+  ringSize = SHM_RING_MIN_SIZE;
+  while (ringSize < size) {
+    if (ringSize > SIZE_MAX / 2 - SHM_RING_DATA_OFFSET) {
+      ezwebsocket_log(EZLOG_ERROR, "ring too big\n");
+      return NULL;
+    }
+    ringSize *= 2;
+  }
+
+  fd = memfd_create("ezwebsocket-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    ezwebsocket_log(EZLOG_ERROR, "memfd_create failed\n");
+    return NULL;
+  }
+
+  // the consumers must not be able to shrink the memfd below the mapping of the producer
+  if ((ftruncate(fd, SHM_RING_DATA_OFFSET + ringSize) < 0) ||
+      (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)) {
+    ezwebsocket_log(EZLOG_ERROR, "couldn't size the memfd\n");
+    close(fd);
+    return NULL;
+  }
+
+  ring = mapRing(fd, ringSize, true);
+  if (!ring) {
+    close(fd);
+    return NULL;
+  }
+  ring->header->magic = SHM_RING_MAGIC;
+  ring->header->size = ringSize;
+  return ring;
+}
+
+/**
+ * \brief Attaches to a ring that was created by another process
+ *
+ * \param fd The memfd of the ring (it's not taken over and can be closed afterwards)
+ *
+ * \return The ring or NULL in case of an error
+ */
+struct shm_ring *
+shmRing_attach(int fd)
+{
+  struct shm_ring_header header;
+  struct stat st;
+
+  if ((fstat(fd, &st) < 0) || (st.st_size < SHM_RING_DATA_OFFSET + SHM_RING_MIN_SIZE) ||
+      (pread(fd, &header, sizeof(header), 0) != sizeof(header)) ||
+      (header.magic != SHM_RING_MAGIC) ||
+      (header.size != (uint64_t) st.st_size - SHM_RING_DATA_OFFSET) ||
+      (header.size & (header.size - 1))) {
+    ezwebsocket_log(EZLOG_ERROR, "fd is not a ring\n");
+    return NULL;
+  }
+
+  return mapRing(fd, header.size, false);
+}
+
+/**
+ * \brief Unmaps the ring (the memfd is closed by the producer)
+ *
+ * \param *ring Pointer to the ring
+ */
+void
+shmRing_close(struct shm_ring *ring)
+{
+  if (!ring)
+    return;
+
+  munmap(ring->header, SHM_RING_DATA_OFFSET + ring->size);
+  if (ring->producer)
+    close(ring->fd);
+  free(ring);
+}
+
+/**
+ * \brief Returns the memfd of the ring that can be passed to other processes
+ *
+ * \param *ring Pointer to the ring
+ *
+ * \return The memfd or -1 if the ring was attached
+ */
+int
+shmRing_getFd(struct shm_ring *ring)
+{
+  return ring->producer ? ring->fd : -1;
+}
+
+/**
+ * \brief Returns the position after the newest record (consumers start reading there)
+ *
+ * \param *ring Pointer to the ring
+ *
+ * \return The position
+ */
+uint64_t
+shmRing_head(struct shm_ring *ring)
+{
+  return __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * \brief Returns the size of the record at the given position
+ *
+ * \param *ring Pointer to the ring
+ * \param pos The position of the record (it must be written by this process)
+ *
+ * \return The size including the header and the padding
+ */
+static size_t
+recordSize(struct shm_ring *ring, uint64_t pos)
+{
+  struct shm_ring_record record;
+  size_t offset;
+
+  offset = pos & (ring->size - 1);
+  memcpy(&record, &ring->data[offset], sizeof(record));
+  if (record.flags & SHM_RING_FLAG_PAD)
+    return ring->size - offset;
+  return sizeof(record) + SHM_RING_ALIGN(record.len);
+}
+
+/**
+ * \brief Appends a record to the ring and wakes the waiting consumers
+ *        (the oldest records are overwritten if necessary)
+ *
+ * \param *ring Pointer to the ring (only the producer may write)
+ * \param *data The data of the record
+ * \param len The length of the data (at most a quarter of the ring)
+ *
+ * \return 0 if successful else -1
+ */
+int
+shmRing_write(struct shm_ring *ring, const void *data, size_t len)
+{
+  struct shm_ring_header *header = ring->header;
+  struct shm_ring_record record;
+  size_t offset, recordLen, padLen;
+  uint64_t pos, end, tail;
+
+  if (!ring->producer || (len == 0) || (len > ring->size / 4) || (len > UINT32_MAX)) {
+    ezwebsocket_log(EZLOG_ERROR, "invalid record\n");
+    return -1;
+  }
+
+  recordLen = sizeof(record) + SHM_RING_ALIGN(len);
+  pos = header->head;
+  offset = pos & (ring->size - 1);
+  padLen = (offset + recordLen > ring->size) ? ring->size - offset : 0;
+  end = pos + padLen + recordLen;
+
+  // consumers check the tail after copying a record, so it's moved before anything is overwritten
+  tail = header->tail;
+  while (end - tail > ring->size)
+    tail += recordSize(ring, tail);
+  __atomic_store_n(&header->tail, tail, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (padLen) {
+    record.pos = pos;
+    record.len = 0;
+    record.flags = SHM_RING_FLAG_PAD;
+    memcpy(&ring->data[offset], &record, sizeof(record));
+    pos += padLen;
+    offset = 0;
+  }
+  record.pos = pos;
+  record.len = len;
+  record.flags = 0;
+  memcpy(&ring->data[offset], &record, sizeof(record));
+  memcpy(&ring->data[offset + sizeof(record)], data, len);
+
+  __atomic_store_n(&header->head, end, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&header->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &header->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  return 0;
+}
+
+/**
+ * \brief Copies the record at the given position and advances the position
+ *
+ * \param *ring Pointer to the ring
+ * \param *pos The read position of the consumer (it's moved to the oldest record if the
+ *             consumer was too slow)
+ * \param *buf Buffer for the data
+ * \param len The size of the buffer
+ * \param *lost Is set to true if records were overwritten before they were read
+ *
+ * \return The length of the record (if it's bigger than len nothing is copied and the position
+ *         stays the same) or 0 if there's no new record
+ */
+size_t
+shmRing_read(struct shm_ring *ring, uint64_t *pos, void *buf, size_t len, bool *lost)
+{
+  struct shm_ring_header *header = ring->header;
+  struct shm_ring_record record;
+  uint64_t head, tail, next;
+  size_t offset;
+
+  for (;;) {
+    head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    if (*pos == head)
+      return 0;
+    if ((*pos < tail) || (*pos > head)) {
+      *pos = tail;
+      *lost = true;
+      continue;
+    }
+
+    offset = *pos & (ring->size - 1);
+    memcpy(&record, &ring->data[offset], sizeof(record));
+    if ((record.pos == *pos) && (record.flags & SHM_RING_FLAG_PAD)) {
+      next = *pos + ring->size - offset;
+    } else if ((record.pos == *pos) && record.len &&
+               (record.len <= ring->size - offset - sizeof(record))) {
+      next = *pos + sizeof(record) + SHM_RING_ALIGN(record.len);
+      if (record.len <= len)
+        memcpy(buf, &ring->data[offset + sizeof(record)], record.len);
+    } else {
+      next = 0;
+    }
+
+    // the producer moves the tail before it overwrites a record
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&header->tail, __ATOMIC_RELAXED) > *pos) {
+      *lost = true;
+      continue;
+    }
+    if (!next) {
+      // only a broken producer writes invalid records, skip everything that is there
+      *pos = head;
+      *lost = true;
+      return 0;
+    }
+    if (record.flags & SHM_RING_FLAG_PAD) {
+      *pos = next;
+      continue;
+    }
+    if (record.len <= len)
+      *pos = next;
+    return record.len;
+  }
+}
+
+/**
+ * \brief Waits until a record is written after the given position
+ *
+ * \param *ring Pointer to the ring
+ * \param pos The read position of the consumer
+ * \param timeoutMs The maximum time to wait in milliseconds
+ */
+void
+shmRing_wait(struct shm_ring *ring, uint64_t pos, int timeoutMs)
+{
+  struct shm_ring_header *header = ring->header;
+  struct timespec timeout;
+  uint32_t seq;
+
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+
+  __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+  seq = __atomic_load_n(&header->seq, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == pos)
+    syscall(SYS_futex, &header->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+  __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * \brief Wakes all consumers that are waiting (e.g. to stop a reader thread)
+ *
+ * \param *ring Pointer to the ring
+ */
+void
+shmRing_wake(struct shm_ring *ring)
+{
+  __atomic_add_fetch(&ring->header->seq, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &ring->header->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
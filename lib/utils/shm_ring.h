@@ -0,0 +1,55 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_SHM_RING_H_
+#define UTILS_SHM_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! single producer multi consumer ring of records in shared memory (memfd)
+//! the producer never waits for the consumers, slow consumers lose the overwritten records
+struct shm_ring;
+
+struct shm_ring *
+shmRing_create(size_t size);
+struct shm_ring *
+shmRing_attach(int fd);
+void
+shmRing_close(struct shm_ring *ring);
+int
+shmRing_getFd(struct shm_ring *ring);
+uint64_t
+shmRing_head(struct shm_ring *ring);
+int
+shmRing_write(struct shm_ring *ring, const void *data, size_t len);
+size_t
+shmRing_read(struct shm_ring *ring, uint64_t *pos, void *buf, size_t len, bool *lost);
+void
+shmRing_wait(struct shm_ring *ring, uint64_t pos, int timeoutMs);
+void
+shmRing_wake(struct shm_ring *ring);
+
+#endif /* UTILS_SHM_RING_H_ */
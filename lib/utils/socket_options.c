@@ -0,0 +1,153 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "socket_options.h"
+
+#include <ezwebsocket_log.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/**
+ * \brief sets an integer socket option and logs an error if it fails
+ *
+ * \param fd The file descriptor of the socket
+ * \param level The protocol level of the option
+ * \param name The name of the option
+ * \param value The value that should be set
+ * \param *str The name of the option for the log
+ */
+static void
+setOption(int fd, int level, int name, int value, const char *str)
+{
+  if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+    ezwebsocket_log(EZLOG_ERROR, "setsockopt %s failed\n", str);
+}
+
+/**
+ * \brief applies the given options to a socket
+ *
+ * \param fd The file descriptor of the socket
+ * \param *options Pointer to the options
+ *
+ * \note if applied to a listening socket the accepted sockets inherit the options
+ *       the buffer sizes have to be set before listen or connect to take full effect
+ */
+void
+socketOptions_apply(int fd, const struct socket_options *options)
+{
+  setOption(fd, SOL_SOCKET, SO_KEEPALIVE, options->keepalive, "SO_KEEPALIVE");
+  if (options->keepalive) {
+    if (options->keepIdleSec > 0)
+      setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, options->keepIdleSec, "TCP_KEEPIDLE");
+    if (options->keepCnt > 0)
+      setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, options->keepCnt, "TCP_KEEPCNT");
+    if (options->keepIntvlSec > 0)
+      setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, options->keepIntvlSec, "TCP_KEEPINTVL");
+  }
+
+  if (options->noDelay)
+    setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+  if (options->sndBuf > 0)
+    setOption(fd, SOL_SOCKET, SO_SNDBUF, options->sndBuf, "SO_SNDBUF");
+
+  if (options->rcvBuf > 0)
+    setOption(fd, SOL_SOCKET, SO_RCVBUF, options->rcvBuf, "SO_RCVBUF");
+
+  if (options->notSentLowat > 0)
+    setOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notSentLowat, "TCP_NOTSENT_LOWAT");
+
+#ifdef SO_BUSY_POLL
+  if (options->busyPollUs > 0)
+    setOption(fd, SOL_SOCKET, SO_BUSY_POLL, options->busyPollUs, "SO_BUSY_POLL");
+#endif
+
+  socketOptions_rearm(fd, options);
+}
+
+/**
+ * \brief rearms the options that are reset by the kernel (has to be called after every read)
+ *
+ * \param fd The file descriptor of the socket
+ * \param *options Pointer to the options
+ */
+void
+socketOptions_rearm(int fd, const struct socket_options *options)
+{
+  if (options->quickAck)
+    setOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+}
+
+/**
+ * \brief removes the options that are only supported by tcp sockets (e.g. for unix sockets)
+ *
+ * \param *options Pointer to the options
+ */
+void
+socketOptions_removeTcp(struct socket_options *options)
+{
+  options->noDelay = false;
+  options->quickAck = false;
+  options->keepalive = false;
+  options->keepIdleSec = 0;
+  options->keepCnt = 0;
+  options->keepIntvlSec = 0;
+  options->notSentLowat = 0;
+}
+
+/**
+ * \brief limits the rate at which the kernel sends the data of a tcp socket
+ *        (SO_MAX_PACING_RATE), the packets are spread out by the fq qdisc or by the internal
+ *        pacing of tcp
+ *
+ * \param fd The file descriptor of the socket
+ * \param rate The maximum rate in bytes per second (0 => unlimited)
+ *
+ * \return 0 if the kernel paces the socket else -1 (not a tcp socket or not supported)
+ */
+int
+socketOptions_setPacingRate(int fd, unsigned long rate)
+{
+#ifdef SO_MAX_PACING_RATE
+  unsigned int value;
+  int domain;
+  socklen_t len = sizeof(domain);
+
+  // the option is accepted by every socket but only tcp sockets are paced
+  if ((getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0) ||
+      ((domain != AF_INET) && (domain != AF_INET6)))
+    return -1;
+
+  value = (!rate || (rate >= UINT_MAX)) ? UINT_MAX : rate;
+  if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) < 0)
+    return -1;
+  return 0;
+#else
+  (void) fd;
+  (void) rate;
+  return -1;
+#endif
+}
@@ -0,0 +1,63 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_SOCKET_OPTIONS_H_
+#define UTILS_SOCKET_OPTIONS_H_
+
+#include <stdbool.h>
+
+//! options that are applied to a tcp socket (false or 0 => the default of the kernel is kept)
+struct socket_options {
+  //! disable Nagle's algorithm (TCP_NODELAY)
+  bool noDelay;
+  //! send acks immediately (TCP_QUICKACK) has to be rearmed after every read
+  bool quickAck;
+  //! enable keepalive probes (SO_KEEPALIVE)
+  bool keepalive;
+  //! idle time before the first keepalive probe in seconds (TCP_KEEPIDLE)
+  int keepIdleSec;
+  //! the number of unanswered probes before the connection is closed (TCP_KEEPCNT)
+  int keepCnt;
+  //! the interval between keepalive probes in seconds (TCP_KEEPINTVL)
+  int keepIntvlSec;
+  //! the size of the send buffer in bytes (SO_SNDBUF)
+  int sndBuf;
+  //! the size of the receive buffer in bytes (SO_RCVBUF)
+  int rcvBuf;
+  //! the limit of unsent bytes in the send buffer (TCP_NOTSENT_LOWAT)
+  int notSentLowat;
+  //! the time to busy poll on receive in microseconds (SO_BUSY_POLL)
+  int busyPollUs;
+};
+
+void
+socketOptions_apply(int fd, const struct socket_options *options);
+void
+socketOptions_rearm(int fd, const struct socket_options *options);
+void
+socketOptions_removeTcp(struct socket_options *options);
+int
+socketOptions_setPacingRate(int fd, unsigned long rate);
+
+#endif /* UTILS_SOCKET_OPTIONS_H_ */
@@ -0,0 +1,91 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "token_bucket.h"
+
+#include <limits.h>
+
+/**
+ * \brief initializes a token bucket (it starts full)
+ *
+ * \param *bucket Pointer to the bucket
+ * \param rate The tokens that are added per second (0 => unlimited)
+ * \param burst The maximum number of tokens (0 => rate)
+ */
+void
+tokenBucket_init(struct token_bucket *bucket, unsigned long rate, unsigned long burst)
+{
+  bucket->rate = rate;
+  bucket->burst = burst ? burst : rate;
+  bucket->tokens = bucket->burst;
+  clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/**
+ * \brief refills the bucket and returns how long it takes until the given amount is available
+ *
+ * \param *bucket Pointer to the bucket
+ * \param amount The amount of tokens that is needed (amounts above the burst only need a full
+ *               bucket, the rest is taken on credit)
+ *
+ * \return 0 if the tokens are available else the time to wait in milliseconds
+ */
+int
+tokenBucket_wait(struct token_bucket *bucket, double amount)
+{
+  struct timespec now;
+  double ms;
+
+  if (bucket->rate <= 0)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) +
+                     (now.tv_nsec - bucket->last.tv_nsec) / 1000000000.0) *
+                    bucket->rate;
+  if (bucket->tokens > bucket->burst)
+    bucket->tokens = bucket->burst;
+  bucket->last = now;
+
+  if (amount > bucket->burst)
+    amount = bucket->burst;
+  if (bucket->tokens >= amount)
+    return 0;
+
+  ms = (amount - bucket->tokens) * 1000.0 / bucket->rate + 1;
+  return ms > INT_MAX ? INT_MAX : (int) ms;
+}
+
+/**
+ * \brief takes tokens from the bucket (tokenBucket_wait has to be called before)
+ *
+ * \param *bucket Pointer to the bucket
+ * \param amount The amount of tokens
+ */
+void
+tokenBucket_take(struct token_bucket *bucket, double amount)
+{
+  if (bucket->rate > 0)
+    bucket->tokens -= amount;
+}
@@ -0,0 +1,49 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_TOKEN_BUCKET_H_
+#define UTILS_TOKEN_BUCKET_H_
+
+#include <time.h>
+
+//! token bucket that limits a rate (e.g. messages or bytes per second)
+struct token_bucket {
+  //! the tokens that are added per second (0 => unlimited)
+  double rate;
+  //! the maximum number of tokens
+  double burst;
+  //! the currently available tokens (negative if a take exceeded the burst)
+  double tokens;
+  //! the time of the last refill (CLOCK_MONOTONIC)
+  struct timespec last;
+};
+
+void
+tokenBucket_init(struct token_bucket *bucket, unsigned long rate, unsigned long burst);
+int
+tokenBucket_wait(struct token_bucket *bucket, double amount);
+void
+tokenBucket_take(struct token_bucket *bucket, double amount);
+
+#endif /* UTILS_TOKEN_BUCKET_H_ */
@@ -0,0 +1,81 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "unix_socket.h"
+
+#include <ezwebsocket_log.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * \brief checks if an address refers to a unix domain socket
+ *
+ * \param *address The address that should be checked (may be NULL)
+ *
+ * \return true if the address starts with UNIX_SOCKET_PREFIX
+ */
+bool
+unixSocket_isAddress(const char *address)
+{
+  return address && !strncmp(address, UNIX_SOCKET_PREFIX, strlen(UNIX_SOCKET_PREFIX));
+}
+
+/**
+ * \brief converts an address of the form "unix:/path" or "unix:@name" to a sockaddr
+ *
+ * \param *address The address that should be converted
+ * \param *addr Pointer to the sockaddr that is filled
+ * \param *addrLen Pointer to where the length of the sockaddr is stored
+ *
+ * \return 0 if successful else -1
+ */
+int
+unixSocket_getAddress(const char *address, struct sockaddr_un *addr, socklen_t *addrLen)
+{
+  const char *path;
+  size_t len;
+
+  if (!unixSocket_isAddress(address))
+    return -1;
+
+  path = address + strlen(UNIX_SOCKET_PREFIX);
+  len = strlen(path);
+  if (len == 0 || len >= sizeof(addr->sun_path)) {
+    ezwebsocket_log(EZLOG_ERROR, "invalid unix socket path\n");
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, len);
+  if (path[0] == '@') {
+    // abstract names start with a null byte and aren't null terminated
+    addr->sun_path[0] = '\0';
+    *addrLen = offsetof(struct sockaddr_un, sun_path) + len;
+  } else {
+    *addrLen = sizeof(*addr);
+  }
+
+  return 0;
+}
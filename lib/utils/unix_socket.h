@@ -0,0 +1,41 @@
+/* EzWebSocket
+ *
+ * Copyright © 2017 Clemens Kresser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UTILS_UNIX_SOCKET_H_
+#define UTILS_UNIX_SOCKET_H_
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//! prefix of addresses that refer to a unix domain socket
+//! ("unix:/path/to/socket" or "unix:@name" for the abstract namespace)
+#define UNIX_SOCKET_PREFIX "unix:"
+
+bool
+unixSocket_isAddress(const char *address);
+int
+unixSocket_getAddress(const char *address, struct sockaddr_un *addr, socklen_t *addrLen);
+
+#endif /* UTILS_UNIX_SOCKET_H_ */
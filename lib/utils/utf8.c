@@ -23,7 +23,12 @@
  */
 
 #include "utf8.h"
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+//! the high bits of 8 bytes (set for all bytes that aren't ASCII)
+#define UTF8_NON_ASCII_MASK 0x8080808080808080ULL
 
 /**
  * \brief Checks a single character if it is valid utf8
@@ -108,12 +113,24 @@ enum utf8_state
 utf8_validate(char *string, size_t len, unsigned long *handle)
 {
   enum utf8_state state = UTF8_STATE_OK;
+  uint64_t word;
 
-  while (len--) {
+  while (len) {
+    // skip 8 ASCII characters at once if no sequence is pending
+    if (!*handle && (len >= sizeof(word))) {
+      memcpy(&word, string, sizeof(word));
+      if (!(word & UTF8_NON_ASCII_MASK)) {
+        state = UTF8_STATE_OK;
+        string += sizeof(word);
+        len -= sizeof(word);
+        continue;
+      }
+    }
     if ((state = utf8_validate_single(*string, handle)) == UTF8_STATE_FAIL) {
       return state;
     }
     string++;
+    len--;
   }
   return state;
 }